@@ -26,12 +26,48 @@
 #define DEFAULT_CE_PIN 9
 #define DEFAULT_CS_PIN 10
 
+// How long wait() sleeps between radio polls when no radio event source
+// (IRQ line) has been configured, in milliseconds.
+#define WAIT_POLL_INTERVAL 2
+
+
+/***
+ * Segmented messages (MySensor::sendSegmented()) carry payloads larger than
+ * MAX_PAYLOAD, at most 255 fragments. Every context holds a whole payload,
+ * there are SEGMENT_CONTEXTS for sending and as many for receiving.
+ */
+#ifdef __Raspberry_Pi
+	#define SEGMENT_MAX_LENGTH 4096
+	#define SEGMENT_CONTEXTS   4
+#else
+	#define SEGMENT_MAX_LENGTH 256
+	#define SEGMENT_CONTEXTS   1
+#endif
+#define SEGMENT_ACK_TIMEOUT 300    // ms the sender waits for the receiver to acknowledge
+#define SEGMENT_RETRIES     8      // retransmission rounds before the sender gives up
+#define SEGMENT_RX_TIMEOUT  5000   // ms an incomplete message is kept by the receiver
+
+// How long a node stays awake before sleep() when the ack of its last frame
+// brought a payload, so the messages the gateway holds for it can follow (ms).
+#define MAILBOX_LISTEN_TIME 100
+
+// The gateway and the repeaters broadcast a channel migration (I_CHANNEL) every
+// CHANNEL_ANNOUNCE_INTERVAL ms until the switch, which is CHANNEL_SWITCH_DELAY ms
+// after the gateway started it. The announcements carry the time left.
+#define CHANNEL_ANNOUNCE_INTERVAL 250
+#define CHANNEL_SWITCH_DELAY      5000
+
 
 /***
  * Enable/Disable debug logging
  */
 #define DEBUG
 
+/***
+ * Enable/Disable per message latency tracing (Raspberry Pi only)
+ */
+#define LATENCY_TRACE
+
 
 #ifdef __Raspberry_Pi 
 	#define vsnprintf_P vsnprintf
@@ -14,6 +14,14 @@
 
 using namespace std;
 
+#ifdef __Raspberry_Pi
+	#include "PiFirmware.h"
+	#include "PiStream.h"
+	#include "PiSeries.h"
+	#include "PiSnapshot.h"
+	#include "PiJournal.h"
+#endif
+
 #ifndef __Raspberry_Pi
 	#include "utility/MsTimer2.h"
 	#include "utility/PinChangeInt.h"
@@ -25,14 +33,24 @@ using namespace std;
 	volatile uint8_t countRx;
 	volatile uint8_t countTx;
 	volatile uint8_t countErr;
-#endif
-boolean buttonTriggeredInclusion;
 
-boolean inclusionMode; // Keeps track on inclusion mode
+	// Gateway the led timer and inclusion button interrupts act on
+	MyGateway *interruptGateway;
+#endif
 
 #ifdef __Raspberry_Pi
+#ifndef MY_NO_RF24
 MyGateway::MyGateway(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed, uint8_t _inclusion_time ) : MySensor(_cepin, _cspin, spispeed ) {
     inclusionTime = _inclusion_time;
+    keeping = 0;
+    ruleRouter = NULL;
+}
+#endif
+
+MyGateway::MyGateway(MyTransport *transport, uint8_t _inclusion_time ) : MySensor(transport) {
+    inclusionTime = _inclusion_time;
+    keeping = 0;
+    ruleRouter = NULL;
 }
 #else
 MyGateway::MyGateway(uint8_t _cepin, uint8_t _cspin, uint8_t _inclusion_time, uint8_t _inclusion_pin, uint8_t _rx, uint8_t _tx, uint8_t _er) : MySensor(_cepin, _cspin) {
@@ -51,6 +69,14 @@ void MyGateway::begin(rf24_pa_dbm_e paLevel, uint8_t channel, rf24_datarate_e da
 	repeaterMode = true;
 	isGateway = true;
 	autoFindParent = false;
+#ifdef __Raspberry_Pi
+	// A warm start: node id, routes and channel of the last run, before the routing table and the radio read them
+	boolean warm = (keeping & KEEP_SNAPSHOT) && snapshotAttach(baseRadioId, eeprom_image());
+	// The journal has every EEPROM write up to its last commit, newer than the snapshot's image
+	if (keeping & KEEP_JOURNAL) {
+		journalAttach(baseRadioId, eeprom_image());
+	}
+#endif
 	setupRepeaterMode();
 
 	if (inDataCallback != NULL) {
@@ -65,7 +91,16 @@ void MyGateway::begin(rf24_pa_dbm_e paLevel, uint8_t channel, rf24_datarate_e da
 	nc.distance = 0;
 	inclusionMode = 0;
 	buttonTriggeredInclusion = false;
+#ifdef __Raspberry_Pi
+	mailNode = -1;
+	mailWoken = -1;
+	mailCursor = 0;
+	mailRescan = true;
+	mailAckPayloads = true;
+	mailExpired = 0;
+#endif
 #ifndef __Raspberry_Pi
+	interruptGateway = this;
 	countRx = 0;
 	countTx = 0;
 	countErr = 0;
@@ -95,9 +130,9 @@ void MyGateway::begin(rf24_pa_dbm_e paLevel, uint8_t channel, rf24_datarate_e da
 	    printf("Unable to start up the radio library. (Error: %s)\n", msg);
 	    exit(EXIT_FAILURE);
 	}
-	RF24::openReadingPipe(WRITE_PIPE, BASE_RADIO_ID);
-	RF24::openReadingPipe(CURRENT_NODE_PIPE, BASE_RADIO_ID);
-	RF24::startListening();
+	radio->openReadingPipe(WRITE_PIPE, baseRadioId);
+	radio->openReadingPipe(CURRENT_NODE_PIPE, baseRadioId);
+	radio->startListening();
 #ifndef __Raspberry_Pi
 	// Add led timer interrupt
     MsTimer2::set(300, ledTimersInterrupt);
@@ -108,11 +143,51 @@ void MyGateway::begin(rf24_pa_dbm_e paLevel, uint8_t channel, rf24_datarate_e da
 #endif
 	// Send startup log message on serial
 	serial(PSTR("0;0;%d;0;%d;Gateway startup complete.\n"),  C_INTERNAL, I_GATEWAY_READY);
+#ifdef __Raspberry_Pi
+	if (warm) {
+		// The controller gets the network as it was instead of waiting for every node to present again
+		unsigned long left = snapshotInclusionLeft();
+		unsigned int replayed = snapshotReplay(baseRadioId, replayMessage, this);
+		debug(PSTR("snapshot: warm start, %d messages replayed\n"), replayed);
+		if (left > 0) {
+			// Inclusion mode goes on for the rest of its time
+			left = min(left, 60000UL*inclusionTime);
+			setInclusionMode(true);
+			inclusionStartTime = millis() - (60000UL*inclusionTime - left);
+			snapshotInclusion(left);
+		}
+	}
+#endif
+}
+
+#ifdef __Raspberry_Pi
+void MyGateway::keepState(uint8_t stores) {
+	keeping = stores;
 }
 
+void MyGateway::setRuleRouter(bool (*router)(void *context, const MyMessage &action), void *context) {
+	ruleRouter = router;
+	ruleRouterContext = context;
+}
+
+void MyGateway::replayMessage(void *context, MyMessage &message, bool stale) {
+	MyGateway *gateway = (MyGateway *)context;
+
+	if (!stale) {
+		gateway->serial(message);
+		return;
+	}
+	// Not to be taken for the node's state now
+	gateway->serial(PSTR("0;0;%d;0;%d;Before restart %d;%d;%d;0;%d;%s\n"), C_INTERNAL, I_LOG_MESSAGE,
+			message.sender, message.sensor, mGetCommand(message), message.type, message.getString(gateway->convBuf));
+}
+#endif
+
 
 void startInclusionInterrupt() {
-	  buttonTriggeredInclusion = true;
+#ifndef __Raspberry_Pi
+	  interruptGateway->buttonTriggeredInclusion = true;
+#endif
 }
 
 
@@ -148,8 +223,9 @@ uint8_t MyGateway::h2i(char c) {
 void MyGateway::parseAndSend(char *commandBuffer) {
   boolean ok = false;
   char *str, *p, *value=NULL;
-  uint8_t bvalue[MAX_PAYLOAD];
-  uint8_t blen = 0;
+  uint8_t bvalue[SEGMENT_MAX_LENGTH];
+  uint16_t blen = 0;
+  uint16_t vlen = 0;
   int i = 0;
   uint16_t destination = 0;
   uint8_t sensor = 0;
@@ -182,7 +258,8 @@ void MyGateway::parseAndSend(char *commandBuffer) {
 		if (command == C_STREAM) {
 			blen = 0;
 			uint8_t val;
-			while (*str) {
+			// Stop at a trailing half byte or carriage return
+			while (str[0] && str[1] && str[0] != '\r' && str[1] != '\r' && blen < SEGMENT_MAX_LENGTH) {
 				val = h2i(*str++) << 4;
 				val += h2i(*str++);
 				bvalue[blen] = val;
@@ -191,23 +268,41 @@ void MyGateway::parseAndSend(char *commandBuffer) {
 		} else {
 			value = str;
 			// Remove ending carriage return character (if it exists)
-			uint8_t lastCharacter = strlen(value)-1;
-			if (value[lastCharacter] == '\r')
-				value[lastCharacter] = 0;
+			vlen = strlen(value);
+			if (vlen > 0 && value[vlen-1] == '\r')
+				value[--vlen] = 0;
 		}
 		break;
 	  }
 	  i++;
   }
+  traceStage(TS_PARSE);
+
+  if (i < 5) {
+    // Not even a message type, nothing sensible can be done with this
+    metricInc(M_PARSE_ERRORS);
+    traceStage(TS_DONE);
+    return;
+  }
 
   if (destination==GATEWAY_ADDRESS && command==C_INTERNAL) {
     // Handle messages directed to gateway
     if (type == I_VERSION) {
       // Request for version
       serial(PSTR("0;0;%d;0;%d;%s\n"),C_INTERNAL, I_VERSION, LIBRARY_VERSION);
-    } else if (type == I_INCLUSION_MODE) {
+    } else if (type == I_INCLUSION_MODE && value != NULL) {
       // Request to change inclusion mode
       setInclusionMode(atoi(value) == 1);
+    } else if (type == I_CHANNEL && value != NULL && atoi(value) >= 0 && atoi(value) <= 125) {
+      migrateChannel(atoi(value));
+    }
+  } else if ((command == C_STREAM ? blen : vlen) > MAX_PAYLOAD) {
+    // Too long for one message, the receiver acknowledges the whole of it
+    txBlink(1);
+    ok = sendSegmented(destination, sensor, command, type, command == C_STREAM ? (const void *)bvalue : (const void *)value,
+        command == C_STREAM ? blen : vlen);
+    if (!ok) {
+      errBlink(1);
     }
   } else {
     txBlink(1);
@@ -221,26 +316,121 @@ void MyGateway::parseAndSend(char *commandBuffer) {
 	if (command == C_STREAM)
 		msg.set(bvalue, blen);
 	else
-		msg.set(value);
-    ok = sendRoute(msg);
-    if (!ok) {
-      errBlink(1);
+		msg.set(value ? value : "");
+    sendDownstream(msg);
+  }
+  traceStage(TS_DONE);
+}
+
+
+/*
+ * Send a message from the controller or a rule to its node: tracked until
+ * its ack if it asks for one, held in the mailbox if the node is asleep.
+ */
+boolean MyGateway::sendDownstream(MyMessage &message) {
+  boolean ok;
+#ifdef __Raspberry_Pi
+  InFlight *tracked = NULL;
+  if (mGetRequestAck(message) && message.destination != BROADCAST_ADDRESS && message.destination != GATEWAY_ADDRESS) {
+    tracked = inFlight.find(message.destination, message.sensor, message.type);
+    if (tracked != NULL) {
+      deliveryReport(tracked->message, DELIVERY_REPLACED, tracked->sends, millis() - tracked->first);
+      if (tracked->held) {
+        mailbox.remove(message.destination, message.sensor, message.type);
+      }
+      inFlight.remove(tracked);
+    }
+    tracked = inFlight.add(message, millis());
+    if (tracked == NULL) {
+      deliveryReport(message, DELIVERY_BUSY, 1, 0);
     }
   }
+  if (message.destination != BROADCAST_ADDRESS && mailbox.pending(message.destination)) {
+    // Behind the messages already held for the node, in case it is awake now
+    ok = mailbox.put(message, millis());
+    if (ok && tracked != NULL) {
+      inFlight.held(tracked, millis());
+    }
+    mailRescan = true;
+    mailboxFlush(message.destination);
+  } else
+#endif
+  ok = sendRoute(message);
+#ifdef __Raspberry_Pi
+  if (tracked != NULL && !tracked->held) {
+    // Retried until the deadline, the mailbox only gets it after that
+    inFlight.sent(tracked, ok, millis());
+  }
+#endif
+  if (!ok) {
+    errBlink(1);
+#ifdef __Raspberry_Pi
+    if (tracked == NULL && message.destination != BROADCAST_ADDRESS && message.destination != GATEWAY_ADDRESS) {
+      // Most likely asleep, held until the node is heard again
+      mailbox.put(message, millis());
+      mailRescan = true;
+    }
+#endif
+  }
+  return ok;
 }
 
 
 void MyGateway::setInclusionMode(boolean newMode) {
-  if (newMode != inclusionMode)
+  if (newMode != inclusionMode) {
     inclusionMode = newMode;
-    // Send back mode change on serial line to ack command
-    serial(PSTR("0;0;%d;0;%d;%d\n"), C_INTERNAL, I_INCLUSION_MODE, inclusionMode?1:0);
-
     if (inclusionMode) {
       inclusionStartTime = millis();
     }
+    metricSet(M_INCLUSION_MODE, inclusionMode ? 1 : 0);
+#ifdef __Raspberry_Pi
+    if (keeping & KEEP_SNAPSHOT) {
+      snapshotInclusion(inclusionMode ? 60000UL*inclusionTime : 0);
+    }
+#endif
+  }
+  // Send back mode on serial line to ack command, also if it didn't change
+  serial(PSTR("0;0;%d;0;%d;%d\n"), C_INTERNAL, I_INCLUSION_MODE, inclusionMode?1:0);
+}
+
+void MyGateway::migrateChannel(uint8_t next) {
+  // One migration at a time
+  if (next == channel || channelNext != channel) {
+    return;
+  }
+  serial(PSTR("0;0;%d;0;%d;%d\n"), C_INTERNAL, I_CHANNEL, next);
+  metricInc(M_CHANNEL_MIGRATIONS);
+  channelMigrate(next, CHANNEL_SWITCH_DELAY);
 }
 
+#ifdef __Raspberry_Pi
+/*
+ * The occupancy goes to the controller as log messages, ten channels a
+ * line, idle channels left out.
+ */
+bool MyGateway::surveyChannels(PiChannelSurvey &survey, unsigned int dwell) {
+  char line[MAX_SEND_LENGTH - 16];
+
+  bool ok = survey.run(radio, dwell);
+  radio->setChannel(channel);
+  radio->startListening();
+  if (!ok) {
+    serial(PSTR("0;0;%d;0;%d;No channel survey, the radio has no RPD.\n"), C_INTERNAL, I_LOG_MESSAGE);
+    return false;
+  }
+  metricInc(M_CHANNEL_SURVEYS);
+  metricSet(M_CHANNEL_OCCUPANCY, survey.occupancy(channel));
+  for (unsigned int first = 0; first < SURVEY_CHANNELS; first += 10) {
+    if (survey.format(line, sizeof(line), first, first + 9) > 0) {
+      serial(PSTR("0;0;%d;0;%d;Survey %s\n"), C_INTERNAL, I_LOG_MESSAGE, line);
+    }
+  }
+  serial(PSTR("0;0;%d;0;%d;Survey done, channel %d busy %d permille.\n"), C_INTERNAL, I_LOG_MESSAGE,
+      channel, survey.occupancy(channel));
+  return true;
+}
+#endif
+
 void MyGateway::processRadioMessage() {
 	try {
     if (process()) {
@@ -251,34 +441,364 @@ void MyGateway::processRadioMessage() {
       } else {
         rxBlink(1);
       }
+      boolean served = false;
+#ifdef __Raspberry_Pi
+      if (mGetCommand(message) == C_STREAM) {
+        // Firmware requests are answered and images and sounds reassembled here
+        served = serveFirmware(message) ||
+            streamChunk(message.sender, message.sensor, message.type, (const uint8_t *)message.data, mGetLength(message));
+      }
+#endif
+#ifdef __Raspberry_Pi
+      if (keeping & KEEP_SERIES) {
+        seriesRecord(message);
+      }
+      if (keeping & KEEP_SNAPSHOT) {
+        snapshotRecord(baseRadioId, message);
+      }
+      // Actions of the gateway rules go out at once, the controller hears of them after the value
+      unsigned int fired = served ? 0 : rulesMatch(message, actions, RULES_MAX_ACTIONS);
+      bool actionSent[RULES_MAX_ACTIONS];
+      for (unsigned int i = 0; i < fired; i++) {
+        // The radio the node was heard on sends and reports the actions for other radios' nodes
+        if (ruleRouter != NULL && ruleRouter(ruleRouterContext, actions[i])) {
+          actionSent[i] = false;
+          continue;
+        }
+        txBlink(1);
+        actionSent[i] = sendDownstream(actions[i]);
+      }
+      // Repeated and minor changes of values are held back by the filter rules
+      served = served || !filter.pass(message, millis());
+#endif
       // Pass along the message from sensors to serial line
-      serial(message);
+      if (!served) {
+        serial(message);
+      }
+      // The reports and echoes that follow aren't the message traced
+      traceEnd(TRACE_UPSTREAM);
+#ifdef __Raspberry_Pi
+      if (mGetAck(message) && inFlight.size() > 0) {
+        InFlight *entry = inFlight.find(message.sender, message.sensor, message.type);
+        if (entry != NULL) {
+          deliveryReport(entry->message, DELIVERY_OK, entry->sends, millis() - entry->first);
+          inFlight.remove(entry);
+        }
+      }
+      // Only the actions that went out or wait in the mailbox, as a log line: the node didn't send them
+      for (unsigned int i = 0; i < fired; i++) {
+        if (actionSent[i]) {
+          ruleReport(actions[i]);
+        }
+      }
+#endif
     }
+    // Nor is anything written until the next message, if this one went nowhere
+    traceEnd(TRACE_UPSTREAM);
   } catch (const char* msg) {
     printf("Unable to process radio messages. (Error: %s)\n", msg);
     exit(EXIT_FAILURE);
   }
+#ifdef __Raspberry_Pi
+  mailboxService();
+  inFlightService();
+  filterService();
+#endif
 
   checkButtonTriggeredInclusion();
   checkInclusionFinished();
 }
 
+#ifdef __Raspberry_Pi
+boolean MyGateway::serveFirmware(MyMessage &request) {
+  FirmwareConfig config;
+  FirmwareRequest blockRequest;
+  FirmwareResponse response;
+
+  msg.sender = GATEWAY_ADDRESS;
+  msg.destination = request.sender;
+  msg.sensor = request.sensor;
+  mSetCommand(msg, C_STREAM);
+  mSetRequestAck(msg, false);
+  mSetAck(msg, false);
+  if (request.type == ST_FIRMWARE_CONFIG_REQUEST && mGetLength(request) >= sizeof(config)) {
+    memcpy(&config, request.data, sizeof(config));
+    if (!firmwareConfig(config.type, &config)) {
+      return false;
+    }
+    msg.type = ST_FIRMWARE_CONFIG_RESPONSE;
+    msg.set(&config, sizeof(config));
+  } else if (request.type == ST_FIRMWARE_REQUEST && mGetLength(request) >= sizeof(blockRequest)) {
+    memcpy(&blockRequest, request.data, sizeof(blockRequest));
+    if (!firmwareBlock(&blockRequest, &response)) {
+      return false;
+    }
+    msg.type = ST_FIRMWARE_RESPONSE;
+    msg.set(&response, sizeof(response));
+  } else {
+    return false;
+  }
+  txBlink(1);
+  if (!sendRoute(msg)) {
+    errBlink(1);
+  }
+  if (request.type == ST_FIRMWARE_REQUEST) {
+    firmwareProgress(request.sender, &blockRequest);
+  }
+  return true;
+}
+
+
+void MyGateway::frameReceived(uint8_t pipe, MyMessage &message) {
+  if (mailNode >= 0 && pipe != BROADCAST_PIPE) {
+    // The payload was queued with the RX FIFO empty, the first acked frame took it
+    ack_payload_state_e state = radio->getAckPayloadState();
+    if (state == ACK_PAYLOAD_SENT && message.last == mailNode) {
+      mailbox.delivered(mailNode, mailId, true, millis());
+      mailDelivered(mailMessage);
+      debug(PSTR("mailbox: %d got a message with an ack\n"), mailNode);
+    }
+    if (state != ACK_PAYLOAD_QUEUED) {
+      mailNode = -1;
+    }
+  }
+  if (mailbox.pending(message.sender)) {
+    mailWoken = message.sender;
+  }
+  mailRescan = true;
+}
+
+/*
+ * Deliver the mail of nodes that were just heard, expire old mail and
+ * queue the next message as ack payload while the radio is idle.
+ */
+void MyGateway::mailboxService() {
+  uint32_t id;
+
+  if (mailbox.size() == 0) {
+    return;
+  }
+  unsigned long now = millis();
+  if (now - mailExpired >= 1000) {
+    mailExpired = now;
+    mailbox.expire(now);
+  }
+  if (mailWoken >= 0) {
+    uint8_t node = mailWoken;
+    mailWoken = -1;
+    mailboxFlush(node);
+  }
+  if (!mailAckPayloads || radio->available()) {
+    return;
+  }
+  if (mailNode >= 0) {
+    if (radio->getAckPayloadState() == ACK_PAYLOAD_QUEUED) {
+      return;
+    }
+    // Flushed by a transmission, or taken by a frame that was dropped
+    mailNode = -1;
+    mailRescan = true;
+  }
+  if (!mailRescan) {
+    return;
+  }
+  mailRescan = false;
+  int first = -1;
+  for (int node = mailbox.next(mailCursor); node >= 0 && node != first; node = mailbox.next(node)) {
+    if (first < 0) {
+      first = node;
+    }
+    // Whoever transmits next gets the ack, only a direct child keeps the payload
+    if (getChildRoute(node) != node) {
+      continue;
+    }
+    mailMessage = *mailbox.peek(node, &id);
+    mailMessage.last = nc.nodeId;
+    mSetVersion(mailMessage, PROTOCOL_VERSION);
+    if (!radio->writeAckPayload(CURRENT_NODE_PIPE, &mailMessage, min(MAX_MESSAGE_LENGTH, HEADER_SIZE + mGetLength(mailMessage)))) {
+      mailAckPayloads = false;
+      return;
+    }
+    mailNode = node;
+    mailId = id;
+    mailCursor = node;
+    return;
+  }
+}
+
+unsigned long MyGateway::untilService(unsigned long max) {
+  unsigned long now = millis();
+
+  max = radio->untilEvent(max);
+  max = segmentUntilDue(now, max);
+  max = inFlight.untilDue(now, max);
+  max = filter.untilDue(now, max);
+  if (mailbox.size() > 0) {
+    long left = (long)(mailExpired + 1000 - now);
+    max = left <= 0 ? 0 : (unsigned long)left < max ? left : max;
+  }
+  return max;
+}
+
+/*
+ * Send the mail of a node that is listening, oldest first, until a send fails.
+ */
+void MyGateway::mailboxFlush(uint8_t node) {
+  const MyMessage *held;
+  uint32_t id;
+
+  while ((held = mailbox.peek(node, &id)) != NULL) {
+    MyMessage mail = *held;
+    txBlink(1);
+    if (!sendRoute(mail)) {
+      errBlink(1);
+      return;
+    }
+    mailbox.delivered(node, id, false, millis());
+    mailDelivered(mail);
+  }
+}
+
+/*
+ * A held message reached its node, the wait for its ack starts now.
+ */
+void MyGateway::mailDelivered(const MyMessage &message) {
+  InFlight *entry;
+
+  if (mGetRequestAck(message) && inFlight.size() > 0 &&
+      (entry = inFlight.find(message.destination, message.sensor, message.type)) != NULL && entry->held) {
+    inFlight.sent(entry, true, millis());
+  }
+}
+
+/*
+ * Send messages again whose ack is overdue, and give up on those past
+ * their deadline. One retry per call, the radio listens for the acks in
+ * between.
+ */
+void MyGateway::inFlightService() {
+  InFlight *entry;
+
+  if (inFlight.size() == 0) {
+    return;
+  }
+  unsigned long now = millis();
+  while ((entry = inFlight.due(now)) != NULL) {
+    if ((long)(now - entry->deadline) >= 0) {
+      // Never taken by the node: asleep, it waits for the node to wake up
+      if (entry->held || entry->reached || !mailbox.put(entry->message, now)) {
+        deliveryReport(entry->message, DELIVERY_TIMEOUT, entry->sends, now - entry->first);
+        inFlight.remove(entry);
+      } else {
+        inFlight.held(entry, now);
+        mailRescan = true;
+      }
+      continue;
+    }
+    // A node with held mail is asleep, the retry waits with it
+    if (mailbox.pending(entry->message.destination) && mailbox.put(entry->message, now)) {
+      inFlight.held(entry, now);
+      mailRescan = true;
+      continue;
+    }
+    metricInc(M_DELIVERY_RETRIES);
+    MyMessage retry = entry->message;
+    txBlink(1);
+    boolean ok = sendRoute(retry);
+    if (!ok) {
+      errBlink(1);
+    }
+    inFlight.sent(entry, ok, now);
+    break;
+  }
+}
+
+/*
+ * Pass on the values the filter held back whose time has come
+ */
+void MyGateway::filterService() {
+  const MyMessage *due;
+
+  if (filter.size() == 0) {
+    return;
+  }
+  while ((due = filter.due(millis())) != NULL) {
+    MyMessage message = *due;
+    serial(message);
+  }
+}
+
+void MyGateway::sendRuleAction(MyMessage &action) {
+  txBlink(1);
+  if (sendDownstream(action)) {
+    ruleReport(action);
+  }
+}
+
+/*
+ * Tell the controller about a rule action that went out or waits in the mailbox
+ */
+void MyGateway::ruleReport(MyMessage &action) {
+  serial(PSTR("0;0;%d;0;%d;Rule sent %d;%d;%d;%d;%d;%s\n"), C_INTERNAL, I_LOG_MESSAGE,
+      action.destination, action.sensor, mGetCommand(action), mGetRequestAck(action),
+      action.type, action.getString(convBuf));
+}
+
+void MyGateway::deliveryReport(const MyMessage &message, delivery_result_e result, uint8_t sends, unsigned long ms) {
+  static const char *results[] = { "ok", "timeout", "replaced", "busy" };
+
+  metricInc((metric_id)(M_DELIVERY_OK + result));
+  serial(PSTR("%d;%d;%d;0;%d;%d,%s,%d,%lu\n"), message.destination, message.sensor, C_INTERNAL, I_DELIVERY,
+      message.type, results[result], sends, ms);
+}
+#endif
+
 void MyGateway::serial(const char *fmt, ... ) {
    va_list args;
    va_start (args, fmt );
    vsnprintf_P(serialBuffer, MAX_SEND_LENGTH, fmt, args);
    va_end (args);
+   serialWrite(serialBuffer);
+}
+
+void MyGateway::serialWrite(char *line) {
 #ifndef __Raspberry_Pi
-   Serial.print(serialBuffer);
+   Serial.print(line);
 #endif
    if (useWriteCallback) {
 	   // We have a registered write callback (probably Ethernet)
-	   dataCallback(serialBuffer);
+	   traceStage(TS_ENQUEUE);
+	   dataCallback(line);
    }
 }
 
 void MyGateway::serial(MyMessage &msg) {
-  serial(PSTR("%d;%d;%d;%d;%d;%s\n"),msg.sender, msg.sensor, mGetCommand(msg), mGetAck(msg), msg.type, msg.getString(convBuf));
+  snprintf_P(serialBuffer, MAX_SEND_LENGTH, PSTR("%d;%d;%d;%d;%d;%s\n"),msg.sender, msg.sensor, mGetCommand(msg), mGetAck(msg), msg.type, msg.getString(convBuf));
+  // Only the message from the radio is traced, not the lines of the gateway itself
+  traceStage(TS_FORMAT);
+  serialWrite(serialBuffer);
+}
+
+void MyGateway::deliverSegmented(SegmentRx &rx) {
+  char line[MAX_SEGMENTED_LENGTH];
+  uint16_t length = (rx.count - 1) * SEGMENT_FRAGMENT_SIZE + rx.lastLength;
+  int pos = snprintf_P(line, sizeof(line), PSTR("%d;%d;%d;0;%d;"), rx.sender, rx.sensor, rx.command, rx.type);
+
+  rxBlink(1);
+  for (uint16_t i = 0; i < length && pos < MAX_SEGMENTED_LENGTH - 3; i++) {
+    if (rx.command == C_STREAM) {
+      line[pos++] = msg.i2h(rx.data[i] >> 4);
+      line[pos++] = msg.i2h(rx.data[i]);
+    } else if (rx.data[i] == 0) {
+      break;
+    } else {
+      line[pos++] = rx.data[i];
+    }
+  }
+  line[pos++] = '\n';
+  line[pos] = 0;
+  traceStage(TS_FORMAT);
+  serialWrite(line);
 }
 
 
@@ -301,7 +821,7 @@ void ledTimersInterrupt() {
      digitalWrite(pinTx, HIGH);
    }
    if(countTx != 255) { countTx--; }
-   else if(inclusionMode) { countTx = 8; }
+   else if(interruptGateway->inclusionMode) { countTx = 8; }
 
   if(countErr && countErr != 255) {
     // switch led on
@@ -19,10 +19,23 @@
 	#include <sys/time.h>
 	#include <cstdarg>
 	#include <stdio.h>
+	#include "PiMailbox.h"
+	#include "PiInFlight.h"
+	#include "PiChannelSurvey.h"
+	#include "PiFilter.h"
+	#include "PiRules.h"
 #endif
 
 #define MAX_RECEIVE_LENGTH 100 // Max buffersize needed for messages coming from controller
 #define MAX_SEND_LENGTH 120 // Max buffersize needed for messages destined for controller
+#define MAX_SEGMENTED_LENGTH (2*SEGMENT_MAX_LENGTH+32) // Max line length of segmented messages, in both directions
+
+#ifdef __Raspberry_Pi
+// Stores of the process a gateway keeps its state in, see keepState()
+#define KEEP_SNAPSHOT 0x01 // routes, nodes and values, PiSnapshot.h
+#define KEEP_JOURNAL  0x02 // EEPROM writes, PiJournal.h
+#define KEEP_SERIES   0x04 // readings, PiSeries.h
+#endif
 
 class MyGateway : public MySensor
 {
@@ -44,7 +57,11 @@ class MyGateway : public MySensor
 		*
 		*/
 #ifdef __Raspberry_Pi
+#ifndef MY_NO_RF24
 		MyGateway(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed, uint8_t _inclusion_time );
+#endif
+		/* Gateway on top of any radio transport, e.g. MyTransportVirtual */
+		MyGateway(MyTransport *transport, uint8_t _inclusion_time );
 #else
 		MyGateway(uint8_t _cepin=DEFAULT_CE_PIN, uint8_t _cspin=DEFAULT_CS_PIN, uint8_t _inclusion_time = 1, uint8_t _inclusion_pin = 3, uint8_t _rx=6, uint8_t _tx=5, uint8_t _er=4);
 #endif
@@ -54,19 +71,93 @@ class MyGateway : public MySensor
 		void processRadioMessage();
 	    void parseAndSend(char *inputString);
 
+	    /**
+	     * Move the network to channel: announce it (I_CHANNEL) and switch
+	     * CHANNEL_SWITCH_DELAY ms later. Also "0;0;3;0;201;<channel>" from the
+	     * controller. Nodes that are asleep meanwhile stay behind.
+	     */
+	    void migrateChannel(uint8_t channel);
+#ifdef __Raspberry_Pi
+	    /**
+	     * Keep the state of this gateway in the stores the process opened,
+	     * KEEP_* flags; none by default, so a second gateway in the process
+	     * doesn't mix its nodes into them. Call before begin().
+	     */
+	    void keepState(uint8_t stores);
+
+	    /**
+	     * Survey all channels for dwell ms each (off the air meanwhile) and report
+	     * their occupancy to the controller. False if the radio can't tell.
+	     */
+	    bool surveyChannels(PiChannelSurvey &survey, unsigned int dwell);
+
+	    /**
+	     * ms until processRadioMessage() has work without a frame arriving:
+	     * a replayed frame, a retry, a segment ack timeout, a held value or
+	     * mail to expire; at most max.
+	     */
+	    unsigned long untilService(unsigned long max);
+
+	    /**
+	     * Hand the rule actions for nodes this gateway doesn't serve to
+	     * router, e.g. to the radio of a PiRadioGroup the node was heard on.
+	     * router returns false for the actions this gateway sends itself.
+	     */
+	    void setRuleRouter(bool (*router)(void *context, const MyMessage &action), void *context);
+
+	    /**
+	     * Send a rule action another gateway handed over, and report it to
+	     * the controller if it was sent or held for its node.
+	     */
+	    void sendRuleAction(MyMessage &action);
+#endif
+
+	protected:
+	    void serial(const char *fmt, ... );
+	    void serial(MyMessage &msg);
+	    void serialWrite(char *line);
+	    /* Segmented messages go to the controller as one line, hex encoded for C_STREAM */
+	    void deliverSegmented(SegmentRx &rx);
+#ifdef __Raspberry_Pi
+	    /* Answer a firmware request from the loaded images (PiFirmware.h), false if it's for the controller */
+	    boolean serveFirmware(MyMessage &request);
+	    /* Notes nodes with mail that were heard, and which one took the ack payload */
+	    void frameReceived(uint8_t pipe, MyMessage &message);
+	    /* Passes a message of the snapshot (PiSnapshot.h) on to the controller at a warm start */
+	    static void replayMessage(void *context, MyMessage &message, bool stale);
+#endif
+
 	private:
 	    char convBuf[MAX_PAYLOAD*2+1];
 	    char serialBuffer[MAX_SEND_LENGTH]; // Buffer for building string when sending data to vera
+	    boolean inclusionMode; // Keeps track on inclusion mode
+	    volatile boolean buttonTriggeredInclusion;
 	    unsigned long inclusionStartTime;
 	    boolean useWriteCallback;
 	    void (*dataCallback)(char *);
 	    uint8_t pinInclusion;
 	    uint8_t inclusionTime;
+#ifdef __Raspberry_Pi
+	    PiMailbox mailbox;        // messages for nodes that were asleep
+	    MyMessage mailMessage;    // copy queued as ack payload
+	    int mailNode;             // node the ack payload is for, -1 if none is queued
+	    uint32_t mailId;
+	    int mailWoken;            // node with mail that just transmitted, -1 if none
+	    uint8_t mailCursor;       // last node that got an ack payload, for the round robin
+	    bool mailRescan;          // routes or mail changed since no ack payload could be queued
+	    bool mailAckPayloads;     // the transport takes ack payloads
+	    unsigned long mailExpired;
+	    PiInFlight inFlight;      // messages waiting for their ack
+	    PiFilter filter;          // values held back from the controller
+	    uint8_t keeping;          // KEEP_* stores this gateway takes part in
+	    MyMessage actions[RULES_MAX_ACTIONS]; // sent by the rules that fired on the last message
+	    bool (*ruleRouter)(void *context, const MyMessage &action);
+	    void *ruleRouterContext;
+#endif
 
 		uint8_t h2i(char c);
+	    boolean sendDownstream(MyMessage &message);
 
-	    void serial(const char *fmt, ... );
-	    void serial(MyMessage &msg);
 	    void checkButtonTriggeredInclusion();
 	    void setInclusionMode(boolean newMode);
 	    void checkInclusionFinished();
@@ -74,6 +165,18 @@ class MyGateway : public MySensor
 	    void rxBlink(uint8_t cnt);
 	    void txBlink(uint8_t cnt);
 	    void errBlink(uint8_t cnt);
+#ifdef __Raspberry_Pi
+	    void mailboxService();
+	    void mailboxFlush(uint8_t node);
+	    void mailDelivered(const MyMessage &message);
+	    void inFlightService();
+	    void deliveryReport(const MyMessage &message, delivery_result_e result, uint8_t sends, unsigned long ms);
+	    void filterService();
+	    void ruleReport(MyMessage &action);
+#endif
+
+	    friend void ledTimersInterrupt();
+	    friend void startInclusionInterrupt();
 };
 
 void ledTimersInterrupt();
@@ -13,13 +13,6 @@
 #ifndef MyMessage_h
 #define MyMessage_h
 
-#ifdef __Raspberry_Pi
-	typedef bool boolean;
-	typedef char * String;
-	#define max(a,b) (a>b?a:b)
-	#define min(a,b) (a<b?a:b)
-#endif
-
 #if defined(__cplusplus) && !defined(__Raspberry_Pi)
 	#include <Arduino.h>
 #elif defined(__cplusplus)
@@ -38,6 +31,14 @@
 	#include <stddef.h>
 #endif
 
+// Defined after the system headers, libstdc++ can't cope with min/max macros
+#ifdef __Raspberry_Pi
+	typedef bool boolean;
+	typedef char * String;
+	#define max(a,b) (a>b?a:b)
+	#define min(a,b) (a<b?a:b)
+#endif
+
 #define PROTOCOL_VERSION 2
 #define MAX_MESSAGE_LENGTH 32
 #define HEADER_SIZE 7
@@ -67,7 +68,9 @@ typedef enum {
 	I_BATTERY_LEVEL, I_TIME, I_VERSION, I_ID_REQUEST, I_ID_RESPONSE,
 	I_INCLUSION_MODE, I_CONFIG, I_FIND_PARENT, I_FIND_PARENT_RESPONSE,
 	I_LOG_MESSAGE, I_CHILDREN, I_SKETCH_NAME, I_SKETCH_VERSION,
-	I_REBOOT, I_GATEWAY_READY
+	I_REBOOT, I_GATEWAY_READY,
+	// Types of this gateway, clear of the ones upstream MySensors uses
+	I_DELIVERY = 200, I_CHANNEL
 } mysensor_internal;
 
 // Type of sensor  (for presentation message)
@@ -81,7 +84,9 @@ typedef enum {
 // Type of data stream  (for streamed message)
 typedef enum {
 	ST_FIRMWARE_CONFIG_REQUEST, ST_FIRMWARE_CONFIG_RESPONSE, ST_FIRMWARE_REQUEST, ST_FIRMWARE_RESPONSE,
-	ST_SOUND, ST_IMAGE
+	ST_SOUND, ST_IMAGE,
+	// Types of this gateway, clear of the ones upstream MySensors uses
+	ST_SEGMENT = 200, ST_SEGMENT_ACK
 } mysensor_stream;
 
 typedef enum {
@@ -213,10 +218,11 @@ struct
 	// This union is used to simplify the construction of the binary data types transferred.
 	union {
 		uint8_t bValue;
-		unsigned long ulValue;
-		long lValue;
-		unsigned int uiValue;
-		int iValue;
+		// Fixed width: int and long are wider on the Pi and 64 bit hosts than OTA
+		uint32_t ulValue;
+		int32_t lValue;
+		uint16_t uiValue;
+		int16_t iValue;
 		struct { // Float messages
 			float fValue;
 			uint8_t fPrecision;   // Number of decimals when serializing
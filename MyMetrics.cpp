@@ -0,0 +1,261 @@
+/*
+ * MyMetrics.cpp - Runtime counters and gauges of the Raspberry Pi gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "MyMetrics.h"
+
+#ifdef __Raspberry_Pi
+
+#define METRICS_BUFFER_SIZE 65536
+
+struct MetricInfo {
+	const char *name;
+	const char *labels; // NULL if none
+	const char *type;
+	const char *help;
+};
+
+unsigned long metricValues[METRICS_SETS][METRICS_COUNT];
+__thread unsigned int metricSetIndex = 0;
+static unsigned int setsSelected = 1; // bit per set in use, the process always
+
+// Metrics sharing a name must be consecutive, HELP and TYPE are printed once
+static const MetricInfo metricInfo[METRICS_COUNT] = {
+	{ "mysensors_rx_frames_total", "command=\"presentation\"", "counter", "Frames received from the radio network." },
+	{ "mysensors_rx_frames_total", "command=\"set\"", "counter", NULL },
+	{ "mysensors_rx_frames_total", "command=\"req\"", "counter", NULL },
+	{ "mysensors_rx_frames_total", "command=\"internal\"", "counter", NULL },
+	{ "mysensors_rx_frames_total", "command=\"stream\"", "counter", NULL },
+	{ "mysensors_tx_frames_total", "result=\"ok\"", "counter", "Frames transmitted to the radio network." },
+	{ "mysensors_tx_frames_total", "result=\"fail\"", "counter", NULL },
+	{ "mysensors_tx_retransmits_total", NULL, "counter", "Automatic retransmissions done by the radio." },
+	{ "mysensors_tx_retry_wait_microseconds_total", NULL, "counter", "Auto retransmit delay the radio waited." },
+	{ "mysensors_tx_retry_changes_total", NULL, "counter", "Auto retransmit settings changed for the next hop." },
+	{ "mysensors_tx_retry_links", NULL, "gauge", "Next hops with a tuned auto retransmit setting." },
+	{ "mysensors_rx_fifo_empty_total", NULL, "counter", "Radio polls that found the RX FIFO empty." },
+	{ "mysensors_wait_cpu_microseconds_total", NULL, "counter", "CPU time the radio threads spent waiting for and servicing the radio." },
+	{ "mysensors_parse_errors_total", NULL, "counter", "Malformed commands received from the controller." },
+	{ "mysensors_output_dropped_total", NULL, "counter", "Messages that could not be written to the controller." },
+	{ "mysensors_version_mismatch_total", NULL, "counter", "Frames dropped because of a protocol version mismatch." },
+	{ "mysensors_route_changes_total", NULL, "counter", "Routing table updates." },
+	{ "mysensors_routes", NULL, "gauge", "Nodes with a known route." },
+	{ "mysensors_inclusion_mode", NULL, "gauge", "1 while inclusion mode is active." },
+	{ "mysensors_log_dropped_total", NULL, "counter", "Log messages dropped because the log queue was full." },
+	{ "mysensors_captured_frames_total", NULL, "counter", "Frames written to the capture file." },
+	{ "mysensors_capture_dropped_total", NULL, "counter", "Frames not captured because no capture file was ready." },
+	{ "mysensors_firmware_blocks_total", NULL, "counter", "Firmware blocks served to nodes by the gateway." },
+	{ "mysensors_firmware_updates_total", NULL, "counter", "Firmware transfers to nodes completed by the gateway." },
+	{ "mysensors_stream_chunks_total", NULL, "counter", "Image and sound chunks taken for reassembly." },
+	{ "mysensors_stream_duplicate_chunks_total", NULL, "counter", "Image and sound chunks received more than once." },
+	{ "mysensors_stream_objects_total", NULL, "counter", "Reassembled objects delivered to the stream sink." },
+	{ "mysensors_stream_expired_total", NULL, "counter", "Incomplete objects dropped after a timeout or replaced by a newer one." },
+	{ "mysensors_stream_dropped_total", NULL, "counter", "Objects dropped for lack of memory or a failing stream sink." },
+	{ "mysensors_stream_backlog", NULL, "gauge", "Objects being reassembled." },
+	{ "mysensors_stream_memory_bytes", NULL, "gauge", "Memory held by reassembly buffers." },
+	{ "mysensors_segmented_tx_total", NULL, "counter", "Segmented messages acknowledged by their receiver." },
+	{ "mysensors_segmented_tx_failed_total", NULL, "counter", "Segmented messages given up after all retransmissions." },
+	{ "mysensors_segment_retransmits_total", NULL, "counter", "Fragments of segmented messages sent again." },
+	{ "mysensors_segmented_rx_total", NULL, "counter", "Segmented messages reassembled." },
+	{ "mysensors_segmented_rx_dropped_total", NULL, "counter", "Incoming segmented messages dropped incomplete or malformed." },
+	{ "mysensors_mailbox_queued_total", NULL, "counter", "Messages held for nodes that could not be reached." },
+	{ "mysensors_mailbox_delivered_total", "path=\"ack_payload\"", "counter", "Held messages delivered to their node." },
+	{ "mysensors_mailbox_delivered_total", "path=\"direct\"", "counter", NULL },
+	{ "mysensors_mailbox_expired_total", NULL, "counter", "Held messages dropped after waiting too long for their node." },
+	{ "mysensors_mailbox_dropped_total", NULL, "counter", "Held messages dropped because the node's queue was full." },
+	{ "mysensors_mailbox_delay_milliseconds_total", NULL, "counter", "Time delivered messages were held, in total." },
+	{ "mysensors_mailbox_pending", NULL, "gauge", "Messages held for nodes." },
+	{ "mysensors_deliveries_total", "result=\"ok\"", "counter", "Controller messages with ack requested, by result." },
+	{ "mysensors_deliveries_total", "result=\"timeout\"", "counter", NULL },
+	{ "mysensors_deliveries_total", "result=\"replaced\"", "counter", NULL },
+	{ "mysensors_deliveries_total", "result=\"busy\"", "counter", NULL },
+	{ "mysensors_delivery_retries_total", NULL, "counter", "Controller messages sent again for a missing ack." },
+	{ "mysensors_inflight", NULL, "gauge", "Controller messages waiting for their ack." },
+	{ "mysensors_channel_surveys_total", NULL, "counter", "Channel surveys done." },
+	{ "mysensors_channel_migrations_total", NULL, "counter", "Channel changes announced to the network." },
+	{ "mysensors_channel_occupancy_permille", NULL, "gauge", "Share of survey samples the channel in use was busy." },
+	{ "mysensors_filter_values_total", "result=\"forwarded\"", "counter", "Values under a filter rule, by result." },
+	{ "mysensors_filter_values_total", "result=\"suppressed\"", "counter", NULL },
+	{ "mysensors_filter_held", NULL, "gauge", "Values held back by the filter." },
+	{ "mysensors_rule_values_total", NULL, "counter", "Values with gateway rules for their sensor." },
+	{ "mysensors_rule_actions_total", NULL, "counter", "Messages sent by gateway rules that fired." },
+	{ "mysensors_rule_lookups_total", NULL, "counter", "Values looked up in the gateway rules." },
+	{ "mysensors_rule_lookup_nanoseconds_total", NULL, "counter", "Time spent looking up values in the gateway rules and matching them." },
+	{ "mysensors_series_readings_total", "result=\"stored\"", "counter", "Readings taken by the time series store, by result." },
+	{ "mysensors_series_readings_total", "result=\"dropped\"", "counter", NULL },
+	{ "mysensors_series_flushes_total", NULL, "counter", "Batched writes of the time series store." },
+	{ "mysensors_series_written_bytes_total", NULL, "counter", "Bytes written to the time series segment files." },
+	{ "mysensors_series_queries_total", NULL, "counter", "Time series queries answered." },
+	{ "mysensors_series", NULL, "gauge", "Time series kept." },
+	{ "mysensors_snapshot_writes_total", "result=\"ok\"", "counter", "Snapshots of the gateway state written, by result." },
+	{ "mysensors_snapshot_writes_total", "result=\"failed\"", "counter", NULL },
+	{ "mysensors_snapshot_values", NULL, "gauge", "Presentations and values kept in the snapshot." },
+	{ "mysensors_journal_records_total", NULL, "counter", "EEPROM writes recorded in the journal." },
+	{ "mysensors_journal_commits_total", "result=\"ok\"", "counter", "Group commits of the EEPROM journal, by result." },
+	{ "mysensors_journal_commits_total", "result=\"failed\"", "counter", NULL },
+	{ "mysensors_journal_compactions_total", NULL, "counter", "Compactions of the EEPROM journal into the image file." },
+	{ "mysensors_journal_bytes", NULL, "gauge", "Bytes in the EEPROM journal." },
+	{ "mysensors_backlog_lines_total", "result=\"kept\"", "counter", "Lines for the controller kept while it had the tty closed, by result." },
+	{ "mysensors_backlog_lines_total", "result=\"replayed\"", "counter", NULL },
+	{ "mysensors_backlog_lines_total", "result=\"dropped\"", "counter", NULL },
+	{ "mysensors_backlog_bytes", NULL, "gauge", "Bytes of lines kept for the controller." },
+	{ "mysensors_controller_hangups_total", NULL, "counter", "Times the controller closed the tty." },
+};
+
+static int serverFd = -1;
+static pthread_t serverThread;
+static volatile bool serverRunning = false;
+
+bool metricIsCounter(metric_id id)
+{
+	return strcmp(metricInfo[id].type, "counter") == 0;
+}
+
+void metricSelect(int radio)
+{
+	unsigned int set = radio >= 0 && radio < METRICS_SETS - 1 ? radio + 1 : 0;
+
+	__atomic_fetch_or(&setsSelected, 1U << set, __ATOMIC_RELAXED);
+	metricSetIndex = set;
+}
+
+void metricClear(metric_id id)
+{
+	for (unsigned int set = 0; set < METRICS_SETS; set++) {
+		__atomic_store_n(&metricValues[set][id], 0, __ATOMIC_RELAXED);
+	}
+}
+
+size_t metricsRender(char *buffer, size_t len)
+{
+	unsigned int sets = __atomic_load_n(&setsSelected, __ATOMIC_RELAXED);
+	size_t pos = 0;
+	int n;
+
+	for (int i = 0; i < METRICS_COUNT && pos < len; i++) {
+		const MetricInfo *m = &metricInfo[i];
+		if (i == 0 || strcmp(m->name, metricInfo[i-1].name) != 0) {
+			n = snprintf(buffer + pos, len - pos, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, m->type);
+			pos += n > 0 ? n : 0;
+			if (pos >= len) break;
+		}
+		for (unsigned int set = 0; set < METRICS_SETS && pos < len; set++) {
+			if (!(sets & (1U << set))) {
+				continue;
+			}
+			unsigned long value = __atomic_load_n(&metricValues[set][i], __ATOMIC_RELAXED);
+			if (set > 0) {
+				n = snprintf(buffer + pos, len - pos, "%s{%s%sradio=\"%u\"} %lu\n", m->name,
+						m->labels ? m->labels : "", m->labels ? "," : "", set - 1, value);
+			} else if (m->labels) {
+				n = snprintf(buffer + pos, len - pos, "%s{%s} %lu\n", m->name, m->labels, value);
+			} else {
+				n = snprintf(buffer + pos, len - pos, "%s %lu\n", m->name, value);
+			}
+			pos += n > 0 ? n : 0;
+		}
+	}
+	if (pos >= len) {
+		pos = len - 1;
+	}
+	return pos;
+}
+
+static void serveClient(int fd)
+{
+	static char body[METRICS_BUFFER_SIZE];
+	char request[512];
+	char header[128];
+	pollfd pfd;
+
+	// We only serve metrics, the request itself does not matter
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) > 0) {
+		if (read(fd, request, sizeof(request)) < 0) {
+			return;
+		}
+	}
+	size_t len = metricsRender(body, sizeof(body));
+	int n = snprintf(header, sizeof(header),
+		"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\n\r\n", (unsigned int)len);
+	if (write(fd, header, n) == n) {
+		if (write(fd, body, len) < 0) {
+			return;
+		}
+	}
+}
+
+static void *serverLoop(void *arg)
+{
+	while (serverRunning) {
+		pollfd pfd;
+		pfd.fd = serverFd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 500) <= 0) {
+			continue;
+		}
+		int client = accept(serverFd, NULL, NULL);
+		if (client < 0) {
+			continue;
+		}
+		serveClient(client);
+		close(client);
+	}
+	return NULL;
+}
+
+bool metricsServerStart(uint16_t port)
+{
+	sockaddr_in addr;
+	int on = 1;
+
+	serverFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (serverFd < 0) {
+		return false;
+	}
+	setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(serverFd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(serverFd, 4) != 0) {
+		close(serverFd);
+		serverFd = -1;
+		return false;
+	}
+	serverRunning = true;
+	if (pthread_create(&serverThread, NULL, serverLoop, NULL) != 0) {
+		serverRunning = false;
+		close(serverFd);
+		serverFd = -1;
+		return false;
+	}
+	return true;
+}
+
+void metricsServerStop()
+{
+	if (!serverRunning) {
+		return;
+	}
+	serverRunning = false;
+	pthread_join(serverThread, NULL);
+	close(serverFd);
+	serverFd = -1;
+}
+
+#endif
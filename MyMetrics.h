@@ -0,0 +1,193 @@
+/*
+ * MyMetrics.h - Runtime counters and gauges of the Raspberry Pi gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * All metrics live in one statically allocated array and are updated with
+ * relaxed atomic operations, so updating them from the radio path never
+ * takes a lock or enters the kernel. An optional HTTP server thread bound
+ * to the loopback interface renders them in the Prometheus text format.
+ *
+ * The array has a set of values for the process and one for every radio of
+ * a PiRadioGroup: a radio thread selects its own with metricSelect(), like
+ * its EEPROM image, and whatever its gateway counts goes there. The sets
+ * are rendered as lines of their own, those of radio n with the label
+ * radio="n"; metricGet() adds them up. State of the process that radio
+ * threads happen to update, like a module's memory, is set with
+ * metricSetGlobal() instead.
+ */
+
+#ifndef MyMetrics_h
+#define MyMetrics_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __Raspberry_Pi
+
+typedef enum {
+	M_RX_PRESENTATION,   // frames received, by command
+	M_RX_SET,
+	M_RX_REQ,
+	M_RX_INTERNAL,
+	M_RX_STREAM,
+	M_TX_OK,             // frames transmitted, by result
+	M_TX_FAIL,
+	M_TX_RETRANSMITS,    // automatic retransmissions done by the radio
+	M_RETRY_WAIT,        // us the radio waited between them (ARD)
+	M_RETRY_CHANGES,     // retry settings written by PiRetryTuner
+	M_RETRY_LINKS,       // gauge: next hops with their own retry setting
+	M_RX_FIFO_EMPTY,     // radio polls that found no frame
+	M_WAIT_CPU,          // us of CPU time the radio threads spent in MySensor::wait()
+	M_PARSE_ERRORS,      // malformed commands from the controller
+	M_OUTPUT_DROPPED,    // lines that could not be written to the controller
+	M_VERSION_MISMATCH,  // frames dropped because of a protocol version mismatch
+	M_ROUTE_CHANGES,     // routing table updates
+	M_ROUTES,            // gauge: known routes
+	M_INCLUSION_MODE,    // gauge: 1 while inclusion mode is active
+	M_LOG_DROPPED,       // log messages dropped because the log queue was full
+	M_CAPTURED_FRAMES,   // frames written to the capture file
+	M_CAPTURE_DROPPED,   // frames not captured because no capture file was ready
+	M_FIRMWARE_BLOCKS,   // firmware blocks served by the gateway
+	M_FIRMWARE_UPDATES,  // firmware transfers completed by the gateway
+	M_STREAM_CHUNKS,     // image and sound chunks taken for reassembly
+	M_STREAM_DUPLICATES, // chunks received again
+	M_STREAM_OBJECTS,    // reassembled objects delivered to the sink
+	M_STREAM_EXPIRED,    // incomplete objects dropped after a timeout or a newer object
+	M_STREAM_DROPPED,    // objects dropped for lack of memory or a failing sink
+	M_STREAM_BACKLOG,    // gauge: objects being reassembled
+	M_STREAM_MEMORY,     // gauge: bytes of reassembly buffers
+	M_SEGMENTS_SENT,     // segmented messages acknowledged by their receiver
+	M_SEGMENTS_FAILED,   // segmented messages given up after SEGMENT_RETRIES
+	M_SEGMENT_RETRANSMITS, // fragments sent again
+	M_SEGMENTS_RECEIVED, // segmented messages reassembled
+	M_SEGMENTS_DROPPED,  // incoming segmented messages dropped incomplete or malformed
+	M_MAILBOX_QUEUED,    // messages held for nodes that could not be reached
+	M_MAILBOX_ACK_PAYLOAD, // held messages delivered, by how
+	M_MAILBOX_DIRECT,
+	M_MAILBOX_EXPIRED,   // held messages dropped after MAILBOX_TTL
+	M_MAILBOX_DROPPED,   // held messages dropped for a full queue
+	M_MAILBOX_DELAY,     // ms delivered messages were held, in total
+	M_MAILBOX_PENDING,   // gauge: messages held
+	M_DELIVERY_OK,       // messages with ack requested, by result (delivery_result_e)
+	M_DELIVERY_TIMEOUT,
+	M_DELIVERY_REPLACED,
+	M_DELIVERY_BUSY,
+	M_DELIVERY_RETRIES,  // messages sent again for a missing ack
+	M_INFLIGHT,          // gauge: messages waiting for their ack
+	M_CHANNEL_SURVEYS,   // channel surveys done (PiChannelSurvey)
+	M_CHANNEL_MIGRATIONS, // channel changes announced to the network
+	M_CHANNEL_OCCUPANCY, // gauge: permille of the samples the channel in use was busy
+	M_FILTER_FORWARDED,  // values under a PiFilter rule, by result
+	M_FILTER_SUPPRESSED,
+	M_FILTER_HELD,       // gauge: values held back by PiFilter
+	M_RULE_VALUES,       // values with PiRules rules for their sensor
+	M_RULE_ACTIONS,      // messages sent by rules that fired
+	M_RULE_LOOKUPS,      // values looked up in the rules, and the time it took
+	M_RULE_TIME,
+	M_SERIES_STORED,     // readings taken by PiSeries, by result
+	M_SERIES_DROPPED,
+	M_SERIES_FLUSHES,    // batched writes of the readings
+	M_SERIES_BYTES,      // bytes written to the segment files
+	M_SERIES_QUERIES,    // queries answered
+	M_SERIES,            // gauge: series kept
+	M_SNAPSHOT_WRITES,   // snapshots written by PiSnapshot, by result
+	M_SNAPSHOT_FAILED,
+	M_SNAPSHOT_VALUES,   // gauge: presentations and values kept
+	M_JOURNAL_RECORDS,   // EEPROM writes journaled by PiJournal
+	M_JOURNAL_COMMITS,   // group commits of the journal, by result
+	M_JOURNAL_FAILED,
+	M_JOURNAL_COMPACTIONS, // journal folded into the EEPROM image file
+	M_JOURNAL_BYTES,     // gauge: bytes in the journal
+	M_BACKLOG_KEPT,      // lines kept by PiBacklog while the controller was away, by result
+	M_BACKLOG_REPLAYED,
+	M_BACKLOG_DROPPED,
+	M_BACKLOG_BYTES,     // gauge: bytes of lines kept
+	M_CONTROLLER_HANGUPS, // the controller closed the tty
+	METRICS_COUNT
+} metric_id;
+
+#define METRICS_SETS 5 // the process and up to 4 radios (GROUP_MAX_RADIOS)
+
+extern unsigned long metricValues[METRICS_SETS][METRICS_COUNT];
+extern __thread unsigned int metricSetIndex; // set of the thread, 0 for the process
+
+static inline void metricInc(metric_id id)
+{
+	__atomic_fetch_add(&metricValues[metricSetIndex][id], 1, __ATOMIC_RELAXED);
+}
+
+static inline void metricAdd(metric_id id, unsigned long value)
+{
+	__atomic_fetch_add(&metricValues[metricSetIndex][id], value, __ATOMIC_RELAXED);
+}
+
+static inline void metricSub(metric_id id, unsigned long value)
+{
+	__atomic_fetch_sub(&metricValues[metricSetIndex][id], value, __ATOMIC_RELAXED);
+}
+
+static inline void metricSet(metric_id id, unsigned long value)
+{
+	__atomic_store_n(&metricValues[metricSetIndex][id], value, __ATOMIC_RELAXED);
+}
+
+/* Gauges of the whole process, whichever thread sets them */
+static inline void metricSetGlobal(metric_id id, unsigned long value)
+{
+	__atomic_store_n(&metricValues[0][id], value, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long metricGet(metric_id id)
+{
+	unsigned long value = 0;
+	for (unsigned int set = 0; set < METRICS_SETS; set++) {
+		value += __atomic_load_n(&metricValues[set][id], __ATOMIC_RELAXED);
+	}
+	return value;
+}
+
+/**
+ * Count the metrics of the calling thread from now on in the set of radio
+ * (0..METRICS_SETS-2), or in the process set with -1.
+ */
+void metricSelect(int radio);
+
+/**
+ * Zero the metric in every set.
+ */
+void metricClear(metric_id id);
+
+/**
+ * True for counters, false for gauges.
+ */
+bool metricIsCounter(metric_id id);
+
+/**
+ * Render all metrics in Prometheus text exposition format into buffer.
+ * Returns the length of the text (truncated to len-1 characters).
+ */
+size_t metricsRender(char *buffer, size_t len);
+
+/**
+ * Start serving the metrics over HTTP on 127.0.0.1:port in a background thread.
+ * Returns false if the listening socket could not be set up.
+ */
+bool metricsServerStart(uint16_t port);
+
+/**
+ * Stop the metrics server thread.
+ */
+void metricsServerStop();
+
+#else
+	#define metricInc(id)
+	#define metricAdd(id, value)
+	#define metricSub(id, value)
+	#define metricSet(id, value)
+	#define metricSetGlobal(id, value)
+#endif
+
+#endif
@@ -16,13 +16,14 @@ using namespace std;
 
 #ifdef __Raspberry_Pi
 	#include <PiEEPROM.h>
-	#include "RF24.h"
-	#include "RF24_config.h"
+	#include <PiCapture.h>
 #else
 	#include "utility/LowPower.h"
-	#include "utility/RF24.h"
-	#include "utility/RF24_config.h"
 #endif
+#ifndef MY_NO_RF24
+	#include "MyTransportRF24.h"
+#endif
+
 
 
 // Inline function and macros
@@ -38,16 +39,58 @@ inline MyMessage& build (MyMessage &msg, uint8_t sender, uint8_t destination, ui
 }
 
 #ifdef __Raspberry_Pi
-MySensor::MySensor(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed ) : RF24(_cepin, _cspin, spispeed){
-	timeval curTime;
-	gettimeofday(&curTime, NULL);
-	millis_at_start = curTime.tv_sec;
+#ifndef MY_NO_RF24
+MySensor::MySensor(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed ) {
+	init(new MyTransportRF24(_cepin, _cspin, spispeed), true);
 }
+#endif
 #else
-MySensor::MySensor(uint8_t _cepin, uint8_t _cspin) : RF24(_cepin, _cspin) {
+MySensor::MySensor(uint8_t _cepin, uint8_t _cspin) {
+	init(new MyTransportRF24(_cepin, _cspin), true);
 }
 #endif
 
+MySensor::MySensor(MyTransport *transport) {
+	init(transport, false);
+}
+
+MySensor::~MySensor() {
+	if (ownsRadio) {
+		delete radio;
+	}
+	delete [] childNodeTable;
+}
+
+void MySensor::init(MyTransport *transport, bool owned) {
+	radio = transport;
+	ownsRadio = owned;
+	baseRadioId = BASE_RADIO_ID;
+	// MyGateway doesn't go through MySensor::begin()
+	msgCallback = NULL;
+	timeCallback = NULL;
+	segmentCallback = NULL;
+	for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+		segmentTx[i].active = false;
+		segmentRx[i].active = false;
+	}
+	segmentSeq = 0;
+	childNodeTable = NULL;
+	findingParent = false;
+#ifdef __Raspberry_Pi
+	radioEventFd = -1;
+	radioEventFailed = false;
+	waitCpuTime = 0;
+#endif
+}
+
+MyTransport *MySensor::getTransport() {
+	return radio;
+}
+
+void MySensor::setBaseRadioId(uint64_t baseId) {
+	baseRadioId = baseId;
+}
+
 void MySensor::begin(void (*_msgCallback)(const MyMessage &), uint8_t _nodeId, boolean _repeaterMode, uint8_t _parentNodeId, rf24_pa_dbm_e paLevel, uint8_t channel, rf24_datarate_e dataRate) {
 #ifndef __Raspberry_Pi
 	Serial.begin(BAUD_RATE);
@@ -108,35 +151,51 @@ void MySensor::begin(void (*_msgCallback)(const MyMessage &), uint8_t _nodeId, b
 	}
 }
 
-void MySensor::setupRadio(rf24_pa_dbm_e paLevel, uint8_t channel, rf24_datarate_e dataRate) {
+void MySensor::setupRadio(rf24_pa_dbm_e paLevel, uint8_t _channel, rf24_datarate_e dataRate) {
 	failedTransmissions = 0;
 
-	// Start up the radio library
-	RF24::begin();
+	// A migrated network stays on its new channel
+	channel = _channel;
+	uint8_t migrated = eeprom_read_byte((uint8_t*)EEPROM_CHANNEL_ADDRESS);
+	if (migrated <= 125 && eeprom_read_byte((uint8_t*)EEPROM_CHANNEL_ADDRESS + 1) == (uint8_t)~migrated) {
+		channel = migrated;
+	}
+	channelNext = channel;
 
-	if (!RF24::isPVariant()) {
+	// Start up the radio library
+	if (!radio->begin()) {
 		debug(PSTR("check wires\n"));
 		throw "check wires";
 	}
-	RF24::setAutoAck(1);
-	RF24::setAutoAck(BROADCAST_PIPE,false); // Turn off auto ack for broadcast
-	RF24::enableAckPayload();
-	RF24::setChannel(channel);
-	RF24::setPALevel(paLevel);
-	RF24::setDataRate(dataRate);
-	RF24::setRetries(5,15);
-	RF24::setCRCLength(RF24_CRC_16);
-	RF24::enableDynamicPayloads();
+	radio->setAutoAck(true);
+	radio->setAutoAck(BROADCAST_PIPE,false); // Turn off auto ack for broadcast
+	radio->enableAckPayload();
+	radio->setChannel(channel);
+	radio->setPALevel(paLevel);
+	radio->setDataRate(dataRate);
+	radio->setRetries(5,15);
+	radio->setCRCLength(RF24_CRC_16);
+	radio->enableDynamicPayloads();
 
 	// All nodes listen to broadcast pipe (for FIND_PARENT_RESPONSE messages)
-	RF24::openReadingPipe(BROADCAST_PIPE, TO_ADDR(BROADCAST_ADDRESS));
+	radio->openReadingPipe(BROADCAST_PIPE, baseRadioId + BROADCAST_ADDRESS);
 
-	RF24::printDetails();
+	radio->printDetails();
+#ifdef __Raspberry_Pi
+	retryTuner.begin(dataRate);
+#endif
 }
 
 void MySensor::setupRepeaterMode(){
 	childNodeTable = new uint8_t[256];
 	eeprom_read_block((void*)childNodeTable, (void*)EEPROM_ROUTES_ADDRESS, 256);
+	unsigned long routes = 0;
+	for (int i = 0; i < 256; i++) {
+		if (childNodeTable[i] != 0xff) {
+			routes++;
+		}
+	}
+	metricAdd(M_ROUTES, routes);
 }
 
 uint8_t MySensor::getNodeId() {
@@ -149,15 +208,15 @@ ControllerConfig MySensor::getConfig() {
 
 void MySensor::requestNodeId() {
 	debug(PSTR("req node id\n"));
-	RF24::openReadingPipe(CURRENT_NODE_PIPE, TO_ADDR(nc.nodeId));
+	radio->openReadingPipe(CURRENT_NODE_PIPE, baseRadioId + nc.nodeId);
 	sendRoute(build(msg, nc.nodeId, GATEWAY_ADDRESS, NODE_SENSOR_ID, C_INTERNAL, I_ID_REQUEST, false).set(""));
 	wait(2000);
 }
 
 void MySensor::setupNode() {
 	// Open reading pipe for messages directed to this node (set write pipe to same)
-	RF24::openReadingPipe(WRITE_PIPE, TO_ADDR(nc.nodeId));
-	RF24::openReadingPipe(CURRENT_NODE_PIPE, TO_ADDR(nc.nodeId));
+	radio->openReadingPipe(WRITE_PIPE, baseRadioId + nc.nodeId);
+	radio->openReadingPipe(CURRENT_NODE_PIPE, baseRadioId + nc.nodeId);
 
 	// Send presentation for this radio node (attach
 	present(NODE_SENSOR_ID, repeaterMode? S_ARDUINO_REPEATER_NODE : S_ARDUINO_NODE);
@@ -168,7 +227,51 @@ void MySensor::setupNode() {
 	sendRoute(build(msg, nc.nodeId, GATEWAY_ADDRESS, NODE_SENSOR_ID, C_INTERNAL, I_CONFIG, false).set(nc.parentNodeId));
 }
 
+/*
+ * Move to channel next delay ms from now. The gateway and the repeaters
+ * announce it until then, each in its own slot of the interval so that
+ * neighbours don't keep colliding.
+ */
+void MySensor::channelMigrate(uint8_t next, unsigned long delay) {
+	channelNext = next;
+	channelSwitchAt = millis() + delay;
+	channelAnnounceAt = millis() + nc.nodeId % 32 * (CHANNEL_ANNOUNCE_INTERVAL / 32);
+}
+
+void MySensor::channelService() {
+	unsigned long now = millis();
+
+	if ((long)(now - channelSwitchAt) >= 0) {
+		debug(PSTR("channel %d -> %d\n"), channel, channelNext);
+		channel = channelNext;
+		uint8_t saved[2] = { channel, (uint8_t)~channel };
+		eeprom_write_block((void*)saved, (void*)EEPROM_CHANNEL_ADDRESS, sizeof(saved));
+		radio->stopListening();
+		radio->setChannel(channel);
+		radio->startListening();
+	} else if (repeaterMode && nc.nodeId != AUTO && (long)(now - channelAnnounceAt) >= 0) {
+		MyMessage announcement;
+		unsigned long left = channelSwitchAt - now;
+		uint8_t payload[3] = { channelNext, (uint8_t)left, (uint8_t)(left >> 8) };
+		channelAnnounceAt += CHANNEL_ANNOUNCE_INTERVAL;
+		if ((long)(now - channelAnnounceAt) >= 0) {
+			// Out of step after a long send, the slot is lost
+			channelAnnounceAt = now + CHANNEL_ANNOUNCE_INTERVAL;
+		}
+		build(announcement, nc.nodeId, BROADCAST_ADDRESS, NODE_SENSOR_ID, C_INTERNAL, I_CHANNEL, false).set(payload, sizeof(payload));
+		// The gateway is the origin, whoever passes it on
+		announcement.sender = GATEWAY_ADDRESS;
+		sendWrite(BROADCAST_ADDRESS, announcement, true);
+	}
+}
+
 void MySensor::findParentNode() {
+	// A repeater without parent searches when it hears others search, also
+	// while waiting for the answers to its own search
+	if (findingParent) {
+		return;
+	}
+	findingParent = true;
 	failedTransmissions = 0;
 
 	// Set distance to max
@@ -180,6 +283,7 @@ void MySensor::findParentNode() {
 
 	// Wait for ping response.
 	wait(2000);
+	findingParent = false;
 }
 
 boolean MySensor::sendRoute(MyMessage &message) {
@@ -234,18 +338,359 @@ boolean MySensor::sendWrite(uint8_t next, MyMessage &message, bool broadcast) {
 	message.last = nc.nodeId;
 	mSetVersion(message, PROTOCOL_VERSION);
 	// Make sure radio has powered up
-	RF24::powerUp();
-	RF24::stopListening();
-	RF24::openWritingPipe(TO_ADDR(next));
-	bool ok = RF24::write(&message, min(MAX_MESSAGE_LENGTH, HEADER_SIZE + length), broadcast);
-	RF24::startListening();
+	radio->powerUp();
+	radio->stopListening();
+	radio->openWritingPipe(baseRadioId + next);
+#ifdef __Raspberry_Pi
+	if (!broadcast) {
+		retryTuner.prepare(radio, next);
+	}
+#endif
+	bool ok = radio->write(&message, min(MAX_MESSAGE_LENGTH, HEADER_SIZE + length), broadcast);
+	radio->startListening();
+	traceStage(TS_TX);
+#ifdef __Raspberry_Pi
+	if (captureEnabled) {
+		captureFrame(CAPTURE_TX, WRITE_PIPE, next, ok, &message, min(MAX_MESSAGE_LENGTH, HEADER_SIZE + length));
+	}
+	if (!broadcast) {
+		uint8_t retransmits = radio->getRetransmits();
+		metricAdd(M_TX_RETRANSMITS, retransmits);
+		retryTuner.sent(next, ok, retransmits);
+	}
+#endif
+	metricInc(ok ? M_TX_OK : M_TX_FAIL);
 
 	debug(PSTR("send: %d-%d-%d-%d s=%d,c=%d,t=%d,pt=%d,l=%d,st=%s:%s\n"),
-			message.sender,message.last, next, message.destination, message.sensor, mGetCommand(message), message.type, mGetPayloadType(message), mGetLength(message), ok?"ok":"fail", message.getString(convBuf));
+			message.sender,message.last, next, message.destination, message.sensor, mGetCommand(message), message.type, mGetPayloadType(message), mGetLength(message), ok?"ok":"fail", debugPayload(message, convBuf));
+
+	return ok;
+}
+
+boolean MySensor::sendRouteBurst(MyMessage *messages, uint8_t count) {
+	// Same next hop as sendRoute() picks, all messages go to the same destination
+	uint8_t dest = messages[0].destination;
+
+	if (nc.nodeId == AUTO) {
+		return false;
+	}
+	if (repeaterMode) {
+		uint8_t route = getChildRoute(dest);
+		if (route>GATEWAY_ADDRESS && route<BROADCAST_ADDRESS && dest != GATEWAY_ADDRESS) {
+			return sendWriteBurst(route, messages, count);
+		}
+	}
+	if (!isGateway) {
+		return sendWriteBurst(nc.parentNodeId, messages, count);
+	}
+	return false;
+}
 
+/*
+ * Send messages to one next hop, TX_FIFO_SIZE at a time through the TX FIFO.
+ * The radio returns to RX after every group, so it is never deaf for longer
+ * than a FIFO takes to drain.
+ */
+boolean MySensor::sendWriteBurst(uint8_t next, MyMessage *messages, uint8_t count) {
+	bool ok = true;
+
+	radio->powerUp();
+	for (uint8_t first = 0; first < count; first += TX_FIFO_SIZE) {
+		uint8_t last = count - first < TX_FIFO_SIZE ? count : first + TX_FIFO_SIZE;
+		bool groupOk = true;
+
+		radio->stopListening();
+		radio->openWritingPipe(baseRadioId + next);
+#ifdef __Raspberry_Pi
+		// Only the last frame's retransmissions are known, the estimate stays as it is
+		retryTuner.prepare(radio, next);
+#endif
+		for (uint8_t i = first; i < last; i++) {
+			MyMessage &message = messages[i];
+			message.last = nc.nodeId;
+			mSetVersion(message, PROTOCOL_VERSION);
+			// Once a frame failed the radio drops the rest of the FIFO
+			groupOk = groupOk && radio->writeFast(&message, min(MAX_MESSAGE_LENGTH, HEADER_SIZE + mGetLength(message)));
+		}
+		groupOk = radio->txStandBy() && groupOk;
+		radio->startListening();
+		traceStage(TS_TX);
+		for (uint8_t i = first; i < last; i++) {
+#ifdef __Raspberry_Pi
+			if (captureEnabled) {
+				captureFrame(CAPTURE_TX, WRITE_PIPE, next, groupOk, &messages[i], min(MAX_MESSAGE_LENGTH, HEADER_SIZE + mGetLength(messages[i])));
+			}
+#endif
+			metricInc(groupOk ? M_TX_OK : M_TX_FAIL);
+			debug(PSTR("send: %d-%d-%d-%d s=%d,c=%d,t=%d,pt=%d,l=%d,st=%s (burst %d/%d)\n"),
+					messages[i].sender, messages[i].last, next, messages[i].destination, messages[i].sensor, mGetCommand(messages[i]),
+					messages[i].type, mGetPayloadType(messages[i]), mGetLength(messages[i]), groupOk?"ok":"fail", i+1, count);
+		}
+		ok = ok && groupOk;
+	}
 	return ok;
 }
 
+bool MySensor::sendSegmented(uint8_t destination, uint8_t sensor, uint8_t command, uint8_t type, const void *data, uint16_t length) {
+	SegmentTx *tx = NULL;
+
+	if (length == 0 || length > SEGMENT_MAX_LENGTH || (length + SEGMENT_FRAGMENT_SIZE - 1) / SEGMENT_FRAGMENT_SIZE > 255) {
+		return false;
+	}
+	for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+		if (!segmentTx[i].active) {
+			tx = &segmentTx[i];
+			break;
+		}
+	}
+	if (tx == NULL) {
+		return false;
+	}
+	tx->destination = destination;
+	tx->sensor = sensor;
+	tx->command = command;
+	tx->type = type;
+	tx->seq = segmentSeq++;
+	tx->count = (length + SEGMENT_FRAGMENT_SIZE - 1) / SEGMENT_FRAGMENT_SIZE;
+	tx->retries = 0;
+	tx->length = length;
+	memcpy(tx->data, data, length);
+	if (!segmentSend(*tx, NULL, tx->count)) {
+		return false;
+	}
+	tx->active = true;
+	tx->lastSend = millis();
+	return true;
+}
+
+void MySensor::setSegmentCallback(void (*_segmentCallback)(uint8_t, uint8_t, uint8_t, uint8_t, const uint8_t *, uint16_t)) {
+	segmentCallback = _segmentCallback;
+}
+
+/*
+ * Send the fragments listed in indices, or the first count fragments if
+ * indices is NULL, SEGMENT_BURST at a time
+ */
+boolean MySensor::segmentSend(SegmentTx &tx, const uint8_t *indices, uint8_t count) {
+	MyMessage fragments[SEGMENT_BURST];
+	uint8_t buffer[MAX_PAYLOAD];
+	SegmentHeader header;
+	uint8_t queued = 0;
+	bool ok = true;
+
+	header.seq = tx.seq;
+	header.count = tx.count;
+	header.command = tx.command;
+	header.type = tx.type;
+	for (uint8_t i = 0; i < count; i++) {
+		header.index = indices ? indices[i] : i;
+		if (header.index >= tx.count) {
+			continue;
+		}
+		uint16_t offset = header.index * SEGMENT_FRAGMENT_SIZE;
+		uint8_t length = tx.length - offset < (uint16_t)SEGMENT_FRAGMENT_SIZE ? tx.length - offset : SEGMENT_FRAGMENT_SIZE;
+		memcpy(buffer, &header, sizeof(header));
+		memcpy(buffer + sizeof(header), tx.data + offset, length);
+		build(fragments[queued++], nc.nodeId, tx.destination, tx.sensor, C_STREAM, ST_SEGMENT, false).set(buffer, sizeof(header) + length);
+		if (queued == SEGMENT_BURST || i + 1 == count) {
+			ok = sendRouteBurst(fragments, queued) && ok;
+			queued = 0;
+		}
+	}
+	if (queued > 0) {
+		ok = sendRouteBurst(fragments, queued) && ok;
+	}
+	return ok;
+}
+
+void MySensor::segmentReceive(MyMessage &message) {
+	SegmentHeader header;
+	SegmentRx *rx = NULL;
+	uint8_t length = mGetLength(message);
+	bool completed = false;
+
+	if (message.type == ST_SEGMENT_ACK) {
+		segmentAcknowledged(message);
+		return;
+	}
+	if (length <= sizeof(header)) {
+		return;
+	}
+	memcpy(&header, message.data, sizeof(header));
+	length -= sizeof(header);
+	if (header.count == 0 || header.index >= header.count || length > SEGMENT_FRAGMENT_SIZE ||
+			(uint16_t)(header.count - 1) * SEGMENT_FRAGMENT_SIZE + length > SEGMENT_MAX_LENGTH ||
+			(header.index + 1 < header.count && length != SEGMENT_FRAGMENT_SIZE)) {
+		metricInc(M_SEGMENTS_DROPPED);
+		return;
+	}
+	for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+		SegmentRx &r = segmentRx[i];
+		if (r.active && r.sender == message.sender && r.seq == header.seq && r.count == header.count) {
+			rx = &r;
+			break;
+		}
+	}
+	if (rx == NULL) {
+		// A free context, or the one heard from longest ago
+		for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+			SegmentRx &r = segmentRx[i];
+			if (!r.active) {
+				rx = &r;
+				break;
+			}
+			if (rx == NULL || millis() - r.lastFragment > millis() - rx->lastFragment) {
+				rx = &r;
+			}
+		}
+		if (rx->active && !rx->complete) {
+			metricInc(M_SEGMENTS_DROPPED);
+		}
+		rx->active = true;
+		rx->complete = false;
+		rx->sender = message.sender;
+		rx->sensor = message.sensor;
+		rx->command = header.command;
+		rx->type = header.type;
+		rx->seq = header.seq;
+		rx->count = header.count;
+		rx->received = 0;
+		rx->lastLength = 0;
+		memset(rx->bitmap, 0, sizeof(rx->bitmap));
+	}
+	rx->lastFragment = millis();
+	if (!rx->complete && !(rx->bitmap[header.index >> 3] & (1 << (header.index & 7)))) {
+		rx->bitmap[header.index >> 3] |= 1 << (header.index & 7);
+		memcpy(rx->data + header.index * SEGMENT_FRAGMENT_SIZE, message.data + sizeof(header), length);
+		if (header.index + 1 == header.count) {
+			rx->lastLength = length;
+		}
+		if (++rx->received == rx->count) {
+			rx->complete = true;
+			completed = true;
+		}
+	}
+	if (completed) {
+		metricInc(M_SEGMENTS_RECEIVED);
+		deliverSegmented(*rx);
+	}
+	if (completed || header.index + 1 == header.count) {
+		segmentAcknowledge(*rx);
+	}
+}
+
+void MySensor::deliverSegmented(SegmentRx &rx) {
+	if (segmentCallback != NULL) {
+		segmentCallback(rx.sender, rx.sensor, rx.command, rx.type, rx.data, (rx.count - 1) * SEGMENT_FRAGMENT_SIZE + rx.lastLength);
+	}
+}
+
+/*
+ * Tell the sender which fragments are missing, none once complete
+ */
+void MySensor::segmentAcknowledge(SegmentRx &rx) {
+	MyMessage reply;
+	SegmentAck payload;
+
+	payload.seq = rx.seq;
+	payload.missing = 0;
+	for (uint16_t i = 0; !rx.complete && i < rx.count && payload.missing < SEGMENT_ACK_MISSING; i++) {
+		if (!(rx.bitmap[i >> 3] & (1 << (i & 7)))) {
+			payload.index[payload.missing++] = i;
+		}
+	}
+	sendRoute(build(reply, nc.nodeId, rx.sender, rx.sensor, C_STREAM, ST_SEGMENT_ACK, false).set(&payload, 2 + payload.missing));
+}
+
+void MySensor::segmentAcknowledged(MyMessage &message) {
+	SegmentAck payload;
+	uint8_t length = mGetLength(message);
+
+	if (length < 2 || length > sizeof(payload)) {
+		return;
+	}
+	memcpy(&payload, message.data, length);
+	for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+		SegmentTx &tx = segmentTx[i];
+		if (!tx.active || tx.destination != message.sender || tx.seq != payload.seq) {
+			continue;
+		}
+		if (payload.missing == 0) {
+			tx.active = false;
+			metricInc(M_SEGMENTS_SENT);
+		} else if (tx.retries++ == SEGMENT_RETRIES) {
+			tx.active = false;
+			metricInc(M_SEGMENTS_FAILED);
+		} else {
+			if (payload.missing > length - 2) {
+				payload.missing = length - 2;
+			}
+			metricAdd(M_SEGMENT_RETRANSMITS, payload.missing);
+			segmentSend(tx, payload.index, payload.missing);
+			tx.lastSend = millis();
+		}
+		return;
+	}
+}
+
+/*
+ * Repeat the last fragment of unacknowledged messages, which makes the
+ * receiver report what it is missing, and forget stale incoming messages
+ */
+void MySensor::segmentTimers() {
+	unsigned long now = 0;
+
+	for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+		SegmentTx &tx = segmentTx[i];
+		if (!tx.active) {
+			continue;
+		}
+		now = now ? now : millis();
+		if (now - tx.lastSend < SEGMENT_ACK_TIMEOUT) {
+			continue;
+		}
+		if (tx.retries++ == SEGMENT_RETRIES) {
+			debug(PSTR("segment %d to %d failed\n"), tx.seq, tx.destination);
+			tx.active = false;
+			metricInc(M_SEGMENTS_FAILED);
+			continue;
+		}
+		uint8_t last = tx.count - 1;
+		metricInc(M_SEGMENT_RETRANSMITS);
+		segmentSend(tx, &last, 1);
+		tx.lastSend = now;
+	}
+	for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+		SegmentRx &rx = segmentRx[i];
+		if (!rx.active) {
+			continue;
+		}
+		now = now ? now : millis();
+		if (now - rx.lastFragment > SEGMENT_RX_TIMEOUT) {
+			if (!rx.complete) {
+				metricInc(M_SEGMENTS_DROPPED);
+			}
+			rx.active = false;
+		}
+	}
+}
+
+unsigned long MySensor::segmentUntilDue(unsigned long now, unsigned long max) {
+	for (uint8_t i = 0; i < SEGMENT_CONTEXTS; i++) {
+		SegmentTx &tx = segmentTx[i];
+		if (tx.active) {
+			long left = (long)(tx.lastSend + SEGMENT_ACK_TIMEOUT - now);
+			max = left <= 0 ? 0 : (unsigned long)left < max ? left : max;
+		}
+		SegmentRx &rx = segmentRx[i];
+		if (rx.active) {
+			long left = (long)(rx.lastFragment + SEGMENT_RX_TIMEOUT + 1 - now);
+			max = left <= 0 ? 0 : (unsigned long)left < max ? left : max;
+		}
+	}
+	return max;
+}
+
 bool MySensor::send(MyMessage &message, bool enableAck) {
 	message.sender = nc.nodeId;
 	mSetCommand(message,C_SET);
@@ -281,29 +726,65 @@ void MySensor::requestTime(void (* _timeCallback)(unsigned long)) {
 
 boolean MySensor::process() {
 	uint8_t pipe;
-	boolean available = RF24::available(&pipe);
+	segmentTimers();
+	if (channelNext != channel) {
+		channelService();
+	}
+	boolean available = radio->available(&pipe);
 
-	if (!available || pipe>6)
+	if (!available || pipe>6) {
+		metricInc(M_RX_FIFO_EMPTY);
 		return false;
+	}
+	traceBegin(TRACE_UPSTREAM);
 	memset(&msg,0,sizeof(MyMessage));
-	uint8_t len = RF24::getDynamicPayloadSize();
-	RF24::read(&msg, len);
+	uint8_t len = radio->getDynamicPayloadSize();
+	radio->read(&msg, len);
+	traceStage(TS_RX_READ);
+#ifdef __Raspberry_Pi
+	if (captureEnabled) {
+		captureFrame(CAPTURE_RX, pipe, 0xff, true, &msg, len);
+	}
+#endif
 
+	if (mGetLength(msg) > MAX_PAYLOAD) {
+		// The length field has 5 bits, more than a frame can carry
+		debug(PSTR("bad length %d\n"), mGetLength(msg));
+		return false;
+	}
 	// Add string termination, good if we later would want to print it.
 	msg.data[mGetLength(msg)] = '\0';
 	debug(PSTR("read: %d-%d-%d s=%d,c=%d,t=%d,pt=%d,l=%d:%s\n"),
-				msg.sender, msg.last, msg.destination,  msg.sensor, mGetCommand(msg), msg.type, mGetPayloadType(msg), mGetLength(msg), msg.getString(convBuf));
+				msg.sender, msg.last, msg.destination,  msg.sensor, mGetCommand(msg), msg.type, mGetPayloadType(msg), mGetLength(msg), debugPayload(msg, convBuf));
 
 	if(!(mGetVersion(msg) == PROTOCOL_VERSION)) {
 		debug(PSTR("version mismatch\n"));
+		metricInc(M_VERSION_MISMATCH);
 		return false;
 	}
 
+	frameReceived(pipe, msg);
+
 	uint8_t command = mGetCommand(msg);
+	if (command <= C_STREAM) {
+		metricInc((metric_id)(M_RX_PRESENTATION + command));
+	}
+
+	if (msg.destination == BROADCAST_ADDRESS && command == C_INTERNAL && msg.type == I_CHANNEL &&
+			msg.sender == GATEWAY_ADDRESS && !isGateway) {
+		uint8_t *payload = (uint8_t *)msg.getCustom();
+		uint16_t left = payload[1] | payload[2] << 8;
+		// The first announcement heard sets the time, repeaters pass it on from then
+		if (mGetLength(msg) == 3 && payload[0] <= 125 && payload[0] != channel && payload[0] != channelNext) {
+			channelMigrate(payload[0], left < CHANNEL_SWITCH_DELAY ? left : CHANNEL_SWITCH_DELAY);
+		}
+		return false;
+	}
 	uint8_t type = msg.type;
 	uint8_t sender = msg.sender;
 	uint8_t last = msg.last;
 	uint8_t destination = msg.destination;
+	traceStage(TS_DECODE);
 
 	if (destination == nc.nodeId) {
 		// This message is addressed to this node
@@ -324,6 +805,13 @@ boolean MySensor::process() {
 			sendRoute(ack);
 		}
 
+		if (command == C_STREAM && (type == ST_SEGMENT || type == ST_SEGMENT_ACK)) {
+			// Fragments are reassembled, the message is delivered once complete
+			segmentReceive(msg);
+			traceStage(TS_CALLBACK);
+			return false;
+		}
+
 		if (command == C_INTERNAL) {
 			if (type == I_FIND_PARENT_RESPONSE) {
 				if (autoFindParent) {
@@ -334,8 +822,9 @@ boolean MySensor::process() {
 						// Found a neighbor closer to GW than previously found
 						nc.distance = distance + 1;
 						nc.parentNodeId = msg.sender;
-						eeprom_write_byte((uint8_t*)EEPROM_PARENT_NODE_ID_ADDRESS, nc.parentNodeId);
-						eeprom_write_byte((uint8_t*)EEPROM_DISTANCE_ADDRESS, nc.distance);
+						// Parent and distance in one write, never one without the other
+						uint8_t route[2] = { nc.parentNodeId, nc.distance };
+						eeprom_write_block((void*)route, (void*)EEPROM_PARENT_NODE_ID_ADDRESS, sizeof(route));
 						debug(PSTR("new parent=%d, d=%d\n"), nc.parentNodeId, nc.distance);
 					}
 				}
@@ -381,8 +870,8 @@ boolean MySensor::process() {
 							removeChildRoute(i);
 						} while (i--);
 						// Clear parent node id & distance to gw
-						eeprom_write_byte((uint8_t*)EEPROM_PARENT_NODE_ID_ADDRESS, 0xFF);
-						eeprom_write_byte((uint8_t*)EEPROM_DISTANCE_ADDRESS, 0xFF);
+						uint8_t route[2] = { 0xFF, 0xFF };
+						eeprom_write_block((void*)route, (void*)EEPROM_PARENT_NODE_ID_ADDRESS, sizeof(route));
 						// Find parent node
 						findParentNode();
 						sendRoute(build(msg, nc.nodeId, GATEWAY_ADDRESS, NODE_SENSOR_ID, C_INTERNAL, I_CHILDREN,false).set(""));
@@ -400,6 +889,7 @@ boolean MySensor::process() {
 		if (msgCallback != NULL) {
 			msgCallback(msg);
 		}
+		traceStage(TS_CALLBACK);
 		// Return true if message was addressed for this node...
 		return true;
 	} else if (repeaterMode && nc.nodeId != AUTO) {
@@ -412,7 +902,11 @@ boolean MySensor::process() {
 				// Relaying nodes should always answer ping messages
 				// Wait a random delay of 0-2 seconds to minimize collision
 				// between ping ack messages from other relaying nodes
+#ifdef __Raspberry_Pi
+				radio->delayMs(millis() & 0x3ff);
+#else
 				delay(millis() & 0x3ff);
+#endif
 				sendWrite(sender, build(msg, nc.nodeId, sender, NODE_SENSOR_ID, C_INTERNAL, I_FIND_PARENT_RESPONSE, false).set(nc.distance), true);
 			}
 		} else if (pipe == CURRENT_NODE_PIPE) {
@@ -474,6 +968,10 @@ uint8_t MySensor::loadState(uint8_t pos) {
 
 void MySensor::addChildRoute(uint8_t childId, uint8_t route) {
 	if (childNodeTable[childId] != route) {
+		if (childNodeTable[childId] == 0xff) {
+			metricInc(M_ROUTES);
+		}
+		metricInc(M_ROUTE_CHANGES);
 		childNodeTable[childId] = route;
 		eeprom_write_byte((uint8_t*)EEPROM_ROUTES_ADDRESS+childId, route);
 	}
@@ -481,6 +979,8 @@ void MySensor::addChildRoute(uint8_t childId, uint8_t route) {
 
 void MySensor::removeChildRoute(uint8_t childId) {
 	if (childNodeTable[childId] != 0xff) {
+		metricSub(M_ROUTES, 1);
+		metricInc(M_ROUTE_CHANGES);
 		childNodeTable[childId] = 0xff;
 		eeprom_write_byte((uint8_t*)EEPROM_ROUTES_ADDRESS+childId, 0xff);
 	}
@@ -512,15 +1012,35 @@ void MySensor::internalSleep(unsigned long ms) {
 	if (!pinIntTrigger && ms >= 64)      { LowPower.powerDown(SLEEP_60MS, ADC_OFF, BOD_OFF); ms -= 60; }
 	if (!pinIntTrigger && ms >= 32)      { LowPower.powerDown(SLEEP_30MS, ADC_OFF, BOD_OFF); ms -= 30; }
 	if (!pinIntTrigger && ms >= 16)      { LowPower.powerDown(SLEEP_15Ms, ADC_OFF, BOD_OFF); ms -= 15; }
+#else
+	// On the transport's clock, simulated nodes sleep in virtual time
+	radio->delayMs(ms);
 #endif
 }
 
+/*
+ * A gateway holding messages sends one with the ack of the node's last frame,
+ * and the rest of a node's messages right after hearing it. An ack payload
+ * may be meant for another node, but says the gateway has mail: handle it
+ * and listen a little longer before the radio goes down.
+ */
+void MySensor::receiveMail() {
+	if (!radio->available()) {
+		return;
+	}
+	do {
+		process();
+	} while (radio->available());
+	wait(MAILBOX_LISTEN_TIME);
+}
+
 void MySensor::sleep(unsigned long ms) {
+	receiveMail();
 #ifndef __Raspberry_Pi
 	// Let serial prints finish (debug, log etc)
 	Serial.flush();
 #endif
-	RF24::powerDown();
+	radio->powerDown();
 	pinIntTrigger = 0;
 	internalSleep(ms);
 }
@@ -529,23 +1049,122 @@ void MySensor::wait(unsigned long ms) {
 	// Let serial prints finish (debug, log etc)
 #ifdef __Raspberry_Pi
 	fflush(stdout);
+
+	timespec cpuStart, cpuEnd;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+	unsigned long enter = millis();
+	for (;;) {
+		try {
+			// Drain everything the radio has for us before blocking again
+			do {
+				process();
+			} while (radio->available());
+		} catch (const char* msg) {
+			printf("Unable to process radio messages. (Error: %s)\n", msg);
+			exit(EXIT_FAILURE);
+		}
+		unsigned long elapsed = millis() - enter;
+		if (elapsed >= ms) {
+			break;
+		}
+		if (channelNext != channel) {
+			// Wake up for the next announcement or the switch
+			unsigned long due = repeaterMode && (long)(channelAnnounceAt - channelSwitchAt) < 0 ? channelAnnounceAt : channelSwitchAt;
+			long until = (long)(due - millis());
+			if (until < (long)(ms - elapsed)) {
+				waitForRadio(until > 0 ? until : 0);
+				continue;
+			}
+		}
+		waitForRadio(ms - elapsed);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+	unsigned long long cpu = (cpuEnd.tv_sec - cpuStart.tv_sec) * 1000000ULL + cpuEnd.tv_nsec / 1000 - cpuStart.tv_nsec / 1000;
+	waitCpuTime += cpu;
+	metricAdd(M_WAIT_CPU, cpu);
 #else
 	Serial.flush();
-#endif
 	unsigned long enter = millis();
 	while (millis() - enter < ms) {
-#ifndef __Raspberry_Pi
 		// reset watchdog
 		wdt_reset();
+		process();
+	}
 #endif
-    try {
-			process();
-		} catch (const char* msg) {
-			printf("Unable to process radio messages. (Error: %s)\n", msg);
-			exit(EXIT_FAILURE);
+}
+
+#ifdef __Raspberry_Pi
+void MySensor::setRadioEventSource(int fd) {
+	radioEventFd = fd;
+	radioEventFailed = false;
+}
+
+unsigned long long MySensor::getWaitCpuTime() {
+	return waitCpuTime;
+}
+
+void MySensor::setRetryTuning(bool enable) {
+	retryTuner.enable(enable);
+}
+
+bool MySensor::getRadioEvent(pollfd *pfd) {
+	pfd->revents = 0;
+	if (radioEventFailed) {
+		pfd->fd = -1;
+	} else if (radioEventFd >= 0) {
+		// A GPIO value file is always readable, only an edge is news
+		pfd->fd = radioEventFd;
+		pfd->events = POLLPRI;
+	} else {
+		pfd->fd = radio->getEventFd();
+		pfd->events = POLLIN;
+	}
+	return pfd->fd >= 0;
+}
+
+void MySensor::radioEventDone(const pollfd *pfd) {
+	if (pfd->fd < 0 || pfd->revents == 0) {
+		return;
+	}
+	if (pfd->fd == radioEventFd && (pfd->revents & POLLPRI) && !(pfd->revents & POLLNVAL)) {
+		// An edge comes with POLLERR from sysfs; the value file needs to be read again to re-arm it
+		char value[4];
+		::lseek(pfd->fd, 0, SEEK_SET);
+		if (::read(pfd->fd, value, sizeof(value)) < 0) {
+			debug(PSTR("irq read failed\n"));
+		}
+	} else if (pfd->revents & (POLLHUP | POLLERR | POLLNVAL)) {
+		// Would fire again at once, every time
+		debug(PSTR("radio event source failed, polling\n"));
+		radioEventFailed = true;
+	}
+}
+
+/*
+ * Block until the radio event source fires or ms milliseconds have passed.
+ */
+void MySensor::waitForRadio(unsigned long ms) {
+	pollfd pfd;
+
+	if (radio->waitForEvent(ms)) {
+		return;
+	}
+	if (getRadioEvent(&pfd)) {
+		// Any event wakes up, process() finds what the radio has
+		if (poll(&pfd, 1, ms) > 0) {
+			radioEventDone(&pfd);
 		}
+	} else {
+		timespec interval;
+		if (ms > WAIT_POLL_INTERVAL) {
+			ms = WAIT_POLL_INTERVAL;
+		}
+		interval.tv_sec = 0;
+		interval.tv_nsec = ms * 1000000L;
+		nanosleep(&interval, NULL);
 	}
 }
+#endif
 
 bool MySensor::sleep(uint8_t interrupt, uint8_t mode, unsigned long ms) {
 #ifdef __Raspberry_Pi
@@ -553,8 +1172,9 @@ bool MySensor::sleep(uint8_t interrupt, uint8_t mode, unsigned long ms) {
 #else
 	// Let serial prints finish (debug, log etc)
 	bool pinTriggeredWakeup = true;
+	receiveMail();
 	Serial.flush();
-	RF24::powerDown();
+	radio->powerDown();
 	attachInterrupt(interrupt, wakeUp, mode);
 	if (ms>0) {
 		pinIntTrigger = 0;
@@ -576,8 +1196,9 @@ int8_t MySensor::sleep(uint8_t interrupt1, uint8_t mode1, uint8_t interrupt2, ui
 #ifdef __Raspberry_Pi
 	return retVal;
 #else
+	receiveMail();
 	Serial.flush(); // Let serial prints finish (debug, log etc)
-	RF24::powerDown();
+	radio->powerDown();
 	attachInterrupt(interrupt1, wakeUp, mode1);
 	attachInterrupt(interrupt2, wakeUp2, mode2);
 	if (ms>0) {
@@ -640,9 +1261,7 @@ void MySensor::debugPrint(const char *fmt, ... ) {
 #ifdef __Raspberry_Pi
 unsigned long MySensor::millis()
 {
-    timeval curTime;
-    gettimeofday(&curTime, NULL);
-    return ((curTime.tv_sec - millis_at_start) * 1000) + (curTime.tv_usec / 1000);
+    return radio->millis();
 }
 
 /**
@@ -16,6 +16,9 @@
 #include "Version.h"   // Auto generated by bot
 #include "MyConfig.h"
 #include "MyMessage.h"
+#include "MyTrace.h"
+#include "MyMetrics.h"
+#include "MyTransport.h"
 
 #if !defined(__Raspberry_Pi)
 	#include <avr/eeprom.h>
@@ -30,12 +33,7 @@
 	#include <Arduino.h>
 	#include <SPI.h>
 	#include "utility/LowPower.h"
-	#include "utility/RF24.h"
-	#include "utility/RF24_config.h"
 #elif defined(__cplusplus) && defined(__Raspberry_Pi)
-	#include <nRF24L01.h>
-	#include "RF24.h"
-	#include "RF24_config.h"
 	#include <cstdlib>
 	#include <stdlib.h>
 	#include <stdio.h>
@@ -45,11 +43,27 @@
 	#include <getopt.h>
 	#include <iostream>
 	#include <syslog.h>
+	#include <poll.h>
+	#include <time.h>
 #endif
 
-#ifdef DEBUG
+#ifdef __Raspberry_Pi
+	#include "PiRetryTuner.h"
+#endif
+
+#if defined(DEBUG) && defined(__Raspberry_Pi)
+	#include "PiLog.h"
+	// Check the level before the arguments get evaluated
+	#define debug(x,...) do { \
+		if (logBinary) logRecord(x, ##__VA_ARGS__); \
+		else if (logEnabled(LOG_DEBUG)) log(LOG_DEBUG, x, ##__VA_ARGS__); \
+	} while (0)
+	// The binary ring keeps type and length of the payload, it is formatted for the text log only
+	#define debugPayload(m, buffer) (logBinary ? "" : (m).getString(buffer))
+#elif defined(DEBUG)
 	extern void log(int priority, const char *format, ...);
 	#define debug(x,...) log(LOG_DEBUG, x, ##__VA_ARGS__)
+	#define debugPayload(m, buffer) (m).getString(buffer)
 #else
 	#define debug(x,...)
 #endif
@@ -69,6 +83,8 @@
 #define EEPROM_DISTANCE_ADDRESS (EEPROM_PARENT_NODE_ID_ADDRESS+1)
 #define EEPROM_ROUTES_ADDRESS (EEPROM_DISTANCE_ADDRESS+1) // Where to start storing routing information in EEPROM. Will allocate 256 bytes.
 #define EEPROM_CONTROLLER_CONFIG_ADDRESS (EEPROM_ROUTES_ADDRESS+256) // Location of controller sent configuration (we allow one payload of config data from controller)
+// EEPROM location of the channel a migration (I_CHANNEL) moved to, and its complement
+#define EEPROM_CHANNEL_ADDRESS (EEPROM_CONTROLLER_CONFIG_ADDRESS+22)
 #define EEPROM_FIRMWARE_TYPE_ADDRESS (EEPROM_CONTROLLER_CONFIG_ADDRESS+24)
 #define EEPROM_FIRMWARE_VERSION_ADDRESS (EEPROM_FIRMWARE_TYPE_ADDRESS+2)
 #define EEPROM_FIRMWARE_BLOCKS_ADDRESS (EEPROM_FIRMWARE_VERSION_ADDRESS+2)
@@ -78,12 +94,15 @@
 // This is the nodeId for sensor net gateway receiver sketch (where all sensors should send their data).
 #define GATEWAY_ADDRESS ((uint8_t)0)
 #define BROADCAST_ADDRESS ((uint8_t)0xFF)
-#define TO_ADDR(x) (BASE_RADIO_ID + x)
+#define TO_ADDR(x) (BASE_RADIO_ID + x)  // with the default address base, see setBaseRadioId()
 
 #define WRITE_PIPE ((uint8_t)0)
 #define CURRENT_NODE_PIPE ((uint8_t)1)
 #define BROADCAST_PIPE ((uint8_t)2)
 
+// Frames the radio's TX FIFO holds, a burst returns to RX after this many
+#define TX_FIFO_SIZE 3
+
 // Search for a new parent node after this many transmission failures
 #define SEARCH_FAILURES  5
 
@@ -98,24 +117,101 @@ struct ControllerConfig {
 	uint8_t isMetric;
 };
 
+// Header of every fragment of a segmented message (C_STREAM, ST_SEGMENT)
+struct SegmentHeader {
+	uint8_t seq;      // message number of the sender
+	uint8_t index;    // fragment number, 0..count-1
+	uint8_t count;    // fragments in the message
+	uint8_t command;  // command and type of the reassembled message
+	uint8_t type;
+};
+// Payload bytes per fragment, all fragments but the last are full
+#define SEGMENT_FRAGMENT_SIZE (MAX_PAYLOAD - sizeof(SegmentHeader))
+// Fragments sent back to back, as many as the radio's TX FIFO holds
+#define SEGMENT_BURST TX_FIFO_SIZE
+// Missing fragments listed in one acknowledgement
+#define SEGMENT_ACK_MISSING (MAX_PAYLOAD - 2)
+
+// Payload of ST_SEGMENT_ACK. The receiver sends it when it gets the last
+// fragment or completes the message; missing is 0 once it is complete.
+struct SegmentAck {
+	uint8_t seq;
+	uint8_t missing;
+	uint8_t index[SEGMENT_ACK_MISSING];
+};
+
+// Segmented message being sent
+struct SegmentTx {
+	bool active;
+	uint8_t destination;
+	uint8_t sensor;
+	uint8_t command;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t count;
+	uint8_t retries;
+	uint16_t length;
+	unsigned long lastSend;
+	uint8_t data[SEGMENT_MAX_LENGTH];
+};
+
+// Segmented message being received
+struct SegmentRx {
+	bool active;
+	bool complete;   // delivered, kept to acknowledge repeated last fragments
+	uint8_t sender;
+	uint8_t sensor;
+	uint8_t command;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t count;
+	uint8_t received;
+	uint8_t lastLength;
+	unsigned long lastFragment;
+	uint8_t bitmap[32];
+	uint8_t data[SEGMENT_MAX_LENGTH];
+};
+
 #ifdef __cplusplus
-class MySensor : public RF24
+class MySensor
 {
   public:
 	/**
 	* Constructor
 	*
-	* Creates a new instance of Sensor class.
+	* Creates a new instance of Sensor class using a nRF24L01+ radio.
 	*
 	* @param _cepin The pin attached to RF24 Chip Enable on the RF module (default 9)
 	* @param _cspin The pin attached to RF24 Chip Select (default 10)
 	*/
 #ifdef __Raspberry_Pi
+#ifndef MY_NO_RF24
 	MySensor(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed );
+#endif
 #else
 	MySensor(uint8_t _cepin=DEFAULT_CE_PIN, uint8_t _cspin=DEFAULT_CS_PIN);
 #endif
 
+	/**
+	* Constructor
+	*
+	* Creates a new instance of Sensor class on top of any radio transport.
+	* The transport is not deleted with the sensor.
+	*/
+	MySensor(MyTransport *transport);
+	virtual ~MySensor();
+
+	/**
+	 * Returns the radio transport used by this node.
+	 */
+	MyTransport *getTransport();
+
+	/**
+	 * Use another radio address base than BASE_RADIO_ID, e.g. for a second
+	 * sensor network served by the same gateway process. Call before begin().
+	 */
+	void setBaseRadioId(uint64_t baseId);
+
 	/**
 	* Begin operation of the MySensors library
 	*
@@ -136,6 +232,11 @@ class MySensor : public RF24
 	 */
 	uint8_t getNodeId();
 
+	/**
+	 * Return the radio channel in use, which a migration may have changed.
+	 */
+	uint8_t getChannel() { return channel; }
+
 	/**
 	* Each node must present all attached sensors before any values can be handled correctly by the controller.
     * It is usually good to present all attached sensors after power-up in setup().
@@ -164,6 +265,28 @@ class MySensor : public RF24
 	*/
 	bool send(MyMessage &msg, bool ack=false);
 
+	/**
+	* Sends a payload of up to SEGMENT_MAX_LENGTH bytes, split into fragments
+	* that are sent SEGMENT_BURST at a time. The receiver acknowledges the
+	* message or asks for the fragments it missed, which are sent again from
+	* process(); keep calling it (or wait()) until the message is through.
+	*
+	* @param destination The nodeId of the receiver.
+	* @param sensor Child sensor id of the message.
+	* @param command Command of the reassembled message (C_SET, C_STREAM, ...).
+	* @param type Type of the reassembled message.
+	* @param data Payload, copied.
+	* @param length Payload length.
+	* @return false if the payload is too large, all send contexts are busy or
+	* the first fragments could not be sent.
+	*/
+	bool sendSegmented(uint8_t destination, uint8_t sensor, uint8_t command, uint8_t type, const void *data, uint16_t length);
+
+	/**
+	* Callback for segmented messages addressed to this node.
+	*/
+	void setSegmentCallback(void (*segmentCallback)(uint8_t sender, uint8_t sensor, uint8_t command, uint8_t type, const uint8_t *data, uint16_t length));
+
 	/**
 	 * Send this nodes battery level to gateway.
 	 * @param level Level between 0-100(%)
@@ -242,6 +365,43 @@ class MySensor : public RF24
 	 */
 	void wait(unsigned long ms);
 
+#ifdef __Raspberry_Pi
+	/**
+	 * Use the sysfs value file of the GPIO wired to the nRF24 IRQ pin (with
+	 * edge set to "falling") as radio event source for wait(). It is polled
+	 * for POLLPRI, the edges; sysfs reports it readable all the time. Without
+	 * an event source (fd -1) wait() uses the transport's own, or sleeps
+	 * WAIT_POLL_INTERVAL ms between radio polls.
+	 * @param fd File descriptor to poll or -1 to disable.
+	 */
+	void setRadioEventSource(int fd);
+
+	/**
+	 * Fill pfd with the radio event source wait() would poll, for threads
+	 * that poll it along with their own: the one of setRadioEventSource() for
+	 * POLLPRI, else the transport's for POLLIN. Returns false if there is
+	 * none, or it failed.
+	 */
+	bool getRadioEvent(pollfd *pfd);
+
+	/**
+	 * Handle what poll() returned for the pfd of getRadioEvent(): re-arm the
+	 * GPIO after an edge, give up a source that failed.
+	 */
+	void radioEventDone(const pollfd *pfd);
+
+	/**
+	 * Returns the CPU time spent inside wait() so far, in microseconds.
+	 */
+	unsigned long long getWaitCpuTime();
+
+	/**
+	 * Tune the auto retransmit delay and count per next hop (PiRetryTuner.h),
+	 * on by default. Off uses setupRadio()'s setting for every write.
+	 */
+	void setRetryTuning(bool enable);
+#endif
+
 	/**
 	 * Sleep (PowerDownMode) the Arduino and radio. Wake up on timer or pin change.
 	 * See: http://arduino.cc/en/Reference/attachInterrupt for details on modes and which pin
@@ -275,22 +435,45 @@ class MySensor : public RF24
 #endif
 
   protected:
+	MyTransport *radio;
+	bool ownsRadio;
+	uint64_t baseRadioId;
 	NodeConfig nc; // Essential settings for node to work
 	ControllerConfig cc; // Configuration coming from controller
 	bool repeaterMode;
 	bool autoFindParent;
 	bool isGateway;
+	uint8_t channel;
+	uint8_t channelNext;              // channel after a migration, or channel
+	unsigned long channelSwitchAt;
+	unsigned long channelAnnounceAt;
 	MyMessage msg;  // Buffer for incoming messages.
 	MyMessage ack;  // Buffer for ack messages.
 
+	void init(MyTransport *transport, bool owned);
 	void setupRepeaterMode();
 	void setupRadio(rf24_pa_dbm_e paLevel, uint8_t channel, rf24_datarate_e dataRate);
+	void channelMigrate(uint8_t next, unsigned long delay);
 	boolean sendRoute(MyMessage &message);
 	boolean sendWrite(uint8_t dest, MyMessage &message, bool broadcast=false);
+	boolean sendRouteBurst(MyMessage *messages, uint8_t count);
+	boolean sendWriteBurst(uint8_t next, MyMessage *messages, uint8_t count);
+	virtual void deliverSegmented(SegmentRx &rx);
+	/* ms until segmentTimers() has something to do, at most max */
+	unsigned long segmentUntilDue(unsigned long now, unsigned long max);
+	/* Every frame of the current protocol version, before process() acts on it */
+	virtual void frameReceived(uint8_t pipe, MyMessage &message) {}
+	uint8_t getChildRoute(uint8_t childId);
+	void addChildRoute(uint8_t childId, uint8_t route);
+	void removeChildRoute(uint8_t childId);
 
 #ifdef __Raspberry_Pi
 	unsigned long millis();
-	unsigned long millis_at_start;
+	int radioEventFd;
+	bool radioEventFailed;       // the event source hung up, wait() polls the radio instead
+	unsigned long long waitCpuTime;
+	PiRetryTuner retryTuner;
+	void waitForRadio(unsigned long ms);
 	char * itoa(int value, char *result, int base);
 	char * ltoa(long value, char *result, int base);
 	char * dtostrf(float f, int width, int decimals, char *result);
@@ -300,18 +483,27 @@ class MySensor : public RF24
 	char convBuf[MAX_PAYLOAD*2+1];
 #endif
 	uint8_t failedTransmissions;
+	bool findingParent;
 	uint8_t *childNodeTable; // In memory buffer for routing information to other nodes. also stored in EEPROM
     void (*timeCallback)(unsigned long); // Callback for requested time messages
     void (*msgCallback)(const MyMessage &); // Callback for incoming messages from other nodes and gateway.
+    void (*segmentCallback)(uint8_t, uint8_t, uint8_t, uint8_t, const uint8_t *, uint16_t);
+    SegmentTx segmentTx[SEGMENT_CONTEXTS];
+    SegmentRx segmentRx[SEGMENT_CONTEXTS];
+    uint8_t segmentSeq;
 
     void requestNodeId();
 	void setupNode();
 	void findParentNode();
 	uint8_t crc8Message(MyMessage &message);
-	uint8_t getChildRoute(uint8_t childId);
-	void addChildRoute(uint8_t childId, uint8_t route);
-	void removeChildRoute(uint8_t childId);
 	void internalSleep(unsigned long ms);
+	void channelService();
+	void receiveMail();
+	boolean segmentSend(SegmentTx &tx, const uint8_t *indices, uint8_t count);
+	void segmentReceive(MyMessage &message);
+	void segmentAcknowledged(MyMessage &message);
+	void segmentAcknowledge(SegmentRx &rx);
+	void segmentTimers();
 };
 #endif
 
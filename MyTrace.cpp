@@ -0,0 +1,155 @@
+/*
+ * MyTrace.cpp - Per message latency tracing for the Raspberry Pi gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "MyTrace.h"
+
+#if defined(LATENCY_TRACE) && defined(__Raspberry_Pi)
+
+static const char *stageNames[TRACE_STAGES] = {
+	"rx_read", "decode", "callback", "format", "enqueue", "write",
+	"read", "parse", "tx", "done"
+};
+static const uint8_t stageDirection[TRACE_STAGES] = {
+	TRACE_UPSTREAM, TRACE_UPSTREAM, TRACE_UPSTREAM, TRACE_UPSTREAM, TRACE_UPSTREAM, TRACE_UPSTREAM,
+	TRACE_DOWNSTREAM, TRACE_DOWNSTREAM, TRACE_DOWNSTREAM, TRACE_DOWNSTREAM
+};
+static const char *directionNames[TRACE_DIRECTIONS] = { "up", "down" };
+
+static LatencyHistogram stageHistograms[TRACE_STAGES];
+static LatencyHistogram totalHistograms[TRACE_DIRECTIONS];
+
+// Message in flight, one per direction and thread
+static __thread bool active[TRACE_DIRECTIONS];
+static __thread uint64_t startTime[TRACE_DIRECTIONS];
+static __thread uint64_t lastTime[TRACE_DIRECTIONS];
+
+static inline uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Values below 2^TRACE_SUB_BITS get a bucket each, above that every power
+ * of two is split in 2^TRACE_SUB_BITS linear sub buckets.
+ */
+static unsigned int bucketOf(uint64_t value)
+{
+	if (value < (1 << TRACE_SUB_BITS)) {
+		return value;
+	}
+	unsigned int exp = 63 - __builtin_clzll(value);
+	if (exp >= TRACE_MAX_EXP) {
+		return TRACE_BUCKETS - 1;
+	}
+	unsigned int sub = (value >> (exp - TRACE_SUB_BITS)) & ((1 << TRACE_SUB_BITS) - 1);
+	return ((exp - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS) + sub;
+}
+
+// Highest value that ends up in bucket
+static uint64_t bucketValue(unsigned int bucket)
+{
+	if (bucket < (1 << TRACE_SUB_BITS)) {
+		return bucket;
+	}
+	unsigned int exp = (bucket >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+	uint64_t sub = bucket & ((1 << TRACE_SUB_BITS) - 1);
+	return (((1ULL << TRACE_SUB_BITS) + sub + 1) << (exp - TRACE_SUB_BITS)) - 1;
+}
+
+static void record(LatencyHistogram *h, uint64_t value)
+{
+	__atomic_fetch_add(&h->counts[bucketOf(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+	// min and max are shared by the radio threads as well
+	uint64_t seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (value > seen && !__atomic_compare_exchange_n(&h->max, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	seen = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+	while ((seen == 0 || value < seen) && !__atomic_compare_exchange_n(&h->min, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static uint64_t percentile(const LatencyHistogram *h, uint64_t count, double p)
+{
+	uint64_t rank = (uint64_t)(count * p);
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < TRACE_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen > rank) {
+			uint64_t value = bucketValue(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+	return h->max;
+}
+
+static void dumpHistogram(void (*print)(const char *line), const char *direction, const char *name, const LatencyHistogram *h)
+{
+	char line[200];
+	uint64_t count = h->count;
+	if (count == 0) {
+		snprintf(line, sizeof(line), "trace %s %s n=0\n", direction, name);
+	} else {
+		snprintf(line, sizeof(line), "trace %s %s n=%llu min=%.1f avg=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f us\n",
+			direction, name, (unsigned long long)count, h->min / 1000.0, (double)h->sum / count / 1000.0,
+			percentile(h, count, 0.5) / 1000.0, percentile(h, count, 0.9) / 1000.0,
+			percentile(h, count, 0.99) / 1000.0, percentile(h, count, 0.999) / 1000.0, h->max / 1000.0);
+	}
+	print(line);
+}
+
+void traceBegin(uint8_t direction)
+{
+	active[direction] = true;
+	startTime[direction] = lastTime[direction] = now();
+}
+
+void traceEnd(uint8_t direction)
+{
+	active[direction] = false;
+}
+
+void traceStage(uint8_t stage)
+{
+	uint8_t direction = stageDirection[stage];
+	if (!active[direction]) {
+		return;
+	}
+	uint64_t t = now();
+	record(&stageHistograms[stage], t - lastTime[direction]);
+	lastTime[direction] = t;
+	if (stage == TS_WRITE || stage == TS_DONE) {
+		record(&totalHistograms[direction], t - startTime[direction]);
+		active[direction] = false;
+	}
+}
+
+void traceDump(void (*print)(const char *line))
+{
+	for (uint8_t d = 0; d < TRACE_DIRECTIONS; d++) {
+		for (uint8_t s = 0; s < TRACE_STAGES; s++) {
+			if (stageDirection[s] == d) {
+				dumpHistogram(print, directionNames[d], stageNames[s], &stageHistograms[s]);
+			}
+		}
+		dumpHistogram(print, directionNames[d], "total", &totalHistograms[d]);
+	}
+}
+
+void traceReset()
+{
+	memset(stageHistograms, 0, sizeof(stageHistograms));
+	memset(totalHistograms, 0, sizeof(totalHistograms));
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * MyTrace.h - Per message latency tracing for the Raspberry Pi gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Every message is timestamped (CLOCK_MONOTONIC) when it passes a pipeline
+ * stage. The time spent since the previous stage is accumulated in a
+ * log-linear (HDR style) histogram per stage, and the time since the message
+ * entered the pipeline in a histogram per direction.
+ */
+
+#ifndef MyTrace_h
+#define MyTrace_h
+
+#include <stdint.h>
+#include "MyConfig.h"
+
+// Pipeline directions
+#define TRACE_UPSTREAM   0 // radio -> controller
+#define TRACE_DOWNSTREAM 1 // controller -> radio
+#define TRACE_DIRECTIONS 2
+
+// Pipeline stages, each one belongs to exactly one direction
+typedef enum {
+	TS_RX_READ,   // frame read from the RX FIFO
+	TS_DECODE,    // header checked, message dispatched
+	TS_CALLBACK,  // message handled by the node/callback
+	TS_FORMAT,    // serial protocol line formatted
+	TS_ENQUEUE,   // line handed over to the output callback
+	TS_WRITE,     // line written to the controller (last upstream stage)
+	TS_READ,      // command read from the controller
+	TS_PARSE,     // command parsed
+	TS_TX,        // frame transmitted by the radio
+	TS_DONE,      // command fully handled (last downstream stage)
+	TRACE_STAGES
+} trace_stage;
+
+// Histogram resolution: 2^TRACE_SUB_BITS buckets per power of two
+#define TRACE_SUB_BITS 4
+#define TRACE_MAX_EXP  40 // values from 2^40 ns (~18 minutes) on share the last bucket
+#define TRACE_BUCKETS  ((TRACE_MAX_EXP - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS)
+
+struct LatencyHistogram {
+	uint32_t counts[TRACE_BUCKETS];
+	uint64_t count;
+	uint64_t sum;  // ns
+	uint64_t min;  // ns
+	uint64_t max;  // ns
+};
+
+#if defined(LATENCY_TRACE) && defined(__Raspberry_Pi)
+	/**
+	 * Start tracing a new message in the given direction (current thread).
+	 */
+	void traceBegin(uint8_t direction);
+
+	/**
+	 * Stop tracing the message in flight in direction without recording its
+	 * total, e.g. because it isn't passed on. Lines written afterwards by the
+	 * same thread are not stamped on it.
+	 */
+	void traceEnd(uint8_t direction);
+
+	/**
+	 * Record that the message in flight passed stage. Ignored when there is no
+	 * message of the stage's direction being traced.
+	 */
+	void traceStage(uint8_t stage);
+
+	/**
+	 * Print count, min, percentiles and max of every stage and direction
+	 * (in microseconds), one line per histogram.
+	 */
+	void traceDump(void (*print)(const char *line));
+
+	/**
+	 * Reset all histograms.
+	 */
+	void traceReset();
+#else
+	#define traceBegin(x)
+	#define traceEnd(x)
+	#define traceStage(x)
+	#define traceDump(x)
+	#define traceReset()
+#endif
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * MyTransport.h - Radio transport interface used by MySensor
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * MySensor talks to the radio only through this interface. MyTransportRF24
+ * drives a real nRF24L01+ and is the default; MyTransportVirtual replays a
+ * capture file or exchanges frames with another process over a socket, so
+ * the gateways can be built and run on any Linux host (make RADIO=virtual).
+ */
+
+#ifndef MyTransport_h
+#define MyTransport_h
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __Raspberry_Pi
+	#include <time.h>
+#endif
+
+#ifdef MY_NO_RF24
+// Same values as the RF24 library, so MyConfig.h and callers work unchanged
+typedef enum { RF24_PA_MIN = 0, RF24_PA_LOW, RF24_PA_HIGH, RF24_PA_MAX, RF24_PA_ERROR } rf24_pa_dbm_e;
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+typedef enum { RF24_CRC_DISABLED = 0, RF24_CRC_8, RF24_CRC_16 } rf24_crclength_e;
+#elif defined(__Raspberry_Pi)
+	#include <RF24.h>
+#else
+	#include "utility/RF24.h"
+#endif
+
+/* What became of the last frame given to writeAckPayload() */
+typedef enum {
+	ACK_PAYLOAD_NONE = 0,   // none given since begin()
+	ACK_PAYLOAD_QUEUED,     // waiting for a frame on its pipe
+	ACK_PAYLOAD_SENT,       // carried by an auto ack
+	ACK_PAYLOAD_FLUSHED     // dropped when the radio left RX
+} ack_payload_state_e;
+
+class MyTransport
+{
+  public:
+	virtual ~MyTransport() {}
+
+	/**
+	 * Initialize the radio. Returns false if no usable radio was found.
+	 */
+	virtual bool begin() = 0;
+
+	/**
+	 * Radio configuration, see the RF24 library for the meaning of each call.
+	 */
+	virtual void setAutoAck(bool enable) = 0;
+	virtual void setAutoAck(uint8_t pipe, bool enable) = 0;
+	virtual void enableAckPayload() = 0;
+	virtual void enableDynamicPayloads() = 0;
+	virtual void setChannel(uint8_t channel) = 0;
+	virtual void setPALevel(rf24_pa_dbm_e level) = 0;
+	virtual bool setDataRate(rf24_datarate_e speed) = 0;
+	virtual void setRetries(uint8_t delay, uint8_t count) = 0;
+	virtual void setCRCLength(rf24_crclength_e length) = 0;
+	virtual void printDetails() {}
+
+	virtual void openWritingPipe(uint64_t address) = 0;
+	virtual void openReadingPipe(uint8_t pipe, uint64_t address) = 0;
+	virtual void startListening() = 0;
+	virtual void stopListening() = 0;
+	virtual void powerUp() = 0;
+	virtual void powerDown() = 0;
+
+	/**
+	 * Returns true if a frame is waiting, and the pipe it arrived on.
+	 */
+	virtual bool available(uint8_t *pipe) = 0;
+	bool available() { return available(NULL); }
+	virtual uint8_t getDynamicPayloadSize() = 0;
+	virtual void read(void *buf, uint8_t len) = 0;
+
+	/**
+	 * Send a frame to the address of the writing pipe.
+	 * @param multicast true to send without waiting for an auto ack.
+	 * @return true if the frame was acknowledged (or sent, for multicast).
+	 */
+	virtual bool write(const void *buf, uint8_t len, bool multicast) = 0;
+
+	/**
+	 * Queue a frame for the writing pipe in the TX FIFO (3 frames deep),
+	 * waiting only while it is full, and txStandBy() once all are queued.
+	 * Returns false if a queued frame already failed. Transports without a
+	 * FIFO send each frame at once.
+	 */
+	virtual bool writeFast(const void *buf, uint8_t len) { return write(buf, len, false); }
+
+	/**
+	 * Wait until the TX FIFO is empty. Returns false if a frame failed, the
+	 * remaining frames are then dropped.
+	 */
+	virtual bool txStandBy() { return true; }
+
+	/**
+	 * Queue a frame for the auto ack of the next frame that arrives on pipe
+	 * (see enableAckPayload()). It stays queued until then, or until the
+	 * radio leaves RX to transmit. Returns false if the transport can't send
+	 * ack payloads.
+	 */
+	virtual bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len) { return false; }
+
+	/**
+	 * State of the frame last given to writeAckPayload(). The sender of the
+	 * acked frame gets it in its RX FIFO on pipe 0, like any other frame.
+	 */
+	virtual ack_payload_state_e getAckPayloadState() { return ACK_PAYLOAD_NONE; }
+
+	/**
+	 * Number of retransmissions the last write() needed.
+	 */
+	virtual uint8_t getRetransmits() { return 0; }
+
+	/**
+	 * Received power detector: whether more than -64 dBm was on the channel
+	 * since the radio last entered RX. Returns false if the transport has
+	 * no detector.
+	 */
+	virtual bool testRPD(bool *power) { return false; }
+
+	/**
+	 * A descriptor that becomes readable when frames arrive, or -1 if the
+	 * radio must be polled. Used by MySensor::wait() and the gateways.
+	 */
+	virtual int getEventFd() { return -1; }
+
+	/**
+	 * ms until a frame arrives that getEventFd() doesn't announce, e.g. the
+	 * next one of a replay, at most max.
+	 */
+	virtual unsigned long untilEvent(unsigned long max) { return max; }
+
+#ifdef __Raspberry_Pi
+	/* CLOCK_MONOTONIC in ms */
+	static uint64_t monotonicMs() {
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+	}
+
+	/**
+	 * Clock and sleeps used by MySensor. A simulated radio overrides them
+	 * to run the node on the simulation's virtual time. Like on an Arduino
+	 * millis() counts from the start, the first call, not from boot, so an
+	 * unsigned long of 32 bits only wraps after 49 days of running; times are
+	 * still compared by the sign of their difference for when it does.
+	 */
+	virtual unsigned long millis() {
+		static const uint64_t start = monotonicMs();
+		return monotonicMs() - start;
+	}
+	virtual void delayMs(unsigned long ms) {
+		timespec interval = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000L };
+		nanosleep(&interval, NULL);
+	}
+
+	/**
+	 * Block until a frame arrives or ms milliseconds have passed. Returns
+	 * false if the transport can't, MySensor then polls getEventFd().
+	 */
+	virtual bool waitForEvent(unsigned long ms) { return false; }
+#endif
+};
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * MyTransportRF24.cpp - nRF24L01+ transport (default)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include "MyTransportRF24.h"
+
+#ifdef __Raspberry_Pi
+#include <pthread.h>
+
+/*
+ * All radios share the SPI bus and the state of the bcm2835 driver. A gateway
+ * with several radios (PiRadioGroup) drives each from its own thread, so
+ * every call holds the bus until it is done.
+ */
+static pthread_mutex_t spiBus = PTHREAD_MUTEX_INITIALIZER;
+
+class SpiLock {
+  public:
+	SpiLock() { pthread_mutex_lock(&spiBus); }
+	~SpiLock() { pthread_mutex_unlock(&spiBus); }
+};
+#define LOCK_SPI() SpiLock spiLock
+#else
+#define LOCK_SPI()
+#endif
+
+/* Width of the addresses MySensors uses, the RF24 default */
+#define ADDRESS_WIDTH 5
+
+#ifdef __Raspberry_Pi
+MyTransportRF24::MyTransportRF24(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed) : RF24(_cepin, _cspin, spispeed),
+		poweredUp(false), listening(-1), txAddress(0), txAddressOnPipe0(false), readingPipe0(false),
+		ackPayload(ACK_PAYLOAD_NONE) {
+}
+#else
+MyTransportRF24::MyTransportRF24(uint8_t _cepin, uint8_t _cspin) : RF24(_cepin, _cspin),
+		poweredUp(false), listening(-1), txAddress(0), txAddressOnPipe0(false), readingPipe0(false),
+		ackPayload(ACK_PAYLOAD_NONE) {
+}
+#endif
+
+bool MyTransportRF24::begin() {
+	LOCK_SPI();
+	poweredUp = false;
+	listening = -1;
+	txAddress = 0;
+	txAddressOnPipe0 = false;
+	readingPipe0 = false;
+	ackPayload = ACK_PAYLOAD_NONE;
+	RF24::begin();
+	// A chip answering the + variant check is the only sign there is one at all
+	return RF24::isPVariant();
+}
+
+void MyTransportRF24::setAutoAck(bool enable) {
+	LOCK_SPI();
+	RF24::setAutoAck(enable);
+}
+
+void MyTransportRF24::setAutoAck(uint8_t pipe, bool enable) {
+	LOCK_SPI();
+	RF24::setAutoAck(pipe, enable);
+}
+
+void MyTransportRF24::enableAckPayload() {
+	LOCK_SPI();
+	RF24::enableAckPayload();
+}
+
+void MyTransportRF24::enableDynamicPayloads() {
+	LOCK_SPI();
+	RF24::enableDynamicPayloads();
+}
+
+void MyTransportRF24::setChannel(uint8_t channel) {
+	LOCK_SPI();
+	RF24::setChannel(channel);
+}
+
+void MyTransportRF24::setPALevel(rf24_pa_dbm_e level) {
+	LOCK_SPI();
+	RF24::setPALevel(level);
+}
+
+bool MyTransportRF24::setDataRate(rf24_datarate_e speed) {
+	LOCK_SPI();
+	return RF24::setDataRate(speed);
+}
+
+void MyTransportRF24::setRetries(uint8_t delay, uint8_t count) {
+	LOCK_SPI();
+	RF24::setRetries(delay, count);
+}
+
+void MyTransportRF24::setCRCLength(rf24_crclength_e length) {
+	LOCK_SPI();
+	RF24::setCRCLength(length);
+}
+
+void MyTransportRF24::printDetails() {
+	LOCK_SPI();
+	RF24::printDetails();
+}
+
+void MyTransportRF24::openWritingPipe(uint64_t address) {
+	LOCK_SPI();
+	if (address != txAddress) {
+		// TX_ADDR, RX_ADDR_P0 and RX_PW_P0
+		RF24::openWritingPipe(address);
+		txAddress = address;
+	} else if (!txAddressOnPipe0) {
+		// Same next hop, startListening() only put the reading address back on pipe 0
+		RF24::write_register(RX_ADDR_P0, (const uint8_t *)&address, ADDRESS_WIDTH);
+	}
+	txAddressOnPipe0 = true;
+}
+
+void MyTransportRF24::openReadingPipe(uint8_t pipe, uint64_t address) {
+	LOCK_SPI();
+	RF24::openReadingPipe(pipe, address);
+	if (pipe == 0) {
+		readingPipe0 = true;
+		txAddressOnPipe0 = false;
+	}
+}
+
+void MyTransportRF24::startListening() {
+	LOCK_SPI();
+	if (listening == 1) {
+		return;
+	}
+	ackPayloadFlush();
+	RF24::startListening();
+	listening = 1;
+	poweredUp = true;
+	if (readingPipe0) {
+		txAddressOnPipe0 = false;
+	}
+}
+
+void MyTransportRF24::stopListening() {
+	LOCK_SPI();
+	if (listening == 0) {
+		return;
+	}
+	ackPayloadFlush();
+	RF24::stopListening();
+	listening = 0;
+}
+
+void MyTransportRF24::powerUp() {
+	LOCK_SPI();
+	if (poweredUp) {
+		return;
+	}
+	RF24::powerUp();
+	poweredUp = true;
+}
+
+void MyTransportRF24::powerDown() {
+	LOCK_SPI();
+	RF24::powerDown();
+	// CE is low now, and PRIM_RX as it was
+	poweredUp = false;
+	listening = -1;
+}
+
+bool MyTransportRF24::available(uint8_t *pipe) {
+	LOCK_SPI();
+	return pipe ? RF24::available(pipe) : RF24::available();
+}
+
+uint8_t MyTransportRF24::getDynamicPayloadSize() {
+	LOCK_SPI();
+	return RF24::getDynamicPayloadSize();
+}
+
+void MyTransportRF24::read(void *buf, uint8_t len) {
+	LOCK_SPI();
+	RF24::read(buf, len);
+}
+
+bool MyTransportRF24::write(const void *buf, uint8_t len, bool multicast) {
+	LOCK_SPI();
+	return RF24::write(buf, len, multicast);
+}
+
+bool MyTransportRF24::writeFast(const void *buf, uint8_t len) {
+	LOCK_SPI();
+	return RF24::writeFast(buf, len);
+}
+
+bool MyTransportRF24::txStandBy() {
+	LOCK_SPI();
+	return RF24::txStandBy();
+}
+
+bool MyTransportRF24::writeAckPayload(uint8_t pipe, const void *buf, uint8_t len) {
+	LOCK_SPI();
+	RF24::writeAckPayload(pipe, buf, len);
+	ackPayload = ACK_PAYLOAD_QUEUED;
+	return true;
+}
+
+ack_payload_state_e MyTransportRF24::getAckPayloadState() {
+	LOCK_SPI();
+	// In RX the TX FIFO holds nothing but the ack payload
+	if (ackPayload == ACK_PAYLOAD_QUEUED && (RF24::read_register(FIFO_STATUS) & _BV(TX_EMPTY))) {
+		ackPayload = ACK_PAYLOAD_SENT;
+	}
+	return ackPayload;
+}
+
+/*
+ * The library flushes the TX FIFO in stopListening() and startListening()
+ * when ack payloads are enabled. Called with the bus locked, before that.
+ */
+void MyTransportRF24::ackPayloadFlush() {
+	if (ackPayload == ACK_PAYLOAD_QUEUED) {
+		ackPayload = RF24::read_register(FIFO_STATUS) & _BV(TX_EMPTY) ? ACK_PAYLOAD_SENT : ACK_PAYLOAD_FLUSHED;
+	}
+}
+
+bool MyTransportRF24::testRPD(bool *power) {
+	LOCK_SPI();
+	*power = RF24::testRPD();
+	return true;
+}
+
+uint8_t MyTransportRF24::getRetransmits() {
+	LOCK_SPI();
+	// ARC_CNT, reset on every new transmission
+	return RF24::read_register(OBSERVE_TX) & 0x0F;
+}
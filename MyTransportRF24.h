@@ -0,0 +1,78 @@
+/*
+ * MyTransportRF24.h - nRF24L01+ transport (default)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef MyTransportRF24_h
+#define MyTransportRF24_h
+
+#include "MyTransport.h"
+
+#ifdef __Raspberry_Pi
+	#include <nRF24L01.h>
+	#include <RF24.h>
+	#include <RF24_config.h>
+#else
+	#include "utility/RF24.h"
+	#include "utility/RF24_config.h"
+#endif
+
+class MyTransportRF24 : public MyTransport, protected RF24
+{
+  public:
+#ifdef __Raspberry_Pi
+	MyTransportRF24(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed);
+#else
+	MyTransportRF24(uint8_t _cepin, uint8_t _cspin);
+#endif
+
+	bool begin();
+	void setAutoAck(bool enable);
+	void setAutoAck(uint8_t pipe, bool enable);
+	void enableAckPayload();
+	void enableDynamicPayloads();
+	void setChannel(uint8_t channel);
+	void setPALevel(rf24_pa_dbm_e level);
+	bool setDataRate(rf24_datarate_e speed);
+	void setRetries(uint8_t delay, uint8_t count);
+	void setCRCLength(rf24_crclength_e length);
+	void printDetails();
+
+	void openWritingPipe(uint64_t address);
+	void openReadingPipe(uint8_t pipe, uint64_t address);
+	void startListening();
+	void stopListening();
+	void powerUp();
+	void powerDown();
+
+	bool available(uint8_t *pipe);
+	uint8_t getDynamicPayloadSize();
+	void read(void *buf, uint8_t len);
+	bool write(const void *buf, uint8_t len, bool multicast);
+	bool writeFast(const void *buf, uint8_t len);
+	bool txStandBy();
+	bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len);
+	ack_payload_state_e getAckPayloadState();
+	uint8_t getRetransmits();
+	bool testRPD(bool *power);
+
+  private:
+	/*
+	 * Register state set by earlier calls, so calls that would write the same
+	 * values again skip their SPI transactions. Unknown after begin() and
+	 * powerDown().
+	 */
+	bool poweredUp;
+	int8_t listening;        // PRIM_RX and CE, -1 if unknown
+	uint64_t txAddress;      // TX_ADDR, 0 if unknown
+	bool txAddressOnPipe0;   // RX_ADDR_P0 holds txAddress for the auto acks
+	bool readingPipe0;       // pipe 0 has a reading address, startListening() restores it
+	ack_payload_state_e ackPayload;
+
+	void ackPayloadFlush();
+};
+
+#endif
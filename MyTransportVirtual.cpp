@@ -0,0 +1,297 @@
+/*
+ * MyTransportVirtual.cpp - Radio transport without radio hardware
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include "MyTransportVirtual.h"
+#include "PiCapture.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static uint64_t monotonicNs()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+MyTransportVirtual *MyTransportVirtual::open(const char *spec)
+{
+	if (strncmp(spec, "socket:", 7) == 0) {
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(spec + 7) >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		strcpy(addr.sun_path, spec + 7);
+		int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		if (sock < 0) {
+			return NULL;
+		}
+		if (connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+			int err = errno;
+			close(sock);
+			errno = err;
+			return NULL;
+		}
+		return new MyTransportVirtual(sock);
+	}
+
+	bool realtime = strncmp(spec, "replay:", 7) == 0;
+	if (!realtime && strncmp(spec, "trace:", 6) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	FILE *file = fopen(strchr(spec, ':') + 1, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+	CaptureFileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+			(header.magic != CAPTURE_MAGIC_NS && header.magic != CAPTURE_MAGIC_US) ||
+			header.network != CAPTURE_LINKTYPE) {
+		fclose(file);
+		errno = EINVAL;
+		return NULL;
+	}
+	MyTransportVirtual *transport = new MyTransportVirtual(file, realtime);
+	transport->traceNano = header.magic == CAPTURE_MAGIC_NS;
+	return transport;
+}
+
+MyTransportVirtual::MyTransportVirtual(int _fd)
+{
+	init();
+	fd = _fd;
+}
+
+MyTransportVirtual::MyTransportVirtual(FILE *_trace, bool _realtime)
+{
+	init();
+	trace = _trace;
+	realtime = _realtime;
+}
+
+MyTransportVirtual::~MyTransportVirtual()
+{
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (trace != NULL) {
+		fclose(trace);
+	}
+}
+
+void MyTransportVirtual::init()
+{
+	fd = -1;
+	trace = NULL;
+	traceNano = true;
+	realtime = false;
+	eof = false;
+	traceStart = 0;
+	replayStart = 0;
+	pipesOpen = 0;
+	writingAddress = 0;
+	hasPending = false;
+	pendingPipe = 0;
+	pendingDue = 0;
+	received = 0;
+	sent = 0;
+}
+
+bool MyTransportVirtual::begin()
+{
+	return fd >= 0 || trace != NULL;
+}
+
+void MyTransportVirtual::openWritingPipe(uint64_t address)
+{
+	writingAddress = address;
+}
+
+void MyTransportVirtual::openReadingPipe(uint8_t pipe, uint64_t address)
+{
+	if (pipe < VIRTUAL_PIPES) {
+		readingPipes[pipe] = address;
+		pipesOpen |= 1 << pipe;
+	}
+}
+
+/*
+ * Pipes sharing an address report the highest one: MySensors opens pipe 0
+ * and 1 with the node address and relays only what arrives on pipe 1.
+ */
+int8_t MyTransportVirtual::matchPipe(uint64_t address)
+{
+	for (int8_t pipe = VIRTUAL_PIPES - 1; pipe >= 0; pipe--) {
+		if ((pipesOpen & (1 << pipe)) && readingPipes[pipe] == address) {
+			return pipe;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Read the next frame addressed to us from the socket, without blocking.
+ * Frames for addresses we don't listen on are dropped like the radio would.
+ */
+bool MyTransportVirtual::fetchSocket()
+{
+	for (;;) {
+		ssize_t n = recv(fd, &pending, sizeof(pending), MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			eof = true;
+			return false;
+		}
+		if (n < (ssize_t)offsetof(VirtualFrame, data)) {
+			return false;
+		}
+		if (pending.length > n - offsetof(VirtualFrame, data)) {
+			continue;
+		}
+		int8_t pipe = matchPipe(pending.address);
+		if (pipe >= 0) {
+			pendingPipe = pipe;
+			return true;
+		}
+	}
+}
+
+/*
+ * Read the next received frame from the capture file. Frames the gateway
+ * transmitted are skipped, they are regenerated by replaying.
+ */
+bool MyTransportVirtual::fetchTrace()
+{
+	CaptureRecordHeader rec;
+	CapturePseudoHeader pseudo;
+
+	while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+		if (rec.inclLen < sizeof(pseudo) || rec.inclLen > sizeof(pseudo) + VIRTUAL_FRAME_SIZE ||
+				fread(&pseudo, sizeof(pseudo), 1, trace) != 1) {
+			break;
+		}
+		pending.length = rec.inclLen - sizeof(pseudo);
+		if (fread(pending.data, 1, pending.length, trace) != pending.length) {
+			break;
+		}
+		if (pseudo.direction != CAPTURE_RX || pseudo.pipe >= VIRTUAL_PIPES) {
+			continue;
+		}
+		pending.address = readingPipes[pseudo.pipe];
+		pendingPipe = pseudo.pipe;
+		if (realtime) {
+			uint64_t ts = rec.tsSec * 1000000000ULL + rec.tsFrac * (traceNano ? 1 : 1000);
+			if (replayStart == 0) {
+				replayStart = monotonicNs();
+				traceStart = ts;
+			}
+			pendingDue = replayStart + (ts - traceStart);
+		}
+		return true;
+	}
+	eof = true;
+	return false;
+}
+
+bool MyTransportVirtual::fetch()
+{
+	if (eof) {
+		return false;
+	}
+	return trace != NULL ? fetchTrace() : fetchSocket();
+}
+
+bool MyTransportVirtual::available(uint8_t *pipe)
+{
+	if (!hasPending) {
+		hasPending = fetch();
+	}
+	if (!hasPending || (realtime && monotonicNs() < pendingDue)) {
+		return false;
+	}
+	if (pipe != NULL) {
+		*pipe = pendingPipe;
+	}
+	return true;
+}
+
+uint8_t MyTransportVirtual::getDynamicPayloadSize()
+{
+	return hasPending ? pending.length : 0;
+}
+
+void MyTransportVirtual::read(void *buf, uint8_t len)
+{
+	if (!hasPending) {
+		return;
+	}
+	memcpy(buf, pending.data, len < pending.length ? len : pending.length);
+	hasPending = false;
+	received++;
+}
+
+bool MyTransportVirtual::write(const void *buf, uint8_t len, bool multicast)
+{
+	if (len > VIRTUAL_FRAME_SIZE) {
+		len = VIRTUAL_FRAME_SIZE;
+	}
+	sent++;
+	if (fd < 0) {
+		return true;
+	}
+	VirtualFrame frame;
+	frame.address = writingAddress;
+	frame.length = len;
+	memcpy(frame.data, buf, len);
+	return send(fd, &frame, offsetof(VirtualFrame, data) + len, MSG_NOSIGNAL) > 0;
+}
+
+int MyTransportVirtual::getEventFd()
+{
+	return fd;
+}
+
+unsigned long MyTransportVirtual::untilEvent(unsigned long max)
+{
+	if (!hasPending) {
+		hasPending = fetch();
+	}
+	if (!realtime || !hasPending) {
+		return max;
+	}
+	uint64_t now = monotonicNs();
+	if (pendingDue <= now) {
+		return 0;
+	}
+	// Rounded up, an early wakeup would find nothing and sleep 0 ms again
+	uint64_t ms = (pendingDue - now + 999999) / 1000000;
+	return ms < max ? ms : max;
+}
+
+bool MyTransportVirtual::finished()
+{
+	return eof && !hasPending;
+}
+
+unsigned long MyTransportVirtual::getReceived()
+{
+	return received;
+}
+
+unsigned long MyTransportVirtual::getSent()
+{
+	return sent;
+}
@@ -0,0 +1,116 @@
+/*
+ * MyTransportVirtual.h - Radio transport without radio hardware
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Frames come from one of:
+ *  - socket:<path>  a SOCK_SEQPACKET unix socket served by another process
+ *                   (traffic generator, simulator). Each packet carries one
+ *                   VirtualFrame in both directions.
+ *  - trace:<file>   a capture written by PiCapture; received frames are
+ *                   replayed as fast as they are read, transmitted ones
+ *                   are skipped.
+ *  - replay:<file>  like trace, but with the recorded inter-arrival times.
+ * Written frames always succeed without retransmissions; in trace mode they
+ * are only counted.
+ */
+
+#ifndef MyTransportVirtual_h
+#define MyTransportVirtual_h
+
+#include <stdio.h>
+#include "MyTransport.h"
+
+#define VIRTUAL_PIPES 6
+#define VIRTUAL_FRAME_SIZE 32
+
+struct VirtualFrame {
+	uint64_t address;   // radio address the frame is sent to
+	uint8_t length;     // bytes used in data
+	uint8_t data[VIRTUAL_FRAME_SIZE];
+} __attribute__((packed));
+
+class MyTransportVirtual : public MyTransport
+{
+  public:
+	/**
+	 * Create a transport from a "socket:", "trace:" or "replay:" spec.
+	 * Returns NULL (errno set) if the socket or file can't be opened.
+	 */
+	static MyTransportVirtual *open(const char *spec);
+
+	/**
+	 * Exchange frames over a connected SOCK_SEQPACKET (or SOCK_DGRAM) socket.
+	 */
+	MyTransportVirtual(int fd);
+
+	/**
+	 * Replay the received frames of a pcap capture.
+	 */
+	MyTransportVirtual(FILE *trace, bool realtime);
+	~MyTransportVirtual();
+
+	bool begin();
+	void setAutoAck(bool enable) {}
+	void setAutoAck(uint8_t pipe, bool enable) {}
+	void enableAckPayload() {}
+	void enableDynamicPayloads() {}
+	void setChannel(uint8_t channel) {}
+	void setPALevel(rf24_pa_dbm_e level) {}
+	bool setDataRate(rf24_datarate_e speed) { return true; }
+	void setRetries(uint8_t delay, uint8_t count) {}
+	void setCRCLength(rf24_crclength_e length) {}
+
+	void openWritingPipe(uint64_t address);
+	void openReadingPipe(uint8_t pipe, uint64_t address);
+	void startListening() {}
+	void stopListening() {}
+	void powerUp() {}
+	void powerDown() {}
+
+	bool available(uint8_t *pipe);
+	uint8_t getDynamicPayloadSize();
+	void read(void *buf, uint8_t len);
+	bool write(const void *buf, uint8_t len, bool multicast);
+	int getEventFd();
+	unsigned long untilEvent(unsigned long max);
+
+	/**
+	 * True once a trace has been replayed completely or the peer hung up.
+	 */
+	bool finished();
+
+	/**
+	 * Frames received and sent so far.
+	 */
+	unsigned long getReceived();
+	unsigned long getSent();
+
+  private:
+	int fd;
+	FILE *trace;
+	bool traceNano;
+	bool realtime;
+	bool eof;
+	uint64_t traceStart;     // capture timestamp of the first frame (ns)
+	uint64_t replayStart;    // CLOCK_MONOTONIC when it was replayed (ns)
+	uint64_t readingPipes[VIRTUAL_PIPES];
+	uint8_t pipesOpen;       // bitmask of pipes with an address
+	uint64_t writingAddress;
+	VirtualFrame pending;
+	uint8_t pendingPipe;
+	uint64_t pendingDue;     // replay mode: when the pending frame arrives
+	bool hasPending;
+	unsigned long received;
+	unsigned long sent;
+
+	void init();
+	bool fetch();
+	bool fetchSocket();
+	bool fetchTrace();
+	int8_t matchPipe(uint64_t address);
+};
+
+#endif
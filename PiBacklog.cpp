@@ -0,0 +1,252 @@
+/*
+ * PiBacklog.cpp - Lines for the controller kept while it has the tty closed
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "PiBacklog.h"
+#include "MyMetrics.h"
+
+volatile bool backlogAttached = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *ring = NULL;
+static size_t ringSize = 0;
+static size_t head = 0;         // oldest line
+static size_t used = 0;         // bytes of lines kept
+static size_t longest = 0;      // longest line kept since the last replay
+static unsigned int lines = 0;
+static uint64_t maxAge = 0;     // ms, 0: no limit
+static bool replaying = false;  // the controller is back, the lines kept are going out
+
+/* lines taken from the ring and not yet written, only used by the thread replaying */
+static char out[UINT16_MAX + 1];
+static size_t outLength = 0;
+static size_t outWritten = 0;
+
+static uint64_t now()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Copy into and out of the ring, across its end
+ */
+static void put(size_t at, const void *data, size_t n)
+{
+	size_t first = n < ringSize - at ? n : ringSize - at;
+
+	memcpy(ring + at, data, first);
+	memcpy(ring, (const uint8_t *)data + first, n - first);
+}
+
+static void get(size_t at, void *data, size_t n)
+{
+	size_t first = n < ringSize - at ? n : ringSize - at;
+
+	memcpy(data, ring + at, first);
+	memcpy((uint8_t *)data + first, ring, n - first);
+}
+
+/*
+ * Remove the oldest line, with the lock held
+ */
+static void dropOldest(BacklogLine *line)
+{
+	size_t size = sizeof(*line) + line->length;
+
+	head = (head + size) % ringSize;
+	used -= size;
+	lines--;
+}
+
+/*
+ * Drop the lines older than the age limit, with the lock held
+ */
+static void expire(uint64_t time)
+{
+	BacklogLine line;
+
+	while (maxAge > 0 && lines > 0) {
+		get(head, &line, sizeof(line));
+		if (time - line.time <= maxAge) {
+			break;
+		}
+		dropOldest(&line);
+		metricInc(M_BACKLOG_DROPPED);
+	}
+}
+
+bool backlogOpen(size_t size, unsigned int age)
+{
+	backlogClose();
+	pthread_mutex_lock(&lock);
+	if (size > 0 && (ring = (uint8_t *)malloc(size)) == NULL) {
+		pthread_mutex_unlock(&lock);
+		errno = ENOMEM;
+		return false;
+	}
+	ringSize = size;
+	maxAge = age * 1000ULL;
+	backlogAttached = false;
+	replaying = false;
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+void backlogClose()
+{
+	pthread_mutex_lock(&lock);
+	free(ring);
+	ring = NULL;
+	ringSize = 0;
+	head = used = longest = 0;
+	lines = 0;
+	outLength = outWritten = 0;
+	metricSetGlobal(M_BACKLOG_BYTES, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+bool backlogKeep(const char *text, size_t length)
+{
+	BacklogLine line;
+	size_t size = sizeof(line) + length;
+
+	pthread_mutex_lock(&lock);
+	if (backlogAttached) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	if (ring == NULL || length > UINT16_MAX) {
+		// Nowhere to keep it, and the tty is closed or busy with older lines
+		metricInc(M_BACKLOG_DROPPED);
+		pthread_mutex_unlock(&lock);
+		return true;
+	}
+	line.time = now();
+	line.length = length;
+	expire(line.time);
+	if (size > ringSize) {
+		metricInc(M_BACKLOG_DROPPED);
+	} else {
+		// The oldest lines make room
+		while (used + size > ringSize) {
+			BacklogLine oldest;
+			get(head, &oldest, sizeof(oldest));
+			dropOldest(&oldest);
+			metricInc(M_BACKLOG_DROPPED);
+		}
+		size_t tail = (head + used) % ringSize;
+		put(tail, &line, sizeof(line));
+		put((tail + sizeof(line)) % ringSize, text, length);
+		used += size;
+		lines++;
+		if (length > longest) {
+			longest = length;
+		}
+		metricInc(M_BACKLOG_KEPT);
+	}
+	metricSetGlobal(M_BACKLOG_BYTES, used);
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+void backlogDetach(int fd)
+{
+	pthread_mutex_lock(&lock);
+	if (backlogAttached || replaying) {
+		metricInc(M_CONTROLLER_HANGUPS);
+	}
+	if (replaying) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	}
+	backlogAttached = false;
+	replaying = false;
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned int backlogAttach(int fd)
+{
+	unsigned int kept;
+
+	pthread_mutex_lock(&lock);
+	expire(now());
+	kept = lines;
+	if (lines == 0 && outWritten == outLength) {
+		backlogAttached = true;
+	} else {
+		// Written as the tty takes them, the lines of the radio threads go on to the ring meanwhile
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		replaying = true;
+	}
+	pthread_mutex_unlock(&lock);
+	return kept;
+}
+
+bool backlogReplaying()
+{
+	return replaying;
+}
+
+unsigned int backlogReplay(int fd)
+{
+	unsigned int replayed = 0;
+
+	while (replaying) {
+		if (outWritten < outLength) {
+			ssize_t n = write(fd, out + outWritten, outLength - outWritten);
+			if (n < 0 && errno == EAGAIN) {
+				break;
+			}
+			if (n < 0) {
+				// The rest of the batch can't go out
+				metricInc(M_OUTPUT_DROPPED);
+				n = outLength - outWritten;
+			}
+			outWritten += n;
+			continue;
+		}
+
+		// The next lines that fit, taken from the ring under the lock and written without it
+		pthread_mutex_lock(&lock);
+		outLength = outWritten = 0;
+		expire(now());
+		while (lines > 0) {
+			BacklogLine line;
+			get(head, &line, sizeof(line));
+			if (outLength + line.length > sizeof(out)) {
+				break;
+			}
+			get((head + sizeof(line)) % ringSize, out + outLength, line.length);
+			outLength += line.length;
+			dropOldest(&line);
+			replayed++;
+		}
+		if (lines == 0) {
+			head = used = longest = 0;
+		}
+		metricSetGlobal(M_BACKLOG_BYTES, used);
+		if (outLength == 0) {
+			// All out, the lines from now on go straight to the tty
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+			replaying = false;
+			backlogAttached = true;
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	metricAdd(M_BACKLOG_REPLAYED, replayed);
+	return replayed;
+}
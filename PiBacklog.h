@@ -0,0 +1,85 @@
+/*
+ * PiBacklog.h - Lines for the controller kept while it has the tty closed
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * A pty master takes writes while no one has the tty open, until the tty
+ * queue is full, and then blocks the radio thread writing. PiGatewaySerial
+ * sees the controller close the tty as POLLHUP on the master and detaches:
+ * from then on the lines of the radio threads are kept here instead, in a
+ * ring of BacklogLine records and their text, the oldest dropped once the
+ * ring is full or older than the age limit. Once the controller opens the tty again the
+ * lines still kept are written to it in the order they came, before any
+ * new one.
+ *
+ * The replay runs in the main loop: the master is non-blocking meanwhile and
+ * backlogReplay() writes as much as the tty takes whenever poll() reports
+ * POLLOUT. New lines go on to the ring until it is empty, only then are they
+ * written straight to the tty again.
+ */
+
+#ifndef __PiBacklog_H__
+#define __PiBacklog_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BACKLOG_SIZE  (256 * 1024) // bytes of lines kept by default
+#define BACKLOG_AGE   3600         // s a line is kept by default, 0: no limit
+#define BACKLOG_CHECK 200          // ms between looks for the controller while it is away
+
+struct BacklogLine {
+	uint64_t time;              // ms, CLOCK_MONOTONIC
+	uint16_t length;            // bytes of the line following
+} __attribute__((packed));
+
+/* false while the controller has the tty closed */
+extern volatile bool backlogAttached;
+
+/**
+ * Keep up to size bytes of lines, none older than age s (0: no limit),
+ * while the controller is away. Starts detached, until backlogAttach().
+ * Returns false with errno set without memory; size 0 keeps nothing.
+ */
+bool backlogOpen(size_t size, unsigned int age);
+
+/**
+ * Drop the lines kept and free the ring.
+ */
+void backlogClose();
+
+/**
+ * Keep line while the controller is away or its lines are being replayed.
+ * Returns false if it is attached: write the line to the tty then. A line
+ * that can't be kept, e.g. with size 0, is dropped.
+ */
+bool backlogKeep(const char *line, size_t length);
+
+/**
+ * The controller closed the tty on the pty master fd. A replay stops where
+ * it is and goes on once the controller is back.
+ */
+void backlogDetach(int fd);
+
+/**
+ * The controller opened the tty on the pty master fd: attach at once if
+ * nothing is kept, else start the replay, fd is non-blocking until it is
+ * done. Returns the lines kept.
+ */
+unsigned int backlogAttach(int fd);
+
+/**
+ * True while the lines kept are being replayed, poll fd for POLLOUT then.
+ */
+bool backlogReplaying();
+
+/**
+ * Write the lines kept to fd, oldest first, until the tty takes no more,
+ * and attach once none are left. Only called by the thread that polls fd.
+ * Returns the lines taken from the ring.
+ */
+unsigned int backlogReplay(int fd);
+
+#endif /* __PiBacklog_H__ */
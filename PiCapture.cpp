@@ -0,0 +1,294 @@
+/*
+ * PiCapture.cpp - Radio frame capture into memory mapped pcap files
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "PiCapture.h"
+#include "MyMetrics.h"
+
+struct CaptureSegment {
+	int fd;
+	uint8_t *map;
+	size_t size;
+	size_t used;        // bytes reserved, may grow past size
+	size_t end;         // offset of the first record that did not fit, 0 if none
+	unsigned int writers;
+	unsigned int number;
+	bool inUse;
+};
+
+/* Writers may still hold a pointer to a segment that was rotated out and
+   closed, so segments are taken from a fixed pool and never freed: the
+   active, standby and retired one */
+#define CAPTURE_SEGMENTS 3
+static CaptureSegment segments[CAPTURE_SEGMENTS];
+
+volatile bool captureEnabled = false;
+
+static CaptureSegment *active = NULL;   // segment records are appended to
+static CaptureSegment *standby = NULL;  // next segment, prepared in advance
+static CaptureSegment *retired = NULL;  // full segment waiting to be closed
+
+static char *baseName = NULL;
+static size_t segmentSize;
+static unsigned int keepFiles;
+static unsigned int nextNumber;
+
+static pthread_t rotator;
+static pthread_mutex_t rotatorLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rotatorWake = PTHREAD_COND_INITIALIZER;
+static bool rotatorRunning = false;
+
+static void segmentName(char *name, size_t len, unsigned int number)
+{
+	snprintf(name, len, "%s.%u.pcap", baseName, number);
+}
+
+static CaptureSegment *segmentOpen()
+{
+	char name[256];
+	CaptureFileHeader header;
+	CaptureSegment *seg = NULL;
+
+	for (int i = 0; i < CAPTURE_SEGMENTS && seg == NULL; i++) {
+		if (!segments[i].inUse) {
+			seg = &segments[i];
+		}
+	}
+	if (seg == NULL) {
+		return NULL;
+	}
+	seg->number = nextNumber++;
+	segmentName(name, sizeof(name), seg->number);
+	seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0640);
+	if (seg->fd < 0) {
+		return NULL;
+	}
+	// The blocks are allocated and the pages mapped in here, on the rotator,
+	// not by the page faults of the radio threads; a sparse file is the
+	// fallback where the file system can't allocate
+	if (fallocate(seg->fd, 0, 0, segmentSize) != 0 && ftruncate(seg->fd, segmentSize) != 0) {
+		close(seg->fd);
+		return NULL;
+	}
+	seg->map = (uint8_t *)mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+	if (seg->map == MAP_FAILED) {
+		close(seg->fd);
+		return NULL;
+	}
+	header.magic = CAPTURE_MAGIC_NS;
+	header.versionMajor = 2;
+	header.versionMinor = 4;
+	header.thiszone = 0;
+	header.sigfigs = 0;
+	header.snaplen = CAPTURE_SNAPLEN;
+	header.network = CAPTURE_LINKTYPE;
+	memcpy(seg->map, &header, sizeof(header));
+	seg->size = segmentSize;
+	seg->used = sizeof(header);
+	seg->end = 0;
+	// writers is left alone, a late writer of the segment's last use may still count itself in and out
+	seg->inUse = true;
+
+	// Remove the oldest file we are no longer supposed to keep
+	if (seg->number >= keepFiles) {
+		segmentName(name, sizeof(name), seg->number - keepFiles);
+		unlink(name);
+	}
+	return seg;
+}
+
+static void segmentClose(CaptureSegment *seg)
+{
+	timespec wait = { 0, 100000L };
+
+	// Wait for writers still copying records into this segment
+	while (__atomic_load_n(&seg->writers, __ATOMIC_ACQUIRE) != 0) {
+		nanosleep(&wait, NULL);
+	}
+	size_t length = seg->end ? seg->end : seg->used;
+	if (length > seg->size) {
+		length = seg->size;
+	}
+	msync(seg->map, length, MS_ASYNC);
+	munmap(seg->map, seg->size);
+	if (ftruncate(seg->fd, length) != 0) {
+		// the file keeps its zero padding, readers stop at the first empty record
+	}
+	close(seg->fd);
+	seg->inUse = false;
+}
+
+/*
+ * Closes full segments and keeps a fresh standby segment around, so the
+ * radio path never touches the file system.
+ */
+static void *rotatorLoop(void *arg)
+{
+	pthread_mutex_lock(&rotatorLock);
+	while (rotatorRunning) {
+		CaptureSegment *full = __atomic_exchange_n(&retired, (CaptureSegment *)NULL, __ATOMIC_ACQ_REL);
+		if (full) {
+			pthread_mutex_unlock(&rotatorLock);
+			segmentClose(full);
+			pthread_mutex_lock(&rotatorLock);
+		}
+		if (__atomic_load_n(&standby, __ATOMIC_ACQUIRE) == NULL) {
+			pthread_mutex_unlock(&rotatorLock);
+			CaptureSegment *seg = segmentOpen();
+			pthread_mutex_lock(&rotatorLock);
+			__atomic_store_n(&standby, seg, __ATOMIC_RELEASE);
+			if (seg == NULL) {
+				// try again later
+				timespec retry;
+				clock_gettime(CLOCK_REALTIME, &retry);
+				retry.tv_sec += 1;
+				pthread_cond_timedwait(&rotatorWake, &rotatorLock, &retry);
+			}
+			continue;
+		}
+		if (__atomic_load_n(&retired, __ATOMIC_ACQUIRE) == NULL) {
+			// rotate() signals with the lock held, the wakeup can't be missed
+			pthread_cond_wait(&rotatorWake, &rotatorLock);
+		}
+	}
+	pthread_mutex_unlock(&rotatorLock);
+	return NULL;
+}
+
+/*
+ * Make the standby segment active, called by the writer that found active
+ * full. Under the rotator's lock, which is only held between its file
+ * system calls: with segments reused, full may have been rotated out and
+ * come back as another segment since the writer looked.
+ */
+static void rotate(CaptureSegment *full)
+{
+	pthread_mutex_lock(&rotatorLock);
+	CaptureSegment *next = standby;
+	if (active == full && next != NULL && retired == NULL) {
+		__atomic_store_n(&active, next, __ATOMIC_RELEASE);
+		__atomic_store_n(&standby, (CaptureSegment *)NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&retired, full, __ATOMIC_RELEASE);
+		pthread_cond_signal(&rotatorWake);
+	}
+	pthread_mutex_unlock(&rotatorLock);
+}
+
+void captureFrame(uint8_t direction, uint8_t pipe, uint8_t next, bool ok, const void *frame, uint8_t length)
+{
+	CaptureRecordHeader rec;
+	CapturePseudoHeader pseudo;
+	timespec ts;
+
+	if (!captureEnabled) {
+		return;
+	}
+	if (length > CAPTURE_SNAPLEN - sizeof(pseudo)) {
+		length = CAPTURE_SNAPLEN - sizeof(pseudo);
+	}
+	size_t need = sizeof(rec) + sizeof(pseudo) + length;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		CaptureSegment *seg = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+		if (seg == NULL) {
+			break;
+		}
+		__atomic_fetch_add(&seg->writers, 1, __ATOMIC_ACQ_REL);
+		if (seg != __atomic_load_n(&active, __ATOMIC_ACQUIRE)) {
+			// rotated in between, the segment may already be closed; its slot of the pool stays valid
+			__atomic_fetch_sub(&seg->writers, 1, __ATOMIC_RELEASE);
+			continue;
+		}
+		size_t offset = __atomic_fetch_add(&seg->used, need, __ATOMIC_RELAXED);
+		if (offset + need > seg->size) {
+			size_t none = 0;
+			__atomic_compare_exchange_n(&seg->end, &none, offset, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			__atomic_fetch_sub(&seg->writers, 1, __ATOMIC_RELEASE);
+			rotate(seg);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		rec.tsSec = ts.tv_sec;
+		rec.tsFrac = ts.tv_nsec;
+		rec.inclLen = rec.origLen = sizeof(pseudo) + length;
+		pseudo.direction = direction;
+		pseudo.pipe = pipe;
+		pseudo.ok = ok ? 1 : 0;
+		pseudo.next = next;
+		uint8_t *p = seg->map + offset;
+		memcpy(p, &rec, sizeof(rec));
+		memcpy(p + sizeof(rec), &pseudo, sizeof(pseudo));
+		memcpy(p + sizeof(rec) + sizeof(pseudo), frame, length);
+		__atomic_fetch_sub(&seg->writers, 1, __ATOMIC_RELEASE);
+		metricInc(M_CAPTURED_FRAMES);
+		return;
+	}
+	metricInc(M_CAPTURE_DROPPED);
+}
+
+bool captureOpen(const char *basename, size_t fileSize, unsigned int files)
+{
+	if (captureEnabled) {
+		return false;
+	}
+	baseName = strdup(basename);
+	segmentSize = fileSize;
+	keepFiles = files > 0 ? files : 1;
+	nextNumber = 0;
+	active = segmentOpen();
+	if (active == NULL) {
+		free(baseName);
+		baseName = NULL;
+		return false;
+	}
+	rotatorRunning = true;
+	if (pthread_create(&rotator, NULL, rotatorLoop, NULL) != 0) {
+		rotatorRunning = false;
+		segmentClose(active);
+		active = NULL;
+		return false;
+	}
+	captureEnabled = true;
+	return true;
+}
+
+void captureClose()
+{
+	if (!captureEnabled) {
+		return;
+	}
+	captureEnabled = false;
+	pthread_mutex_lock(&rotatorLock);
+	rotatorRunning = false;
+	pthread_cond_signal(&rotatorWake);
+	pthread_mutex_unlock(&rotatorLock);
+	pthread_join(rotator, NULL);
+
+	CaptureSegment *seg = __atomic_exchange_n(&active, (CaptureSegment *)NULL, __ATOMIC_ACQ_REL);
+	if (seg) segmentClose(seg);
+	seg = __atomic_exchange_n(&retired, (CaptureSegment *)NULL, __ATOMIC_ACQ_REL);
+	if (seg) segmentClose(seg);
+	seg = __atomic_exchange_n(&standby, (CaptureSegment *)NULL, __ATOMIC_ACQ_REL);
+	if (seg) {
+		// never used, remove the empty file
+		char name[256];
+		segmentName(name, sizeof(name), seg->number);
+		segmentClose(seg);
+		unlink(name);
+	}
+	free(baseName);
+	baseName = NULL;
+}
@@ -0,0 +1,77 @@
+/*
+ * PiCapture.h - Radio frame capture into memory mapped pcap files
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Every frame received or transmitted by the radio is appended to a memory
+ * mapped capture file in pcap format (nanosecond timestamps, link type
+ * LINKTYPE_USER0). Each packet starts with a CapturePseudoHeader followed by
+ * the raw MySensors frame. Files are rotated when full: a background thread
+ * always keeps the next file mapped, so recording a frame never waits for
+ * the file system; if the next file is not ready the frame is dropped. The
+ * next file is allocated on disk and its pages are populated when it is
+ * mapped, so recording a frame doesn't take a page fault either.
+ */
+
+#ifndef __PiCapture_H__
+#define __PiCapture_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_LINKTYPE   147       // LINKTYPE_USER0
+#define CAPTURE_MAGIC_NS   0xa1b23c4d
+#define CAPTURE_MAGIC_US   0xa1b2c3d4
+#define CAPTURE_SNAPLEN    64
+#define CAPTURE_FILE_SIZE  (4UL * 1024 * 1024)
+#define CAPTURE_FILES      4         // rotated files to keep
+
+#define CAPTURE_RX 0
+#define CAPTURE_TX 1
+
+struct CapturePseudoHeader {
+	uint8_t direction;  // CAPTURE_RX or CAPTURE_TX
+	uint8_t pipe;       // pipe the frame was received on or written to
+	uint8_t ok;         // 1 if received or acknowledged, 0 if the transmission failed
+	uint8_t next;       // next hop of transmitted frames, 0xff for received frames
+} __attribute__((packed));
+
+struct CaptureFileHeader {
+	uint32_t magic;
+	uint16_t versionMajor;
+	uint16_t versionMinor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+} __attribute__((packed));
+
+struct CaptureRecordHeader {
+	uint32_t tsSec;
+	uint32_t tsFrac;    // ns or us, depending on the file magic
+	uint32_t inclLen;
+	uint32_t origLen;
+} __attribute__((packed));
+
+/* true while capturing, checked before any work is done on the radio path */
+extern volatile bool captureEnabled;
+
+/**
+ * Start capturing into files named <basename>.<n>.pcap, each fileSize bytes
+ * at most, keeping the last files ones.
+ */
+bool captureOpen(const char *basename, size_t fileSize = CAPTURE_FILE_SIZE, unsigned int files = CAPTURE_FILES);
+
+/**
+ * Stop capturing and truncate the current file to its content.
+ */
+void captureClose();
+
+/**
+ * Append a frame. Lock free, may be called from any thread.
+ */
+void captureFrame(uint8_t direction, uint8_t pipe, uint8_t next, bool ok, const void *frame, uint8_t length);
+
+#endif /* __PiCapture_H__ */
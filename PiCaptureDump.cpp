@@ -0,0 +1,189 @@
+/*
+ * PiCaptureDump.cpp - Decode radio capture files written by the gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Usage: PiCaptureDump [-n node] [-c command] [-t type] file.pcap...
+ *
+ * -n only shows frames the node sent, relayed or was addressed by,
+ * -c and -t filter on the message command and type.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "PiCapture.h"
+#include "MyMessage.h"
+
+static const char *commandNames[] = { "presentation", "set", "req", "internal", "stream" };
+
+static int filterNode = -1;
+static int filterCommand = -1;
+static int filterType = -1;
+
+static void printPayload(const uint8_t *payload, uint8_t length, uint8_t payloadType)
+{
+	int16_t i16;
+	uint16_t u16;
+	int32_t i32;
+	uint32_t u32;
+	float f;
+
+	switch (payloadType) {
+		case P_STRING:
+			printf("%.*s", length, (const char *)payload);
+			break;
+		case P_BYTE:
+			printf("%u", payload[0]);
+			break;
+		case P_INT16:
+			memcpy(&i16, payload, sizeof(i16));
+			printf("%d", i16);
+			break;
+		case P_UINT16:
+			memcpy(&u16, payload, sizeof(u16));
+			printf("%u", u16);
+			break;
+		case P_LONG32:
+			memcpy(&i32, payload, sizeof(i32));
+			printf("%ld", (long)i32);
+			break;
+		case P_ULONG32:
+			memcpy(&u32, payload, sizeof(u32));
+			printf("%lu", (unsigned long)u32);
+			break;
+		case P_FLOAT32:
+			memcpy(&f, payload, sizeof(f));
+			printf("%.*f", length > 4 ? payload[4] : 2, f);
+			break;
+		default:
+			for (uint8_t i = 0; i < length; i++) {
+				printf("%02X", payload[i]);
+			}
+			break;
+	}
+}
+
+static void printRecord(const CaptureRecordHeader *rec, bool nano, const uint8_t *data)
+{
+	const CapturePseudoHeader *pseudo = (const CapturePseudoHeader *)data;
+	const uint8_t *frame = data + sizeof(CapturePseudoHeader);
+	int frameLength = rec->inclLen - sizeof(CapturePseudoHeader);
+
+	if (frameLength < HEADER_SIZE) {
+		return;
+	}
+	uint8_t last = frame[0], sender = frame[1], destination = frame[2];
+	uint8_t length = BF_GET(frame[3], 3, 5);
+	uint8_t command = BF_GET(frame[4], 0, 3);
+	uint8_t requestAck = BF_GET(frame[4], 3, 1);
+	uint8_t isAck = BF_GET(frame[4], 4, 1);
+	uint8_t payloadType = BF_GET(frame[4], 5, 3);
+	uint8_t type = frame[5], sensor = frame[6];
+
+	if (filterNode >= 0 && sender != filterNode && last != filterNode && destination != filterNode
+			&& (pseudo->direction != CAPTURE_TX || pseudo->next != filterNode)) {
+		return;
+	}
+	if (filterCommand >= 0 && command != filterCommand) return;
+	if (filterType >= 0 && type != filterType) return;
+	if (length > frameLength - HEADER_SIZE) {
+		length = frameLength - HEADER_SIZE;
+	}
+
+	char when[32];
+	time_t sec = rec->tsSec;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+	printf("%s.%09lu ", when, (unsigned long)(nano ? rec->tsFrac : rec->tsFrac * 1000));
+	if (pseudo->direction == CAPTURE_RX) {
+		printf("rx pipe=%u      ", pseudo->pipe);
+	} else {
+		printf("tx next=%-3u %-4s ", pseudo->next, pseudo->ok ? "ok" : "fail");
+	}
+	printf("%d-%d-%d s=%d,c=%d(%s),t=%d,pt=%d,l=%d%s%s:", sender, last, destination, sensor, command,
+			command < sizeof(commandNames) / sizeof(commandNames[0]) ? commandNames[command] : "?",
+			type, payloadType, length, requestAck ? ",rack" : "", isAck ? ",ack" : "");
+	printPayload(frame + HEADER_SIZE, length, payloadType);
+	printf("\n");
+}
+
+static int dumpFile(const char *name)
+{
+	struct stat st;
+	int fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(name);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(CaptureFileHeader)) {
+		close(fd);
+		return 0;
+	}
+	const uint8_t *map = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(name);
+		return -1;
+	}
+	const CaptureFileHeader *header = (const CaptureFileHeader *)map;
+	if ((header->magic != CAPTURE_MAGIC_NS && header->magic != CAPTURE_MAGIC_US) || header->network != CAPTURE_LINKTYPE) {
+		fprintf(stderr, "%s: not a MySensors capture file\n", name);
+		munmap((void *)map, st.st_size);
+		return -1;
+	}
+	bool nano = header->magic == CAPTURE_MAGIC_NS;
+	size_t pos = sizeof(CaptureFileHeader);
+	while (pos + sizeof(CaptureRecordHeader) <= (size_t)st.st_size) {
+		const CaptureRecordHeader *rec = (const CaptureRecordHeader *)(map + pos);
+		// files still being written are zero padded
+		if (rec->inclLen == 0 || rec->inclLen > CAPTURE_SNAPLEN) break;
+		pos += sizeof(CaptureRecordHeader);
+		if (pos + rec->inclLen > (size_t)st.st_size) break;
+		if (rec->inclLen >= sizeof(CapturePseudoHeader)) {
+			printRecord(rec, nano, map + pos);
+		}
+		pos += rec->inclLen;
+	}
+	munmap((void *)map, st.st_size);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, status = EXIT_SUCCESS;
+
+	while ((c = getopt(argc, argv, "n:c:t:")) != -1) {
+		switch (c) {
+			case 'n':
+				filterNode = atoi(optarg);
+				break;
+			case 'c':
+				filterCommand = atoi(optarg);
+				break;
+			case 't':
+				filterType = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n node] [-c command] [-t type] file.pcap...\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [-n node] [-c command] [-t type] file.pcap...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (int i = optind; i < argc; i++) {
+		if (dumpFile(argv[i]) != 0) {
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,103 @@
+/*
+ * PiChannelSurvey.cpp - Occupancy of the radio channels, and the quietest one
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PiChannelSurvey.h"
+
+PiChannelSurvey::PiChannelSurvey()
+{
+	memset(busy, 0, sizeof(busy));
+	samples = 0;
+}
+
+bool PiChannelSurvey::run(MyTransport *radio, unsigned int dwell)
+{
+	bool power;
+
+	memset(busy, 0, sizeof(busy));
+	samples = dwell > 0 ? (dwell < 1000 ? dwell : 1000) : 1;
+	radio->stopListening();
+	for (uint8_t channel = 0; channel < SURVEY_CHANNELS; channel++) {
+		radio->setChannel(channel);
+		for (uint16_t i = 0; i < samples; i++) {
+			// RPD latches a carrier seen while listening, until listening again
+			radio->startListening();
+			radio->delayMs(1);
+			radio->stopListening();
+			if (!radio->testRPD(&power)) {
+				samples = 0;
+				return false;
+			}
+			busy[channel] += power;
+		}
+	}
+	return true;
+}
+
+unsigned int PiChannelSurvey::occupancy(uint8_t channel)
+{
+	if (channel >= SURVEY_CHANNELS || samples == 0) {
+		return 0;
+	}
+	return busy[channel] * 1000U / samples;
+}
+
+unsigned int PiChannelSurvey::score(uint8_t channel)
+{
+	unsigned int neighbours = 0;
+
+	if (channel > 0) {
+		neighbours += occupancy(channel - 1);
+	}
+	if (channel + 1 < SURVEY_CHANNELS) {
+		neighbours += occupancy(channel + 1);
+	}
+	return occupancy(channel) + neighbours / 2;
+}
+
+uint8_t PiChannelSurvey::quietest(uint8_t first, uint8_t last, const uint8_t *avoid, unsigned int count)
+{
+	uint8_t best = first;
+	unsigned int bestScore = ~0U;
+
+	if (last >= SURVEY_CHANNELS) {
+		last = SURVEY_CHANNELS - 1;
+	}
+	for (unsigned int channel = first; channel <= last; channel++) {
+		bool taken = false;
+		for (unsigned int i = 0; i < count && !taken; i++) {
+			taken = channel + 1 >= avoid[i] && channel <= avoid[i] + 1U;
+		}
+		if (!taken && score(channel) < bestScore) {
+			best = channel;
+			bestScore = score(channel);
+		}
+	}
+	return best;
+}
+
+size_t PiChannelSurvey::format(char *buffer, size_t len, uint8_t first, uint8_t last)
+{
+	size_t pos = 0;
+
+	buffer[0] = '\0';
+	for (unsigned int channel = first; channel <= last && channel < SURVEY_CHANNELS; channel++) {
+		if (busy[channel] == 0) {
+			continue;
+		}
+		int n = snprintf(buffer + pos, len - pos, "%s%d:%d", pos > 0 ? " " : "", channel, occupancy(channel));
+		if (n < 0 || (size_t)n >= len - pos) {
+			buffer[pos] = '\0';
+			break;
+		}
+		pos += n;
+	}
+	return pos;
+}
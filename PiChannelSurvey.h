@@ -0,0 +1,73 @@
+/*
+ * PiChannelSurvey.h - Occupancy of the radio channels, and the quietest one
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * The nRF24L01+ has no RSSI, but its RPD bit is set when the receiver saw
+ * a carrier above -64 dBm for at least 40 us. The survey listens on every
+ * channel for dwell ms, in samples of one ms each, and counts the samples
+ * with RPD set: WiFi, Bluetooth and other networks on a channel show up as
+ * the share of busy samples, in permille.
+ *
+ * A channel also takes the interference of its neighbours (2 MHz wide
+ * frames at 2 Mbps, WiFi 20 MHz), so quietest() scores a channel with its
+ * own occupancy plus half that of the channels next to it. The radio is
+ * left off the air for the whole survey, about 126 * dwell ms, so it is
+ * meant for startup.
+ */
+
+#ifndef __PiChannelSurvey_H__
+#define __PiChannelSurvey_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyTransport.h"
+
+#define SURVEY_CHANNELS 126
+#define SURVEY_DWELL    50        // ms per channel
+#define SURVEY_FIRST    0         // channels picked from, by default the ISM band
+#define SURVEY_LAST     83
+#define SURVEY_MARGIN   20        // permille a channel must be quieter to move there
+
+class PiChannelSurvey
+{
+  public:
+	PiChannelSurvey();
+
+	/**
+	 * Listen on every channel for dwell ms. The radio is left on the last
+	 * channel, not listening. Returns false if the radio has no RPD.
+	 */
+	bool run(MyTransport *radio, unsigned int dwell);
+
+	/**
+	 * Permille of the samples channel was busy in the last run.
+	 */
+	unsigned int occupancy(uint8_t channel);
+
+	/**
+	 * Score of channel, its own occupancy and half of its neighbours'.
+	 */
+	unsigned int score(uint8_t channel);
+
+	/**
+	 * Channel of first..last with the lowest score, skipping the count
+	 * channels in avoid and their neighbours.
+	 */
+	uint8_t quietest(uint8_t first, uint8_t last, const uint8_t *avoid, unsigned int count);
+
+	/**
+	 * The occupancy of channels first..last as text, "<channel>:<permille>"
+	 * separated by spaces, for the channels that weren't idle.
+	 */
+	size_t format(char *buffer, size_t len, uint8_t first, uint8_t last);
+
+  private:
+	uint16_t busy[SURVEY_CHANNELS];
+	uint16_t samples;
+};
+
+#endif /* __PiChannelSurvey_H__ */
@@ -24,6 +24,7 @@
 #include <string.h>
 
 #include <PiEEPROM.h>
+#include <PiJournal.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,6 +32,20 @@ extern "C" {
 
 uint8_t _eeprom[EEPROM_SIZE] = {};
 
+/* EEPROM image of the calling thread, _eeprom unless eeprom_select()ed */
+static __thread uint8_t *_eepromImage = NULL;
+#define EEPROM_BASE (_eepromImage ? _eepromImage : _eeprom)
+
+void eeprom_select(uint8_t *image)
+{
+    _eepromImage = image;
+}
+
+uint8_t *eeprom_image()
+{
+    return EEPROM_BASE;
+}
+
 int eeprom_is_ready()
 {
     return 1;
@@ -45,7 +60,7 @@ uint8_t eeprom_read_byte (const uint8_t *__p)
 
     if (addr < EEPROM_SIZE)
     {
-        return *(_eeprom + addr);
+        return *(EEPROM_BASE + addr);
     }
 
     return 0;
@@ -60,7 +75,7 @@ uint16_t eeprom_read_word (const uint16_t *__p)
 
     if (addr < EEPROM_SIZE - (sizeof(uint16_t) - sizeof(uint8_t)))
     {
-        return (uint16_t)*(_eeprom + addr);
+        return (uint16_t)*(EEPROM_BASE + addr);
     }
 
     return 0;
@@ -75,7 +90,7 @@ uint32_t eeprom_read_dword (const uint32_t *__p)
 
     if (addr < EEPROM_SIZE - (sizeof(uint32_t) - sizeof(uint8_t)))
     {
-        return (uint32_t)*(_eeprom + addr);
+        return (uint32_t)*(EEPROM_BASE + addr);
     }
 
     return 0;
@@ -90,7 +105,7 @@ float eeprom_read_float (const float *__p)
 
     if (addr < EEPROM_SIZE - (sizeof(float) - sizeof(uint8_t)))
     {
-        return (float)*(_eeprom + addr);
+        return (float)*(EEPROM_BASE + addr);
     }
 
     return 0;
@@ -105,7 +120,7 @@ void eeprom_read_block (void *__dst, const void *__src, size_t __n)
 
     if (addr < EEPROM_SIZE - (__n - sizeof(uint8_t)))
     {
-        memcpy(__dst, (_eeprom + addr), __n);
+        memcpy(__dst, (EEPROM_BASE + addr), __n);
     }
 }
 
@@ -120,7 +135,8 @@ void eeprom_write_byte (uint8_t *__p, uint8_t __value)
 
     if (addr < EEPROM_SIZE)
     {
-        memcpy((_eeprom + addr), &__value, sizeof(uint8_t));
+        if (!journalEnabled || !journalWrite(EEPROM_BASE, addr, &__value, sizeof(uint8_t)))
+            memcpy((EEPROM_BASE + addr), &__value, sizeof(uint8_t));
     }
 }
 
@@ -133,7 +149,8 @@ void eeprom_write_word (uint16_t *__p, uint16_t __value)
 
     if (addr < EEPROM_SIZE - (sizeof(uint16_t) - sizeof(uint8_t)))
     {
-        memcpy((_eeprom + addr), &__value, sizeof(uint16_t));
+        if (!journalEnabled || !journalWrite(EEPROM_BASE, addr, &__value, sizeof(uint16_t)))
+            memcpy((EEPROM_BASE + addr), &__value, sizeof(uint16_t));
     }
 }
 
@@ -146,7 +163,8 @@ void eeprom_write_dword (uint32_t *__p, uint32_t __value)
 
     if (addr < EEPROM_SIZE - (sizeof(uint32_t) - sizeof(uint8_t)))
     {
-        memcpy((_eeprom + addr), &__value, sizeof(uint32_t));
+        if (!journalEnabled || !journalWrite(EEPROM_BASE, addr, &__value, sizeof(uint32_t)))
+            memcpy((EEPROM_BASE + addr), &__value, sizeof(uint32_t));
     }
 }
 
@@ -159,7 +177,8 @@ void eeprom_write_float (float *__p, float __value)
 
     if (addr < EEPROM_SIZE - (sizeof(float) - sizeof(uint8_t)))
     {
-        memcpy((_eeprom + addr), &__value, sizeof(float));
+        if (!journalEnabled || !journalWrite(EEPROM_BASE, addr, &__value, sizeof(float)))
+            memcpy((EEPROM_BASE + addr), &__value, sizeof(float));
     }
 }
 
@@ -173,7 +192,8 @@ void eeprom_write_block (const void *__src, void *__dst, size_t __n)
 
     if (addr < EEPROM_SIZE - (__n - sizeof(uint8_t)))
     {
-        memcpy((_eeprom + addr), __src, __n);
+        if (!journalEnabled || !journalWrite(EEPROM_BASE, addr, __src, __n))
+            memcpy((EEPROM_BASE + addr), __src, __n);
     }
 }
 
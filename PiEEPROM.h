@@ -33,6 +33,18 @@ extern "C" {
 
 extern uint8_t _eeprom[EEPROM_SIZE];
 
+/**
+ * Make the calling thread use its own EEPROM_SIZE bytes image instead of
+ * _eeprom, or go back to _eeprom with NULL. Lets several nodes share one
+ * process, e.g. in the mesh simulator.
+ */
+void eeprom_select(uint8_t *image);
+
+/**
+ * The EEPROM_SIZE bytes image the calling thread uses.
+ */
+uint8_t *eeprom_image();
+
 int eeprom_is_ready();
 /**
  * Loops until the eeprom is no longer busy.
@@ -0,0 +1,339 @@
+/*
+ * PiFilter.cpp - Values from the nodes held back before the controller
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PiFilter.h"
+#include "MyMetrics.h"
+
+#define FILTER_ANY  -1
+#define FILTER_FREE 0xffffffff
+
+struct FilterRule {
+	int node;                   // or FILTER_ANY
+	int sensor;
+	int type;
+	double deadband;
+	unsigned long interval;     // ms
+	unsigned long window;
+	unsigned long refresh;      // ms, 0 = never
+	unsigned int specificity;
+};
+
+static FilterRule rules[FILTER_MAX_RULES];
+static unsigned int ruleCount = 0;
+
+/*
+ * A number or '*' up to the next ':' or the end, FILTER_ANY for '*'
+ */
+static bool parseField(const char **spec, bool wildcard, double *value)
+{
+	const char *p = *spec;
+	char *end;
+
+	if (wildcard && *p == '*') {
+		*value = FILTER_ANY;
+		end = (char *)p + 1;
+	} else {
+		*value = strtod(p, &end);
+		if (end == p || *value < 0) {
+			return false;
+		}
+	}
+	if (*end != ':' && *end != '\0') {
+		return false;
+	}
+	*spec = *end == ':' ? end + 1 : end;
+	return true;
+}
+
+bool filterAddRule(const char *spec)
+{
+	double fields[7] = { 0, 0, 0, 0, 0, 0, FILTER_REFRESH };
+	int count = 0;
+
+	if (ruleCount == FILTER_MAX_RULES) {
+		errno = ENOSPC;
+		return false;
+	}
+	while (*spec != '\0' && count < 7) {
+		if (!parseField(&spec, count < 3, &fields[count])) {
+			errno = EINVAL;
+			return false;
+		}
+		count++;
+	}
+	if (count < 4 || *spec != '\0' || fields[0] > 255 || fields[1] > 255 || fields[2] > 255) {
+		errno = EINVAL;
+		return false;
+	}
+	FilterRule *rule = &rules[ruleCount++];
+	rule->node = (int)fields[0];
+	rule->sensor = (int)fields[1];
+	rule->type = (int)fields[2];
+	rule->deadband = fields[3];
+	rule->interval = (unsigned long)fields[4];
+	rule->window = (unsigned long)fields[5];
+	rule->refresh = (unsigned long)(fields[6] * 1000);
+	rule->specificity = (rule->node != FILTER_ANY) * 4 + (rule->type != FILTER_ANY) * 2 + (rule->sensor != FILTER_ANY);
+	return true;
+}
+
+void filterClearRules()
+{
+	ruleCount = 0;
+}
+
+unsigned int filterRuleCount()
+{
+	return ruleCount;
+}
+
+static const FilterRule *findRule(uint8_t node, uint8_t sensor, uint8_t type)
+{
+	const FilterRule *best = NULL;
+
+	for (unsigned int i = 0; i < ruleCount; i++) {
+		const FilterRule *rule = &rules[i];
+		if ((rule->node == FILTER_ANY || rule->node == node) &&
+				(rule->sensor == FILTER_ANY || rule->sensor == sensor) &&
+				(rule->type == FILTER_ANY || rule->type == type) &&
+				(best == NULL || rule->specificity > best->specificity)) {
+			best = rule;
+		}
+	}
+	return best;
+}
+
+/*
+ * The payload as a number, false for custom payloads and text that isn't one
+ */
+static bool numeric(const MyMessage &message, double *value)
+{
+	char *end;
+
+	switch (mGetPayloadType(message)) {
+		case P_BYTE:    *value = message.getByte(); return true;
+		case P_INT16:   *value = message.getInt(); return true;
+		case P_UINT16:  *value = message.getUInt(); return true;
+		case P_LONG32:  *value = message.getLong(); return true;
+		case P_ULONG32: *value = message.getULong(); return true;
+		case P_FLOAT32: *value = message.getFloat(); return true;
+		case P_STRING:
+			*value = strtod(message.data, &end);
+			return end != message.data && *end == '\0';
+		default:
+			return false;
+	}
+}
+
+PiFilter::PiFilter()
+{
+	slots = NULL;
+	used = 0;
+	heap = NULL;
+	held = 0;
+}
+
+PiFilter::~PiFilter()
+{
+	metricSub(M_FILTER_HELD, held);
+	delete [] slots;
+	delete [] heap;
+}
+
+PiFilter::Entry *PiFilter::lookup(const MyMessage &message)
+{
+	uint32_t key = (uint32_t)message.sender << 16 | message.sensor << 8 | message.type;
+
+	if (slots == NULL) {
+		slots = new Entry[FILTER_SLOTS];
+		heap = new Entry *[FILTER_SLOTS];
+		for (int i = 0; i < FILTER_SLOTS; i++) {
+			slots[i].key = FILTER_FREE;
+		}
+	}
+	// Open addressing, entries are never removed
+	unsigned int i = (key * 2654435761U) >> 16 & (FILTER_SLOTS - 1);
+	for (unsigned int probe = 0; probe < FILTER_SLOTS; probe++, i = (i + 1) & (FILTER_SLOTS - 1)) {
+		Entry *entry = &slots[i];
+		if (entry->key == key) {
+			return entry;
+		}
+		if (entry->key == FILTER_FREE) {
+			if (used == FILTER_SLOTS * 3 / 4) {
+				return NULL;
+			}
+			used++;
+			entry->key = key;
+			entry->rule = findRule(message.sender, message.sensor, message.type);
+			entry->sent = false;
+			entry->heapIndex = -1;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+bool PiFilter::differs(const FilterRule *rule, const MyMessage &last, const MyMessage &message)
+{
+	double a, b;
+
+	if (numeric(last, &a) && numeric(message, &b)) {
+		return fabs(b - a) > rule->deadband;
+	}
+	return mGetPayloadType(last) != mGetPayloadType(message) || mGetLength(last) != mGetLength(message) ||
+			memcmp(last.data, message.data, mGetLength(message)) != 0;
+}
+
+bool PiFilter::pass(const MyMessage &message, unsigned long now)
+{
+	if (ruleCount == 0 || mGetCommand(message) != C_SET || mGetAck(message)) {
+		return true;
+	}
+	Entry *entry = lookup(message);
+	if (entry == NULL || entry->rule == NULL) {
+		return true;
+	}
+	const FilterRule *rule = entry->rule;
+	unsigned long since = now - entry->sentAt;
+
+	if (!entry->sent || (rule->refresh > 0 && since >= rule->refresh)) {
+		sent(entry, message, now);
+		return true;
+	}
+	if (!differs(rule, entry->last, message)) {
+		// Within the deadband: the newest goes on at the refresh
+		if (rule->refresh > 0) {
+			hold(entry, message, false, entry->sentAt + rule->refresh);
+		} else {
+			metricInc(M_FILTER_SUPPRESSED);
+		}
+		return false;
+	}
+	if (rule->window == 0 && since >= rule->interval) {
+		sent(entry, message, now);
+		return true;
+	}
+	// A change waits for the end of its window and the interval
+	unsigned long dueAt = now + rule->window;
+	if (entry->heapIndex >= 0 && entry->changed) {
+		dueAt = entry->dueAt;
+	} else if ((long)(entry->sentAt + rule->interval - dueAt) > 0) {
+		dueAt = entry->sentAt + rule->interval;
+	}
+	hold(entry, message, true, dueAt);
+	return false;
+}
+
+void PiFilter::hold(Entry *entry, const MyMessage &message, bool changed, unsigned long dueAt)
+{
+	entry->message = message;
+	entry->changed = changed;
+	entry->dueAt = dueAt;
+	if (entry->heapIndex >= 0) {
+		// The newest wins, due no later than the one it replaces
+		metricInc(M_FILTER_SUPPRESSED);
+		siftUp(entry->heapIndex);
+		siftDown(entry->heapIndex);
+	} else {
+		place(held++, entry);
+		siftUp(entry->heapIndex);
+		metricAdd(M_FILTER_HELD, 1);
+	}
+}
+
+void PiFilter::release(Entry *entry)
+{
+	unsigned int i = entry->heapIndex;
+
+	entry->heapIndex = -1;
+	if (i != --held) {
+		place(i, heap[held]);
+		siftUp(i);
+		siftDown(heap[i]->heapIndex);
+	}
+	metricSub(M_FILTER_HELD, 1);
+}
+
+void PiFilter::place(unsigned int i, Entry *entry)
+{
+	heap[i] = entry;
+	entry->heapIndex = i;
+}
+
+void PiFilter::siftUp(unsigned int i)
+{
+	Entry *entry = heap[i];
+
+	while (i > 0 && (long)(heap[(i - 1) / 2]->dueAt - entry->dueAt) > 0) {
+		place(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	place(i, entry);
+}
+
+void PiFilter::siftDown(unsigned int i)
+{
+	Entry *entry = heap[i];
+
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+		if (child >= held) {
+			break;
+		}
+		if (child + 1 < held && (long)(heap[child]->dueAt - heap[child + 1]->dueAt) > 0) {
+			child++;
+		}
+		if ((long)(entry->dueAt - heap[child]->dueAt) <= 0) {
+			break;
+		}
+		place(i, heap[child]);
+		i = child;
+	}
+	place(i, entry);
+}
+
+void PiFilter::sent(Entry *entry, const MyMessage &message, unsigned long now)
+{
+	if (entry->heapIndex >= 0) {
+		// Older than the message passed on
+		release(entry);
+		metricInc(M_FILTER_SUPPRESSED);
+	}
+	entry->sent = true;
+	entry->sentAt = now;
+	entry->last = message;
+	metricInc(M_FILTER_FORWARDED);
+}
+
+unsigned long PiFilter::untilDue(unsigned long now, unsigned long max)
+{
+	if (held == 0) {
+		return max;
+	}
+	long left = (long)(heap[0]->dueAt - now);
+	if (left <= 0) {
+		return 0;
+	}
+	return (unsigned long)left < max ? left : max;
+}
+
+const MyMessage *PiFilter::due(unsigned long now)
+{
+	if (held == 0 || (long)(now - heap[0]->dueAt) < 0) {
+		return NULL;
+	}
+	Entry *entry = heap[0];
+	release(entry);
+	sent(entry, entry->message, now);
+	return &entry->last;
+}
@@ -0,0 +1,116 @@
+/*
+ * PiFilter.h - Values from the nodes held back before the controller
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Some sensors send the same value several times a second, and every
+ * C_SET message costs a line to the controller and its database. Rules,
+ * given per (node, sensor, type) with '*' for any, decide which of them
+ * go on:
+ *
+ *   <node>:<sensor>:<type>:<deadband>[:<interval ms>[:<window ms>[:<refresh s>]]]
+ *
+ * - deadband: a numeric value within it of the last one passed on is held
+ *   back (strings and custom payloads: an equal payload), only the newest
+ *   of them goes on after refresh s, FILTER_REFRESH by default, so the
+ *   controller never goes stale. Refresh 0 drops them.
+ * - interval: changes come at most once per interval ms, the newest wins.
+ * - window: a change is held for window ms, the newest of the changes
+ *   within the window goes on at its end.
+ *
+ * The most specific rule applies, by node, then type, then sensor; of
+ * equally specific rules the first. Rules are added before the radios start
+ * and read only afterwards. Acks and messages without a rule pass as before.
+ *
+ * Every MyGateway filters its own messages, from its radio thread. A
+ * message costs one hash lookup; the rule of a (node, sensor, type) is
+ * found once, when it is first heard. Held messages are kept in a heap by
+ * the time they are due.
+ */
+
+#ifndef __PiFilter_H__
+#define __PiFilter_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyMessage.h"
+
+#define FILTER_MAX_RULES 64
+#define FILTER_SLOTS     1024      // (node, sensor, type) tracked per gateway, a power of two
+#define FILTER_REFRESH   300       // s
+
+struct FilterRule;
+
+/**
+ * Add a rule from a -u spec, see above. Returns false with errno set if
+ * the spec is malformed or there are FILTER_MAX_RULES rules already.
+ */
+bool filterAddRule(const char *spec);
+
+/**
+ * Drop all rules.
+ */
+void filterClearRules();
+
+unsigned int filterRuleCount();
+
+class PiFilter
+{
+  public:
+	PiFilter();
+	~PiFilter();
+
+	/**
+	 * A message from the network, now is the gateway's millis(). True if
+	 * it goes to the controller now, false if it is held or dropped.
+	 */
+	bool pass(const MyMessage &message, unsigned long now);
+
+	/**
+	 * A held message that is due, NULL if none. It was passed on by then,
+	 * the pointer is valid until the next call.
+	 */
+	const MyMessage *due(unsigned long now);
+
+	/**
+	 * ms until a held message is due, at most max.
+	 */
+	unsigned long untilDue(unsigned long now, unsigned long max);
+
+	/**
+	 * Messages held.
+	 */
+	unsigned int size() { return held; }
+
+  private:
+	struct Entry {
+		uint32_t key;           // node << 16 | sensor << 8 | type
+		const FilterRule *rule; // NULL: passes
+		bool sent;              // a value went to the controller
+		bool changed;           // the held message is a change, not a refresh
+		int heapIndex;          // in heap, -1 if nothing is held
+		unsigned long sentAt;
+		unsigned long dueAt;
+		MyMessage last;         // passed on last
+		MyMessage message;      // held
+	};
+
+	Entry *slots;               // allocated with the first message
+	unsigned int used;
+	Entry **heap;               // held entries, a binary heap by dueAt
+	unsigned int held;
+
+	Entry *lookup(const MyMessage &message);
+	void hold(Entry *entry, const MyMessage &message, bool changed, unsigned long dueAt);
+	void release(Entry *entry);
+	void place(unsigned int i, Entry *entry);
+	void siftUp(unsigned int i);
+	void siftDown(unsigned int i);
+	void sent(Entry *entry, const MyMessage &message, unsigned long now);
+	static bool differs(const FilterRule *rule, const MyMessage &last, const MyMessage &message);
+};
+
+#endif /* __PiFilter_H__ */
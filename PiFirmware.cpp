@@ -0,0 +1,331 @@
+/*
+ * PiFirmware.cpp - Firmware images served to nodes by the gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "PiFirmware.h"
+#include "PiLog.h"
+#include "MyMetrics.h"
+
+struct FirmwareImage {
+	FirmwareConfig config;
+	const uint8_t *data;
+	void *map;
+	size_t mapLength;
+};
+
+/* Transfer in progress to a node */
+struct FirmwareTransfer {
+	uint16_t type;
+	uint16_t version;
+	uint16_t blocks;     // blocks served so far
+	uint64_t start;      // ns, 0 if no transfer is running
+};
+
+static FirmwareImage images[FIRMWARE_MAX_IMAGES];
+static unsigned int imageCount = 0;
+
+/* Image of the last block request of this radio thread, nodes fetch blocks in a row */
+static __thread const FirmwareImage *lastImage = NULL;
+
+static FirmwareTransfer transfers[256];
+static pthread_mutex_t transferLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint16_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void crcTableInit()
+{
+	for (unsigned int i = 0; i < 256; i++) {
+		uint16_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+		}
+		crcTable[i] = crc;
+	}
+}
+
+uint16_t firmwareCrc16(const uint8_t *data, size_t length)
+{
+	uint16_t crc = 0xffff;
+
+	pthread_once(&crcTableOnce, crcTableInit);
+	while (length--) {
+		crc = (crc >> 8) ^ crcTable[(crc ^ *data++) & 0xff];
+	}
+	return crc;
+}
+
+static uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hexDigit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static int hexByte(const char *p)
+{
+	int high = hexDigit(p[0]);
+	int low = hexDigit(p[1]);
+	return high < 0 || low < 0 ? -1 : high << 4 | low;
+}
+
+/*
+ * Walk the records of an Intel HEX text. Returns the end address of the
+ * data, and copies the data into image when it's not NULL. Returns -1 on
+ * malformed records.
+ */
+static long hexParse(const char *text, size_t length, uint8_t *image)
+{
+	const char *p = text;
+	const char *end = text + length;
+	unsigned long base = 0;
+	unsigned long top = 0;
+
+	while (p < end) {
+		if (*p == '\r' || *p == '\n' || *p == ' ') {
+			p++;
+			continue;
+		}
+		if (*p != ':' || end - p < 11) {
+			return -1;
+		}
+		int count = hexByte(p + 1);
+		if (count < 0 || end - p < 11 + 2 * count) {
+			return -1;
+		}
+		uint8_t record[4 + 255 + 1];
+		uint8_t sum = 0;
+		for (int i = 0; i < count + 5; i++) {
+			int b = hexByte(p + 1 + 2 * i);
+			if (b < 0) {
+				return -1;
+			}
+			record[i] = b;
+			sum += b;
+		}
+		if (sum != 0) {
+			return -1;
+		}
+		p += 11 + 2 * count;
+
+		unsigned long address = base + (record[1] << 8 | record[2]);
+		switch (record[3]) {
+			case 0x00: // data
+				if (address + count > (unsigned long)FIRMWARE_MAX_BLOCKS * FIRMWARE_BLOCK_SIZE) {
+					return -1;
+				}
+				if (image != NULL) {
+					memcpy(image + address, record + 4, count);
+				}
+				if (address + count > top) {
+					top = address + count;
+				}
+				break;
+			case 0x01: // end of file
+				return top;
+			case 0x02: // extended segment address
+				base = (unsigned long)(record[4] << 8 | record[5]) << 4;
+				break;
+			case 0x04: // extended linear address
+				base = (unsigned long)(record[4] << 8 | record[5]) << 16;
+				break;
+			default:   // start addresses
+				break;
+		}
+	}
+	return top;
+}
+
+static const FirmwareImage *findImage(uint16_t type, uint16_t version)
+{
+	const FirmwareImage *image = lastImage;
+
+	if (image != NULL && image->config.type == type && image->config.version == version) {
+		return image;
+	}
+	for (unsigned int i = 0; i < imageCount; i++) {
+		if (images[i].config.type == type && images[i].config.version == version) {
+			lastImage = &images[i];
+			return lastImage;
+		}
+	}
+	return NULL;
+}
+
+bool firmwareLoad(uint16_t type, uint16_t version, const char *path)
+{
+	FirmwareImage *image;
+	struct stat st;
+	size_t length, mapLength;
+	void *map;
+	int fd;
+
+	if (imageCount == FIRMWARE_MAX_IMAGES) {
+		errno = ENOSPC;
+		return false;
+	}
+	if (findImage(type, version) != NULL) {
+		errno = EEXIST;
+		return false;
+	}
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	// Private writable mapping, so the last block can be padded in place
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	if (*(const char *)map == ':') {
+		long top = hexParse((const char *)map, st.st_size, NULL);
+		if (top <= 0) {
+			munmap(map, st.st_size);
+			errno = EINVAL;
+			return false;
+		}
+		length = (top + FIRMWARE_BLOCK_SIZE - 1) / FIRMWARE_BLOCK_SIZE * FIRMWARE_BLOCK_SIZE;
+		void *decoded = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (decoded == MAP_FAILED) {
+			munmap(map, st.st_size);
+			return false;
+		}
+		memset(decoded, 0xff, length);
+		hexParse((const char *)map, st.st_size, (uint8_t *)decoded);
+		munmap(map, st.st_size);
+		map = decoded;
+		mapLength = length;
+	} else {
+		length = (st.st_size + FIRMWARE_BLOCK_SIZE - 1) / FIRMWARE_BLOCK_SIZE * FIRMWARE_BLOCK_SIZE;
+		if (length > (size_t)FIRMWARE_MAX_BLOCKS * FIRMWARE_BLOCK_SIZE) {
+			munmap(map, st.st_size);
+			errno = EFBIG;
+			return false;
+		}
+		// The padding is in the last page of the mapping, the file ends inside it
+		memset((uint8_t *)map + st.st_size, 0xff, length - st.st_size);
+		mapLength = st.st_size;
+	}
+	mprotect(map, length, PROT_READ);
+
+	image = &images[imageCount];
+	image->config.type = type;
+	image->config.version = version;
+	image->config.blocks = length / FIRMWARE_BLOCK_SIZE;
+	image->config.crc = firmwareCrc16((const uint8_t *)map, length);
+	image->data = (const uint8_t *)map;
+	image->map = map;
+	image->mapLength = mapLength;
+	imageCount++;
+	log(LOG_INFO, "Firmware type %d version %d: %d blocks, crc 0x%04x (%s)\n",
+			type, version, image->config.blocks, image->config.crc, path);
+	return true;
+}
+
+void firmwareUnloadAll()
+{
+	for (unsigned int i = 0; i < imageCount; i++) {
+		munmap(images[i].map, images[i].mapLength);
+	}
+	imageCount = 0;
+	lastImage = NULL;
+}
+
+unsigned int firmwareCount()
+{
+	return imageCount;
+}
+
+bool firmwareConfig(uint16_t type, FirmwareConfig *config)
+{
+	const FirmwareImage *newest = NULL;
+
+	for (unsigned int i = 0; i < imageCount; i++) {
+		if (images[i].config.type == type && (newest == NULL || images[i].config.version > newest->config.version)) {
+			newest = &images[i];
+		}
+	}
+	if (newest == NULL) {
+		return false;
+	}
+	*config = newest->config;
+	return true;
+}
+
+bool firmwareBlock(const FirmwareRequest *request, FirmwareResponse *response)
+{
+	const FirmwareImage *image = findImage(request->type, request->version);
+
+	if (image == NULL || request->block >= image->config.blocks) {
+		return false;
+	}
+	response->type = request->type;
+	response->version = request->version;
+	response->block = request->block;
+	memcpy(response->data, image->data + (size_t)request->block * FIRMWARE_BLOCK_SIZE, FIRMWARE_BLOCK_SIZE);
+	return true;
+}
+
+void firmwareProgress(uint8_t node, const FirmwareRequest *request)
+{
+	FirmwareTransfer *t = &transfers[node];
+	uint64_t start = 0;
+	unsigned int blocks = 0;
+
+	pthread_mutex_lock(&transferLock);
+	if (t->start == 0 || t->type != request->type || t->version != request->version) {
+		t->type = request->type;
+		t->version = request->version;
+		t->blocks = 0;
+		t->start = now();
+	}
+	t->blocks++;
+	if (request->block == 0) {
+		start = t->start;
+		blocks = t->blocks;
+		t->start = 0;
+	}
+	pthread_mutex_unlock(&transferLock);
+
+	metricInc(M_FIRMWARE_BLOCKS);
+	if (start != 0) {
+		double seconds = (now() - start) / 1e9;
+		metricInc(M_FIRMWARE_UPDATES);
+		log(LOG_INFO, "Node %d got firmware type %d version %d: %u blocks in %.1f s, %.0f blocks/s\n",
+				node, request->type, request->version, blocks, seconds, seconds > 0 ? blocks / seconds : 0.0);
+	}
+}
@@ -0,0 +1,96 @@
+/*
+ * PiFirmware.h - Firmware images served to nodes by the gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Nodes running the MySensors bootloader fetch a new sketch with
+ * ST_FIRMWARE_CONFIG_REQUEST and then one ST_FIRMWARE_REQUEST per 16 byte
+ * block, last block first. Without this store every block makes a round trip
+ * through the controller as hex text. Images loaded here are answered by the
+ * gateway itself: a config request for a loaded firmware type gets the
+ * newest loaded version, a block request for a loaded type and version gets
+ * the block straight from the image.
+ *
+ * Images are read from Intel HEX or raw binary files and kept in memory
+ * mappings padded with 0xff to whole blocks; binary files are mapped
+ * directly. Requests for firmware that is not loaded still go to the
+ * controller. The store is filled before the radios start and read only
+ * afterwards, so any radio thread may look up blocks without locking.
+ */
+
+#ifndef __PiFirmware_H__
+#define __PiFirmware_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FIRMWARE_BLOCK_SIZE 16
+#define FIRMWARE_MAX_IMAGES 16
+#define FIRMWARE_MAX_BLOCKS 0xffff
+
+/* Payload of ST_FIRMWARE_CONFIG_REQUEST and ST_FIRMWARE_CONFIG_RESPONSE */
+struct FirmwareConfig {
+	uint16_t type;
+	uint16_t version;
+	uint16_t blocks;
+	uint16_t crc;
+} __attribute__((packed));
+
+/* Payload of ST_FIRMWARE_REQUEST */
+struct FirmwareRequest {
+	uint16_t type;
+	uint16_t version;
+	uint16_t block;
+} __attribute__((packed));
+
+/* Payload of ST_FIRMWARE_RESPONSE */
+struct FirmwareResponse {
+	uint16_t type;
+	uint16_t version;
+	uint16_t block;
+	uint8_t data[FIRMWARE_BLOCK_SIZE];
+} __attribute__((packed));
+
+/**
+ * Load the image of firmware type and version from an Intel HEX file (by
+ * its first character ':') or a binary file. Returns false with errno set
+ * if the file can't be read or parsed, or the store is full.
+ */
+bool firmwareLoad(uint16_t type, uint16_t version, const char *path);
+
+/**
+ * Unmap all images.
+ */
+void firmwareUnloadAll();
+
+/**
+ * Number of loaded images.
+ */
+unsigned int firmwareCount();
+
+/**
+ * Fill config with the newest loaded version of firmware type.
+ * Returns false if no image of that type is loaded.
+ */
+bool firmwareConfig(uint16_t type, FirmwareConfig *config);
+
+/**
+ * Fill response with the requested block. Returns false if the image is
+ * not loaded or the block is past its end.
+ */
+bool firmwareBlock(const FirmwareRequest *request, FirmwareResponse *response);
+
+/**
+ * Note a block served to node. Block 0 is the last one a node requests; its
+ * transfer is then logged with its duration and blocks per second.
+ */
+void firmwareProgress(uint8_t node, const FirmwareRequest *request);
+
+/**
+ * CRC16 of the bootloader (polynomial 0xa001, initial value 0xffff).
+ */
+uint16_t firmwareCrc16(const uint8_t *data, size_t length);
+
+#endif /* __PiFirmware_H__ */
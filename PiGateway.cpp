@@ -10,45 +10,49 @@
 */
  
 #include <stdio.h>
+#include <signal.h>
 #include "MyGateway.h"
+#include "PiLog.h"
+#include "MyTransportVirtual.h"
+#ifndef MY_NO_RF24
 #include <RF24.h>
+#endif
 
 MyGateway *gw;
+MyTransportVirtual *radio;
 
-int daemonizeFlag = 0;
+/* cleared by SIGINT and SIGTERM, the loop ends and the queued log lines are written */
+volatile static sig_atomic_t running = 1;
 
-void openSyslog()
+void handle_sigint(int sig)
 {
-    setlogmask(LOG_UPTO (LOG_INFO));
-    openlog(NULL, 0, LOG_USER);
-}
-
-void closeSyslog()
-{
-    closelog();
-}
-
-void log(int priority, const char *format, ...)
-{
-	va_list argptr;
-    va_start(argptr, format);
-    if (daemonizeFlag == 1) {
-		vsyslog(priority, format, argptr);
-	} else {
-		vprintf(format, argptr);
-	}
-	va_end(argptr);
+	running = 0;
 }
 
 void msgCallback(char *msg){
 	printf("[CALLBACK]%s", msg);
+	traceStage(TS_WRITE);
 
 }
 
-void setup(void)
+void setup(const char *radioSpec)
 {
 	printf("Starting Gateway...\n"); 
-	gw = new MyGateway(RPI_V2_GPIO_P1_22, RPI_V2_GPIO_P1_24, BCM2835_SPI_SPEED_8MHZ, 60);
+	if (radioSpec != NULL) {
+		radio = MyTransportVirtual::open(radioSpec);
+		if (radio == NULL) {
+			printf("Could not open virtual radio '%s'\n", radioSpec);
+			exit(EXIT_FAILURE);
+		}
+		gw = new MyGateway(radio, 60);
+	} else {
+#ifdef MY_NO_RF24
+		printf("Built without RF24 support, pass a virtual radio spec\n");
+		exit(EXIT_FAILURE);
+#else
+		gw = new MyGateway(RPI_V2_GPIO_P1_22, RPI_V2_GPIO_P1_24, BCM2835_SPI_SPEED_8MHZ, 60);
+#endif
+	}
 	
 	if (gw == NULL)
     {
@@ -65,11 +69,22 @@ void loop(void)
 int main(int argc, char** argv) 
 {
 	openSyslog();
-	setup();
-	while(1) {
+	signal(SIGINT, handle_sigint);
+	signal(SIGTERM, handle_sigint);
+	if (!logStartAsync())
+		log(LOG_ERR,"Could not start the log writer thread, logging synchronously\n");
+	// Optional argument: virtual radio spec, see MyTransportVirtual.h
+	setup(argc > 1 ? argv[1] : NULL);
+	while(running) {
 		loop();
-		sleep(1);
+		// Keep going while frames are queued, a replayed trace runs at full speed
+		if (!gw->getTransport()->available())
+			sleep(1);
 	}
+	log(LOG_INFO,"Exiting...\n");
+	if (logDropped() > 0)
+		log(LOG_WARNING,"%lu log messages were dropped\n", logDropped());
+	logFlush();
 	closeSyslog();
 	return 0;
 }
@@ -32,8 +32,23 @@
 #include <fcntl.h>
 #include <syslog.h>
 
+#ifndef MY_NO_RF24
 #include <RF24.h>
+#include <MyTransportRF24.h>
+#endif
 #include <MyGateway.h>
+#include <MyTransportVirtual.h>
+#include <PiRadioGroup.h>
+#include <PiLog.h>
+#include <PiCapture.h>
+#include <PiFirmware.h>
+#include <PiStream.h>
+#include <PiFilter.h>
+#include <PiRules.h>
+#include <PiSeries.h>
+#include <PiSnapshot.h>
+#include <PiJournal.h>
+#include <PiBacklog.h>
 #include <Version.h>
 
 #ifndef _TTY_NAME
@@ -47,6 +62,12 @@
 /* variable indicating if the server is still running */
 volatile static int running = 1;
 
+/* set when latency histograms should be dumped */
+volatile static int dumpTrace = 0;
+
+/* set when the binary debug log should be dumped */
+volatile static int dumpLog = 0;
+
 /* PTY file descriptors */
 int pty_master = -1;
 int pty_slave = -1;
@@ -55,46 +76,41 @@ static const mode_t ttyPermissions = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
 static const char *serial_tty = _TTY_NAME;
 static const char *devGroupName = _TTY_GROUPNAME;
 
-int daemonizeFlag = 0;
-
-void openSyslog()
-{
-    setlogmask(LOG_UPTO (LOG_INFO));
-    openlog(NULL, 0, LOG_USER);
-}
-
-void closeSyslog()
+/*
+ * handler for SIGINT signal
+ */
+void handle_sigint(int sig)
 {
-    closelog();
+	log(LOG_INFO,"Received SIGINT\n");
+	running = 0;
 }
 
-void log(int priority, const char *format, ...)
+/*
+ * handler for SIGUSR1 signal, toggles debug logging or, when debug messages
+ * go to the binary log, requests a dump of it
+ */
+void handle_sigusr1(int sig)
 {
-	va_list argptr;
-    va_start(argptr, format);
-    if (daemonizeFlag == 1) {
-		vsyslog(priority, format, argptr);
-	} else {
-		vprintf(format, argptr);
+	if (logBinary) {
+		dumpLog = 1;
+		return;
 	}
-	va_end(argptr);
+	log(LOG_INFO,"Received SIGUSR1\n");
+	if (logMask != LOG_UPTO(LOG_DEBUG)) logSetMask(LOG_UPTO (LOG_DEBUG));
+	else logSetMask(LOG_UPTO (LOG_INFO));
 }
 
 /*
- * handler for SIGINT signal
+ * handler for SIGUSR2 signal, dumps the latency histograms and the rule hits
  */
-void handle_sigint(int sig)
+void handle_sigusr2(int sig)
 {
-	log(LOG_INFO,"Received SIGINT\n");
-	running = 0;
+	dumpTrace = 1;
 }
 
-void handle_sigusr1(int sig)
+void log_trace_line(const char *line)
 {
-	log(LOG_INFO,"Received SIGUSR1\n");
-	int curLogLevel = setlogmask(0);
-	if (curLogLevel != LOG_UPTO(LOG_DEBUG)) setlogmask(LOG_UPTO (LOG_DEBUG));
-	else setlogmask(LOG_UPTO (LOG_INFO));
+	log(LOG_INFO, "%s", line);
 }
 
 /*
@@ -111,7 +127,15 @@ void write_msg_to_pty(char *msg)
 	}
 	
 	len = strlen(msg);
-	write(pty_master, msg, len);
+	/* while the controller has the tty closed, or gets the older lines, the line waits for it instead of filling the tty queue */
+	if (backlogAttached || !backlogKeep(msg, len))
+	{
+		if (write(pty_master, msg, len) != (ssize_t)len)
+		{
+			metricInc(M_OUTPUT_DROPPED);
+		}
+	}
+	traceStage(TS_WRITE);
 }
 
 
@@ -165,25 +189,233 @@ static void daemonize(void)
     umask(027);  
 }  
 
+#ifndef MY_NO_RF24
+/*
+ * write value to a sysfs attribute
+ */
+static bool write_sysfs(const char *path, const char *value)
+{
+	int fd = open(path, O_WRONLY);
+	bool written;
+
+	if (fd < 0)
+		return false;
+	written = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+	close(fd);
+	return written;
+}
+
+/*
+ * open the sysfs value file of the GPIO wired to the radio IRQ pin, armed
+ * for falling edges, -1 with errno set on failure
+ */
+static int open_irq(unsigned int pin)
+{
+	char path[64], value[8];
+	int fd, tries;
+
+	snprintf(value, sizeof(value), "%u", pin);
+	if (!write_sysfs("/sys/class/gpio/export", value) && errno != EBUSY)
+		return -1;
+	/* udev may still be setting up the files of a newly exported pin */
+	snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/direction", pin);
+	for (tries = 0; !write_sysfs(path, "in") && tries < 10; tries++)
+		usleep(50000);
+	snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/edge", pin);
+	if (!write_sysfs(path, "falling"))
+		return -1;
+	snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/value", pin);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	/* the first read arms the edge detection */
+	if (read(fd, value, sizeof(value)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+/*
+ * add a radio to the gateway from a -r spec: rf24:<ce pin>:<cs pin>[:<irq
+ * gpio>], or a virtual radio (socket:, trace:, replay:, see
+ * MyTransportVirtual.h), either optionally followed by
+ * @<channel>[:<radio address base>]
+ */
+static bool add_radio(PiRadioGroup *group, char *spec)
+{
+	uint8_t channel = RF24_CHANNEL;
+	uint64_t baseId = BASE_RADIO_ID;
+	MyTransport *transport = NULL;
+	int irqFd = -1;
+	char *at = strrchr(spec, '@');
+
+	if (at != NULL)
+	{
+		char *end;
+		*at++ = '\0';
+		channel = strtoul(at, &end, 0);
+		if (*end == ':')
+			baseId = strtoull(end + 1, &end, 0);
+		if (*end != '\0' || channel > 125)
+		{
+			errno = EINVAL;
+			return false;
+		}
+	}
+	if (strncmp(spec, "rf24:", 5) == 0)
+	{
+#ifdef MY_NO_RF24
+		errno = ENOTSUP;
+		return false;
+#else
+		unsigned int ce, cs, irq;
+		int fields = sscanf(spec + 5, "%u:%u:%u", &ce, &cs, &irq);
+		if (fields < 2)
+		{
+			errno = EINVAL;
+			return false;
+		}
+		/* with the IRQ pin wired the radio thread sleeps until the radio needs it */
+		if (fields == 3 && (irqFd = open_irq(irq)) < 0)
+			return false;
+		transport = new MyTransportRF24(ce, cs, BCM2835_SPI_SPEED_8MHZ);
+#endif
+	}
+	else
+	{
+		transport = MyTransportVirtual::open(spec);
+	}
+	if (transport == NULL)
+		return false;
+	if (group->add(transport, channel, baseId, irqFd) < 0)
+	{
+		delete transport;
+		if (irqFd >= 0)
+			close(irqFd);
+		errno = ENOSPC;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * load a firmware image from a -f spec: <type>:<version>:<file>
+ */
+static bool load_firmware(char *spec)
+{
+	unsigned int type, version;
+	int pathStart = 0;
+
+	if (sscanf(spec, "%u:%u:%n", &type, &version, &pathStart) != 2 || pathStart == 0 || type > 0xffff || version > 0xffff)
+	{
+		errno = EINVAL;
+		return false;
+	}
+	return firmwareLoad(type, version, spec + pathStart);
+}
+
 /*
  * Main gateway logic
  */
 int main(int argc, char **argv)
 {
-	struct pollfd fds;
+	struct pollfd fds[1];
 	struct group* devGrp;
 	
-	MyGateway *gw = NULL;
+	PiRadioGroup *group = NULL;
+	char *radioSpecs[GROUP_MAX_RADIOS];
+	int radioCount = 0;
+	char *firmwareSpecs[FIRMWARE_MAX_IMAGES];
+	int firmwareSpecCount = 0;
+	char *filterSpecs[FILTER_MAX_RULES];
+	int filterSpecCount = 0;
+	char *rulesPath = NULL;
+	int rulesLine;
+	char *seriesPath = NULL;
+	const char *snapshotPath = NULL;
+	char *journalPath = NULL;
+	const char *backlogSpec = NULL;
+	JournalRecovery recovery;
 	int status = EXIT_SUCCESS;
 	int ret, c;
+	int metricsPort = 0;
+	const char *captureBase = NULL;
+	const char *streamSink = NULL;
+	const char *surveySpec = NULL;
+	time_t lastExpire = 0;
+	char buff[MAX_SEGMENTED_LENGTH];
+	size_t buffLen = 0;
 	
-	while ((c = getopt (argc, argv, "d")) != -1) 
+	while ((c = getopt (argc, argv, "dm:b:c:r:t:f:s:q:u:e:w:k:j:l:")) != -1) 
 	{
     	switch (c)
       	{
       		case 'd':
         		daemonizeFlag = 1;
         		break;
+      		case 'm':
+        		metricsPort = atoi(optarg);
+        		break;
+      		case 'b':
+        		if (!logBinaryEnable(optarg))
+        		{
+        			fprintf(stderr, "Can't open binary log dump %s: %s\n", optarg, strerror(errno));
+        			exit(EXIT_FAILURE);
+        		}
+        		break;
+      		case 'c':
+        		captureBase = optarg;
+        		break;
+      		case 'r':
+        		if (radioCount == GROUP_MAX_RADIOS)
+        		{
+        			fprintf(stderr, "At most %d radios\n", GROUP_MAX_RADIOS);
+        			exit(EXIT_FAILURE);
+        		}
+        		radioSpecs[radioCount++] = optarg;
+        		break;
+      		case 't':
+        		serial_tty = optarg;
+        		break;
+      		case 'f':
+        		if (firmwareSpecCount == FIRMWARE_MAX_IMAGES)
+        		{
+        			fprintf(stderr, "At most %d firmware images\n", FIRMWARE_MAX_IMAGES);
+        			exit(EXIT_FAILURE);
+        		}
+        		firmwareSpecs[firmwareSpecCount++] = optarg;
+        		break;
+      		case 's':
+        		streamSink = optarg;
+        		break;
+      		case 'q':
+        		surveySpec = optarg;
+        		break;
+      		case 'u':
+        		if (filterSpecCount == FILTER_MAX_RULES)
+        		{
+        			fprintf(stderr, "At most %d filter rules\n", FILTER_MAX_RULES);
+        			exit(EXIT_FAILURE);
+        		}
+        		filterSpecs[filterSpecCount++] = optarg;
+        		break;
+      		case 'e':
+        		rulesPath = optarg;
+        		break;
+      		case 'w':
+        		seriesPath = optarg;
+        		break;
+      		case 'k':
+        		snapshotPath = optarg;
+        		break;
+      		case 'j':
+        		journalPath = optarg;
+        		break;
+      		case 'l':
+        		backlogSpec = optarg;
+        		break;
         }
     }
 	openSyslog();
@@ -194,18 +426,151 @@ int main(int argc, char **argv)
 	signal(SIGINT, handle_sigint);
 	signal(SIGTERM, handle_sigint);
 	signal(SIGUSR1, handle_sigusr1);
+	signal(SIGUSR2, handle_sigusr2);
 	
-	/* create MySensors Gateway object */
-#ifdef __PI_BPLUS
-	gw = new MyGateway(RPI_BPLUS_GPIO_J8_22, RPI_BPLUS_GPIO_J8_24, BCM2835_SPI_SPEED_8MHZ, 1);
-#else
-	gw = new MyGateway(RPI_V2_GPIO_P1_22, BCM2835_SPI_CS0, BCM2835_SPI_SPEED_8MHZ, 1);
-#endif	
-	if (gw == NULL)
+	/* firmware served to the nodes by the gateway, loaded before daemonize() changes the directory */
+	for (c = 0; c < firmwareSpecCount; c++)
+	{
+		if (!load_firmware(firmwareSpecs[c]))
+		{
+			log(LOG_ERR,"Could not load firmware '%s' (%d) %s\n", firmwareSpecs[c], errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	/* values from the nodes held back before they reach the controller */
+	for (c = 0; c < filterSpecCount; c++)
 	{
-		log(LOG_ERR,"Could not create MyGateway! (%d) %s\n", errno, strerror(errno));
+		if (!filterAddRule(filterSpecs[c]))
+		{
+			log(LOG_ERR,"Bad filter rule '%s', expected <node>:<sensor>:<type>:<deadband>[:<interval ms>[:<window ms>[:<refresh s>]]]\n", filterSpecs[c]);
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+	if (filterSpecCount > 0)
+		log(LOG_INFO,"Filtering values with %d rules\n", filterSpecCount);
+
+	/* actions the gateway takes itself, loaded before daemonize() changes the directory */
+	if (rulesPath != NULL)
+	{
+		if (!rulesLoad(rulesPath, &rulesLine))
+		{
+			if (rulesLine > 0)
+				log(LOG_ERR,"Bad rule in '%s' line %d, expected <node>;<sensor>;<type> [<op> <value>] -> <node>;<sensor>;<command>;<ack>;<type>;<payload>\n", rulesPath, rulesLine);
+			else
+				log(LOG_ERR,"Could not load rules '%s' (%d) %s\n", rulesPath, errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+		log(LOG_INFO,"Loaded %d rules from %s\n", rulesCount(), rulesPath);
+	}
+
+	/* images and sounds from the nodes go to the sink, opened before daemonize() changes the directory */
+	if (streamSink != NULL)
+	{
+		if (!streamOpen(streamSink))
+		{
+			log(LOG_ERR,"Could not open stream sink '%s' (%d) %s\n", streamSink, errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+		log(LOG_INFO,"Reassembling images and sounds into %s\n", streamSink);
+	}
+
+	/* readings kept on the gateway, the directory resolved before daemonize() changes it */
+	if (seriesPath != NULL)
+	{
+		char *path = realpath(seriesPath, NULL);
+		if (path == NULL)
+		{
+			log(LOG_ERR,"Could not use the directory '%s' for readings (%d) %s\n", seriesPath, errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+		seriesPath = path;
+	}
+
+	/* EEPROM journal, made absolute before daemonize() changes the directory, opened after it */
+	if (journalPath != NULL && journalPath[0] != '/')
+	{
+		char *cwd = getcwd(NULL, 0), *path = NULL;
+		if (cwd == NULL || asprintf(&path, "%s/%s", cwd, journalPath) < 0)
+		{
+			log(LOG_ERR,"Could not use the EEPROM journal '%s' (%d) %s\n", journalPath, errno, strerror(errno));
+			free(cwd);
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+		free(cwd);
+		journalPath = path;
+	}
+
+	/* state of the last run, taken back before the radios start */
+	if (snapshotPath != NULL)
+	{
+		if (snapshotOpen(snapshotPath))
+			log(LOG_INFO,"Warm start from %s\n", snapshotPath);
+		else if (errno == ENOENT)
+			log(LOG_INFO,"No snapshot in %s yet, cold start\n", snapshotPath);
+		else if (snapshotEnabled)
+			log(LOG_WARNING,"Could not use the snapshot in %s (%d) %s, cold start\n", snapshotPath, errno, strerror(errno));
+		else
+		{
+			log(LOG_ERR,"Could not keep the state in %s (%d) %s\n", snapshotPath, errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	/* lines kept while the controller has the tty closed, from the startup message on */
+	{
+		unsigned long size = BACKLOG_SIZE, age = BACKLOG_AGE;
+		if (backlogSpec != NULL)
+		{
+			char *end;
+			size = strtoul(backlogSpec, &end, 10);
+			if (*end == ':')
+				age = strtoul(end + 1, &end, 10);
+			if (*end != '\0')
+			{
+				log(LOG_ERR,"Bad backlog '%s', expected <bytes>[:<max age s>]\n", backlogSpec);
+				status = EXIT_FAILURE;
+				goto cleanup;
+			}
+		}
+		if (!backlogOpen(size, age))
+		{
+			log(LOG_ERR,"Could not keep %lu bytes of lines for the controller (%d) %s\n", size, errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	/* create a MySensors Gateway for every radio */
+	group = new PiRadioGroup(&write_msg_to_pty);
+	for (c = 0; c < radioCount; c++)
+	{
+		log(LOG_INFO,"Using radio '%s'\n", radioSpecs[c]);
+		if (!add_radio(group, radioSpecs[c]))
+		{
+			log(LOG_ERR,"Could not open radio '%s' (%d) %s\n", radioSpecs[c], errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+	if (radioCount == 0)
+	{
+#if defined(MY_NO_RF24)
+		log(LOG_ERR,"Built without RF24 support, use -r to select a virtual radio\n");
 		status = EXIT_FAILURE;
 		goto cleanup;
+#elif defined(__PI_BPLUS)
+		group->add(new MyTransportRF24(RPI_BPLUS_GPIO_J8_22, RPI_BPLUS_GPIO_J8_24, BCM2835_SPI_SPEED_8MHZ), RF24_CHANNEL, BASE_RADIO_ID);
+#else
+		group->add(new MyTransportRF24(RPI_V2_GPIO_P1_22, BCM2835_SPI_CS0, BCM2835_SPI_SPEED_8MHZ), RF24_CHANNEL, BASE_RADIO_ID);
+#endif
 	}
 
 	/* create PTY - Pseudo TTY device */
@@ -254,49 +619,159 @@ int main(int argc, char **argv)
 	close(pty_slave);
 	configure_master_fd(pty_master);
 
-	fds.events = POLLRDNORM;
-	fds.fd = pty_master;
+	fds[0].events = POLLRDNORM;
+	fds[0].fd = pty_master;
 	if (daemonizeFlag) daemonize();
-	/* we are ready, initialize the Gateway */
-	gw->begin(RF24_PA_LEVEL_GW, RF24_CHANNEL, RF24_DATARATE, &write_msg_to_pty);
+	if (!logStartAsync())
+		log(LOG_ERR,"Could not start the log writer thread, logging synchronously\n");
+	if (metricsPort > 0)
+	{
+		if (metricsServerStart(metricsPort))
+			log(LOG_INFO,"Serving metrics on http://127.0.0.1:%d/metrics\n", metricsPort);
+		else
+			log(LOG_ERR,"Could not start metrics server on port %d (%d) %s\n", metricsPort, errno, strerror(errno));
+	}
+	if (captureBase != NULL)
+	{
+		if (captureOpen(captureBase))
+			log(LOG_INFO,"Capturing radio frames to %s.*.pcap\n", captureBase);
+		else
+			log(LOG_ERR,"Could not open capture file %s (%d) %s\n", captureBase, errno, strerror(errno));
+	}
+	if (seriesPath != NULL)
+	{
+		if (seriesOpen(seriesPath))
+			log(LOG_INFO,"Keeping readings in %s, queries on %s/%s\n", seriesPath, seriesPath, SERIES_SOCKET);
+		else
+			log(LOG_ERR,"Could not keep readings in %s (%d) %s\n", seriesPath, errno, strerror(errno));
+	}
+	/* the EEPROM of the radios as of their last write, taken back before the radios start */
+	if (journalPath != NULL)
+	{
+		if (!journalOpen(journalPath, &recovery))
+		{
+			log(LOG_ERR,"Could not keep the EEPROM in %s (%d) %s\n", journalPath, errno, strerror(errno));
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+		log(LOG_INFO,"Keeping the EEPROM in %s, %u images and %u journal records taken back\n", journalPath, recovery.images, recovery.records);
+		if (recovery.dropped > 0)
+			log(LOG_WARNING,"Dropped %lu bytes of a torn journal record from %s.journal\n", (unsigned long)recovery.dropped, journalPath);
+	}
+	/* the snapshot writer, started after daemonize() like the other threads */
+	if (snapshotEnabled && !snapshotStart())
+		log(LOG_ERR,"Could not start the snapshot thread (%d) %s, the snapshot is only written at the end\n", errno, strerror(errno));
+	if (surveySpec != NULL)
+	{
+		char *end;
+		unsigned long dwell = strtoul(surveySpec, &end, 10), first = SURVEY_FIRST, last = SURVEY_LAST;
+		if (*end == ':')
+		{
+			first = strtoul(end + 1, &end, 10);
+			last = *end == '-' ? strtoul(end + 1, &end, 10) : 0;
+		}
+		if (*end != '\0' || dwell == 0 || first > last || last > 125)
+		{
+			log(LOG_ERR,"Bad channel survey '%s', expected <dwell ms>[:<first>-<last>]\n", surveySpec);
+			status = EXIT_FAILURE;
+			goto cleanup;
+		}
+		group->setSurvey(dwell, first, last);
+		log(LOG_INFO,"Surveying the channels, moving to the quietest of %lu-%lu\n", first, last);
+	}
+	group->setKeeping((snapshotEnabled ? KEEP_SNAPSHOT : 0) | (journalEnabled ? KEEP_JOURNAL : 0) | (seriesEnabled ? KEEP_SERIES : 0));
+	/* we are ready, start the radio threads, they initialize the Gateways */
+	if (!group->start(RF24_PA_LEVEL_GW, RF24_DATARATE))
+	{
+		log(LOG_ERR,"Could not start the radio threads (%d) %s\n", errno, strerror(errno));
+		status = EXIT_FAILURE;
+		goto cleanup;
+	}
 
-	/* Do the work until interrupted */
+	/* Do the work until interrupted, radio msgs are processed by the radio threads */
 	while(running)
 	{
-		/* process radio msgs */
-		gw->processRadioMessage();
+		if (dumpTrace)
+		{
+			dumpTrace = 0;
+			traceDump(log_trace_line);
+			rulesDump(log_trace_line);
+		}
+		if (dumpLog)
+		{
+			dumpLog = 0;
+			log(LOG_INFO,"Dumped %d binary log records\n", logDumpRing());
+		}
+		if (time(NULL) != lastExpire)
+		{
+			lastExpire = time(NULL);
+			streamExpire();
+		}
 		
 		/* process serial port msgs */
-		ret = poll(&fds, 1, 500);
-		if (ret == -1)
+		/* while the controller is away only look whether it is back, the sleep below paces the loop */
+		fds[0].events = backlogReplaying() ? POLLRDNORM | POLLOUT : POLLRDNORM;
+		ret = poll(fds, 1, backlogAttached || backlogReplaying() ? 500 : 0);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (ret == -1)
 		{
 			log(LOG_ERR,"poll() error (%d) %s\n", errno, strerror(errno));
 			sleep(10);
 		}
-		else if (ret == 0)
+		else if ((fds[0].revents & (POLLHUP | POLLRDNORM)) == POLLHUP)
 		{
-			/* timeout */
-			continue;
+			/* the controller closed the tty, the radios go on and its lines are kept until it is back */
+			if (backlogAttached || backlogReplaying())
+			{
+				backlogDetach(pty_master);
+				log(LOG_INFO,"Controller closed %s, keeping its messages\n", serial_tty);
+			}
+			usleep(BACKLOG_CHECK * 1000);
 		}
 		else
 		{
-			if (fds.revents & POLLRDNORM)
+			if (!backlogAttached && !backlogReplaying() && !(fds[0].revents & POLLHUP))
+			{
+				c = backlogAttach(pty_master);
+				log(LOG_INFO,"Controller opened %s, writing %d kept messages\n", serial_tty, c);
+			}
+			if (backlogReplaying() && (fds[0].revents & POLLOUT))
+			{
+				backlogReplay(pty_master);
+			}
+			if (fds[0].revents & POLLRDNORM)
 			{
-				char buff[256];
 				ssize_t size;
+				char *line, *end;
 
-				fds.revents = 0;
-				size = read(pty_master, buff, sizeof(buff));
+				fds[0].revents = 0;
+				size = read(pty_master, buff + buffLen, sizeof(buff) - 1 - buffLen);
 				if (size < 0)
 				{
 					log(LOG_ERR,"read error (%d) %s\n", errno, strerror(errno));
 					continue;
 				}
-				buff[size] = '\0';
-				
-				gw->parseAndSend(buff);
-			} else {
-				sleep(60);
+				buffLen += size;
+				buff[buffLen] = '\0';
+
+				/* a read may hold several commands, and the last one may be incomplete */
+				line = buff;
+				while ((end = strchr(line, '\n')) != NULL)
+				{
+					*end = '\0';
+					group->parseAndSend(line);
+					line = end + 1;
+				}
+				buffLen -= line - buff;
+				if (buffLen == sizeof(buff) - 1)
+				{
+					log(LOG_WARNING,"Command too long, discarded\n");
+					buffLen = 0;
+				}
+				memmove(buff, line, buffLen);
 			}
 		}
 	}
@@ -304,8 +779,25 @@ int main(int argc, char **argv)
 
 cleanup:
 	log(LOG_INFO,"Exiting...\n");
-	if (gw)
-		delete(gw);
+	if (logDropped() > 0)
+		log(LOG_WARNING,"%lu log messages were dropped\n", logDropped());
+	logFlush();
+	captureClose();
+	metricsServerStop();
+	if (group)
+		group->stop();
+	/* the state for the next start, while the EEPROM images of the radios are still there */
+	if (!snapshotClose())
+		log(LOG_ERR,"Could not write the snapshot to %s (%d) %s\n", snapshotPath, errno, strerror(errno));
+	if (!journalClose())
+		log(LOG_ERR,"Could not compact the EEPROM journal into %s (%d) %s\n", journalPath, errno, strerror(errno));
+	if (group)
+		delete(group);
+	backlogClose();
+	seriesClose();
+	firmwareUnloadAll();
+	rulesUnload();
+	streamClose();
 	(void) unlink(serial_tty);
 	closeSyslog();
 	return status;
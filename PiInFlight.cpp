@@ -0,0 +1,127 @@
+/*
+ * PiInFlight.cpp - Controller messages waiting for the ack of their node
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "PiInFlight.h"
+#include "PiMailbox.h"
+#include "MyMetrics.h"
+
+PiInFlight::PiInFlight()
+{
+	for (int i = 0; i < INFLIGHT_SLOTS; i++) {
+		slots[i].active = false;
+	}
+	count = 0;
+	random = time(NULL);
+}
+
+InFlight *PiInFlight::find(uint8_t destination, uint8_t sensor, uint8_t type)
+{
+	for (int i = 0; i < INFLIGHT_SLOTS && count > 0; i++) {
+		InFlight *entry = &slots[i];
+		if (entry->active && entry->message.destination == destination &&
+				entry->message.sensor == sensor && entry->message.type == type) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+InFlight *PiInFlight::add(const MyMessage &message, unsigned long now)
+{
+	for (int i = 0; i < INFLIGHT_SLOTS; i++) {
+		InFlight *entry = &slots[i];
+		if (!entry->active) {
+			entry->active = true;
+			entry->held = false;
+			entry->reached = false;
+			entry->sends = 0;
+			entry->first = now;
+			entry->next = now;
+			entry->deadline = now + INFLIGHT_DEADLINE;
+			entry->message = message;
+			count++;
+			metricAdd(M_INFLIGHT, 1);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void PiInFlight::sent(InFlight *entry, bool reached, unsigned long now)
+{
+	unsigned long backoff = INFLIGHT_RETRY_MIN;
+
+	if (reached && !entry->reached) {
+		entry->reached = true;
+		entry->deadline = now + INFLIGHT_DEADLINE;
+	}
+	if (entry->held) {
+		entry->held = false;
+		entry->deadline = now + INFLIGHT_DEADLINE;
+	}
+	entry->sends++;
+	for (int i = 1; i < entry->sends && backoff < INFLIGHT_RETRY_MAX; i++) {
+		backoff *= 2;
+	}
+	if (backoff > INFLIGHT_RETRY_MAX) {
+		backoff = INFLIGHT_RETRY_MAX;
+	}
+	entry->next = now + backoff - backoff / 4 + rand_r(&random) % (backoff / 2 + 1);
+}
+
+void PiInFlight::held(InFlight *entry, unsigned long now)
+{
+	entry->held = true;
+	entry->deadline = now + MAILBOX_TTL * 1000UL + INFLIGHT_DEADLINE;
+}
+
+InFlight *PiInFlight::due(unsigned long now)
+{
+	for (int i = 0; i < INFLIGHT_SLOTS && count > 0; i++) {
+		InFlight *entry = &slots[i];
+		if (!entry->active) {
+			continue;
+		}
+		// Differences, so the comparisons survive millis() wrapping
+		if ((long)(now - entry->deadline) >= 0 || (!entry->held && (long)(now - entry->next) >= 0)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+unsigned long PiInFlight::untilDue(unsigned long now, unsigned long max)
+{
+	for (int i = 0; i < INFLIGHT_SLOTS && count > 0; i++) {
+		InFlight *entry = &slots[i];
+		if (!entry->active) {
+			continue;
+		}
+		long left = (long)(entry->deadline - now);
+		if (!entry->held && (long)(entry->next - now) < left) {
+			left = (long)(entry->next - now);
+		}
+		if (left <= 0) {
+			return 0;
+		}
+		if ((unsigned long)left < max) {
+			max = left;
+		}
+	}
+	return max;
+}
+
+void PiInFlight::remove(InFlight *entry)
+{
+	entry->active = false;
+	count--;
+	metricSub(M_INFLIGHT, 1);
+}
@@ -0,0 +1,109 @@
+/*
+ * PiInFlight.h - Controller messages waiting for the ack of their node
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * When the controller asks for an ack, the gateway keeps the message here
+ * per (destination, sensor, type) until the ack comes back, and sends it
+ * again after a backoff that doubles from INFLIGHT_RETRY_MIN up to
+ * INFLIGHT_RETRY_MAX ms, +-25% so retries of several messages don't stay
+ * in step. It gives up INFLIGHT_DEADLINE ms after the first send that
+ * reached the node without an ack coming back. If none reached it within
+ * INFLIGHT_DEADLINE ms of the controller's send, the node is most likely
+ * asleep and the message waits in the mailbox (PiMailbox.h) without
+ * retries, its deadline starting again when it is delivered. A message for a node that already
+ * has mail goes there right away.
+ *
+ * The controller gets one I_DELIVERY line per message with the result:
+ *
+ *   <node>;<sensor>;3;0;200;<type>,<ok|timeout|replaced|busy>,<sends>,<ms>
+ *
+ * "replaced" when a newer message with the same key came first, which
+ * also takes its place in the mailbox, "busy"
+ * when the table was full and the message was sent without tracking. The
+ * returning ack is still passed on as before.
+ */
+
+#ifndef __PiInFlight_H__
+#define __PiInFlight_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyMessage.h"
+
+#define INFLIGHT_SLOTS      32
+#define INFLIGHT_RETRY_MIN  250       // ms before the first retry
+#define INFLIGHT_RETRY_MAX  8000
+#define INFLIGHT_DEADLINE   30000     // ms from the (delivered) send until giving up
+
+/* Results reported to the controller, in the order of their metrics */
+typedef enum {
+	DELIVERY_OK,
+	DELIVERY_TIMEOUT,
+	DELIVERY_REPLACED,
+	DELIVERY_BUSY
+} delivery_result_e;
+
+struct InFlight {
+	bool active;
+	bool held;              // in the mailbox, not sent yet
+	bool reached;           // a send got the auto ack of the first hop
+	uint8_t sends;
+	unsigned long first;    // millis() the controller sent it
+	unsigned long next;     // millis() of the next retry
+	unsigned long deadline;
+	MyMessage message;
+};
+
+class PiInFlight
+{
+  public:
+	PiInFlight();
+
+	/**
+	 * The message waiting for an ack from destination for sensor and type,
+	 * NULL if none.
+	 */
+	InFlight *find(uint8_t destination, uint8_t sensor, uint8_t type);
+
+	/**
+	 * Track message, not sent yet. Returns NULL if all slots are in use.
+	 */
+	InFlight *add(const MyMessage &message, unsigned long now);
+
+	/**
+	 * A message was sent, reached if the first hop took it: the next retry
+	 * is due after the backoff, and the deadline runs from the first send
+	 * that reached the node.
+	 */
+	void sent(InFlight *entry, bool reached, unsigned long now);
+
+	/**
+	 * A message went to the mailbox, it waits for its node without retries.
+	 */
+	void held(InFlight *entry, unsigned long now);
+
+	/**
+	 * A message whose retry or deadline is due, NULL if none.
+	 */
+	InFlight *due(unsigned long now);
+
+	/**
+	 * ms until a retry or deadline is due, at most max.
+	 */
+	unsigned long untilDue(unsigned long now, unsigned long max);
+
+	void remove(InFlight *entry);
+
+	unsigned int size() { return count; }
+
+  private:
+	InFlight slots[INFLIGHT_SLOTS];
+	unsigned int count;
+	unsigned int random;
+};
+
+#endif /* __PiInFlight_H__ */
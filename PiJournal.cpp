@@ -0,0 +1,518 @@
+/*
+ * PiJournal.cpp - EEPROM images of the radios kept on disk through a journal
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "PiJournal.h"
+#include "PiFirmware.h"
+#include "MyMetrics.h"
+
+struct JournalImageState {
+	uint64_t id;
+	uint8_t *eeprom;            // image of the running radio, NULL until attached
+	uint8_t saved[EEPROM_SIZE]; // image taken back from the files
+};
+
+volatile bool journalEnabled = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;   // records to commit, or stop
+static pthread_cond_t space = PTHREAD_COND_INITIALIZER;  // the buffer was taken for a commit
+static pthread_t committer;
+static bool running = false;
+static char *path = NULL;
+static char *tmpPath = NULL;
+static char *journalPath = NULL;
+static JournalImageState images[JOURNAL_MAX_IMAGES];
+static unsigned int imageCount = 0;
+
+// Records collected while the other buffer is committed
+static uint8_t buffers[2][JOURNAL_BUFFER];
+static unsigned int active = 0;
+static size_t used = 0;
+static uint64_t firstAt;        // ms, the first record of the buffer
+
+// The files, only touched by the committer once it runs
+static int fd = -1;
+static uint32_t generation = 0;
+static size_t journalSize = 0;
+static bool damaged = false;    // a commit failed, compact before the journal is trusted again
+
+static uint64_t now()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static JournalImageState *findImage(uint64_t id)
+{
+	for (unsigned int i = 0; i < imageCount; i++) {
+		if (images[i].id == id) {
+			return &images[i];
+		}
+	}
+	return NULL;
+}
+
+static bool writeAll(int file, const uint8_t *data, size_t size)
+{
+	ssize_t written;
+
+	for (size_t done = 0; done < size; done += written) {
+		if ((written = write(file, data + done, size - done)) <= 0) {
+			if (written == 0) {
+				errno = EIO;
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Append a record to the buffer, with the lock held. Waits while the
+ * buffer is full.
+ */
+static void append(uint64_t id, size_t address, const uint8_t *data, size_t n)
+{
+	JournalRecord record;
+	size_t size = sizeof(record) + n;
+
+	while (used + size > JOURNAL_BUFFER && running) {
+		pthread_cond_wait(&space, &lock);
+	}
+	if (used + size > JOURNAL_BUFFER) {
+		// No committer, the next compaction has it
+		damaged = true;
+		return;
+	}
+	uint8_t *p = buffers[active] + used;
+	memset(&record, 0, sizeof(record));
+	record.id = id;
+	record.address = address;
+	record.length = n;
+	memcpy(p, &record, sizeof(record));
+	memcpy(p + sizeof(record), data, n);
+	record.crc = firmwareCrc16(p, size);
+	memcpy(p, &record, sizeof(record));
+	if (used == 0) {
+		firstAt = now();
+	}
+	used += size;
+	metricInc(M_JOURNAL_RECORDS);
+	if (used == size || used >= JOURNAL_BUFFER / 2) {
+		pthread_cond_signal(&work);
+	}
+}
+
+/*
+ * Write to the temporary file, then rename it over the image file, so a
+ * crash leaves either complete
+ */
+static bool replace(const uint8_t *image, size_t size)
+{
+	char *slash = strrchr(path, '/');
+	int file, error;
+
+	if ((file = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0) {
+		return false;
+	}
+	if (!writeAll(file, image, size) || fsync(file) != 0) {
+		error = errno;
+		close(file);
+		unlink(tmpPath);
+		errno = error;
+		return false;
+	}
+	if (close(file) != 0 || rename(tmpPath, path) != 0) {
+		error = errno;
+		unlink(tmpPath);
+		errno = error;
+		return false;
+	}
+	*slash = '\0';
+	if ((file = open(slash == path ? "/" : path, O_RDONLY | O_DIRECTORY)) >= 0) {
+		fsync(file);
+		close(file);
+	}
+	*slash = '/';
+	return true;
+}
+
+/*
+ * Write the images as they are now into the image file of the next
+ * generation and start the journal over. The images are copied while the
+ * radios write: a record collected meanwhile is replayed on top, which
+ * writes what the copy already has.
+ */
+static bool compact()
+{
+	JournalFileHeader header;
+
+	pthread_mutex_lock(&lock);
+	size_t size = sizeof(header) + imageCount * sizeof(JournalImage);
+	uint8_t *image = (uint8_t *)malloc(size);
+	if (image == NULL) {
+		pthread_mutex_unlock(&lock);
+		errno = ENOMEM;
+		return false;
+	}
+	memset(&header, 0, sizeof(header));
+	header.magic = JOURNAL_MAGIC;
+	header.version = JOURNAL_VERSION;
+	header.count = imageCount;
+	header.generation = generation + 1;
+	uint8_t *p = image + sizeof(header);
+	for (unsigned int i = 0; i < imageCount; i++, p += sizeof(JournalImage)) {
+		JournalImage entry;
+		entry.id = images[i].id;
+		memcpy(entry.eeprom, images[i].eeprom != NULL ? images[i].eeprom : images[i].saved, EEPROM_SIZE);
+		memcpy(p, &entry, sizeof(entry));
+	}
+	pthread_mutex_unlock(&lock);
+	header.crc = firmwareCrc16(image + sizeof(header), size - sizeof(header));
+	memcpy(image, &header, sizeof(header));
+	bool ok = replace(image, size);
+	free(image);
+	if (!ok) {
+		return false;
+	}
+	generation++;
+
+	// Until this is done the old journal is ignored, it is of the last generation
+	memset(&header, 0, sizeof(header));
+	header.magic = JOURNAL_MAGIC;
+	header.version = JOURNAL_VERSION;
+	header.generation = generation;
+	if (ftruncate(fd, 0) != 0 || !writeAll(fd, (const uint8_t *)&header, sizeof(header)) || fdatasync(fd) != 0) {
+		return false;
+	}
+	journalSize = sizeof(header);
+	metricInc(M_JOURNAL_COMPACTIONS);
+	metricSetGlobal(M_JOURNAL_BYTES, journalSize);
+	return true;
+}
+
+/*
+ * One group commit. A failed write may have left a torn record that hides
+ * the ones after it, the images in memory have them all: compact.
+ */
+static void commit(const uint8_t *batch, size_t size)
+{
+	if (!damaged) {
+		if (writeAll(fd, batch, size) && fdatasync(fd) == 0) {
+			journalSize += size;
+			metricInc(M_JOURNAL_COMMITS);
+			metricSetGlobal(M_JOURNAL_BYTES, journalSize);
+		} else {
+			metricInc(M_JOURNAL_FAILED);
+			damaged = true;
+		}
+	}
+	if (damaged || journalSize >= JOURNAL_COMPACT) {
+		damaged = !compact();
+	}
+}
+
+static void *commitLoop(void *)
+{
+	pthread_mutex_lock(&lock);
+	while (running || used > 0) {
+		if (used == 0) {
+			pthread_cond_wait(&work, &lock);
+			continue;
+		}
+		uint64_t due = firstAt + JOURNAL_COMMIT;
+		if (running && used < JOURNAL_BUFFER / 2 && now() < due) {
+			timespec until;
+			until.tv_sec = due / 1000;
+			until.tv_nsec = due % 1000 * 1000000;
+			pthread_cond_timedwait(&work, &lock, &until);
+			continue;
+		}
+		const uint8_t *batch = buffers[active];
+		size_t size = used;
+		active ^= 1;
+		used = 0;
+		pthread_cond_broadcast(&space);
+		pthread_mutex_unlock(&lock);
+		commit(batch, size);
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Read a whole file, NULL with errno set if it can't be
+ */
+static uint8_t *readFile(int file, size_t *size)
+{
+	struct stat st;
+	uint8_t *data;
+	ssize_t got;
+
+	if (fstat(file, &st) != 0) {
+		return NULL;
+	}
+	if ((data = (uint8_t *)malloc(st.st_size + 1)) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (*size = 0; *size < (size_t)st.st_size; *size += got) {
+		if ((got = read(file, data + *size, st.st_size - *size)) <= 0) {
+			if (got == 0) {
+				break;
+			}
+			free(data);
+			return NULL;
+		}
+	}
+	return data;
+}
+
+/*
+ * The images of the image file, false with errno EINVAL if it is damaged
+ */
+static bool loadImages(JournalRecovery *recovery)
+{
+	JournalFileHeader header;
+	size_t size;
+	uint8_t *data;
+	int file;
+
+	if ((file = open(path, O_RDONLY)) < 0) {
+		return false;
+	}
+	data = readFile(file, &size);
+	close(file);
+	if (data == NULL) {
+		return false;
+	}
+	memcpy(&header, data, size < sizeof(header) ? size : sizeof(header));
+	if (size < sizeof(header) || header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION ||
+			header.count > JOURNAL_MAX_IMAGES || size != sizeof(header) + header.count * sizeof(JournalImage) ||
+			firmwareCrc16(data + sizeof(header), size - sizeof(header)) != header.crc) {
+		free(data);
+		errno = EINVAL;
+		return false;
+	}
+	const uint8_t *p = data + sizeof(header);
+	for (unsigned int i = 0; i < header.count; i++, p += sizeof(JournalImage)) {
+		JournalImage entry;
+		memcpy(&entry, p, sizeof(entry));
+		images[i].id = entry.id;
+		images[i].eeprom = NULL;
+		memcpy(images[i].saved, entry.eeprom, EEPROM_SIZE);
+	}
+	imageCount = header.count;
+	generation = header.generation;
+	recovery->images = imageCount;
+	free(data);
+	return true;
+}
+
+/*
+ * Apply the records of the journal of this generation, up to the first
+ * one that is incomplete or damaged
+ */
+static void replay(const uint8_t *data, size_t size, JournalRecovery *recovery)
+{
+	JournalFileHeader header;
+	JournalRecord record;
+	uint8_t check[sizeof(JournalRecord) + EEPROM_SIZE];
+	size_t at = sizeof(header);
+
+	memcpy(&header, data, size < sizeof(header) ? size : sizeof(header));
+	if (size < sizeof(header) || header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION ||
+			header.generation != generation) {
+		return;
+	}
+	while (at + sizeof(record) <= size) {
+		memcpy(&record, data + at, sizeof(record));
+		size_t length = sizeof(record) + record.length;
+		if (record.length == 0 || record.address + record.length > EEPROM_SIZE || at + length > size) {
+			break;
+		}
+		uint16_t crc = record.crc;
+		record.crc = 0;
+		memcpy(check, &record, sizeof(record));
+		memcpy(check + sizeof(record), data + at + sizeof(record), record.length);
+		if (firmwareCrc16(check, length) != crc) {
+			break;
+		}
+
+		JournalImageState *image = findImage(record.id);
+		if (image == NULL && imageCount < JOURNAL_MAX_IMAGES) {
+			image = &images[imageCount++];
+			image->id = record.id;
+			image->eeprom = NULL;
+			memset(image->saved, 0xff, EEPROM_SIZE);
+		}
+		if (image != NULL) {
+			memcpy(image->saved + record.address, data + at + sizeof(record), record.length);
+			recovery->records++;
+		}
+		at += length;
+	}
+	recovery->dropped = size - at;
+}
+
+bool journalOpen(const char *file, JournalRecovery *recovery)
+{
+	char cwd[PATH_MAX];
+	size_t size;
+	uint8_t *data;
+	int error;
+
+	memset(recovery, 0, sizeof(*recovery));
+	if (journalEnabled) {
+		errno = EBUSY;
+		return false;
+	}
+	// Written after daemonize() changed the directory
+	if (file[0] == '/') {
+		path = strdup(file);
+	} else if (getcwd(cwd, sizeof(cwd)) != NULL && (path = (char *)malloc(strlen(cwd) + strlen(file) + 2)) != NULL) {
+		sprintf(path, "%s/%s", cwd, file);
+	}
+	if (path == NULL || (tmpPath = (char *)malloc(strlen(path) + 5)) == NULL ||
+			(journalPath = (char *)malloc(strlen(path) + 9)) == NULL) {
+		error = ENOMEM;
+		goto failed;
+	}
+	sprintf(tmpPath, "%s.tmp", path);
+	sprintf(journalPath, "%s.journal", path);
+
+	imageCount = 0;
+	generation = 0;
+	if (!loadImages(recovery) && errno != ENOENT) {
+		error = errno;
+		goto failed;
+	}
+	if ((fd = open(journalPath, O_RDWR | O_CREAT | O_APPEND, 0640)) < 0 || (data = readFile(fd, &size)) == NULL) {
+		error = errno;
+		goto failed;
+	}
+	replay(data, size, recovery);
+	free(data);
+
+	// The recovered images become the new generation, the journal starts empty
+	if (!compact()) {
+		error = errno;
+		goto failed;
+	}
+	damaged = false;
+	active = 0;
+	used = 0;
+	running = true;
+	if (pthread_create(&committer, NULL, commitLoop, NULL) != 0) {
+		running = false;
+		error = EAGAIN;
+		goto failed;
+	}
+	journalEnabled = true;
+	return true;
+
+failed:
+	if (fd >= 0) {
+		close(fd);
+	}
+	fd = -1;
+	imageCount = 0;
+	free(path);
+	free(tmpPath);
+	free(journalPath);
+	path = tmpPath = journalPath = NULL;
+	errno = error;
+	return false;
+}
+
+bool journalClose()
+{
+	if (!journalEnabled) {
+		return true;
+	}
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+	pthread_join(committer, NULL);
+
+	bool ok = compact();
+	int error = errno;
+	pthread_mutex_lock(&lock);
+	journalEnabled = false;
+	imageCount = 0;
+	pthread_mutex_unlock(&lock);
+	close(fd);
+	fd = -1;
+	free(path);
+	free(tmpPath);
+	free(journalPath);
+	path = tmpPath = journalPath = NULL;
+	errno = error;
+	return ok;
+}
+
+bool journalAttach(uint64_t id, uint8_t *eeprom)
+{
+	bool restored = false;
+
+	if (!journalEnabled) {
+		return false;
+	}
+	pthread_mutex_lock(&lock);
+	JournalImageState *image = findImage(id);
+	if (image != NULL && image->eeprom == NULL) {
+		memcpy(eeprom, image->saved, EEPROM_SIZE);
+		restored = true;
+	} else if (image == NULL && imageCount < JOURNAL_MAX_IMAGES) {
+		image = &images[imageCount++];
+		image->id = id;
+	}
+	if (image != NULL) {
+		image->eeprom = eeprom;
+		if (!restored) {
+			// Replayed first, the writes after it go on top
+			append(id, 0, eeprom, EEPROM_SIZE);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return restored;
+}
+
+bool journalWrite(uint8_t *eeprom, size_t address, const void *src, size_t n)
+{
+	JournalImageState *image = NULL;
+
+	pthread_mutex_lock(&lock);
+	for (unsigned int i = 0; i < imageCount && image == NULL; i++) {
+		if (images[i].eeprom == eeprom) {
+			image = &images[i];
+		}
+	}
+	if (image != NULL && memcmp(eeprom + address, src, n) != 0) {
+		// Under the lock, a compaction copies the image with all records collected so far
+		memcpy(eeprom + address, src, n);
+		append(image->id, address, eeprom + address, n);
+	}
+	pthread_mutex_unlock(&lock);
+	return image != NULL;
+}
@@ -0,0 +1,110 @@
+/*
+ * PiJournal.h - EEPROM images of the radios kept on disk through a journal
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * The EEPROM of PiEEPROM.h lives in memory: node id, parent, distance and
+ * the routing table are gone when the gateway stops, and a snapshot
+ * (PiSnapshot.h) only has them as they were up to SNAPSHOT_INTERVAL ago.
+ * With a journal every eeprom_write_*() to an attached image is also
+ * appended to <file>.journal as a JournalRecord with a CRC-16 over record
+ * and data, and recovered from there after a crash:
+ *
+ * - Records are collected in memory and written by one thread in a group
+ *   commit, one write and one fdatasync, JOURNAL_COMMIT ms after the first
+ *   of them or as soon as half of the buffer is used, so a burst of route
+ *   changes costs the SD card one sync. A writer only waits if the buffer
+ *   is full.
+ * - Once the journal has JOURNAL_COMPACT bytes, or a commit failed, the
+ *   images are written to <file>.tmp and renamed over <file>, and the
+ *   journal starts over. <file> is a JournalFileHeader and count
+ *   JournalImage, <file>.journal a JournalFileHeader and the records; a
+ *   journal only applies to the images of the same generation, so a crash
+ *   between the rename and the new journal never replays an old one.
+ * - journalOpen() loads <file>, replays the records of the journal up to
+ *   the first one that is incomplete or damaged (a write torn by the
+ *   crash) and compacts.
+ *
+ * One eeprom_write_*() call is one record: an update of several bytes that
+ * belong together, like parent and distance, is one eeprom_write_block().
+ * MyGateway::begin() attaches the image of its radio after a snapshot
+ * restored it, the journal is newer.
+ */
+
+#ifndef __PiJournal_H__
+#define __PiJournal_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "PiEEPROM.h"
+
+#define JOURNAL_COMMIT      200        // ms from a write to its commit
+#define JOURNAL_BUFFER      (64 * 1024) // bytes of records collected for a commit
+#define JOURNAL_COMPACT     (256 * 1024) // journal bytes that start a compaction
+#define JOURNAL_MAX_IMAGES  8
+#define JOURNAL_MAGIC       0x4a45534d // "MSEJ"
+#define JOURNAL_VERSION     1
+
+struct JournalFileHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;             // images in the image file, 0 in the journal
+	uint32_t generation;        // of the images, the journal has the same
+	uint16_t crc;               // CRC-16 (firmwareCrc16) of the images, 0 in the journal
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct JournalImage {
+	uint64_t id;                // address base of the radio
+	uint8_t eeprom[EEPROM_SIZE];
+} __attribute__((packed));
+
+struct JournalRecord {
+	uint64_t id;
+	uint16_t address;
+	uint16_t length;            // bytes of data following the record
+	uint16_t crc;               // CRC-16 of the record with crc 0 and the data
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct JournalRecovery {
+	unsigned int images;        // images taken from <file>
+	unsigned int records;       // records replayed
+	size_t dropped;             // bytes after the last good record
+};
+
+/* true while a journal is open, checked before any work is done on the write path */
+extern volatile bool journalEnabled;
+
+/**
+ * Keep the EEPROM images in the file at path and journal their writes in
+ * path.journal, take them back from there, compact and start the commit
+ * thread. Call before the radios start. Returns false with errno set if the
+ * files can't be used; what was recovered is in recovery.
+ */
+bool journalOpen(const char *path, JournalRecovery *recovery);
+
+/**
+ * Commit what is collected, compact, stop the thread and close the
+ * journal. Call after the radios stopped, while their images are still
+ * there. Returns false with errno set if the last commit failed.
+ */
+bool journalClose();
+
+/**
+ * Take back the image with address base id into eeprom and journal the
+ * writes to eeprom from now on. Without a recovered image all of eeprom is
+ * journaled as it is. Returns true if the image was recovered.
+ */
+bool journalAttach(uint64_t id, uint8_t *eeprom);
+
+/**
+ * Write n bytes of src to address of the image eeprom and journal them, or
+ * return false if eeprom isn't attached. For PiEEPROM.cpp.
+ */
+bool journalWrite(uint8_t *eeprom, size_t address, const void *src, size_t n);
+
+#endif /* __PiJournal_H__ */
@@ -0,0 +1,501 @@
+/*
+ * PiLog.cpp - Logging for the Raspberry Pi gateways
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "PiLog.h"
+#include "MyMetrics.h"
+
+struct LogRecord {
+	uint32_t seq;         // ring position + 1, written last
+	uint8_t nargs;
+	uint8_t strLength;
+	uint64_t timestamp;   // CLOCK_MONOTONIC, ns
+	const char *format;
+	uint32_t args[LOG_RING_ARGS];
+	char strings[LOG_RING_STRINGS];
+};
+
+struct LogSlot {
+	uint32_t seq;         // free for position seq, or filled for position seq - 1
+	int priority;
+	char text[LOG_LINE_SIZE];
+};
+
+int daemonizeFlag = 0;
+volatile int logMask = LOG_UPTO(LOG_INFO);
+volatile int logBinary = 0;
+
+static LogRecord ring[LOG_RING_SIZE];
+static uint32_t ringHead = 0;
+static int ringFd = -1;          // dump file, opened up front for the crash handler
+
+static const int crashSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static LogSlot queue[LOG_QUEUE_SIZE];
+static uint32_t queueTail = 0; // next position to fill
+static uint32_t queueHead = 0; // next position to write out
+static volatile bool writerRunning = false;
+static pthread_t writerThread;
+
+static void writeOut(int priority, const char *text)
+{
+	if (daemonizeFlag == 1) {
+		syslog(priority, "%s", text);
+	} else {
+		fputs(text, stdout);
+	}
+}
+
+/*
+ * Bounded multi producer queue (Vyukov): a producer claims a position by
+ * advancing the tail, fills the slot and publishes it through the slot
+ * sequence number.
+ */
+static bool enqueue(int priority, const char *format, va_list args)
+{
+	uint32_t pos = __atomic_load_n(&queueTail, __ATOMIC_RELAXED);
+	LogSlot *slot;
+
+	for (;;) {
+		slot = &queue[pos & (LOG_QUEUE_SIZE - 1)];
+		int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queueTail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// full
+			return false;
+		} else {
+			pos = __atomic_load_n(&queueTail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->priority = priority;
+	vsnprintf(slot->text, LOG_LINE_SIZE, format, args);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Write out one queued message, returns false if the queue is empty
+static bool dequeue()
+{
+	uint32_t pos = queueHead;
+	LogSlot *slot = &queue[pos & (LOG_QUEUE_SIZE - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+		return false;
+	}
+	writeOut(slot->priority, slot->text);
+	__atomic_store_n(&slot->seq, pos + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+	__atomic_store_n(&queueHead, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *writerLoop(void *arg)
+{
+	timespec idle = { 0, 10000000L };
+
+	while (writerRunning) {
+		if (!dequeue()) {
+			if (daemonizeFlag != 1) fflush(stdout);
+			nanosleep(&idle, NULL);
+		}
+	}
+	// drain what is left
+	while (dequeue());
+	fflush(stdout);
+	return NULL;
+}
+
+bool logStartAsync()
+{
+	if (writerRunning) {
+		return true;
+	}
+	for (uint32_t i = 0; i < LOG_QUEUE_SIZE; i++) {
+		queue[i].seq = queueTail + i;
+	}
+	queueHead = queueTail;
+	writerRunning = true;
+	if (pthread_create(&writerThread, NULL, writerLoop, NULL) != 0) {
+		writerRunning = false;
+		return false;
+	}
+	return true;
+}
+
+void logFlush()
+{
+	timespec wait = { 0, 1000000L };
+
+	while (writerRunning && __atomic_load_n(&queueHead, __ATOMIC_ACQUIRE) != __atomic_load_n(&queueTail, __ATOMIC_ACQUIRE)) {
+		nanosleep(&wait, NULL);
+	}
+	fflush(stdout);
+}
+
+unsigned long logDropped()
+{
+	return metricGet(M_LOG_DROPPED);
+}
+
+void openSyslog()
+{
+	logSetMask(LOG_UPTO (LOG_INFO));
+	openlog(NULL, 0, LOG_USER);
+}
+
+void closeSyslog()
+{
+	if (writerRunning) {
+		writerRunning = false;
+		pthread_join(writerThread, NULL);
+	}
+	closelog();
+}
+
+void logSetMask(int mask)
+{
+	setlogmask(mask);
+	logMask = mask;
+}
+
+void log(int priority, const char *format, ...)
+{
+	va_list argptr;
+	va_start(argptr, format);
+	if (writerRunning) {
+		if (!enqueue(priority, format, argptr)) {
+			metricInc(M_LOG_DROPPED);
+		}
+	} else if (daemonizeFlag == 1) {
+		vsyslog(priority, format, argptr);
+	} else {
+		vprintf(format, argptr);
+	}
+	va_end(argptr);
+}
+
+/*
+ * Skip flags, width, precision and length modifiers of the conversion
+ * starting after '%'. Returns the conversion character, longs holds the
+ * number of 'l' modifiers found.
+ */
+static const char *parseConversion(const char *p, int *longs)
+{
+	*longs = 0;
+	while (*p && strchr("-+ #0123456789.hlLjzt", *p)) {
+		if (*p == 'l') (*longs)++;
+		p++;
+	}
+	return p;
+}
+
+void logRecord(const char *format, ...)
+{
+	va_list args;
+	uint32_t pos = __atomic_fetch_add(&ringHead, 1, __ATOMIC_RELAXED);
+	LogRecord *r = &ring[pos & (LOG_RING_SIZE - 1)];
+	timespec ts;
+	int longs;
+
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r->timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->format = format;
+	r->nargs = 0;
+	r->strLength = 0;
+
+	va_start(args, format);
+	for (const char *p = format; *p && r->nargs < LOG_RING_ARGS; p++) {
+		if (*p != '%') continue;
+		p = parseConversion(p + 1, &longs);
+		switch (*p) {
+			case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+				if (longs > 1) {
+					r->args[r->nargs++] = (uint32_t)va_arg(args, long long);
+				} else if (longs == 1) {
+					r->args[r->nargs++] = (uint32_t)va_arg(args, long);
+				} else {
+					r->args[r->nargs++] = (uint32_t)va_arg(args, int);
+				}
+				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': {
+				float f = (float)va_arg(args, double);
+				memcpy(&r->args[r->nargs++], &f, sizeof(f));
+				break;
+			}
+			case 's': {
+				const char *str = va_arg(args, const char *);
+				size_t len = str ? strlen(str) : 0;
+				if (len > (size_t)(LOG_RING_STRINGS - 1 - r->strLength)) {
+					len = LOG_RING_STRINGS - 1 - r->strLength;
+				}
+				if (len) memcpy(r->strings + r->strLength, str, len);
+				r->strings[r->strLength + len] = '\0';
+				r->args[r->nargs++] = r->strLength;
+				r->strLength += len + 1;
+				if (r->strLength >= LOG_RING_STRINGS) r->strLength = LOG_RING_STRINGS - 1;
+				break;
+			}
+			case 'p':
+				r->args[r->nargs++] = (uint32_t)(uintptr_t)va_arg(args, void *);
+				break;
+			case '\0':
+				p--;
+				break;
+		}
+	}
+	va_end(args);
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Re-create the text of a record, the arguments are taken from the record
+ * in the order the format string consumes them.
+ */
+static int decodeRecord(const LogRecord *r, char *out, size_t len)
+{
+	char spec[32];
+	size_t pos;
+	uint8_t arg = 0;
+	int longs;
+
+	pos = snprintf(out, len, "[%llu.%06llu] ", (unsigned long long)(r->timestamp / 1000000000ULL),
+			(unsigned long long)(r->timestamp % 1000000000ULL) / 1000);
+	for (const char *p = r->format; *p && pos < len - 1; p++) {
+		if (*p != '%') {
+			out[pos++] = *p;
+			continue;
+		}
+		if (p[1] == '%') {
+			out[pos++] = '%';
+			p++;
+			continue;
+		}
+		const char *end = parseConversion(p + 1, &longs);
+		if (!*end) break;
+		size_t specLen = end - p + 1;
+		if (specLen >= sizeof(spec)) break;
+		memcpy(spec, p, specLen);
+		spec[specLen] = '\0';
+		p = end;
+
+		uint32_t value = arg < r->nargs ? r->args[arg] : 0;
+		arg++;
+		int n = 0;
+		switch (*end) {
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': {
+				float f;
+				memcpy(&f, &value, sizeof(f));
+				n = snprintf(out + pos, len - pos, spec, (double)f);
+				break;
+			}
+			case 's':
+				n = snprintf(out + pos, len - pos, spec, value < LOG_RING_STRINGS ? r->strings + value : "");
+				break;
+			case 'p':
+				n = snprintf(out + pos, len - pos, spec, (void *)(uintptr_t)value);
+				break;
+			default:
+				if (longs > 1) {
+					n = snprintf(out + pos, len - pos, spec, (long long)(int32_t)value);
+				} else if (longs == 1) {
+					n = snprintf(out + pos, len - pos, spec, (long)(int32_t)value);
+				} else {
+					n = snprintf(out + pos, len - pos, spec, (int)value);
+				}
+				break;
+		}
+		if (n > 0) pos += n;
+	}
+	if (pos >= len) pos = len - 1;
+	out[pos] = '\0';
+	return pos;
+}
+
+/*
+ * Start the dump file over, in the crash handler as well
+ */
+static bool rewindDump()
+{
+	return ringFd >= 0 && ftruncate(ringFd, 0) == 0 && lseek(ringFd, 0, SEEK_SET) == 0;
+}
+
+int logDumpRing()
+{
+	char line[300];
+	int written = 0;
+
+	if (!rewindDump()) {
+		return -1;
+	}
+	uint32_t head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+	uint32_t first = head > LOG_RING_SIZE ? head - LOG_RING_SIZE : 0;
+	for (uint32_t pos = first; pos != head; pos++) {
+		const LogRecord *r = &ring[pos & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+			// overwritten or still being written
+			continue;
+		}
+		int len = decodeRecord(r, line, sizeof(line));
+		if (write(ringFd, line, len) != len) {
+			break;
+		}
+		written++;
+	}
+	return written;
+}
+
+/*
+ * Append value in base 10 or 16 to out, without stdio, for the crash handler
+ */
+static size_t putNumber(char *out, size_t pos, size_t len, uint64_t value, unsigned int base, unsigned int digits)
+{
+	char text[24];
+	unsigned int n = 0;
+
+	do {
+		text[n++] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value > 0 && n < sizeof(text));
+	while (n < digits && n < sizeof(text)) {
+		text[n++] = '0';
+	}
+	while (n > 0 && pos < len) {
+		out[pos++] = text[--n];
+	}
+	return pos;
+}
+
+/*
+ * decodeRecord() for the crash handler: only async-signal-safe calls, so
+ * integers are written by hand, without width and precision, floats with
+ * three decimals.
+ */
+static int decodeRecordSafe(const LogRecord *r, char *out, size_t len)
+{
+	size_t pos = 0;
+	uint8_t arg = 0;
+	int longs;
+
+	out[pos++] = '[';
+	pos = putNumber(out, pos, len, r->timestamp / 1000000000ULL, 10, 1);
+	out[pos++] = '.';
+	pos = putNumber(out, pos, len, r->timestamp % 1000000000ULL / 1000, 10, 6);
+	out[pos++] = ']';
+	out[pos++] = ' ';
+	for (const char *p = r->format; *p && pos < len; p++) {
+		if (*p != '%') {
+			out[pos++] = *p;
+			continue;
+		}
+		if (p[1] == '%') {
+			out[pos++] = '%';
+			p++;
+			continue;
+		}
+		const char *end = parseConversion(p + 1, &longs);
+		if (!*end) break;
+		p = end;
+
+		uint32_t value = arg < r->nargs ? r->args[arg] : 0;
+		arg++;
+		switch (*end) {
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': {
+				float f;
+				memcpy(&f, &value, sizeof(f));
+				if (f < 0 && pos < len) {
+					out[pos++] = '-';
+					f = -f;
+				}
+				uint64_t thousandths = (uint64_t)(f * 1000.0f + 0.5f);
+				pos = putNumber(out, pos, len, thousandths / 1000, 10, 1);
+				if (pos < len) out[pos++] = '.';
+				pos = putNumber(out, pos, len, thousandths % 1000, 10, 3);
+				break;
+			}
+			case 's':
+				for (const char *c = value < LOG_RING_STRINGS ? r->strings + value : ""; *c && pos < len; c++) {
+					out[pos++] = *c;
+				}
+				break;
+			case 'c':
+				if (pos < len) out[pos++] = (char)value;
+				break;
+			case 'x': case 'X': case 'p':
+				pos = putNumber(out, pos, len, value, 16, 1);
+				break;
+			case 'u': case 'o':
+				pos = putNumber(out, pos, len, value, 10, 1);
+				break;
+			default:
+				if ((int32_t)value < 0 && pos < len) {
+					out[pos++] = '-';
+					value = -(int64_t)(int32_t)value;
+				}
+				pos = putNumber(out, pos, len, value, 10, 1);
+				break;
+		}
+	}
+	if (pos > len) pos = len;
+	return pos;
+}
+
+static void handleCrash(int sig)
+{
+	char line[300];
+
+	// No stdio and no open() here, the fd was opened by logBinaryEnable()
+	if (rewindDump()) {
+		uint32_t head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+		uint32_t first = head > LOG_RING_SIZE ? head - LOG_RING_SIZE : 0;
+		for (uint32_t pos = first; pos != head; pos++) {
+			const LogRecord *r = &ring[pos & (LOG_RING_SIZE - 1)];
+			if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+				continue;
+			}
+			int len = decodeRecordSafe(r, line, sizeof(line));
+			if (write(ringFd, line, len) != len) {
+				break;
+			}
+		}
+	}
+	// the handler was installed with SA_RESETHAND, so this is fatal now
+	raise(sig);
+}
+
+bool logBinaryEnable(const char *dumpFile)
+{
+	struct sigaction sa;
+
+	if (ringFd >= 0) {
+		close(ringFd);
+	}
+	if ((ringFd = open(dumpFile, O_WRONLY | O_CREAT | O_CLOEXEC, 0640)) < 0) {
+		return false;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handleCrash;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	for (size_t i = 0; i < sizeof(crashSignals) / sizeof(crashSignals[0]); i++) {
+		sigaction(crashSignals[i], &sa, NULL);
+	}
+	logBinary = 1;
+	return true;
+}
@@ -0,0 +1,103 @@
+/*
+ * PiLog.h - Logging for the Raspberry Pi gateways
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Besides the syslog/stdout text logging, debug messages can be recorded in
+ * binary form: only the format string pointer and the raw arguments are
+ * copied into a preallocated in-memory ring. The ring is decoded only when it
+ * is dumped (on request or when the process crashes). Arguments that take
+ * work to produce, like the payload text of a message, are left out of the
+ * ring (see debugPayload() in MySensor.h).
+ *
+ * Once logStartAsync() has been called, log() only formats the message into
+ * a bounded lock-free queue and a background thread writes it out, so a
+ * stalled syslog daemon cannot block the caller. Messages that do not fit
+ * into the queue are dropped and counted.
+ */
+
+#ifndef __PiLog_H__
+#define __PiLog_H__ 1
+
+#include <stdint.h>
+#include <syslog.h>
+
+#define LOG_RING_SIZE    4096 // records, must be a power of two
+#define LOG_RING_ARGS    16   // max arguments recorded per message
+#define LOG_RING_STRINGS 40   // bytes for string arguments per message
+
+#define LOG_QUEUE_SIZE   256  // queued messages, must be a power of two
+#define LOG_LINE_SIZE    200  // max length of a queued message
+
+/* log to syslog (1) or stdout (0) */
+extern int daemonizeFlag;
+
+/* mirror of the syslog mask, readable without a library call */
+extern volatile int logMask;
+
+/* record debug messages into the binary ring instead of logging them */
+extern volatile int logBinary;
+
+/**
+ * True if a message with priority would be logged at all.
+ * Messages are never filtered when logging to stdout.
+ */
+#define logEnabled(priority) (!daemonizeFlag || (logMask & LOG_MASK(priority)))
+
+void openSyslog();
+
+/**
+ * Flush and stop the writer thread (if any) and close syslog.
+ */
+void closeSyslog();
+
+/**
+ * Start the background writer thread. Call after daemonizing, threads do
+ * not survive fork().
+ */
+bool logStartAsync();
+
+/**
+ * Wait until all queued messages have been written.
+ */
+void logFlush();
+
+/**
+ * Number of messages dropped because the queue was full.
+ */
+unsigned long logDropped();
+
+/**
+ * Change the syslog mask (see setlogmask(3)).
+ */
+void logSetMask(int mask);
+
+/**
+ * Log a message to syslog or stdout.
+ */
+void log(int priority, const char *format, ...);
+
+/**
+ * Record a message in the binary ring. Supports the integer, character,
+ * float and string conversions of printf. Strings are copied (truncated if
+ * needed), all other arguments are stored as 32 bit values.
+ */
+void logRecord(const char *format, ...);
+
+/**
+ * Enable binary debug logging. The ring is dumped to dumpFile on
+ * logDumpRing() and when the process crashes; the file is opened here, the
+ * crash handler only writes to it. Returns false with errno set if it can't
+ * be opened.
+ */
+bool logBinaryEnable(const char *dumpFile);
+
+/**
+ * Decode the binary ring, oldest record first, into the dump file.
+ * Returns the number of records written or -1 on error.
+ */
+int logDumpRing();
+
+#endif /* __PiLog_H__ */
@@ -0,0 +1,145 @@
+/*
+ * PiMailbox.cpp - Messages held by the gateway for nodes that are asleep
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <new>
+#include <stdio.h>
+#include <string.h>
+
+#include "PiMailbox.h"
+#include "PiLog.h"
+#include "MyMetrics.h"
+
+PiMailbox::PiMailbox()
+{
+	memset(boxes, 0, sizeof(boxes));
+	total = 0;
+	nextId = 0;
+}
+
+PiMailbox::~PiMailbox()
+{
+	metricSub(M_MAILBOX_PENDING, total);
+	for (int i = 0; i < 256; i++) {
+		delete boxes[i];
+	}
+}
+
+bool PiMailbox::put(const MyMessage &message, unsigned long now)
+{
+	uint8_t node = message.destination;
+	Box *box = boxes[node];
+
+	if (box == NULL) {
+		// Only nodes that ever missed a message get a queue
+		box = boxes[node] = new (std::nothrow) Box;
+		if (box == NULL) {
+			return false;
+		}
+		box->head = 0;
+		box->count = 0;
+	}
+	if (box->count == MAILBOX_DEPTH) {
+		log(LOG_INFO, "Node %d: mailbox full, dropped the oldest message\n", node);
+		metricInc(M_MAILBOX_DROPPED);
+		removeHead(node);
+	}
+	Entry *entry = &box->entries[(box->head + box->count) % MAILBOX_DEPTH];
+	entry->id = nextId++;
+	entry->queued = now;
+	entry->message = message;
+	box->count++;
+	total++;
+	metricInc(M_MAILBOX_QUEUED);
+	metricAdd(M_MAILBOX_PENDING, 1);
+	return true;
+}
+
+const MyMessage *PiMailbox::peek(uint8_t node, uint32_t *id)
+{
+	Box *box = boxes[node];
+
+	if (box == NULL || box->count == 0) {
+		return NULL;
+	}
+	*id = box->entries[box->head].id;
+	return &box->entries[box->head].message;
+}
+
+void PiMailbox::delivered(uint8_t node, uint32_t id, bool ackPayload, unsigned long now)
+{
+	Box *box = boxes[node];
+
+	if (box == NULL || box->count == 0 || box->entries[box->head].id != id) {
+		return;
+	}
+	metricInc(ackPayload ? M_MAILBOX_ACK_PAYLOAD : M_MAILBOX_DIRECT);
+	metricAdd(M_MAILBOX_DELAY, now - box->entries[box->head].queued);
+	removeHead(node);
+}
+
+unsigned int PiMailbox::remove(uint8_t node, uint8_t sensor, uint8_t type)
+{
+	Box *box = boxes[node];
+	uint8_t kept = 0;
+
+	if (box == NULL) {
+		return 0;
+	}
+	// The ones kept move up, in their order
+	for (uint8_t i = 0; i < box->count; i++) {
+		Entry *entry = &box->entries[(box->head + i) % MAILBOX_DEPTH];
+		if (entry->message.sensor == sensor && entry->message.type == type) {
+			continue;
+		}
+		if (entry != &box->entries[(box->head + kept) % MAILBOX_DEPTH]) {
+			box->entries[(box->head + kept) % MAILBOX_DEPTH] = *entry;
+		}
+		kept++;
+	}
+	unsigned int removed = box->count - kept;
+	box->count = kept;
+	total -= removed;
+	metricSub(M_MAILBOX_PENDING, removed);
+	return removed;
+}
+
+int PiMailbox::next(uint8_t node)
+{
+	if (total == 0) {
+		return -1;
+	}
+	for (int i = 1; i <= 256; i++) {
+		uint8_t candidate = node + i;
+		if (pending(candidate)) {
+			return candidate;
+		}
+	}
+	return -1;
+}
+
+void PiMailbox::expire(unsigned long now)
+{
+	for (int node = 0; node < 256 && total > 0; node++) {
+		Box *box = boxes[node];
+		while (box != NULL && box->count > 0 && now - box->entries[box->head].queued > MAILBOX_TTL * 1000UL) {
+			log(LOG_INFO, "Node %d: message expired in the mailbox\n", node);
+			metricInc(M_MAILBOX_EXPIRED);
+			removeHead(node);
+		}
+	}
+}
+
+void PiMailbox::removeHead(uint8_t node)
+{
+	Box *box = boxes[node];
+
+	box->head = (box->head + 1) % MAILBOX_DEPTH;
+	box->count--;
+	total--;
+	metricSub(M_MAILBOX_PENDING, 1);
+}
@@ -0,0 +1,109 @@
+/*
+ * PiMailbox.h - Messages held by the gateway for nodes that are asleep
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * A battery node powers its radio down between transmissions, so commands
+ * from the controller fail in sendRoute() unless they happen to arrive
+ * while the node is listening. The gateway keeps such messages here, up to
+ * MAILBOX_DEPTH per node, and delivers them when the node is next heard:
+ *
+ * - While the radio is idle, the oldest message of a node that is a direct
+ *   child of the gateway is queued as ack payload. The auto ack of the next
+ *   frame the gateway receives carries it, and if that frame came from the
+ *   node the message is delivered without another transmission.
+ * - Once a node with mail has transmitted, the gateway sends the rest right
+ *   away. Nodes listen for MAILBOX_LISTEN_TIME ms before going back to sleep
+ *   when an ack brought them anything, as a payload for another node still
+ *   means the gateway has mail.
+ *
+ * Messages for nodes behind a repeater are only held when the repeater
+ * can't be reached; the gateway can't tell if the repeater reached them.
+ *
+ * The oldest message is dropped when a node's queue is full, and messages
+ * older than MAILBOX_TTL seconds expire. Every MyGateway has its own
+ * mailbox and uses it from its radio thread only.
+ */
+
+#ifndef __PiMailbox_H__
+#define __PiMailbox_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyMessage.h"
+
+#define MAILBOX_DEPTH 8         // messages per node
+#define MAILBOX_TTL   3600      // seconds a message waits for its node
+
+class PiMailbox
+{
+  public:
+	PiMailbox();
+	~PiMailbox();
+
+	/**
+	 * Queue message for its destination, now is the gateway's millis().
+	 * Returns false if there was no memory for it.
+	 */
+	bool put(const MyMessage &message, unsigned long now);
+
+	/**
+	 * Oldest message for node and its id, NULL if there is none.
+	 */
+	const MyMessage *peek(uint8_t node, uint32_t *id);
+
+	/**
+	 * Remove message id of node after it reached the node. Does nothing if
+	 * it expired or was dropped in the meantime.
+	 */
+	void delivered(uint8_t node, uint32_t id, bool ackPayload, unsigned long now);
+
+	/**
+	 * Drop the messages for node to sensor of type, replaced by a newer
+	 * one. Returns how many there were.
+	 */
+	unsigned int remove(uint8_t node, uint8_t sensor, uint8_t type);
+
+	/**
+	 * True if there are messages for node.
+	 */
+	bool pending(uint8_t node) { return boxes[node] != NULL && boxes[node]->count > 0; }
+
+	/**
+	 * First node with mail after node, in a round robin, or -1 if none.
+	 */
+	int next(uint8_t node);
+
+	/**
+	 * Drop expired messages. Call about once a second.
+	 */
+	void expire(unsigned long now);
+
+	/**
+	 * Messages held for all nodes.
+	 */
+	unsigned int size() { return total; }
+
+  private:
+	struct Entry {
+		uint32_t id;
+		unsigned long queued;   // millis() of put()
+		MyMessage message;
+	};
+	struct Box {
+		uint8_t head;
+		uint8_t count;
+		Entry entries[MAILBOX_DEPTH];
+	};
+
+	Box *boxes[256];
+	unsigned int total;
+	uint32_t nextId;
+
+	void removeHead(uint8_t node);
+};
+
+#endif /* __PiMailbox_H__ */
@@ -0,0 +1,397 @@
+/*
+ * PiRadioGroup.cpp - Several gateway radios behind one controller stream
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "PiRadioGroup.h"
+#include "PiLog.h"
+
+/* The radio of the calling radio thread, for the output callback */
+static __thread void *currentRadio = NULL;
+
+PiRadioGroup::PiRadioGroup(void (*_output)(char *))
+{
+	output = _output;
+	count = 0;
+	started = false;
+	running = false;
+	surveyDwell = 0;
+	surveyFirst = SURVEY_FIRST;
+	surveyLast = SURVEY_LAST;
+	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&outputLock, NULL);
+	memset(owner, GROUP_NO_RADIO, sizeof(owner));
+}
+
+PiRadioGroup::~PiRadioGroup()
+{
+	stop();
+	for (unsigned int i = 0; i < count; i++) {
+		for (unsigned int j = 0; j < radios[i].count; j++) {
+			free(radios[i].longQueue[(radios[i].head + j) % GROUP_QUEUE_SIZE]);
+		}
+		delete radios[i].gw;
+		delete radios[i].transport;
+		delete [] radios[i].eeprom;
+		close(radios[i].wakeFd);
+		if (radios[i].irqFd >= 0) {
+			close(radios[i].irqFd);
+		}
+		pthread_cond_destroy(&radios[i].notFull);
+	}
+	pthread_mutex_destroy(&lock);
+	pthread_mutex_destroy(&outputLock);
+}
+
+int PiRadioGroup::add(MyTransport *transport, uint8_t channel, uint64_t baseRadioId, int irqFd)
+{
+	if (count == GROUP_MAX_RADIOS || started) {
+		return -1;
+	}
+	Radio *r = &radios[count];
+	r->group = this;
+	r->index = count;
+	r->transport = transport;
+	r->gw = new MyGateway(transport, 1);
+	r->gw->setBaseRadioId(baseRadioId);
+	r->gw->setRadioEventSource(irqFd);
+	r->gw->setRuleRouter(routeAction, r);
+	r->irqFd = irqFd;
+	r->channel = channel;
+	r->baseRadioId = baseRadioId;
+	// The first radio keeps the process wide EEPROM, the others need their own routes
+	r->eeprom = NULL;
+	if (count > 0) {
+		r->eeprom = new uint8_t[EEPROM_SIZE];
+		memset(r->eeprom, 0, EEPROM_SIZE);
+	}
+	r->wakeFd = eventfd(0, EFD_NONBLOCK);
+	r->head = 0;
+	r->count = 0;
+	pthread_cond_init(&r->notFull, NULL);
+	return count++;
+}
+
+void PiRadioGroup::setKeeping(uint8_t stores)
+{
+	for (unsigned int i = 0; i < count; i++) {
+		radios[i].gw->keepState(stores);
+	}
+}
+
+void PiRadioGroup::setSurvey(unsigned int dwell, uint8_t first, uint8_t last)
+{
+	surveyDwell = dwell;
+	surveyFirst = first;
+	surveyLast = last;
+}
+
+bool PiRadioGroup::start(rf24_pa_dbm_e _paLevel, rf24_datarate_e _dataRate)
+{
+	paLevel = _paLevel;
+	dataRate = _dataRate;
+	running = true;
+	for (unsigned int i = 0; i < count; i++) {
+		if (pthread_create(&radios[i].thread, NULL, radioThread, &radios[i]) != 0) {
+			// Stop the threads already running
+			count = i;
+			started = true;
+			stop();
+			return false;
+		}
+	}
+	started = true;
+	return true;
+}
+
+void PiRadioGroup::stop()
+{
+	if (!started) {
+		return;
+	}
+	running = false;
+	pthread_mutex_lock(&lock);
+	for (unsigned int i = 0; i < count; i++) {
+		uint64_t one = 1;
+		if (write(radios[i].wakeFd, &one, sizeof(one)) < 0) {
+			log(LOG_ERR, "Could not wake radio %d (%d) %s\n", i, errno, strerror(errno));
+		}
+		pthread_cond_broadcast(&radios[i].notFull);
+	}
+	pthread_mutex_unlock(&lock);
+	for (unsigned int i = 0; i < count; i++) {
+		pthread_join(radios[i].thread, NULL);
+	}
+	started = false;
+}
+
+void PiRadioGroup::enqueue(Radio *r, const char *command)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&lock);
+	while (r->count == GROUP_QUEUE_SIZE && running) {
+		pthread_cond_wait(&r->notFull, &lock);
+	}
+	if (running) {
+		unsigned int tail = (r->head + r->count) % GROUP_QUEUE_SIZE;
+		r->longQueue[tail] = NULL;
+		r->isAction[tail] = false;
+		if (strlen(command) < MAX_RECEIVE_LENGTH) {
+			strcpy(r->queue[tail], command);
+			r->count++;
+		} else if ((r->longQueue[tail] = strdup(command)) != NULL) {
+			r->count++;
+		} else {
+			log(LOG_ERR, "Command for radio %d dropped, out of memory\n", r->index);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	if (write(r->wakeFd, &one, sizeof(one)) < 0) {
+		log(LOG_ERR, "Could not wake radio %d (%d) %s\n", r->index, errno, strerror(errno));
+	}
+}
+
+/*
+ * Queue a rule action of another radio's thread. It doesn't wait for room,
+ * two radios could be waiting for each other.
+ */
+bool PiRadioGroup::enqueueAction(Radio *r, const MyMessage &action)
+{
+	uint64_t one = 1;
+	bool queued = false;
+
+	pthread_mutex_lock(&lock);
+	if (r->count < GROUP_QUEUE_SIZE && running) {
+		unsigned int tail = (r->head + r->count) % GROUP_QUEUE_SIZE;
+		r->longQueue[tail] = NULL;
+		r->isAction[tail] = true;
+		r->actions[tail] = action;
+		r->count++;
+		queued = true;
+	}
+	pthread_mutex_unlock(&lock);
+	if (!queued) {
+		return false;
+	}
+	if (write(r->wakeFd, &one, sizeof(one)) < 0) {
+		log(LOG_ERR, "Could not wake radio %d (%d) %s\n", r->index, errno, strerror(errno));
+	}
+	return true;
+}
+
+/*
+ * Rule actions for a node heard on another radio go to that radio, like the
+ * controller's commands
+ */
+bool PiRadioGroup::routeAction(void *context, const MyMessage &action)
+{
+	Radio *r = (Radio *)context;
+	PiRadioGroup *group = r->group;
+	uint8_t radio;
+
+	if (action.destination == GATEWAY_ADDRESS || action.destination == BROADCAST_ADDRESS) {
+		return false;
+	}
+	radio = group->getOwner(action.destination);
+	if (radio == GROUP_NO_RADIO || radio == r->index) {
+		return false;
+	}
+	if (!group->enqueueAction(&group->radios[radio], action)) {
+		log(LOG_WARNING, "Rule action for node %d dropped, the queue of radio %d is full\n", action.destination, radio);
+	}
+	return true;
+}
+
+void PiRadioGroup::parseAndSend(const char *command)
+{
+	int destination, command_, type;
+	uint8_t radio = GROUP_NO_RADIO;
+
+	if (count == 0) {
+		return;
+	}
+	if (sscanf(command, "%d;%*d;%d;%*d;%d", &destination, &command_, &type) != 3) {
+		// Let the first gateway count the parse error
+		enqueue(&radios[0], command);
+		return;
+	}
+	if (destination == GATEWAY_ADDRESS) {
+		if (command_ != C_INTERNAL || type != I_INCLUSION_MODE) {
+			radio = 0;
+		}
+	} else if (destination != BROADCAST_ADDRESS && destination > 0 && destination < 256) {
+		radio = getOwner(destination);
+	}
+	if (radio != GROUP_NO_RADIO) {
+		enqueue(&radios[radio], command);
+	} else {
+		for (unsigned int i = 0; i < count; i++) {
+			enqueue(&radios[i], command);
+		}
+	}
+}
+
+uint8_t PiRadioGroup::getOwner(uint8_t node)
+{
+	return __atomic_load_n(&owner[node], __ATOMIC_RELAXED);
+}
+
+unsigned int PiRadioGroup::getCount()
+{
+	return count;
+}
+
+/*
+ * Pick the quietest channel, apart from those the other radios are on or
+ * moving to, and move there if it is worth it
+ */
+void PiRadioGroup::survey(Radio *r)
+{
+	PiChannelSurvey survey;
+	uint8_t avoid[GROUP_MAX_RADIOS];
+	unsigned int avoidCount = 0;
+	bool migrate = false;
+
+	if (!r->gw->surveyChannels(survey, surveyDwell)) {
+		log(LOG_WARNING, "Radio %d can't survey the channels\n", r->index);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	for (unsigned int i = 0; i < count; i++) {
+		if (i != r->index) {
+			avoid[avoidCount++] = radios[i].channel;
+		}
+	}
+	uint8_t best = survey.quietest(surveyFirst, surveyLast, avoid, avoidCount);
+	if (survey.score(best) + SURVEY_MARGIN <= survey.score(r->channel)) {
+		r->channel = best;
+		migrate = true;
+	}
+	pthread_mutex_unlock(&lock);
+	log(LOG_INFO, "Radio %d survey: channel %d busy %d permille, quietest %d busy %d permille\n", r->index,
+		r->gw->getChannel(), survey.occupancy(r->gw->getChannel()), best, survey.occupancy(best));
+	if (migrate) {
+		log(LOG_INFO, "Radio %d moves to channel %d\n", r->index, best);
+		r->gw->migrateChannel(best);
+	}
+}
+
+/*
+ * Output callback of all gateways, runs in the radio thread of the gateway
+ */
+void PiRadioGroup::radioOutput(char *line)
+{
+	Radio *r = (Radio *)currentRadio;
+	PiRadioGroup *group = r->group;
+	int sender = atoi(line);
+
+	if (sender > GATEWAY_ADDRESS && sender < BROADCAST_ADDRESS) {
+		__atomic_store_n(&group->owner[sender], r->index, __ATOMIC_RELAXED);
+	} else if (sender == GATEWAY_ADDRESS && r->index > 0) {
+		return;
+	}
+	pthread_mutex_lock(&group->outputLock);
+	group->output(line);
+	pthread_mutex_unlock(&group->outputLock);
+}
+
+void *PiRadioGroup::radioThread(void *arg)
+{
+	Radio *r = (Radio *)arg;
+	PiRadioGroup *group = r->group;
+	MyTransport *transport = r->transport;
+	struct pollfd fds[2];
+	nfds_t nfds = 1;
+	char command[MAX_RECEIVE_LENGTH];
+	char *longCommand;
+	MyMessage action;
+
+	currentRadio = r;
+	eeprom_select(r->eeprom);
+	metricSelect(r->index);
+	r->gw->begin(group->paLevel, r->channel, group->dataRate, radioOutput);
+	// A migration before the last restart may have moved it
+	pthread_mutex_lock(&group->lock);
+	r->channel = r->gw->getChannel();
+	pthread_mutex_unlock(&group->lock);
+	log(LOG_INFO, "Radio %d on channel %d, address base 0x%010llx\n", r->index, r->gw->getChannel(), (unsigned long long)r->baseRadioId);
+	if (group->surveyDwell > 0) {
+		group->survey(r);
+	}
+
+	fds[0].fd = r->wakeFd;
+	fds[0].events = POLLIN;
+	while (group->running) {
+		r->gw->processRadioMessage();
+
+		for (;;) {
+			pthread_mutex_lock(&group->lock);
+			if (r->count == 0) {
+				pthread_mutex_unlock(&group->lock);
+				break;
+			}
+			longCommand = r->longQueue[r->head];
+			bool isAction = r->isAction[r->head];
+			if (isAction) {
+				action = r->actions[r->head];
+			} else if (longCommand == NULL) {
+				memcpy(command, r->queue[r->head], MAX_RECEIVE_LENGTH);
+			}
+			r->head = (r->head + 1) % GROUP_QUEUE_SIZE;
+			r->count--;
+			pthread_cond_signal(&r->notFull);
+			pthread_mutex_unlock(&group->lock);
+
+			if (isAction) {
+				r->gw->sendRuleAction(action);
+				continue;
+			}
+			traceBegin(TRACE_DOWNSTREAM);
+			traceStage(TS_READ);
+			if (longCommand != NULL) {
+				r->gw->parseAndSend(longCommand);
+				free(longCommand);
+			} else {
+				r->gw->parseAndSend(command);
+			}
+		}
+
+		/* come back at once while frames are pending, and when the next timer
+		   of the gateway is due; RF24 without its IRQ pin has no event fd and
+		   is looked at every GROUP_POLL_INTERVAL, as the gateway always did,
+		   and a virtual source that closed has nothing more to give */
+		int timeout = r->gw->untilService(GROUP_POLL_INTERVAL);
+		if (r->gw->getChannel() != r->channel && timeout > CHANNEL_ANNOUNCE_INTERVAL) {
+			// Keeps announcing a channel migration until the switch
+			timeout = CHANNEL_ANNOUNCE_INTERVAL;
+		}
+		nfds = r->gw->getRadioEvent(&fds[1]) ? 2 : 1;
+		if (poll(fds, nfds, transport->available() ? 0 : timeout) > 0) {
+			if (fds[0].revents & POLLIN) {
+				uint64_t value;
+				if (read(r->wakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+					log(LOG_ERR, "Radio %d wake read error (%d) %s\n", r->index, errno, strerror(errno));
+				}
+			}
+			if (nfds == 2) {
+				r->gw->radioEventDone(&fds[1]);
+				if (!r->gw->getRadioEvent(&fds[1])) {
+					log(LOG_INFO, "Radio %d event source closed, polling\n", r->index);
+				}
+			}
+		}
+	}
+	return NULL;
+}
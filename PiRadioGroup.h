@@ -0,0 +1,137 @@
+/*
+ * PiRadioGroup.h - Several gateway radios behind one controller stream
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Every radio gets its own MyGateway, with its own channel, radio address
+ * base and EEPROM image, and its own thread. Only that thread touches the
+ * gateway: it processes received frames and sends the controller commands
+ * queued for its radio. The lines all gateways write for the controller go
+ * to one output callback, one line at a time.
+ *
+ * Commands are routed to the radio a node was last heard on. Commands for
+ * nodes not heard yet and broadcasts go to all radios; of the commands for
+ * the gateway itself only inclusion mode changes go to all radios, the rest
+ * to the first one. Gateway messages (node 0) are only passed on from the
+ * first radio, so the controller sees a single gateway.
+ *
+ * The radios count their metrics in their own set (MyMetrics.h) and
+ * keep their state in the snapshot, journal and readings of the process
+ * only as far as setKeeping() says.
+ *
+ * With setSurvey() every radio surveys the channels after its setup
+ * (PiChannelSurvey.h) and moves its network to the quietest one that is
+ * at least SURVEY_MARGIN permille quieter, apart from the other radios.
+ */
+
+#ifndef PiRadioGroup_h
+#define PiRadioGroup_h
+
+#include <pthread.h>
+#include "MyGateway.h"
+#include "PiEEPROM.h"
+
+#define GROUP_MAX_RADIOS 4
+#define GROUP_QUEUE_SIZE 32   // commands waiting per radio
+#define GROUP_NO_RADIO   0xff
+#define GROUP_POLL_INTERVAL 500 // ms between looks at a radio without an event fd
+
+class PiRadioGroup
+{
+  public:
+	/**
+	 * @param output Called with every line for the controller. Calls are
+	 * serialized, but come from the radio threads.
+	 */
+	PiRadioGroup(void (*output)(char *));
+	~PiRadioGroup();
+
+	/**
+	 * Add a radio before start(). The group deletes transport at the end,
+	 * and closes irqFd, the sysfs GPIO value file of its IRQ pin or -1 (see
+	 * MySensor::setRadioEventSource()). Returns the index of the radio, or -1
+	 * if the group is full.
+	 */
+	int add(MyTransport *transport, uint8_t channel, uint64_t baseRadioId, int irqFd = -1);
+
+	/**
+	 * Survey the channels at startup, dwell ms each, and move to the
+	 * quietest of first..last. Call before start().
+	 */
+	void setSurvey(unsigned int dwell, uint8_t first, uint8_t last);
+
+	/**
+	 * Keep the state of every radio's gateway in the stores of the process,
+	 * KEEP_* flags (MyGateway.h). Call before start().
+	 */
+	void setKeeping(uint8_t stores);
+
+	/**
+	 * Start one thread per radio, they set up their radio and gateway.
+	 */
+	bool start(rf24_pa_dbm_e paLevel, rf24_datarate_e dataRate);
+
+	/**
+	 * Stop and join all radio threads.
+	 */
+	void stop();
+
+	/**
+	 * Queue a controller command (node;sensor;command;ack;type;payload) for
+	 * the radio(s) it is routed to. Blocks while a queue is full.
+	 */
+	void parseAndSend(const char *command);
+
+	/**
+	 * Radio a node was last heard on, or GROUP_NO_RADIO.
+	 */
+	uint8_t getOwner(uint8_t node);
+
+	unsigned int getCount();
+
+  private:
+	struct Radio {
+		PiRadioGroup *group;
+		uint8_t index;
+		MyTransport *transport;
+		MyGateway *gw;
+		uint8_t channel;       // in use, or moved to (lock)
+		uint64_t baseRadioId;
+		uint8_t *eeprom;       // NULL for the process wide image
+		pthread_t thread;
+		int wakeFd;            // eventfd, signalled when commands are queued
+		int irqFd;             // GPIO value file of the IRQ pin, or -1
+		char queue[GROUP_QUEUE_SIZE][MAX_RECEIVE_LENGTH];
+		char *longQueue[GROUP_QUEUE_SIZE]; // commands too long for a slot, e.g. segmented messages
+		MyMessage actions[GROUP_QUEUE_SIZE]; // rule actions of the other radios, for the slots marked
+		bool isAction[GROUP_QUEUE_SIZE];
+		unsigned int head;
+		unsigned int count;
+		pthread_cond_t notFull;
+	};
+
+	Radio radios[GROUP_MAX_RADIOS];
+	unsigned int count;
+	bool started;
+	volatile bool running;
+	rf24_pa_dbm_e paLevel;
+	rf24_datarate_e dataRate;
+	unsigned int surveyDwell;  // 0 for no survey
+	uint8_t surveyFirst;
+	uint8_t surveyLast;
+	void (*output)(char *);
+	pthread_mutex_t lock;      // queues
+	pthread_mutex_t outputLock;
+	uint8_t owner[256];
+
+	void enqueue(Radio *radio, const char *command);
+	bool enqueueAction(Radio *radio, const MyMessage &action);
+	void survey(Radio *radio);
+	static void radioOutput(char *line);
+	static bool routeAction(void *context, const MyMessage &action);
+	static void *radioThread(void *arg);
+};
+
+#endif
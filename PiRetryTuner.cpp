@@ -0,0 +1,101 @@
+/*
+ * PiRetryTuner.cpp - Auto retransmit delay and count per next hop
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <string.h>
+
+#include "PiRetryTuner.h"
+#include "MyMetrics.h"
+
+PiRetryTuner::PiRetryTuner()
+{
+	tuned = 0;
+	begin(RF24_250KBPS);
+	enabled = true;
+}
+
+PiRetryTuner::~PiRetryTuner()
+{
+	metricSub(M_RETRY_LINKS, tuned);
+}
+
+void PiRetryTuner::begin(rf24_datarate_e dataRate)
+{
+	// A 32 byte ack payload needs 1500 us at 250 kbps, 500 us otherwise
+	delayMin = dataRate == RF24_250KBPS ? 5 : 1;
+	delay = RETRY_DELAY_DEFAULT;
+	count = RETRY_COUNT_DEFAULT;
+	metricSub(M_RETRY_LINKS, tuned);
+	tuned = 0;
+	memset(links, 0, sizeof(links));
+	for (int i = 0; i < 256; i++) {
+		links[i].count = RETRY_COUNT_DEFAULT;
+	}
+}
+
+void PiRetryTuner::prepare(MyTransport *radio, uint8_t next)
+{
+	uint8_t wantDelay = RETRY_DELAY_DEFAULT;
+	uint8_t wantCount = RETRY_COUNT_DEFAULT;
+
+	if (enabled && links[next].attempts >= RETRY_SAMPLES) {
+		wantDelay = delayMin;
+		wantCount = links[next].count;
+	}
+	if (wantDelay != delay || wantCount != count) {
+		delay = wantDelay;
+		count = wantCount;
+		radio->setRetries(delay, count);
+		metricInc(M_RETRY_CHANGES);
+	}
+}
+
+void PiRetryTuner::sent(uint8_t next, bool ok, uint8_t retransmits)
+{
+	Link *link = &links[next];
+
+	metricAdd(M_RETRY_WAIT, retransmits * (delay + 1) * 250UL);
+	if (!enabled) {
+		return;
+	}
+	if (!ok && link->attempts >= RETRY_SAMPLES && link->failures < UINT8_MAX && ++link->failures < RETRY_DEAF) {
+		// More retries than the estimate needed: the receiver wasn't listening
+		return;
+	}
+	if (ok) {
+		link->failures = 0;
+	}
+	if (link->attempts < RETRY_SAMPLES && link->attempts + retransmits + 1 >= RETRY_SAMPLES) {
+		tuned++;
+		metricAdd(M_RETRY_LINKS, 1);
+	}
+	link->attempts += retransmits + 1;
+	link->acked += ok;
+	if (link->attempts > RETRY_HISTORY) {
+		link->attempts /= 2;
+		link->acked /= 2;
+	}
+	if (link->attempts >= RETRY_SAMPLES) {
+		retune(link);
+	}
+}
+
+/*
+ * Smallest ARC that leaves a write less than 1 - RETRY_TARGET to fail
+ */
+void PiRetryTuner::retune(Link *link)
+{
+	double miss = 1.0 - (double)link->acked / link->attempts;
+	double fail = miss;
+	uint8_t retries = 0;
+
+	while (fail > 1.0 - RETRY_TARGET && retries < 15) {
+		fail *= miss;
+		retries++;
+	}
+	link->count = retries < RETRY_COUNT_MIN ? RETRY_COUNT_MIN : retries;
+}
@@ -0,0 +1,89 @@
+/*
+ * PiRetryTuner.h - Auto retransmit delay and count per next hop
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * setupRadio() gives every link the same auto retransmit setting (ARD
+ * 1500 us, ARC 15). MySensor::sendWrite() asks the tuner for the setting
+ * of each next hop instead and reports back how the write went.
+ *
+ * Per next hop the tuner estimates the chance p that a single attempt is
+ * acked, from the retransmissions of its recent writes. ARC is the
+ * smallest count whose attempts all fail with a chance below
+ * 1 - RETRY_TARGET, so a write to a good link stops after a few frames
+ * instead of 16, and one to a lossy link gets all 15. A write that fails
+ * although the estimate gave it enough retries most likely met a receiver
+ * that wasn't listening (transmitting itself, RX FIFO full, asleep), more
+ * retries wouldn't have helped. Such failures only count from the
+ * RETRY_DEAF-th in a row, when the link itself may have gone bad.
+ *
+ * ARD is the shortest delay that still fits a 32 byte ack payload at the
+ * data rate, for every tuned link: waiting longer doesn't make the next
+ * attempt more likely to get through, it only keeps the radio deaf.
+ *
+ * Until RETRY_SAMPLES attempts were seen a next hop keeps the defaults.
+ */
+
+#ifndef __PiRetryTuner_H__
+#define __PiRetryTuner_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyTransport.h"
+
+#define RETRY_TARGET        0.999     // delivery ratio of a single write
+#define RETRY_SAMPLES       8         // attempts before a next hop is tuned
+#define RETRY_HISTORY       64        // attempts the estimate is based on, about
+#define RETRY_COUNT_MIN     3
+#define RETRY_DEAF          3         // failed writes in a row before they count
+#define RETRY_DELAY_DEFAULT 5         // what setupRadio() sets, (5+1)*250 us
+#define RETRY_COUNT_DEFAULT 15
+
+class PiRetryTuner
+{
+  public:
+	PiRetryTuner();
+	~PiRetryTuner();
+
+	/**
+	 * Forget all estimates, after setupRadio() set the defaults.
+	 */
+	void begin(rf24_datarate_e dataRate);
+
+	/**
+	 * Turn tuning on or off, off restores the defaults on the next write.
+	 */
+	void enable(bool on) { enabled = on; }
+
+	/**
+	 * Set the retries for a write to next, if they differ from the last.
+	 */
+	void prepare(MyTransport *radio, uint8_t next);
+
+	/**
+	 * Result of the write to next prepared last.
+	 */
+	void sent(uint8_t next, bool ok, uint8_t retransmits);
+
+  private:
+	struct Link {
+		uint8_t attempts;       // decayed counts
+		uint8_t acked;
+		uint8_t count;          // ARC, 0-15
+		uint8_t failures;       // writes in a row that failed, up to UINT8_MAX
+	};
+
+	Link links[256];
+	bool enabled;
+	uint8_t delayMin;
+	uint8_t delay;              // as set in the radio
+	uint8_t count;
+	unsigned int tuned;         // links past RETRY_SAMPLES
+
+	void retune(Link *link);
+};
+
+#endif /* __PiRetryTuner_H__ */
@@ -0,0 +1,342 @@
+/*
+ * PiRules.cpp - Actions the gateway takes itself on values from the nodes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PiRules.h"
+#include "MySensor.h"
+#include "MyMetrics.h"
+
+typedef enum {
+	OP_ANY,
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE
+} rule_op_e;
+
+struct Rule {
+	uint32_t key;               // node << 16 | sensor << 8 | type
+	int line;
+	rule_op_e op;
+	bool isNumber;              // compared numerically
+	double number;
+	char text[MAX_PAYLOAD + 1];
+	bool copy;                  // the action takes the value
+	MyMessage action;
+	unsigned long hits;
+};
+
+struct RuleSlot {
+	uint32_t key;
+	uint16_t first;             // rules of the key, rules[first..first+count-1]
+	uint16_t count;             // 0: free
+};
+
+static Rule rules[RULES_MAX];
+static unsigned int ruleCount = 0;
+static RuleSlot slots[RULES_SLOTS];
+
+static const char *ops[] = { "", "==", "!=", "<", "<=", ">", ">=" };
+
+static unsigned int slotOf(uint32_t key)
+{
+	return (key * 2654435761U) >> 16 & (RULES_SLOTS - 1);
+}
+
+/*
+ * The text as a number, false if it isn't one
+ */
+static bool number(const char *text, double *value)
+{
+	char *end;
+
+	*value = strtod(text, &end);
+	return end != text && *end == '\0';
+}
+
+/*
+ * The text of a line without comment and surrounding white space
+ */
+static char *trim(char *text)
+{
+	char *end;
+
+	if ((end = strchr(text, '#')) != NULL) {
+		*end = '\0';
+	}
+	end = text + strlen(text);
+	while (end > text && isspace((unsigned char)end[-1])) {
+		*--end = '\0';
+	}
+	while (isspace((unsigned char)*text)) {
+		text++;
+	}
+	return text;
+}
+
+/*
+ * One rule, false if it is malformed
+ */
+static bool parseRule(char *text, Rule *rule)
+{
+	unsigned int node, sensor, type, command, ack;
+	char op[3], value[MAX_PAYLOAD + 1];
+	char *arrow, *payload;
+	int n = 0;
+
+	if ((arrow = strstr(text, "->")) == NULL) {
+		return false;
+	}
+	*arrow = '\0';
+
+	// The trigger and its condition
+	if (sscanf(text, "%u;%u;%u %n", &node, &sensor, &type, &n) != 3 || n == 0 || node > 255 || sensor > 255 || type > 255) {
+		return false;
+	}
+	rule->key = node << 16 | sensor << 8 | type;
+	rule->op = OP_ANY;
+	text += n;
+	if (*text != '\0') {
+		n = 0;
+		if (sscanf(text, "%2[=!<>] %25[^ \t] %n", op, value, &n) != 2 || text[n] != '\0') {
+			return false;
+		}
+		for (unsigned int i = OP_EQ; i <= OP_GE && rule->op == OP_ANY; i++) {
+			if (strcmp(op, ops[i]) == 0) {
+				rule->op = (rule_op_e)i;
+			}
+		}
+		rule->isNumber = number(value, &rule->number);
+		if (rule->op == OP_ANY || (!rule->isNumber && rule->op != OP_EQ && rule->op != OP_NE)) {
+			return false;
+		}
+		strcpy(rule->text, value);
+	}
+
+	// The action, as parseAndSend() takes it from the controller
+	text = arrow + 2;
+	n = 0;
+	if (sscanf(text, " %u;%u;%u;%u;%u;%n", &node, &sensor, &command, &ack, &type, &n) != 5 || n == 0 ||
+			node > 255 || sensor > 255 || command > C_INTERNAL || ack > 1 || type > 255) {
+		return false;
+	}
+	payload = text + n;
+	if (strlen(payload) > MAX_PAYLOAD || strpbrk(payload, " \t;") != NULL) {
+		return false;
+	}
+	rule->copy = strcmp(payload, "$") == 0;
+	rule->action.sender = GATEWAY_ADDRESS;
+	rule->action.destination = node;
+	rule->action.sensor = sensor;
+	rule->action.type = type;
+	mSetCommand(rule->action, command);
+	mSetRequestAck(rule->action, ack);
+	mSetAck(rule->action, false);
+	rule->action.set(payload);
+	rule->action.data[mGetLength(rule->action)] = '\0';
+	rule->hits = 0;
+	return true;
+}
+
+/*
+ * Sort the rules by key, in the order of the file within a key, and
+ * build the table of keys.
+ */
+static bool compile()
+{
+	for (unsigned int i = 1; i < ruleCount; i++) {
+		Rule rule = rules[i];
+		unsigned int j = i;
+		for (; j > 0 && rules[j - 1].key > rule.key; j--) {
+			rules[j] = rules[j - 1];
+		}
+		rules[j] = rule;
+	}
+	memset(slots, 0, sizeof(slots));
+	for (unsigned int first = 0, last; first < ruleCount; first = last) {
+		for (last = first + 1; last < ruleCount && rules[last].key == rules[first].key; last++)
+			;
+		if (last - first > RULES_MAX_ACTIONS) {
+			errno = E2BIG;
+			return false;
+		}
+		unsigned int i = slotOf(rules[first].key);
+		while (slots[i].count > 0) {
+			i = (i + 1) & (RULES_SLOTS - 1);
+		}
+		slots[i].key = rules[first].key;
+		slots[i].first = first;
+		slots[i].count = last - first;
+	}
+	return true;
+}
+
+bool rulesLoad(const char *path, int *line)
+{
+	char buffer[RULES_LINE_LENGTH];
+	FILE *file;
+	bool ok = true;
+	int number = 0;
+
+	*line = 0;
+	rulesUnload();
+	if ((file = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	while (ok && fgets(buffer, sizeof(buffer), file) != NULL) {
+		number++;
+		bool complete = strchr(buffer, '\n') != NULL || feof(file);
+		char *text = trim(buffer);
+		if (*text == '\0' && complete) {
+			continue;
+		}
+		if (ruleCount == RULES_MAX) {
+			errno = ENOSPC;
+			ok = false;
+		} else if (!complete || !parseRule(text, &rules[ruleCount])) {
+			// Too long or malformed
+			errno = EINVAL;
+			ok = false;
+		} else {
+			rules[ruleCount++].line = number;
+		}
+	}
+	if (!ok) {
+		*line = number;
+	} else if (ferror(file)) {
+		errno = EIO;
+		ok = false;
+	}
+	fclose(file);
+	if (!ok || !compile()) {
+		rulesUnload();
+		return false;
+	}
+	return true;
+}
+
+void rulesUnload()
+{
+	ruleCount = 0;
+	memset(slots, 0, sizeof(slots));
+}
+
+unsigned int rulesCount()
+{
+	return ruleCount;
+}
+
+static bool fires(const Rule *rule, bool isNumber, double value, const char *text)
+{
+	int order;
+
+	if (rule->op == OP_ANY) {
+		return true;
+	}
+	if (rule->isNumber && isNumber) {
+		order = value < rule->number ? -1 : value > rule->number;
+	} else if (rule->op == OP_EQ || rule->op == OP_NE) {
+		order = strcmp(text, rule->text);
+	} else {
+		return false;
+	}
+	switch (rule->op) {
+		case OP_EQ: return order == 0;
+		case OP_NE: return order != 0;
+		case OP_LT: return order < 0;
+		case OP_LE: return order <= 0;
+		case OP_GT: return order > 0;
+		case OP_GE: return order >= 0;
+		default:    return false;
+	}
+}
+
+static uint64_t nowNs()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int match(const MyMessage &message, MyMessage *actions, unsigned int max)
+{
+	char text[MAX_PAYLOAD * 2 + 1];
+	unsigned int count = 0;
+	double value;
+
+	if (mGetCommand(message) != C_SET || mGetAck(message)) {
+		return 0;
+	}
+	uint32_t key = (uint32_t)message.sender << 16 | message.sensor << 8 | message.type;
+	unsigned int i = slotOf(key);
+	while (slots[i].count > 0 && slots[i].key != key) {
+		i = (i + 1) & (RULES_SLOTS - 1);
+	}
+	if (slots[i].count == 0) {
+		return 0;
+	}
+	metricInc(M_RULE_VALUES);
+	message.getString(text);
+	bool isNumber = number(text, &value);
+	for (Rule *rule = &rules[slots[i].first]; rule < &rules[slots[i].first + slots[i].count] && count < max; rule++) {
+		if (!fires(rule, isNumber, value, text)) {
+			continue;
+		}
+		MyMessage &action = actions[count++];
+		action = rule->action;
+		if (rule->copy) {
+			memcpy(action.data, message.data, mGetLength(message));
+			action.data[mGetLength(message)] = '\0';
+			mSetLength(action, mGetLength(message));
+			mSetPayloadType(action, mGetPayloadType(message));
+		}
+		__atomic_fetch_add(&rule->hits, 1, __ATOMIC_RELAXED);
+		metricInc(M_RULE_ACTIONS);
+	}
+	return count;
+}
+
+unsigned int rulesMatch(const MyMessage &message, MyMessage *actions, unsigned int max)
+{
+	if (ruleCount == 0) {
+		return 0;
+	}
+	uint64_t start = nowNs();
+	unsigned int count = match(message, actions, max);
+	metricInc(M_RULE_LOOKUPS);
+	metricAdd(M_RULE_TIME, nowNs() - start);
+	return count;
+}
+
+void rulesDump(void (*print)(const char *line))
+{
+	char condition[MAX_PAYLOAD + 5];
+	char line[128];
+
+	for (unsigned int i = 0; i < ruleCount; i++) {
+		const Rule *rule = &rules[i];
+		condition[0] = '\0';
+		if (rule->op != OP_ANY) {
+			snprintf(condition, sizeof(condition), " %s %s", ops[rule->op], rule->text);
+		}
+		snprintf(line, sizeof(line), "rule %d %d;%d;%d%s -> %d;%d;%d: %lu hits\n", rule->line,
+				rule->key >> 16, rule->key >> 8 & 0xff, rule->key & 0xff, condition,
+				rule->action.destination, rule->action.sensor, rule->action.type,
+				__atomic_load_n(&rule->hits, __ATOMIC_RELAXED));
+		print(line);
+	}
+}
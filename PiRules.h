@@ -0,0 +1,69 @@
+/*
+ * PiRules.h - Actions the gateway takes itself on values from the nodes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * A motion sensor switching a light goes radio, PTY, controller, PTY and
+ * radio again, which takes hundreds of ms. Rules loaded from a file let the
+ * gateway send the message to the light itself, one rule per line:
+ *
+ *   <node>;<sensor>;<type> [<op> <value>] -> <node>;<sensor>;<command>;<ack>;<type>;<payload>
+ *
+ * e.g. "12;1;16 == 1 -> 14;1;1;1;2;1" turns on the light 14/1 when motion
+ * sensor 12/1 trips. The condition compares the value of a C_SET message
+ * from the node with op (==, !=, <, <=, >, >=), numerically if both are
+ * numbers, as text otherwise (== and != only); without one every value
+ * fires. The action is a command line as the controller would write it,
+ * a payload of '$' copies the value. '#' starts a comment. The rules of a
+ * (node, sensor, type), at most RULES_MAX_ACTIONS, fire in the order of
+ * the file.
+ *
+ * The rules are compiled into a table by (node, sensor, type), so a message
+ * costs one hash lookup, and a condition per rule of its key. The file is
+ * loaded before the radios start and read only afterwards; the hits of each
+ * rule are counted atomically from the radio threads. The time rulesMatch()
+ * takes is added up in mysensors_rule_lookup_nanoseconds_total.
+ */
+
+#ifndef __PiRules_H__
+#define __PiRules_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyMessage.h"
+
+#define RULES_MAX         256
+#define RULES_SLOTS       512       // (node, sensor, type) with rules, a power of two
+#define RULES_MAX_ACTIONS 8         // actions fired by one message
+#define RULES_LINE_LENGTH 256
+
+/**
+ * Load the rules from the file at path, replacing any loaded before.
+ * Returns false with errno set if the file can't be read, a rule is
+ * malformed (line is its line number, 0 otherwise), or there are more than
+ * RULES_MAX rules or RULES_MAX_ACTIONS for a (node, sensor, type).
+ */
+bool rulesLoad(const char *path, int *line);
+
+/**
+ * Drop all rules.
+ */
+void rulesUnload();
+
+unsigned int rulesCount();
+
+/**
+ * The actions of the rules that fire on message, at most max of them,
+ * as messages from the gateway ready to be sent. Returns their number.
+ */
+unsigned int rulesMatch(const MyMessage &message, MyMessage *actions, unsigned int max);
+
+/**
+ * Print the hits of every rule, one line per rule.
+ */
+void rulesDump(void (*print)(const char *line));
+
+#endif /* __PiRules_H__ */
@@ -0,0 +1,967 @@
+/*
+ * PiSeries.cpp - Readings of the nodes kept on the gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "PiSeries.h"
+#include "MyMetrics.h"
+
+#define MINUTE_MS    60000ULL
+#define HOUR_MS      3600000ULL
+#define PARTITION_MS (SERIES_PARTITION * 1000ULL)
+#define SERIES_SLOTS (2 * SERIES_MAX)   // a power of two
+#define ROLLUP_KINDS 2                  // minutes and hours
+
+// Largest encoded block: varint time, count and three value columns per entry
+#define BLOCK_SIZE (sizeof(SeriesBlockHeader) + SERIES_PENDING * (10 + 5 + 3 * 10))
+
+struct SeriesReading {
+	uint64_t time;      // ms since the epoch
+	double value;
+	uint32_t key;       // node << 16 | sensor << 8 | type
+};
+
+struct SeriesSlot {
+	uint32_t seq;       // free for position seq, or filled for position seq - 1
+	SeriesReading reading;
+};
+
+struct Rollup {
+	uint64_t start;     // ms
+	uint32_t count;     // 0: none
+	double min;
+	double max;
+	double sum;
+};
+
+struct Series {
+	uint32_t key;
+	uint64_t lastTime;
+	double lastValue;
+	uint16_t pending;                       // readings not written yet
+	uint64_t times[SERIES_PENDING];
+	double values[SERIES_PENDING];
+	Rollup open[ROLLUP_KINDS];              // minute and hour in progress
+	uint16_t closed[ROLLUP_KINDS];          // over, not written yet
+	Rollup rollups[ROLLUP_KINDS][SERIES_ROLLUPS];
+};
+
+struct Segment {
+	int fd;
+	uint8_t *map;
+	size_t size;
+	uint64_t start;     // ms, the partition
+	uint32_t used;      // bytes appended
+	uint32_t synced;    // bytes on the card and in the header
+};
+
+struct SeriesQuery {
+	FILE *out;
+	uint32_t key;
+	uint8_t kind;       // blocks the answer comes from
+	bool downsample;
+	uint64_t from;
+	uint64_t to;
+	uint64_t step;
+	Rollup bucket;
+};
+
+volatile bool seriesEnabled = false;
+
+static SeriesSlot queue[SERIES_QUEUE_SIZE];
+static uint32_t queueTail = 0;  // next position to fill
+static uint32_t queueHead = 0;  // next position to store
+
+static char *directory = NULL;
+static char socketPath[sizeof(((sockaddr_un *)NULL)->sun_path)];
+static int serverFd = -1;
+static pthread_t writer;
+static pthread_t server;
+static volatile bool writerRunning = false;
+
+// Touched by the writer and, for a query, the server thread, with storeLock held
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+static Series *table[SERIES_SLOTS];
+static Series *series[SERIES_MAX];
+static unsigned int seriesCount = 0;
+static Segment segment = { -1, NULL, 0, 0, 0, 0 };
+static uint8_t block[BLOCK_SIZE];
+
+static const uint64_t periods[ROLLUP_KINDS] = { MINUTE_MS, HOUR_MS };
+static const double scales[SERIES_MAX_DECIMALS + 1] = { 1, 10, 100, 1e3, 1e4, 1e5, 1e6 };
+
+static uint64_t now()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The payload as a number, false for custom payloads and text that isn't one
+ */
+static bool numeric(const MyMessage &message, double *value)
+{
+	char *end;
+
+	switch (mGetPayloadType(message)) {
+		case P_BYTE:    *value = message.getByte(); return true;
+		case P_INT16:   *value = message.getInt(); return true;
+		case P_UINT16:  *value = message.getUInt(); return true;
+		case P_LONG32:  *value = message.getLong(); return true;
+		case P_ULONG32: *value = message.getULong(); return true;
+		case P_FLOAT32: *value = message.getFloat(); return true;
+		case P_STRING:
+			*value = strtod(message.data, &end);
+			return end != message.data && *end == '\0' && isfinite(*value);
+		default:
+			return false;
+	}
+}
+
+/*
+ * Bounded multi producer queue as in PiLog.cpp
+ */
+void seriesRecord(const MyMessage &message)
+{
+	uint32_t pos = __atomic_load_n(&queueTail, __ATOMIC_RELAXED);
+	SeriesSlot *slot;
+	double value;
+
+	if (!seriesEnabled || mGetCommand(message) != C_SET || mGetAck(message) || !numeric(message, &value)) {
+		return;
+	}
+	for (;;) {
+		slot = &queue[pos & (SERIES_QUEUE_SIZE - 1)];
+		int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queueTail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			metricInc(M_SERIES_DROPPED);
+			return;
+		} else {
+			pos = __atomic_load_n(&queueTail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->reading.time = now();
+	slot->reading.value = value;
+	slot->reading.key = (uint32_t)message.sender << 16 | message.sensor << 8 | message.type;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static Series *find(uint32_t key, bool create)
+{
+	unsigned int i = (key * 2654435761U) >> 16 & (SERIES_SLOTS - 1);
+
+	while (table[i] != NULL) {
+		if (table[i]->key == key) {
+			return table[i];
+		}
+		i = (i + 1) & (SERIES_SLOTS - 1);
+	}
+	if (!create || seriesCount == SERIES_MAX) {
+		return NULL;
+	}
+	Series *s = new Series;
+	memset(s, 0, sizeof(*s));
+	s->key = key;
+	table[i] = series[seriesCount++] = s;
+	metricSetGlobal(M_SERIES, seriesCount);
+	return s;
+}
+
+static void closeRollup(Series *s, int kind)
+{
+	s->rollups[kind][s->closed[kind]++] = s->open[kind];
+	s->open[kind].count = 0;
+}
+
+/*
+ * Add a reading to its series, true if the series must be written before
+ * it takes another one
+ */
+static bool add(const SeriesReading &reading)
+{
+	Series *s = find(reading.key, true);
+
+	if (s == NULL) {
+		metricInc(M_SERIES_DROPPED);
+		return false;
+	}
+	s->times[s->pending] = reading.time;
+	s->values[s->pending++] = reading.value;
+	s->lastTime = reading.time;
+	s->lastValue = reading.value;
+	for (int kind = 0; kind < ROLLUP_KINDS; kind++) {
+		Rollup *r = &s->open[kind];
+		uint64_t start = reading.time - reading.time % periods[kind];
+		if (r->count > 0 && r->start != start) {
+			closeRollup(s, kind);
+		}
+		if (r->count == 0) {
+			r->start = start;
+			r->min = r->max = reading.value;
+			r->sum = 0;
+		}
+		r->count++;
+		r->sum += reading.value;
+		if (reading.value < r->min) {
+			r->min = reading.value;
+		}
+		if (reading.value > r->max) {
+			r->max = reading.value;
+		}
+	}
+	metricInc(M_SERIES_STORED);
+	return s->pending == SERIES_PENDING || s->closed[0] == SERIES_ROLLUPS || s->closed[1] == SERIES_ROLLUPS;
+}
+
+/*
+ * Take the queued readings until a series is full, true if one is
+ */
+static bool drain()
+{
+	for (;;) {
+		uint32_t pos = queueHead;
+		SeriesSlot *slot = &queue[pos & (SERIES_QUEUE_SIZE - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+			return false;
+		}
+		SeriesReading reading = slot->reading;
+		__atomic_store_n(&slot->seq, pos + SERIES_QUEUE_SIZE, __ATOMIC_RELEASE);
+		queueHead = pos + 1;
+		if (add(reading)) {
+			return true;
+		}
+	}
+}
+
+static uint8_t *putVarint(uint8_t *p, uint64_t value)
+{
+	while (value >= 0x80) {
+		*p++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static const uint8_t *getVarint(const uint8_t *p, const uint8_t *end, uint64_t *value)
+{
+	*value = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		*value |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+	return (uint64_t)value << 1 ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/*
+ * The fewest decimals that keep every value to 1e-7 of itself, about as
+ * precise as the float payloads they mostly come from
+ */
+static uint8_t decimalsOf(const double *columns[], int columnCount, unsigned int count)
+{
+	for (uint8_t decimals = 0; decimals <= SERIES_MAX_DECIMALS; decimals++) {
+		bool fits = true;
+		for (int c = 0; c < columnCount && fits; c++) {
+			for (unsigned int i = 0; i < count && fits; i++) {
+				double scaled = columns[c][i] * scales[decimals];
+				fits = fabs(scaled) < 1e15 && fabs(round(scaled) / scales[decimals] - columns[c][i]) <= fabs(columns[c][i]) * 1e-7 + 1e-9;
+			}
+		}
+		if (fits) {
+			return decimals;
+		}
+	}
+	return SERIES_DOUBLES;
+}
+
+static uint8_t *putColumn(uint8_t *p, const double *values, unsigned int count, uint8_t decimals)
+{
+	int64_t last = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (decimals == SERIES_DOUBLES) {
+			memcpy(p, &values[i], sizeof(double));
+			p += sizeof(double);
+		} else {
+			int64_t scaled = llround(values[i] * scales[decimals]);
+			p = putVarint(p, zigzag(scaled - last));
+			last = scaled;
+		}
+	}
+	return p;
+}
+
+static const uint8_t *getColumn(const uint8_t *p, const uint8_t *end, double *values, unsigned int count, uint8_t decimals)
+{
+	int64_t last = 0;
+	uint64_t delta;
+
+	for (unsigned int i = 0; i < count && p != NULL; i++) {
+		if (decimals == SERIES_DOUBLES) {
+			if (end - p < (ptrdiff_t)sizeof(double)) {
+				return NULL;
+			}
+			memcpy(&values[i], p, sizeof(double));
+			p += sizeof(double);
+		} else if ((p = getVarint(p, end, &delta)) != NULL) {
+			last += unzigzag(delta);
+			values[i] = last / scales[decimals];
+		}
+	}
+	return p;
+}
+
+/*
+ * Encode count entries of a series into block, counts and the last two
+ * columns only for rollups. Returns the length of the block.
+ */
+static size_t encode(uint8_t kind, uint32_t key, unsigned int count, const uint64_t *times, const uint32_t *counts,
+		const double *columns[], int columnCount)
+{
+	SeriesBlockHeader header;
+	uint8_t *p = block + sizeof(header);
+
+	header.kind = kind;
+	header.node = key >> 16;
+	header.sensor = key >> 8;
+	header.type = key;
+	header.count = count;
+	header.decimals = decimalsOf(columns, columnCount, count);
+	header.reserved = 0;
+	header.first = times[0];
+	for (unsigned int i = 0; i < count; i++) {
+		p = putVarint(p, zigzag(times[i] - (i > 0 ? times[i - 1] : times[0])));
+	}
+	for (unsigned int i = 0; counts != NULL && i < count; i++) {
+		p = putVarint(p, counts[i]);
+	}
+	for (int c = 0; c < columnCount; c++) {
+		p = putColumn(p, columns[c], count, header.decimals);
+	}
+	header.length = p - block - sizeof(header);
+	memcpy(block, &header, sizeof(header));
+	return p - block;
+}
+
+static void segmentName(char *name, size_t len, uint64_t start)
+{
+	snprintf(name, len, "%s/%llu.series", directory, (unsigned long long)(start / 1000));
+}
+
+/*
+ * Write the appended blocks to the card, then the used length that makes
+ * them part of the file
+ */
+static void segmentSync()
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (segment.map == NULL || segment.synced == segment.used) {
+		return;
+	}
+	size_t from = segment.synced / page * page;
+	msync(segment.map + from, segment.used - from, MS_SYNC);
+	((SeriesFileHeader *)segment.map)->used = segment.used;
+	msync(segment.map, page, MS_SYNC);
+	segment.synced = segment.used;
+}
+
+static void segmentClose()
+{
+	if (segment.map == NULL) {
+		return;
+	}
+	segmentSync();
+	munmap(segment.map, segment.size);
+	if (ftruncate(segment.fd, segment.used) != 0) {
+		// keeps its padding, readers stop at the used length
+	}
+	close(segment.fd);
+	segment.map = NULL;
+	segment.fd = -1;
+}
+
+/*
+ * Remove the segment files SERIES_KEEP partitions older than start
+ */
+static void prune(uint64_t start)
+{
+	char name[PATH_MAX];
+	unsigned long long seconds;
+	dirent *entry;
+	DIR *dir;
+	int n;
+
+	if ((dir = opendir(directory)) == NULL) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		n = 0;
+		if (sscanf(entry->d_name, "%llu.series%n", &seconds, &n) == 1 && n > 0 && entry->d_name[n] == '\0' &&
+				seconds * 1000 + SERIES_KEEP * PARTITION_MS <= start) {
+			segmentName(name, sizeof(name), seconds * 1000);
+			unlink(name);
+		}
+	}
+	closedir(dir);
+}
+
+/*
+ * Make the segment file of the partition starting at start the one blocks
+ * are appended to, created if there is none
+ */
+static bool segmentUse(uint64_t start)
+{
+	char name[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (segment.map != NULL && segment.start == start) {
+		return true;
+	}
+	segmentClose();
+	segmentName(name, sizeof(name), start);
+	if ((fd = open(name, O_RDWR | O_CREAT, 0640)) < 0) {
+		return false;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	bool created = st.st_size == 0;
+	size_t size = created ? SERIES_SEGMENT_SIZE : st.st_size;
+	if ((created && ftruncate(fd, size) != 0) || size < sizeof(SeriesFileHeader)) {
+		close(fd);
+		return false;
+	}
+	if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	SeriesFileHeader *header = (SeriesFileHeader *)map;
+	if (created) {
+		header->magic = SERIES_MAGIC;
+		header->version = 1;
+		header->reserved = 0;
+		header->start = start;
+		header->used = sizeof(*header);
+		header->reserved2 = 0;
+	} else if (header->magic != SERIES_MAGIC || header->used < sizeof(*header) || header->used > size) {
+		munmap(map, size);
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	segment.fd = fd;
+	segment.map = (uint8_t *)map;
+	segment.size = size;
+	segment.start = start;
+	segment.used = header->used;
+	segment.synced = created ? 0 : segment.used;
+	if (created) {
+		prune(start);
+	}
+	return true;
+}
+
+static bool segmentAppend(uint64_t time, size_t length)
+{
+	if (!segmentUse(time - time % PARTITION_MS)) {
+		return false;
+	}
+	if (segment.used + length > segment.size) {
+		size_t size = segment.size + SERIES_SEGMENT_SIZE;
+		void *map;
+		if (ftruncate(segment.fd, size) != 0 ||
+				(map = mremap(segment.map, segment.size, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+			return false;
+		}
+		segment.map = (uint8_t *)map;
+		segment.size = size;
+	}
+	memcpy(segment.map + segment.used, block, length);
+	segment.used += length;
+	metricAdd(M_SERIES_BYTES, length);
+	return true;
+}
+
+/*
+ * Number of entries from the first on in the same partition
+ */
+static unsigned int run(const uint64_t *times, unsigned int count)
+{
+	unsigned int n = 1;
+
+	while (n < count && times[n] / PARTITION_MS == times[0] / PARTITION_MS) {
+		n++;
+	}
+	return n;
+}
+
+static void writeReadings(Series *s)
+{
+	for (unsigned int i = 0, n; i < s->pending; i += n) {
+		const double *columns[] = { &s->values[i] };
+		n = run(&s->times[i], s->pending - i);
+		if (!segmentAppend(s->times[i], encode(SERIES_RAW, s->key, n, &s->times[i], NULL, columns, 1))) {
+			metricAdd(M_SERIES_DROPPED, n);
+		}
+	}
+	s->pending = 0;
+}
+
+static void writeRollups(Series *s, int kind)
+{
+	uint64_t times[SERIES_ROLLUPS];
+	uint32_t counts[SERIES_ROLLUPS];
+	double mins[SERIES_ROLLUPS], maxs[SERIES_ROLLUPS], sums[SERIES_ROLLUPS];
+
+	for (unsigned int i = 0; i < s->closed[kind]; i++) {
+		const Rollup *r = &s->rollups[kind][i];
+		times[i] = r->start;
+		counts[i] = r->count;
+		mins[i] = r->min;
+		maxs[i] = r->max;
+		sums[i] = r->sum;
+	}
+	for (unsigned int i = 0, n; i < s->closed[kind]; i += n) {
+		const double *columns[] = { &mins[i], &maxs[i], &sums[i] };
+		n = run(&times[i], s->closed[kind] - i);
+		segmentAppend(times[i], encode(SERIES_MINUTE + kind, s->key, n, &times[i], &counts[i], columns, 3));
+	}
+	s->closed[kind] = 0;
+}
+
+/*
+ * Write everything held in one batch. Rollups whose minute or hour is over
+ * go along, all of them when closing.
+ */
+static void flush(bool all)
+{
+	uint64_t time = now();
+
+	for (unsigned int i = 0; i < seriesCount; i++) {
+		Series *s = series[i];
+		for (int kind = 0; kind < ROLLUP_KINDS; kind++) {
+			if (s->open[kind].count > 0 && (all || time >= s->open[kind].start + periods[kind])) {
+				closeRollup(s, kind);
+			}
+		}
+		writeReadings(s);
+		writeRollups(s, 0);
+		writeRollups(s, 1);
+	}
+	segmentSync();
+	metricInc(M_SERIES_FLUSHES);
+}
+
+static void emitBucket(SeriesQuery *q)
+{
+	fprintf(q->out, "%llu;%.10g;%.10g;%.10g;%u\n", (unsigned long long)q->bucket.start, q->bucket.min, q->bucket.max,
+			q->bucket.sum / q->bucket.count, q->bucket.count);
+	q->bucket.count = 0;
+}
+
+static void emit(SeriesQuery *q, uint64_t time, uint32_t count, double min, double max, double sum)
+{
+	if (time < q->from || time >= q->to || count == 0) {
+		return;
+	}
+	if (!q->downsample) {
+		fprintf(q->out, "%llu;%.10g\n", (unsigned long long)time, min);
+		return;
+	}
+	uint64_t start = time - time % q->step;
+	if (q->bucket.count > 0 && q->bucket.start != start) {
+		emitBucket(q);
+	}
+	if (q->bucket.count == 0) {
+		q->bucket.start = start;
+		q->bucket.min = min;
+		q->bucket.max = max;
+		q->bucket.sum = 0;
+	}
+	q->bucket.count += count;
+	q->bucket.sum += sum;
+	if (min < q->bucket.min) {
+		q->bucket.min = min;
+	}
+	if (max > q->bucket.max) {
+		q->bucket.max = max;
+	}
+}
+
+static void decode(SeriesQuery *q, const SeriesBlockHeader &header, const uint8_t *p, const uint8_t *end)
+{
+	uint64_t times[SERIES_PENDING];
+	uint32_t counts[SERIES_PENDING];
+	double columns[3][SERIES_PENDING];
+	uint64_t value;
+	int columnCount = header.kind == SERIES_RAW ? 1 : 3;
+
+	if (header.count > SERIES_PENDING) {
+		return;
+	}
+	for (unsigned int i = 0; i < header.count; i++) {
+		if ((p = getVarint(p, end, &value)) == NULL) {
+			return;
+		}
+		times[i] = (i > 0 ? times[i - 1] : header.first) + unzigzag(value);
+	}
+	for (unsigned int i = 0; header.kind != SERIES_RAW && i < header.count; i++) {
+		if ((p = getVarint(p, end, &value)) == NULL) {
+			return;
+		}
+		counts[i] = value;
+	}
+	for (int c = 0; c < columnCount; c++) {
+		if ((p = getColumn(p, end, columns[c], header.count, header.decimals)) == NULL) {
+			return;
+		}
+	}
+	for (unsigned int i = 0; i < header.count; i++) {
+		if (header.kind == SERIES_RAW) {
+			emit(q, times[i], 1, columns[0][i], columns[0][i], columns[0][i]);
+		} else {
+			emit(q, times[i], counts[i], columns[0][i], columns[1][i], columns[2][i]);
+		}
+	}
+}
+
+static void scan(SeriesQuery *q, uint64_t start)
+{
+	char name[PATH_MAX];
+	SeriesBlockHeader header;
+	const uint8_t *map;
+	struct stat st;
+	size_t size = 0, used;
+	int fd = -1;
+
+	if (segment.map != NULL && segment.start == start) {
+		map = segment.map;
+		used = segment.used;
+	} else {
+		segmentName(name, sizeof(name), start);
+		if ((fd = open(name, O_RDONLY)) < 0) {
+			return;
+		}
+		if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SeriesFileHeader) ||
+				(map = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			close(fd);
+			return;
+		}
+		size = st.st_size;
+		used = ((const SeriesFileHeader *)map)->magic == SERIES_MAGIC ? ((const SeriesFileHeader *)map)->used : 0;
+		if (used > size) {
+			used = size;
+		}
+	}
+	for (size_t offset = sizeof(SeriesFileHeader); offset + sizeof(header) <= used; offset += sizeof(header) + header.length) {
+		memcpy(&header, map + offset, sizeof(header));
+		if (offset + sizeof(header) + header.length > used) {
+			break;
+		}
+		if (header.kind == q->kind && (uint32_t)(header.node << 16 | header.sensor << 8 | header.type) == q->key &&
+				header.first < q->to) {
+			decode(q, header, map + offset + sizeof(header), map + offset + sizeof(header) + header.length);
+		}
+	}
+	if (fd >= 0) {
+		munmap((void *)map, size);
+		close(fd);
+	}
+}
+
+static int compareStarts(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Answer a range or downsample query from the segment files overlapping
+ * it, oldest first, and what is held in memory
+ */
+static void query(SeriesQuery *q)
+{
+	uint64_t starts[SERIES_KEEP + 16];
+	unsigned long long seconds;
+	unsigned int count = 0;
+	dirent *entry;
+	DIR *dir;
+	int n;
+
+	if ((dir = opendir(directory)) != NULL) {
+		while ((entry = readdir(dir)) != NULL && count < sizeof(starts) / sizeof(starts[0])) {
+			n = 0;
+			if (sscanf(entry->d_name, "%llu.series%n", &seconds, &n) == 1 && n > 0 && entry->d_name[n] == '\0' &&
+					seconds * 1000 < q->to && seconds * 1000 + PARTITION_MS > q->from) {
+				starts[count++] = seconds * 1000;
+			}
+		}
+		closedir(dir);
+	}
+	qsort(starts, count, sizeof(starts[0]), compareStarts);
+	for (unsigned int i = 0; i < count; i++) {
+		scan(q, starts[i]);
+	}
+
+	Series *s = find(q->key, false);
+	if (s != NULL && q->kind == SERIES_RAW) {
+		for (unsigned int i = 0; i < s->pending; i++) {
+			emit(q, s->times[i], 1, s->values[i], s->values[i], s->values[i]);
+		}
+	} else if (s != NULL) {
+		int kind = q->kind - SERIES_MINUTE;
+		for (unsigned int i = 0; i < s->closed[kind]; i++) {
+			const Rollup *r = &s->rollups[kind][i];
+			emit(q, r->start, r->count, r->min, r->max, r->sum);
+		}
+		const Rollup *r = &s->open[kind];
+		emit(q, r->start, r->count, r->min, r->max, r->sum);
+	}
+	if (q->downsample && q->bucket.count > 0) {
+		emitBucket(q);
+	}
+}
+
+/*
+ * Answer request into out, with storeLock held
+ */
+static void answer(const char *request, FILE *out)
+{
+	unsigned int node, sensor, type;
+	unsigned long long from, to, step = 0;
+	SeriesQuery q;
+
+	q.out = out;
+	if (strncmp(request, "series", 6) == 0) {
+		for (unsigned int i = 0; i < seriesCount; i++) {
+			const Series *s = series[i];
+			fprintf(q.out, "%d;%d;%d;%llu;%.10g\n", s->key >> 16, s->key >> 8 & 0xff, s->key & 0xff,
+					(unsigned long long)s->lastTime, s->lastValue);
+		}
+	} else if ((sscanf(request, "range %u %u %u %llu %llu", &node, &sensor, &type, &from, &to) == 5 ||
+			(sscanf(request, "downsample %u %u %u %llu %llu %llu", &node, &sensor, &type, &from, &to, &step) == 6 && step > 0)) &&
+			node < 256 && sensor < 256 && type < 256) {
+		q.key = node << 16 | sensor << 8 | type;
+		q.downsample = step > 0;
+		q.kind = step == 0 ? SERIES_RAW : step % HOUR_MS == 0 ? SERIES_HOUR : step % MINUTE_MS == 0 ? SERIES_MINUTE : SERIES_RAW;
+		q.from = from;
+		q.to = to;
+		q.step = step;
+		q.bucket.count = 0;
+		query(&q);
+	} else {
+		fprintf(q.out, "error expected series, range <node> <sensor> <type> <from> <to>"
+				" or downsample <node> <sensor> <type> <from> <to> <step>\n");
+	}
+}
+
+/*
+ * The answer is put together in memory, the client gets it once the store
+ * is free again: a slow one doesn't hold up the writer
+ */
+static void serveClient(int fd)
+{
+	timeval timeout = { 1, 0 };
+	char request[128];
+	char *text = NULL;
+	size_t length = 0;
+	pollfd pfd;
+	ssize_t n = 0;
+	FILE *out;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) > 0) {
+		n = read(fd, request, sizeof(request) - 1);
+	}
+	request[n > 0 ? n : 0] = '\0';
+	if ((out = open_memstream(&text, &length)) == NULL) {
+		close(fd);
+		return;
+	}
+	metricInc(M_SERIES_QUERIES);
+	pthread_mutex_lock(&storeLock);
+	answer(request, out);
+	pthread_mutex_unlock(&storeLock);
+	fclose(out);
+	for (size_t sent = 0; sent < length; sent += n) {
+		if ((n = write(fd, text + sent, length - sent)) <= 0) {
+			break;
+		}
+	}
+	free(text);
+	close(fd);
+}
+
+/*
+ * Takes the readings and writes them every SERIES_FLUSH s
+ */
+static void *writerLoop(void *arg)
+{
+	uint64_t flushAt = now() + SERIES_FLUSH * 1000ULL;
+
+	while (writerRunning) {
+		pthread_mutex_lock(&storeLock);
+		bool full = drain();
+		if (full || now() >= flushAt) {
+			flush(false);
+			flushAt = now() + SERIES_FLUSH * 1000ULL;
+		}
+		pthread_mutex_unlock(&storeLock);
+		// A full series leaves readings in the queue, take them right away
+		if (!full) {
+			usleep(100000);
+		}
+	}
+	pthread_mutex_lock(&storeLock);
+	while (drain()) {
+		flush(false);
+	}
+	flush(true);
+	pthread_mutex_unlock(&storeLock);
+	return NULL;
+}
+
+/*
+ * Answers the queries on the socket, one client at a time
+ */
+static void *serverLoop(void *arg)
+{
+	while (writerRunning) {
+		pollfd pfd;
+		pfd.fd = serverFd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0) {
+			int client = accept(serverFd, NULL, NULL);
+			if (client >= 0) {
+				serveClient(client);
+			}
+		}
+	}
+	return NULL;
+}
+
+bool seriesOpen(const char *path)
+{
+	sockaddr_un addr;
+	struct stat st;
+
+	if (seriesEnabled) {
+		errno = EBUSY;
+		return false;
+	}
+	if (stat(path, &st) != 0) {
+		return false;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return false;
+	}
+	if ((size_t)snprintf(socketPath, sizeof(socketPath), "%s/%s", path, SERIES_SOCKET) >= sizeof(socketPath)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	unlink(socketPath);
+	if ((serverFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+	// Nobody can connect before listen(), the mode is set by then
+	if (bind(serverFd, (sockaddr *)&addr, sizeof(addr)) != 0 || chmod(socketPath, SERIES_SOCKET_MODE) != 0 ||
+			listen(serverFd, 4) != 0) {
+		unlink(socketPath);
+		close(serverFd);
+		serverFd = -1;
+		return false;
+	}
+	directory = strdup(path);
+	for (uint32_t i = 0; i < SERIES_QUEUE_SIZE; i++) {
+		queue[i].seq = queueTail + i;
+	}
+	queueHead = queueTail;
+	writerRunning = true;
+	bool writerStarted = pthread_create(&writer, NULL, writerLoop, NULL) == 0;
+	if (!writerStarted || pthread_create(&server, NULL, serverLoop, NULL) != 0) {
+		writerRunning = false;
+		if (writerStarted) {
+			pthread_join(writer, NULL);
+		}
+		close(serverFd);
+		serverFd = -1;
+		unlink(socketPath);
+		free(directory);
+		directory = NULL;
+		return false;
+	}
+	seriesEnabled = true;
+	return true;
+}
+
+void seriesClose()
+{
+	if (!seriesEnabled) {
+		return;
+	}
+	seriesEnabled = false;
+	writerRunning = false;
+	pthread_join(server, NULL);
+	pthread_join(writer, NULL);
+	segmentClose();
+	close(serverFd);
+	serverFd = -1;
+	unlink(socketPath);
+	for (unsigned int i = 0; i < seriesCount; i++) {
+		delete series[i];
+	}
+	memset(table, 0, sizeof(table));
+	seriesCount = 0;
+	metricSetGlobal(M_SERIES, 0);
+	free(directory);
+	directory = NULL;
+}
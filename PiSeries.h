@@ -0,0 +1,111 @@
+/*
+ * PiSeries.h - Readings of the nodes kept on the gateway
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Every numeric C_SET value from the network is recorded as a reading of
+ * its series (node, sensor, type) with the time it arrived. The radio
+ * threads only put the reading into a bounded lock-free queue; one thread
+ * keeps the store:
+ *
+ * - Readings are appended to memory mapped segment files in a directory,
+ *   one file per SERIES_PARTITION seconds, <partition start>.series. A file
+ *   is a SeriesFileHeader and blocks, each a SeriesBlockHeader and the
+ *   columns of one series: times as varint deltas, then values as varint
+ *   deltas of the values scaled to integers by 10^decimals (doubles if no
+ *   scale up to SERIES_MAX_DECIMALS keeps them).
+ * - Per series the minimum, maximum, sum and count of every minute and hour
+ *   are kept as readings arrive and written as blocks of their own once the
+ *   minute or hour is over: times, counts, then minimums, maximums and sums.
+ * - Readings and rollups are held in memory and written every SERIES_FLUSH
+ *   seconds, or when a series has SERIES_PENDING of them, in one batch with
+ *   one msync, so the SD card sees a few large writes instead of one per
+ *   reading. The header's used length is updated after the blocks are
+ *   synced, a file never ends in a partial block.
+ * - Files older than SERIES_KEEP partitions are removed.
+ *
+ * Queries come through the unix stream socket series.sock in the directory,
+ * mode SERIES_SOCKET_MODE, one line per connection, times in ms since the
+ * epoch. A thread of their own answers them, the answer is put together
+ * while the store is locked and sent after:
+ *
+ *   series                                    -> <node>;<sensor>;<type>;<time>;<value> per series seen since startup
+ *   range <node> <sensor> <type> <from> <to>  -> <time>;<value> per reading
+ *   downsample <node> <sensor> <type> <from> <to> <step>
+ *                                             -> <time>;<min>;<max>;<avg>;<count> per step with readings
+ *
+ * Downsampling uses the hour rollups for whole hours, the minute rollups
+ * for whole minutes and the readings otherwise. Readings not written yet
+ * are included.
+ */
+
+#ifndef __PiSeries_H__
+#define __PiSeries_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyMessage.h"
+
+#define SERIES_QUEUE_SIZE    1024      // readings on their way to the store, a power of two
+#define SERIES_MAX           512       // series kept
+#define SERIES_PENDING       256       // readings of a series held before a write
+#define SERIES_ROLLUPS       16        // minutes or hours of a series held before a write
+#define SERIES_FLUSH         300       // s between writes
+#define SERIES_PARTITION     86400     // s per segment file
+#define SERIES_KEEP          90        // segment files kept
+#define SERIES_SEGMENT_SIZE  (256UL * 1024) // segment files grow by this
+#define SERIES_MAX_DECIMALS  6
+#define SERIES_DOUBLES       0xff      // decimals of values stored as doubles
+#define SERIES_MAGIC         0x5354534d // "MSTS"
+#define SERIES_SOCKET        "series.sock"
+#define SERIES_SOCKET_MODE   0660
+
+#define SERIES_RAW    0
+#define SERIES_MINUTE 1
+#define SERIES_HOUR   2
+
+struct SeriesFileHeader {
+	uint32_t magic;
+	uint16_t version;   // 1
+	uint16_t reserved;
+	uint64_t start;     // ms, start of the partition
+	uint32_t used;      // bytes of header and complete blocks
+	uint32_t reserved2;
+} __attribute__((packed));
+
+struct SeriesBlockHeader {
+	uint8_t kind;       // SERIES_RAW, SERIES_MINUTE or SERIES_HOUR
+	uint8_t node;
+	uint8_t sensor;
+	uint8_t type;
+	uint16_t count;     // readings or rollups
+	uint8_t decimals;   // values scaled by 10^decimals, or SERIES_DOUBLES
+	uint8_t reserved;
+	uint32_t length;    // bytes of the columns after the header
+	uint64_t first;     // ms, the time deltas start from here
+} __attribute__((packed));
+
+/* true while the store is open, checked before any work is done on the radio path */
+extern volatile bool seriesEnabled;
+
+/**
+ * Open the store in directory, an absolute path, and start its thread.
+ * Returns false with errno set if the directory or the socket can't be used.
+ */
+bool seriesOpen(const char *directory);
+
+/**
+ * Write what is held, stop the thread and close the store.
+ */
+void seriesClose();
+
+/**
+ * Record the value of message if it is a numeric C_SET from a node. Lock
+ * free, may be called from any thread; dropped if the queue is full.
+ */
+void seriesRecord(const MyMessage &message);
+
+#endif /* __PiSeries_H__ */
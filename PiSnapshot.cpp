@@ -0,0 +1,583 @@
+/*
+ * PiSnapshot.cpp - Gateway state kept across restarts
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "PiSnapshot.h"
+#include "MySensor.h"
+#include "PiFirmware.h"
+#include "PiLog.h"
+#include "MyMetrics.h"
+
+#define VALUE_FREE 0    // no key of a node, node 0 isn't kept
+
+// Largest snapshot
+#define SNAPSHOT_SIZE (sizeof(SnapshotHeader) + SNAPSHOT_MAX_RADIOS * sizeof(SnapshotRadio) + \
+		256 * sizeof(SnapshotNode) + 0xffff * sizeof(uint64_t) + SNAPSHOT_VALUES * sizeof(MyMessage))
+
+struct SnapshotRadioState {
+	uint64_t baseRadioId;
+	uint8_t *eeprom;            // image of the running radio, NULL until attached
+	uint8_t saved[EEPROM_SIZE]; // image taken from the snapshot
+};
+
+struct SnapshotNodeState {
+	uint64_t radio;             // address base of the radio
+	uint64_t heard;             // ms since the epoch, 0: never
+};
+
+struct SnapshotValue {
+	uint32_t key;               // node << 24 | sensor << 16 | command << 8 | type (0 for presentations)
+	MyMessage message;
+};
+
+volatile bool snapshotEnabled = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t writing = PTHREAD_MUTEX_INITIALIZER; // one snapshot file written at a time
+static pthread_cond_t stop = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static bool running = false;
+static char *path = NULL;
+static char *tmpPath = NULL;
+static bool attached = false;
+static SnapshotRadioState radios[SNAPSHOT_MAX_RADIOS];
+static unsigned int radioCount = 0;
+static SnapshotNodeState nodes[256];
+static SnapshotValue values[SNAPSHOT_VALUES];
+static unsigned int valueCount = 0;
+static uint64_t inclusionEnd = 0;
+
+static uint64_t now()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void reset()
+{
+	radioCount = 0;
+	attached = false;
+	memset(nodes, 0, sizeof(nodes));
+	for (unsigned int i = 0; i < SNAPSHOT_VALUES; i++) {
+		values[i].key = VALUE_FREE;
+	}
+	valueCount = 0;
+	inclusionEnd = 0;
+	metricSetGlobal(M_SNAPSHOT_VALUES, 0);
+}
+
+/*
+ * Presentations, sketch information and values are kept, one per key
+ */
+static uint32_t keyOf(const MyMessage &message)
+{
+	uint8_t command = mGetCommand(message);
+
+	switch (command) {
+		case C_PRESENTATION:
+			return (uint32_t)message.sender << 24 | message.sensor << 16 | command << 8;
+		case C_SET:
+			break;
+		case C_INTERNAL:
+			if (message.type == I_SKETCH_NAME || message.type == I_SKETCH_VERSION || message.type == I_BATTERY_LEVEL) {
+				break;
+			}
+			return VALUE_FREE;
+		default:
+			return VALUE_FREE;
+	}
+	return (uint32_t)message.sender << 24 | message.sensor << 16 | command << 8 | message.type;
+}
+
+/*
+ * Open addressing as in PiFilter.cpp, entries are never removed. NULL if
+ * the table is full.
+ */
+static SnapshotValue *lookup(uint32_t key)
+{
+	unsigned int i = (key * 2654435761U) >> 16 & (SNAPSHOT_VALUES - 1);
+
+	for (;; i = (i + 1) & (SNAPSHOT_VALUES - 1)) {
+		if (values[i].key == key) {
+			return &values[i];
+		}
+		if (values[i].key == VALUE_FREE) {
+			if (valueCount == SNAPSHOT_VALUES * 3 / 4) {
+				return NULL;
+			}
+			valueCount++;
+			metricSetGlobal(M_SNAPSHOT_VALUES, valueCount);
+			values[i].key = key;
+			return &values[i];
+		}
+	}
+}
+
+static SnapshotRadioState *findRadio(uint64_t baseRadioId)
+{
+	for (unsigned int i = 0; i < radioCount; i++) {
+		if (radios[i].baseRadioId == baseRadioId) {
+			return &radios[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take back the state from a snapshot image, false if it is damaged
+ */
+static bool restore(const uint8_t *image, size_t size)
+{
+	SnapshotHeader header;
+
+	if (size < sizeof(header)) {
+		return false;
+	}
+	memcpy(&header, image, sizeof(header));
+	const uint8_t *p = image + sizeof(header);
+	if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.length != size - sizeof(header) ||
+			header.radios > SNAPSHOT_MAX_RADIOS || header.nodes > 256 || header.values > SNAPSHOT_VALUES * 3 / 4 ||
+			header.length != header.radios * sizeof(SnapshotRadio) + header.nodes * sizeof(SnapshotNode) +
+			header.metrics * sizeof(uint64_t) + header.values * sizeof(MyMessage) ||
+			firmwareCrc16(p, header.length) != header.crc) {
+		return false;
+	}
+
+	for (unsigned int i = 0; i < header.radios; i++, p += sizeof(SnapshotRadio)) {
+		SnapshotRadio radio;
+		memcpy(&radio, p, sizeof(radio));
+		radios[i].baseRadioId = radio.baseRadioId;
+		radios[i].eeprom = NULL;
+		memcpy(radios[i].saved, radio.eeprom, EEPROM_SIZE);
+	}
+	radioCount = header.radios;
+	for (unsigned int i = 0; i < header.nodes; i++, p += sizeof(SnapshotNode)) {
+		SnapshotNode node;
+		memcpy(&node, p, sizeof(node));
+		if (node.radio < radioCount) {
+			nodes[node.node].radio = radios[node.radio].baseRadioId;
+			nodes[node.node].heard = node.heard;
+		}
+	}
+	// Counters go on from where they were, gauges start over
+	for (unsigned int i = 0; i < header.metrics; i++, p += sizeof(uint64_t)) {
+		uint64_t value;
+		memcpy(&value, p, sizeof(value));
+		if (header.metrics == METRICS_COUNT && metricIsCounter((metric_id)i)) {
+			metricAdd((metric_id)i, value);
+		}
+	}
+	for (unsigned int i = 0; i < header.values; i++, p += sizeof(MyMessage)) {
+		MyMessage message;
+		SnapshotValue *value;
+		memcpy(&message, p, sizeof(message));
+		uint32_t key = keyOf(message);
+		if (key != VALUE_FREE && message.sender != BROADCAST_ADDRESS && (value = lookup(key)) != NULL) {
+			value->message = message;
+		}
+	}
+	inclusionEnd = header.inclusionEnd;
+	return true;
+}
+
+/*
+ * Writes the snapshot every SNAPSHOT_INTERVAL s, away from the threads of
+ * the radios and the controller: the fsync can take long on an SD card
+ */
+static void *writeLoop(void *)
+{
+	pthread_mutex_lock(&lock);
+	while (running) {
+		uint64_t due = now() + SNAPSHOT_INTERVAL * 1000ULL;
+		timespec until;
+		until.tv_sec = due / 1000;
+		until.tv_nsec = due % 1000 * 1000000;
+		while (running && pthread_cond_timedwait(&stop, &lock, &until) != ETIMEDOUT) {
+		}
+		if (!running) {
+			break;
+		}
+		pthread_mutex_unlock(&lock);
+		if (!snapshotWrite()) {
+			log(LOG_ERR, "Could not write the snapshot to %s (%d) %s\n", path, errno, strerror(errno));
+		}
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+bool snapshotOpen(const char *file)
+{
+	char cwd[PATH_MAX];
+	struct stat st;
+	uint8_t *image;
+	bool warm = false;
+	int fd, error = 0;
+
+	if (snapshotEnabled) {
+		errno = EBUSY;
+		return false;
+	}
+	// Written after daemonize() changed the directory
+	if (file[0] == '/') {
+		path = strdup(file);
+	} else if (getcwd(cwd, sizeof(cwd)) != NULL && (path = (char *)malloc(strlen(cwd) + strlen(file) + 2)) != NULL) {
+		sprintf(path, "%s/%s", cwd, file);
+	}
+	if (path == NULL || (tmpPath = (char *)malloc(strlen(path) + 5)) == NULL) {
+		free(path);
+		path = NULL;
+		errno = ENOMEM;
+		return false;
+	}
+	sprintf(tmpPath, "%s.tmp", path);
+
+	pthread_mutex_lock(&lock);
+	reset();
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		error = errno;
+	} else {
+		if (fstat(fd, &st) != 0) {
+			error = errno;
+		} else if (st.st_size > (off_t)SNAPSHOT_SIZE) {
+			error = EINVAL;
+		} else if ((image = (uint8_t *)malloc(st.st_size + 1)) == NULL) {
+			error = ENOMEM;
+		} else {
+			ssize_t size = read(fd, image, st.st_size + 1);
+			if (size < 0) {
+				error = errno;
+			} else if (size != st.st_size || !restore(image, size)) {
+				reset();
+				error = EINVAL;
+			} else {
+				warm = true;
+			}
+			free(image);
+		}
+		close(fd);
+	}
+	snapshotEnabled = true;
+	pthread_mutex_unlock(&lock);
+	errno = error;
+	return warm;
+}
+
+bool snapshotStart()
+{
+	int error;
+
+	pthread_mutex_lock(&lock);
+	if (!snapshotEnabled || running) {
+		pthread_mutex_unlock(&lock);
+		return true;
+	}
+	error = pthread_create(&writer, NULL, writeLoop, NULL);
+	running = error == 0;
+	pthread_mutex_unlock(&lock);
+	errno = error;
+	return running;
+}
+
+/*
+ * The snapshot image, NULL without memory. The EEPROM images of the radios
+ * are copied while their threads run: a route changing meanwhile is in the
+ * next snapshot.
+ */
+static uint8_t *build(size_t *size)
+{
+	SnapshotHeader header;
+	uint8_t index[256];
+	unsigned int nodeCount = 0;
+
+	memset(index, SNAPSHOT_NO_RADIO, sizeof(index));
+	for (unsigned int node = 1; node < 255; node++) {
+		for (unsigned int i = 0; i < radioCount && nodes[node].heard != 0; i++) {
+			if (radios[i].baseRadioId == nodes[node].radio) {
+				index[node] = i;
+				nodeCount++;
+				break;
+			}
+		}
+	}
+	memset(&header, 0, sizeof(header));
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.written = now();
+	header.inclusionEnd = inclusionEnd;
+	header.radios = radioCount;
+	header.nodes = nodeCount;
+	header.metrics = METRICS_COUNT;
+	header.values = valueCount;
+	header.length = radioCount * sizeof(SnapshotRadio) + nodeCount * sizeof(SnapshotNode) +
+			METRICS_COUNT * sizeof(uint64_t) + valueCount * sizeof(MyMessage);
+	*size = sizeof(header) + header.length;
+	uint8_t *image = (uint8_t *)malloc(*size);
+	if (image == NULL) {
+		return NULL;
+	}
+
+	uint8_t *p = image + sizeof(header);
+	for (unsigned int i = 0; i < radioCount; i++, p += sizeof(SnapshotRadio)) {
+		SnapshotRadio radio;
+		radio.baseRadioId = radios[i].baseRadioId;
+		memcpy(radio.eeprom, radios[i].eeprom != NULL ? radios[i].eeprom : radios[i].saved, EEPROM_SIZE);
+		memcpy(p, &radio, sizeof(radio));
+	}
+	for (unsigned int node = 1; node < 255; node++) {
+		if (index[node] != SNAPSHOT_NO_RADIO) {
+			SnapshotNode entry = { (uint8_t)node, index[node], 0, nodes[node].heard };
+			memcpy(p, &entry, sizeof(entry));
+			p += sizeof(entry);
+		}
+	}
+	for (unsigned int i = 0; i < METRICS_COUNT; i++, p += sizeof(uint64_t)) {
+		uint64_t value = metricIsCounter((metric_id)i) ? metricGet((metric_id)i) : 0;
+		memcpy(p, &value, sizeof(value));
+	}
+	for (unsigned int i = 0; i < SNAPSHOT_VALUES; i++) {
+		if (values[i].key != VALUE_FREE) {
+			memcpy(p, &values[i].message, sizeof(MyMessage));
+			p += sizeof(MyMessage);
+		}
+	}
+	header.crc = firmwareCrc16(image + sizeof(header), header.length);
+	memcpy(image, &header, sizeof(header));
+	return image;
+}
+
+/*
+ * Write to the temporary file, then rename it over the snapshot, so a
+ * crash leaves either snapshot complete
+ */
+static bool replace(const uint8_t *image, size_t size)
+{
+	char *slash = strrchr(path, '/');
+	int fd, error;
+	ssize_t written;
+
+	if ((fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0) {
+		return false;
+	}
+	errno = 0;
+	for (size_t done = 0; done < size; done += written) {
+		if ((written = write(fd, image + done, size - done)) <= 0) {
+			goto failed;
+		}
+	}
+	if (fsync(fd) != 0 || close(fd) != 0) {
+		fd = -1;
+		goto failed;
+	}
+	if (rename(tmpPath, path) != 0) {
+		error = errno;
+		unlink(tmpPath);
+		errno = error;
+		return false;
+	}
+	// The rename itself is on the card once the directory is synced
+	*slash = '\0';
+	if ((fd = open(slash == path ? "/" : path, O_RDONLY | O_DIRECTORY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	*slash = '/';
+	return true;
+
+failed:
+	error = errno != 0 ? errno : EIO;
+	if (fd >= 0) {
+		close(fd);
+	}
+	unlink(tmpPath);
+	errno = error;
+	return false;
+}
+
+bool snapshotWrite()
+{
+	uint8_t *image;
+	size_t size;
+
+	if (!snapshotEnabled) {
+		errno = EBADF;
+		return false;
+	}
+	pthread_mutex_lock(&lock);
+	image = build(&size);
+	pthread_mutex_unlock(&lock);
+	if (image == NULL) {
+		metricInc(M_SNAPSHOT_FAILED);
+		errno = ENOMEM;
+		return false;
+	}
+	pthread_mutex_lock(&writing);
+	bool ok = replace(image, size);
+	int error = errno;
+	pthread_mutex_unlock(&writing);
+	free(image);
+	errno = error;
+	metricInc(ok ? M_SNAPSHOT_WRITES : M_SNAPSHOT_FAILED);
+	return ok;
+}
+
+bool snapshotClose()
+{
+	bool ok = true;
+
+	if (!snapshotEnabled) {
+		return true;
+	}
+	pthread_mutex_lock(&lock);
+	bool started = running;
+	running = false;
+	pthread_cond_signal(&stop);
+	pthread_mutex_unlock(&lock);
+	if (started) {
+		pthread_join(writer, NULL);
+	}
+	if (attached) {
+		ok = snapshotWrite();
+	}
+	int error = errno;
+	pthread_mutex_lock(&lock);
+	snapshotEnabled = false;
+	reset();
+	pthread_mutex_unlock(&lock);
+	free(path);
+	free(tmpPath);
+	path = NULL;
+	tmpPath = NULL;
+	errno = error;
+	return ok;
+}
+
+bool snapshotAttach(uint64_t baseRadioId, uint8_t *eeprom)
+{
+	bool restored = false;
+
+	if (!snapshotEnabled) {
+		return false;
+	}
+	pthread_mutex_lock(&lock);
+	SnapshotRadioState *radio = findRadio(baseRadioId);
+	if (radio != NULL && radio->eeprom == NULL) {
+		memcpy(eeprom, radio->saved, EEPROM_SIZE);
+		restored = true;
+	} else if (radio == NULL && radioCount < SNAPSHOT_MAX_RADIOS) {
+		radio = &radios[radioCount++];
+		radio->baseRadioId = baseRadioId;
+	}
+	if (radio != NULL) {
+		radio->eeprom = eeprom;
+		attached = true;
+	}
+	pthread_mutex_unlock(&lock);
+	return restored;
+}
+
+void snapshotRecord(uint64_t baseRadioId, const MyMessage &message)
+{
+	if (!snapshotEnabled || message.sender == GATEWAY_ADDRESS || message.sender == BROADCAST_ADDRESS) {
+		return;
+	}
+	uint32_t key = mGetAck(message) ? VALUE_FREE : keyOf(message);
+	pthread_mutex_lock(&lock);
+	nodes[message.sender].radio = baseRadioId;
+	nodes[message.sender].heard = now();
+	if (key != VALUE_FREE) {
+		SnapshotValue *value = lookup(key);
+		if (value != NULL) {
+			value->message = message;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void snapshotInclusion(unsigned long left)
+{
+	if (!snapshotEnabled) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	inclusionEnd = left > 0 ? now() + left : 0;
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned long snapshotInclusionLeft()
+{
+	unsigned long left = 0;
+
+	pthread_mutex_lock(&lock);
+	uint64_t time = now();
+	if (inclusionEnd > time) {
+		left = inclusionEnd - time;
+	}
+	pthread_mutex_unlock(&lock);
+	return left;
+}
+
+/*
+ * By node, then presentations, sketch information and values, each by sensor and type
+ */
+static int compareValues(const void *a, const void *b)
+{
+	static const uint8_t ranks[] = { 0, 2, 3, 1, 3 };  // by command
+	const SnapshotValue *x = *(const SnapshotValue **)a;
+	const SnapshotValue *y = *(const SnapshotValue **)b;
+	uint32_t kx = (x->key & 0xff000000) | ranks[x->key >> 8 & 0x07] << 16 | (x->key >> 8 & 0xff00) | (x->key & 0xff);
+	uint32_t ky = (y->key & 0xff000000) | ranks[y->key >> 8 & 0x07] << 16 | (y->key >> 8 & 0xff00) | (y->key & 0xff);
+
+	return kx < ky ? -1 : kx > ky;
+}
+
+unsigned int snapshotReplay(uint64_t baseRadioId, void (*replay)(void *context, MyMessage &message, bool stale), void *context)
+{
+	static SnapshotValue *sorted[SNAPSHOT_VALUES];
+	unsigned int count = 0;
+	MyMessage *messages;
+
+	if (!snapshotEnabled) {
+		return 0;
+	}
+	pthread_mutex_lock(&lock);
+	for (unsigned int i = 0; i < SNAPSHOT_VALUES; i++) {
+		const SnapshotNodeState *node = &nodes[values[i].key >> 24];
+		if (values[i].key != VALUE_FREE && node->heard != 0 && node->radio == baseRadioId) {
+			sorted[count++] = &values[i];
+		}
+	}
+	qsort(sorted, count, sizeof(sorted[0]), compareValues);
+	// Copied out, the other radios record on while the controller gets them
+	if ((messages = (MyMessage *)malloc(count * sizeof(MyMessage) + 1)) == NULL) {
+		count = 0;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		messages[i] = sorted[i]->message;
+	}
+	pthread_mutex_unlock(&lock);
+	for (unsigned int i = 0; i < count; i++) {
+		uint8_t command = mGetCommand(messages[i]);
+		replay(context, messages[i], command == C_SET || (command == C_INTERNAL && messages[i].type == I_BATTERY_LEVEL));
+	}
+	free(messages);
+	return count;
+}
@@ -0,0 +1,143 @@
+/*
+ * PiSnapshot.h - Gateway state kept across restarts
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Without it a restarted gateway knows no routes, so commands for nodes
+ * wait until the nodes are heard again, and the controller learns about
+ * the network only as the nodes present themselves. The snapshot holds:
+ *
+ * - the EEPROM image of every radio (node id, routes, the channel a
+ *   migration moved to), by radio address base
+ * - the node table: the radio every node was last heard on, and when
+ * - the last presentation of every sensor, the sketch name, version and
+ *   battery level of every node and the last value of every sensor and type
+ * - the time inclusion mode ends, and the counters of MyMetrics.h
+ *
+ * It is written every SNAPSHOT_INTERVAL seconds by a thread of its own and
+ * when the gateway stops, to <file>.tmp first and renamed over <file>, so a crash leaves the last
+ * complete snapshot. The file is a SnapshotHeader and, in this order,
+ * radios SnapshotRadio, nodes SnapshotNode, metrics uint64_t counter values
+ * (gauges as 0) and values MyMessage; the header's crc covers all of it.
+ * Counters are only taken back from a snapshot of the same METRICS_COUNT.
+ *
+ * On a warm start MyGateway::begin() takes back the EEPROM image of its
+ * radio before the radio and the routing table read it, restores inclusion
+ * mode and writes the presentations and sketch information of the nodes
+ * last heard on its radio to the controller after the startup message, so
+ * commands are routed at once and the controller knows the network without
+ * waiting for the nodes. Their last values and battery levels may be long
+ * out of date: the controller gets them only as log messages.
+ */
+
+#ifndef __PiSnapshot_H__
+#define __PiSnapshot_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MyMessage.h"
+#include "PiEEPROM.h"
+
+#define SNAPSHOT_INTERVAL   300        // s between writes
+#define SNAPSHOT_VALUES     1024       // presentations and values kept, a power of two
+#define SNAPSHOT_MAX_RADIOS 8
+#define SNAPSHOT_MAGIC      0x5753534d // "MSSW"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_NO_RADIO   0xff
+
+struct SnapshotHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t crc;               // CRC-16 (firmwareCrc16) of everything after the header
+	uint64_t written;           // ms since the epoch
+	uint64_t inclusionEnd;      // ms since the epoch, 0 if inclusion mode was off
+	uint32_t length;            // bytes after the header
+	uint8_t radios;
+	uint8_t reserved;
+	uint16_t nodes;
+	uint16_t metrics;
+	uint16_t values;
+} __attribute__((packed));
+
+struct SnapshotRadio {
+	uint64_t baseRadioId;
+	uint8_t eeprom[EEPROM_SIZE];
+} __attribute__((packed));
+
+struct SnapshotNode {
+	uint8_t node;
+	uint8_t radio;              // index of its SnapshotRadio, or SNAPSHOT_NO_RADIO
+	uint16_t reserved;
+	uint64_t heard;             // ms since the epoch
+} __attribute__((packed));
+
+/* true while a snapshot file is in use, checked before any work is done on the radio path */
+extern volatile bool snapshotEnabled;
+
+/**
+ * Keep the state in the file at path, and take it back from there if the
+ * file holds a snapshot. Call before the radios start. Returns true for a
+ * warm start; false with errno ENOENT if there is no snapshot yet, EINVAL
+ * if it is damaged or of another version, else the error reading it. The
+ * state is kept in path either way. The snapshot is only written by
+ * snapshotClose() until snapshotStart().
+ */
+bool snapshotOpen(const char *path);
+
+/**
+ * Start the thread writing the snapshot every SNAPSHOT_INTERVAL s. Call
+ * after daemonize(), a thread doesn't survive the fork. Returns false with
+ * errno set if it could not be started.
+ */
+bool snapshotStart();
+
+/**
+ * Write the snapshot, as the thread of snapshotStart() does every
+ * SNAPSHOT_INTERVAL s. Returns false with errno set if it could not be
+ * written, the last one is left in place then.
+ */
+bool snapshotWrite();
+
+/**
+ * Write the snapshot, if a radio was attached since snapshotOpen(), and stop
+ * keeping state. Call after the radios stopped, while their EEPROM images
+ * are still there.
+ */
+bool snapshotClose();
+
+/**
+ * Take back the EEPROM image of the radio with address base baseRadioId
+ * into eeprom, and keep eeprom in the snapshots from now on. Returns true
+ * if the snapshot had an image for the radio.
+ */
+bool snapshotAttach(uint64_t baseRadioId, uint8_t *eeprom);
+
+/**
+ * Note the node and the presentation, sketch information or value of
+ * message from the radio with address base baseRadioId.
+ */
+void snapshotRecord(uint64_t baseRadioId, const MyMessage &message);
+
+/**
+ * Inclusion mode was turned on for left ms, or off with 0.
+ */
+void snapshotInclusion(unsigned long left);
+
+/**
+ * ms left of inclusion mode at the last snapshot, 0 if it was off or is over.
+ */
+unsigned long snapshotInclusionLeft();
+
+/**
+ * Call replay with the presentations, sketch information and values of the
+ * nodes last heard on the radio with address base baseRadioId, node by
+ * node, presentations first; stale for values and battery levels, which
+ * are as old as the snapshot. The state isn't locked meanwhile. Returns
+ * their number.
+ */
+unsigned int snapshotReplay(uint64_t baseRadioId, void (*replay)(void *context, MyMessage &message, bool stale), void *context);
+
+#endif /* __PiSnapshot_H__ */
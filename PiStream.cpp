@@ -0,0 +1,450 @@
+/*
+ * PiStream.cpp - Reassembly of streamed images and sounds
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "PiStream.h"
+#include "PiLog.h"
+#include "MyMessage.h"
+#include "MyMetrics.h"
+
+struct StreamSlot {
+	bool busy;
+	bool delivering;    // complete, waiting for or being written to the sink by the delivery thread
+	bool completed;     // idle after delivering the object below, late chunks are duplicates
+	uint8_t node;
+	uint8_t sensor;
+	uint8_t type;
+	uint8_t object;
+	uint16_t count;
+	uint16_t received;
+	uint8_t lastLength; // length of the last chunk, 0 until it arrived
+	uint32_t completion; // order the objects were completed in, for the delivery thread
+	time_t lastChunk;
+	uint8_t *data;
+	size_t capacity;
+	uint32_t *bitmap;
+	size_t bitmapWords;
+};
+
+volatile bool streamEnabled = false;
+
+static StreamSlot slots[STREAM_SLOTS];
+static pthread_mutex_t streamLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t memoryUsed = 0;
+
+static char *sinkDirectory = NULL;
+static char *sinkSocket = NULL;
+static int sinkFd = -1;                 // only used by the delivery thread
+
+// Completed objects are written out by one thread, the radios go on meanwhile
+static pthread_t deliverThread;
+static pthread_cond_t deliverWake = PTHREAD_COND_INITIALIZER;   // with streamLock
+static bool deliverRunning = false;
+static bool deliverStop = false;
+static uint32_t completions = 0;
+
+static time_t seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void updateGauges()
+{
+	unsigned long backlog = 0;
+
+	for (int i = 0; i < STREAM_SLOTS; i++) {
+		if (slots[i].busy) {
+			backlog++;
+		}
+	}
+	metricSetGlobal(M_STREAM_BACKLOG, backlog);
+	metricSetGlobal(M_STREAM_MEMORY, memoryUsed);
+}
+
+static void slotFree(StreamSlot *slot)
+{
+	memoryUsed -= slot->capacity + slot->bitmapWords * sizeof(uint32_t);
+	free(slot->data);
+	free(slot->bitmap);
+	slot->data = NULL;
+	slot->bitmap = NULL;
+	slot->capacity = 0;
+	slot->bitmapWords = 0;
+}
+
+/*
+ * Make room for count chunks in slot, releasing the buffers of idle slots
+ * if the memory limit would be exceeded
+ */
+static bool slotReserve(StreamSlot *slot, uint16_t count)
+{
+	size_t capacity = (size_t)count * STREAM_CHUNK_SIZE;
+	size_t words = (count + 31) / 32;
+	size_t grow = 0;
+
+	if (capacity > slot->capacity) grow += capacity - slot->capacity;
+	if (words > slot->bitmapWords) grow += (words - slot->bitmapWords) * sizeof(uint32_t);
+	for (int i = 0; i < STREAM_SLOTS && grow > 0 && memoryUsed + grow > STREAM_MAX_MEMORY; i++) {
+		if (!slots[i].busy && &slots[i] != slot) {
+			slotFree(&slots[i]);
+		}
+	}
+	if (grow > 0 && memoryUsed + grow > STREAM_MAX_MEMORY) {
+		return false;
+	}
+	if (capacity > slot->capacity) {
+		uint8_t *data = (uint8_t *)realloc(slot->data, capacity);
+		if (data == NULL) {
+			return false;
+		}
+		memoryUsed += capacity - slot->capacity;
+		slot->data = data;
+		slot->capacity = capacity;
+	}
+	if (words > slot->bitmapWords) {
+		uint32_t *bitmap = (uint32_t *)realloc(slot->bitmap, words * sizeof(uint32_t));
+		if (bitmap == NULL) {
+			return false;
+		}
+		memoryUsed += (words - slot->bitmapWords) * sizeof(uint32_t);
+		slot->bitmap = bitmap;
+		slot->bitmapWords = words;
+	}
+	memset(slot->bitmap, 0, words * sizeof(uint32_t));
+	return true;
+}
+
+/*
+ * Idle slot for a new object, preferring one whose buffer is big enough
+ */
+static StreamSlot *slotFind(uint16_t count)
+{
+	size_t needed = (size_t)count * STREAM_CHUNK_SIZE;
+	StreamSlot *fit = NULL;      // smallest buffer that is big enough
+	StreamSlot *largest = NULL;  // otherwise the one that needs to grow least
+
+	for (int i = 0; i < STREAM_SLOTS; i++) {
+		StreamSlot *slot = &slots[i];
+		if (slot->busy) {
+			continue;
+		}
+		if (slot->capacity >= needed && (fit == NULL || slot->capacity < fit->capacity)) {
+			fit = slot;
+		}
+		if (largest == NULL || slot->capacity > largest->capacity) {
+			largest = slot;
+		}
+	}
+	return fit != NULL ? fit : largest;
+}
+
+static bool deliverFile(StreamSlot *slot, size_t length)
+{
+	char name[PATH_MAX];
+	char part[PATH_MAX + 8];
+	ssize_t written;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s/%d-%d-%s-%ld-%d.bin", sinkDirectory, slot->node, slot->sensor,
+			slot->type == ST_IMAGE ? "image" : "sound", (long)time(NULL), slot->object);
+	snprintf(part, sizeof(part), "%s.part", name);
+	fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (fd < 0) {
+		log(LOG_ERR, "Could not create %s (%d) %s\n", part, errno, strerror(errno));
+		return false;
+	}
+	written = write(fd, slot->data, length);
+	close(fd);
+	if (written != (ssize_t)length || rename(part, name) != 0) {
+		log(LOG_ERR, "Could not write %s (%d) %s\n", name, errno, strerror(errno));
+		unlink(part);
+		return false;
+	}
+	log(LOG_INFO, "Node %d sensor %d: %s of %u bytes in %s\n", slot->node, slot->sensor,
+			slot->type == ST_IMAGE ? "image" : "sound", (unsigned int)length, name);
+	return true;
+}
+
+static bool deliverSocket(StreamSlot *slot, size_t length)
+{
+	StreamObjectHeader header;
+	struct iovec iov[2];
+	struct msghdr message;
+	size_t total = sizeof(header) + length;
+	size_t done = 0;
+
+	if (sinkFd < 0) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, sinkSocket, sizeof(addr.sun_path) - 1);
+		// A consumer that stops reading costs it the object, not the gateway its sink
+		struct timeval timeout = { STREAM_SEND_TIMEOUT, 0 };
+		sinkFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sinkFd >= 0) {
+			setsockopt(sinkFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		}
+		if (sinkFd < 0 || connect(sinkFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			log(LOG_ERR, "Could not connect to stream sink %s (%d) %s\n", sinkSocket, errno, strerror(errno));
+			if (sinkFd >= 0) close(sinkFd);
+			sinkFd = -1;
+			return false;
+		}
+	}
+	header.node = slot->node;
+	header.sensor = slot->sensor;
+	header.type = slot->type;
+	header.object = slot->object;
+	header.length = length;
+	while (done < total) {
+		int n = 0;
+		if (done < sizeof(header)) {
+			iov[n].iov_base = (uint8_t *)&header + done;
+			iov[n++].iov_len = sizeof(header) - done;
+			iov[n].iov_base = slot->data;
+			iov[n++].iov_len = length;
+		} else {
+			iov[n].iov_base = slot->data + done - sizeof(header);
+			iov[n++].iov_len = total - done;
+		}
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = n;
+		ssize_t written = sendmsg(sinkFd, &message, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			log(LOG_ERR, "Stream sink %s closed or stalled (%d) %s\n", sinkSocket, errno, strerror(errno));
+			close(sinkFd);
+			sinkFd = -1;
+			return false;
+		}
+		done += written;
+	}
+	return true;
+}
+
+/*
+ * Write the completed objects to the sink, oldest first, and free their slots
+ */
+static void *deliverLoop(void *arg)
+{
+	pthread_mutex_lock(&streamLock);
+	for (;;) {
+		StreamSlot *slot = NULL;
+		for (int i = 0; i < STREAM_SLOTS; i++) {
+			if (slots[i].delivering && (slot == NULL || (int32_t)(slots[i].completion - slot->completion) < 0)) {
+				slot = &slots[i];
+			}
+		}
+		if (slot == NULL) {
+			if (deliverStop) {
+				break;
+			}
+			pthread_cond_wait(&deliverWake, &streamLock);
+			continue;
+		}
+		// The slot stays as it is while delivering, only this thread changes it then
+		size_t length = (size_t)(slot->count - 1) * STREAM_CHUNK_SIZE + slot->lastLength;
+		pthread_mutex_unlock(&streamLock);
+		bool ok = sinkDirectory != NULL ? deliverFile(slot, length) : deliverSocket(slot, length);
+		metricInc(ok ? M_STREAM_OBJECTS : M_STREAM_DROPPED);
+		pthread_mutex_lock(&streamLock);
+		slot->busy = false;
+		slot->delivering = false;
+		slot->completed = true;
+		updateGauges();
+	}
+	pthread_mutex_unlock(&streamLock);
+	return NULL;
+}
+
+bool streamOpen(const char *sink)
+{
+	struct stat st;
+
+	if (strncmp(sink, "file:", 5) == 0) {
+		if (stat(sink + 5, &st) != 0) {
+			return false;
+		}
+		if (!S_ISDIR(st.st_mode)) {
+			errno = ENOTDIR;
+			return false;
+		}
+		// Absolute, the gateway changes its directory when it daemonizes
+		sinkDirectory = realpath(sink + 5, NULL);
+	} else if (strncmp(sink, "socket:", 7) == 0 && strlen(sink + 7) < sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		sinkSocket = strdup(sink + 7);
+	} else {
+		errno = EINVAL;
+		return false;
+	}
+	streamEnabled = true;
+	return true;
+}
+
+void streamClose()
+{
+	streamEnabled = false;
+	pthread_mutex_lock(&streamLock);
+	if (deliverRunning) {
+		// The objects completed so far still go out
+		deliverStop = true;
+		pthread_cond_signal(&deliverWake);
+		pthread_mutex_unlock(&streamLock);
+		pthread_join(deliverThread, NULL);
+		pthread_mutex_lock(&streamLock);
+		deliverRunning = false;
+		deliverStop = false;
+	}
+	for (int i = 0; i < STREAM_SLOTS; i++) {
+		slotFree(&slots[i]);
+		slots[i].busy = false;
+	}
+	updateGauges();
+	pthread_mutex_unlock(&streamLock);
+	if (sinkFd >= 0) {
+		close(sinkFd);
+		sinkFd = -1;
+	}
+	free(sinkDirectory);
+	free(sinkSocket);
+	sinkDirectory = NULL;
+	sinkSocket = NULL;
+}
+
+bool streamChunk(uint8_t node, uint8_t sensor, uint8_t type, const uint8_t *payload, uint8_t length)
+{
+	StreamChunkHeader header;
+	StreamSlot *slot = NULL;
+	uint8_t dataLength;
+
+	if (!streamEnabled || (type != ST_IMAGE && type != ST_SOUND) || length <= sizeof(header)) {
+		return false;
+	}
+	memcpy(&header, payload, sizeof(header));
+	dataLength = length - sizeof(header);
+	if (header.count == 0 || header.count > STREAM_MAX_CHUNKS || header.index >= header.count ||
+			dataLength > STREAM_CHUNK_SIZE || (header.index + 1 < header.count && dataLength != STREAM_CHUNK_SIZE)) {
+		return false;
+	}
+	metricInc(M_STREAM_CHUNKS);
+
+	pthread_mutex_lock(&streamLock);
+	for (int i = 0; i < STREAM_SLOTS; i++) {
+		StreamSlot *s = &slots[i];
+		if (s->node != node || s->sensor != sensor || s->type != type) {
+			continue;
+		}
+		if ((s->delivering || s->completed) && s->object == header.object && s->count == header.count) {
+			// Late chunk of an object that is complete, still waiting for the sink or not
+			metricInc(M_STREAM_DUPLICATES);
+			pthread_mutex_unlock(&streamLock);
+			return true;
+		}
+		if (s->busy && !s->delivering) {
+			slot = s;
+		}
+	}
+	if (slot != NULL && (slot->object != header.object || slot->count != header.count)) {
+		// A new object started before the previous one was complete
+		metricInc(M_STREAM_EXPIRED);
+		slot->busy = false;
+		slot = NULL;
+	}
+	if (slot == NULL) {
+		slot = slotFind(header.count);
+		if (slot == NULL || !slotReserve(slot, header.count)) {
+			metricInc(M_STREAM_DROPPED);
+			updateGauges();
+			pthread_mutex_unlock(&streamLock);
+			return true;
+		}
+		slot->busy = true;
+		slot->delivering = false;
+		slot->completed = false;
+		slot->node = node;
+		slot->sensor = sensor;
+		slot->type = type;
+		slot->object = header.object;
+		slot->count = header.count;
+		slot->received = 0;
+		slot->lastLength = 0;
+		updateGauges();
+	}
+	slot->lastChunk = seconds();
+	if (slot->bitmap[header.index / 32] & (1UL << (header.index % 32))) {
+		metricInc(M_STREAM_DUPLICATES);
+		pthread_mutex_unlock(&streamLock);
+		return true;
+	}
+	slot->bitmap[header.index / 32] |= 1UL << (header.index % 32);
+	memcpy(slot->data + (size_t)header.index * STREAM_CHUNK_SIZE, payload + sizeof(header), dataLength);
+	if (header.index + 1 == header.count) {
+		slot->lastLength = dataLength;
+	}
+	if (++slot->received < slot->count) {
+		pthread_mutex_unlock(&streamLock);
+		return true;
+	}
+
+	// Complete, the delivery thread writes it out, started here as threads don't survive daemonize()
+	if (!deliverRunning) {
+		deliverRunning = pthread_create(&deliverThread, NULL, deliverLoop, NULL) == 0;
+		if (!deliverRunning) {
+			log(LOG_ERR, "Could not start the stream delivery thread (%d) %s\n", errno, strerror(errno));
+			metricInc(M_STREAM_DROPPED);
+			slot->busy = false;
+			updateGauges();
+			pthread_mutex_unlock(&streamLock);
+			return true;
+		}
+	}
+	slot->delivering = true;
+	slot->completion = completions++;
+	pthread_cond_signal(&deliverWake);
+	pthread_mutex_unlock(&streamLock);
+	return true;
+}
+
+void streamExpire()
+{
+	time_t now = seconds();
+
+	if (!streamEnabled) {
+		return;
+	}
+	pthread_mutex_lock(&streamLock);
+	for (int i = 0; i < STREAM_SLOTS; i++) {
+		StreamSlot *slot = &slots[i];
+		if (slot->busy && !slot->delivering && now - slot->lastChunk > STREAM_TIMEOUT) {
+			log(LOG_INFO, "Node %d sensor %d: dropped incomplete object, %d of %d chunks\n",
+					slot->node, slot->sensor, slot->received, slot->count);
+			metricInc(M_STREAM_EXPIRED);
+			slot->busy = false;
+		}
+	}
+	updateGauges();
+	pthread_mutex_unlock(&streamLock);
+}
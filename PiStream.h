@@ -0,0 +1,87 @@
+/*
+ * PiStream.h - Reassembly of streamed images and sounds
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Nodes send ST_IMAGE and ST_SOUND objects as C_STREAM messages, each
+ * carrying a StreamChunkHeader and up to STREAM_CHUNK_SIZE bytes of the
+ * object. Every chunk but the last one is full, so the last chunk gives the
+ * object length. Chunks may arrive in any order and more than once.
+ *
+ * Instead of forwarding every chunk to the controller as a hex line, the
+ * gateway collects the chunks of an object per (node, sensor, stream type)
+ * in one of STREAM_SLOTS slots. The slots keep their buffers after an object
+ * is delivered, so a steady stream of objects doesn't allocate. A bitmap per
+ * slot tracks the chunks received. A completed object is written in one go
+ * to the sink by a delivery thread, so a slow sink doesn't hold up the
+ * radios; its slot stays taken until then and late chunks of it are
+ * counted as duplicates:
+ *
+ *   file:<directory>  one file per object, <node>-<sensor>-<image|sound>-<time>-<object>.bin
+ *   socket:<path>     unix stream socket, a StreamObjectHeader before each object
+ *
+ * Objects that see no chunk for STREAM_TIMEOUT seconds, or are replaced by
+ * a newer object of the same stream before they are complete, are dropped,
+ * and so are those a socket sink doesn't take within STREAM_SEND_TIMEOUT.
+ * Without a sink the chunks are forwarded to the controller as before.
+ */
+
+#ifndef __PiStream_H__
+#define __PiStream_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STREAM_SLOTS       16
+#define STREAM_CHUNK_SIZE  20           // MAX_PAYLOAD less the chunk header
+#define STREAM_MAX_CHUNKS  16384        // largest object 320 KiB
+#define STREAM_MAX_MEMORY  (4UL * 1024 * 1024)
+#define STREAM_TIMEOUT     30           // seconds without a chunk
+#define STREAM_SEND_TIMEOUT 5          // seconds a socket sink may stall an object
+
+struct StreamChunkHeader {
+	uint8_t object;     // sequence number of the object in its stream
+	uint16_t index;     // chunk number, 0..count-1
+	uint16_t count;     // chunks in the object
+} __attribute__((packed));
+
+/* Written before every object to a socket sink */
+struct StreamObjectHeader {
+	uint8_t node;
+	uint8_t sensor;
+	uint8_t type;       // ST_IMAGE or ST_SOUND
+	uint8_t object;
+	uint32_t length;
+} __attribute__((packed));
+
+/* true while reassembling, checked before any work is done on the radio path */
+extern volatile bool streamEnabled;
+
+/**
+ * Start reassembling into sink (file:<directory> or socket:<path>).
+ * Returns false with errno set if the sink is invalid.
+ */
+bool streamOpen(const char *sink);
+
+/**
+ * Stop reassembling, deliver the completed objects, drop incomplete ones
+ * and free the buffers.
+ */
+void streamClose();
+
+/**
+ * Take a C_STREAM payload of type ST_IMAGE or ST_SOUND. Returns false if
+ * it isn't one, reassembly isn't enabled or the chunk is malformed, so the
+ * caller passes it on to the controller. May be called from any thread;
+ * completed objects are handed to the delivery thread.
+ */
+bool streamChunk(uint8_t node, uint8_t sensor, uint8_t type, const uint8_t *payload, uint8_t length);
+
+/**
+ * Drop objects that timed out. Call about once a second.
+ */
+void streamExpire();
+
+#endif /* __PiStream_H__ */
@@ -0,0 +1,568 @@
+/*
+ * LoadGen.cpp - Command throughput and latency of PiGatewaySerial
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Usage: LoadGen [-g gateway] [-t tty] [-s socket] [-n nodes]
+ *                [-r rate | -c outstanding] [-T seconds] [-D us] [-H seconds] [-v]
+ *
+ * LoadGen plays both ends of the serial gateway. It writes commands to the
+ * gateway tty the way a controller does, and it serves the virtual radio of
+ * the gateway (PiGatewaySerial -r socket:<path>) with -n simulated nodes.
+ * Every node first presents itself, so the gateway learns a route to it, and
+ * then answers each command that requests an ack with the ack message after
+ * -D microseconds. A command is done when the gateway writes the ack echo
+ * back to the tty; without echo after a second it counts as lost.
+ *
+ * -r sends that many commands per second whether or not they are answered
+ * (open loop). Latency is then counted from the time a command was due, so a
+ * gateway that falls behind can't hide its backlog. Otherwise -c commands
+ * are kept outstanding (closed loop, default 1).
+ *
+ * -g starts the given gateway binary on a private tty and socket and stops
+ * it at the end. Without -g start PiGatewaySerial -r socket:<-s path> once
+ * LoadGen waits for it; -t names its tty (default /dev/ttyMySensorsGateway).
+ *
+ * -H then closes the tty for that many seconds like a controller going
+ * away, while the nodes send HANGUP_RATE readings per second, opens it again
+ * and counts the readings the gateway kept and wrote in order (PiBacklog.h).
+ *
+ * Reported: commands sent, acked and lost, throughput and latency
+ * percentiles of the acked commands, and with -H the readings written
+ * after the tty was opened again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+// Before MySensor.h, its min/max macros break the STL
+#include "MyTransportVirtual.h"
+#include "MySensor.h"
+
+#ifndef _TTY_NAME
+	#define _TTY_NAME "/dev/ttyMySensorsGateway"
+#endif
+
+#define ACK_TIMEOUT 1000000000ULL   // ns without ack echo before a command is lost
+#define STARTUP_TIMEOUT 5000        // ms for the gateway to start and learn the nodes
+#define COMMAND_SENSOR 1
+#define COMMAND_TYPE V_VAR1
+#define HANGUP_SENSOR 2
+#define HANGUP_TYPE V_VAR2
+#define HANGUP_RATE 100             // readings per second while the tty is closed
+
+struct Reply {
+	uint64_t due;
+	MyMessage msg;
+};
+
+static unsigned int nodeCount = 10;
+static unsigned int replyDelay = 0;   // us
+static int radioFd = -1;
+static volatile bool peerRunning;
+static unsigned long framesIn, acksOut;
+
+static int ttyFd = -1;
+static char lineBuf[512];
+static size_t lineLen;
+static bool presented[256];
+static unsigned int presentedCount;
+static bool versionSeen;
+static long lastReading = -1;
+static unsigned long readingsSeen, readingsOutOfOrder;
+
+static std::vector<uint64_t> sendTime;  // per sequence number, 0 once acked or lost
+static std::deque<unsigned long> pending; // sequence numbers in send order
+static std::vector<uint64_t> latencies;
+static unsigned long acked, lost;
+static uint64_t lastAck;
+
+static uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static timespec toTimespec(uint64_t ns)
+{
+	timespec ts = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+	return ts;
+}
+
+/*
+ * Send a message of a simulated node to the gateway
+ */
+static bool sendToGateway(MyMessage &msg, int flags)
+{
+	VirtualFrame frame;
+	frame.address = TO_ADDR(GATEWAY_ADDRESS);
+	frame.length = HEADER_SIZE + mGetLength(msg);
+	memcpy(frame.data, &msg, frame.length);
+	return send(radioFd, &frame, offsetof(VirtualFrame, data) + frame.length, MSG_NOSIGNAL | flags) >= 0 || errno != EAGAIN;
+}
+
+/*
+ * The simulated nodes: answer every frame that requests an ack with the ack
+ * message, like MySensor::process() does, after the reply delay. Replies
+ * never block, the gateway may itself be blocked sending to us.
+ */
+static void *radioPeer(void *arg)
+{
+	std::deque<Reply> replies;
+
+	while (peerRunning) {
+		uint64_t wait = 100000000ULL;
+		pollfd pfd = { radioFd, POLLIN, 0 };
+		if (!replies.empty()) {
+			uint64_t t = now();
+			wait = replies.front().due > t ? replies.front().due - t : 0;
+			if (wait == 0) {
+				wait = 100000000ULL;
+				pfd.events |= POLLOUT;
+			}
+		}
+		timespec timeout = toTimespec(wait);
+		if (ppoll(&pfd, 1, &timeout, NULL) > 0 && (pfd.revents & POLLIN)) {
+			VirtualFrame frame;
+			ssize_t size = recv(radioFd, &frame, sizeof(frame), 0);
+			if (size <= 0) {
+				break;   // gateway is gone
+			}
+			framesIn++;
+			if (frame.length < HEADER_SIZE || frame.length > sizeof(MyMessage)) {
+				continue;
+			}
+			MyMessage msg;
+			memcpy(&msg, frame.data, frame.length);
+			if (msg.destination < 1 || msg.destination > nodeCount ||
+					frame.address != TO_ADDR(msg.destination) || !mGetRequestAck(msg)) {
+				continue;
+			}
+			Reply reply;
+			reply.due = now() + replyDelay * 1000ULL;
+			reply.msg = msg;
+			mSetRequestAck(reply.msg, false);
+			mSetAck(reply.msg, true);
+			reply.msg.last = msg.destination;
+			reply.msg.sender = msg.destination;
+			reply.msg.destination = msg.sender;
+			replies.push_back(reply);
+		}
+		while (!replies.empty() && replies.front().due <= now()) {
+			if (!sendToGateway(replies.front().msg, MSG_DONTWAIT)) {
+				break;
+			}
+			acksOut++;
+			replies.pop_front();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Handle a line the gateway wrote to the tty: node;sensor;command;ack;type;payload
+ */
+static void handleLine(char *line)
+{
+	unsigned int field[5];
+	int used;
+
+	if (sscanf(line, "%u;%u;%u;%u;%u;%n", &field[0], &field[1], &field[2], &field[3], &field[4], &used) != 5) {
+		return;
+	}
+	if (field[2] == C_PRESENTATION && field[0] >= 1 && field[0] <= nodeCount && !presented[field[0]]) {
+		presented[field[0]] = true;
+		presentedCount++;
+	} else if (field[0] == GATEWAY_ADDRESS && field[2] == C_INTERNAL && field[4] == I_VERSION) {
+		versionSeen = true;
+	} else if (field[2] == C_SET && field[3] == 0 && field[1] == HANGUP_SENSOR && field[4] == HANGUP_TYPE) {
+		long seq = strtol(line + used, NULL, 10);
+		if (seq <= lastReading) {
+			readingsOutOfOrder++;
+		}
+		lastReading = seq;
+		readingsSeen++;
+	} else if (field[2] == C_SET && field[3] == 1 && field[4] == COMMAND_TYPE) {
+		unsigned long seq = strtoul(line + used, NULL, 10);
+		if (seq < sendTime.size() && sendTime[seq] != 0) {
+			lastAck = now();
+			latencies.push_back(lastAck - sendTime[seq]);
+			sendTime[seq] = 0;
+			acked++;
+		}
+	}
+}
+
+/*
+ * Wait up to timeout ns for output of the gateway and handle all complete lines
+ */
+static bool readTty(uint64_t timeout)
+{
+	timespec ts = toTimespec(timeout);
+	pollfd pfd = { ttyFd, POLLIN, 0 };
+
+	if (ppoll(&pfd, 1, &ts, NULL) <= 0) {
+		return true;
+	}
+	ssize_t size = read(ttyFd, lineBuf + lineLen, sizeof(lineBuf) - 1 - lineLen);
+	if (size <= 0) {
+		return size < 0 && errno == EAGAIN;
+	}
+	lineLen += size;
+	lineBuf[lineLen] = '\0';
+
+	char *line = lineBuf, *end;
+	while ((end = strchr(line, '\n')) != NULL) {
+		*end = '\0';
+		handleLine(line);
+		line = end + 1;
+	}
+	lineLen -= line - lineBuf;
+	if (lineLen == sizeof(lineBuf) - 1) {
+		lineLen = 0;
+	}
+	memmove(lineBuf, line, lineLen);
+	return true;
+}
+
+/*
+ * Write to the gateway tty without blocking its output: the gateway stops
+ * reading commands while it can't write.
+ */
+static void writeTty(const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(ttyFd, data, len);
+		if (n > 0) {
+			data += n;
+			len -= n;
+		} else if (n < 0 && errno != EAGAIN) {
+			perror("write");
+			return;
+		} else {
+			pollfd pfd = { ttyFd, POLLIN | POLLOUT, 0 };
+			if (poll(&pfd, 1, 100) > 0 && (pfd.revents & POLLIN)) {
+				readTty(0);
+			}
+		}
+	}
+}
+
+static void sendCommand(unsigned long seq, uint64_t due)
+{
+	char line[64];
+	int len = snprintf(line, sizeof(line), "%u;%d;%d;1;%d;%lu\n", 1 + (unsigned int)(seq % nodeCount),
+			COMMAND_SENSOR, C_SET, COMMAND_TYPE, seq);
+
+	sendTime.push_back(due);
+	pending.push_back(seq);
+	writeTty(line, len);
+}
+
+static bool openTty(const char *tty)
+{
+	termios settings;
+
+	if ((ttyFd = open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+		return false;
+	}
+	tcgetattr(ttyFd, &settings);
+	cfmakeraw(&settings);
+	tcsetattr(ttyFd, TCSANOW, &settings);
+	return true;
+}
+
+/*
+ * Close the tty for seconds while the nodes send readings, open it again
+ * and wait for the gateway to write them
+ */
+static bool hangUp(const char *tty, unsigned int seconds)
+{
+	unsigned long sent = 0;
+	uint64_t start, end, opened, last = 0;
+
+	close(ttyFd);
+	ttyFd = -1;
+	start = now();
+	end = start + seconds * 1000000000ULL;
+	for (uint64_t next = start; next < end; next += 1000000000ULL / HANGUP_RATE) {
+		uint64_t t = now();
+		if (next > t) {
+			timespec ts = toTimespec(next - t);
+			nanosleep(&ts, NULL);
+		}
+		MyMessage msg(HANGUP_SENSOR, HANGUP_TYPE);
+		msg.last = msg.sender = 1 + sent % nodeCount;
+		msg.destination = GATEWAY_ADDRESS;
+		mSetCommand(msg, C_SET);
+		mSetRequestAck(msg, false);
+		mSetAck(msg, false);
+		mSetVersion(msg, PROTOCOL_VERSION);
+		msg.set(sent);
+		sendToGateway(msg, 0);
+		sent++;
+	}
+	opened = now();
+	if (!openTty(tty)) {
+		perror(tty);
+		return false;
+	}
+	while (readingsSeen < sent && now() < opened + STARTUP_TIMEOUT * 1000000ULL) {
+		unsigned long seen = readingsSeen;
+		readTty(10000000ULL);
+		if (readingsSeen > seen) {
+			last = now();
+		}
+	}
+	printf("hangup      tty closed for %u s, %lu readings sent, %lu written once opened (%lu out of order) within %.1f ms\n",
+			seconds, sent, readingsSeen, readingsOutOfOrder, last > opened ? (last - opened) / 1e6 : 0.0);
+	return readingsSeen == sent && readingsOutOfOrder == 0;
+}
+
+static int listenRadio(const char *path)
+{
+	sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static pid_t startGateway(const char *gateway, const char *socketPath, const char *tty, bool verbose)
+{
+	char spec[128];
+	snprintf(spec, sizeof(spec), "socket:%s", socketPath);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (!verbose) {
+			int fd = open("/dev/null", O_WRONLY);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execl(gateway, gateway, "-r", spec, "-t", tty, (char *)NULL);
+		perror(gateway);
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: LoadGen [-g gateway] [-t tty] [-s socket] [-n nodes]\n"
+			"               [-r rate | -c outstanding] [-T seconds] [-D us] [-H seconds] [-v]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *gateway = NULL;
+	const char *tty = NULL;
+	const char *socketPath = NULL;
+	char privateTty[64], privateSocket[64];
+	unsigned int rate = 0, window = 1, duration = 10, hangup = 0;
+	bool verbose = false;
+	int status = EXIT_FAILURE;
+	int listenFd, c;
+	pid_t child = -1;
+	pthread_t peerThread;
+	pollfd pfd;
+	uint64_t start, deadline;
+
+	while ((c = getopt(argc, argv, "g:t:s:n:r:c:T:D:H:v")) != -1) {
+		switch (c) {
+			case 'g': gateway = optarg; break;
+			case 't': tty = optarg; break;
+			case 's': socketPath = optarg; break;
+			case 'n': nodeCount = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'c': window = atoi(optarg); break;
+			case 'T': duration = atoi(optarg); break;
+			case 'D': replyDelay = atoi(optarg); break;
+			case 'H': hangup = atoi(optarg); break;
+			case 'v': verbose = true; break;
+			default: usage();
+		}
+	}
+	if (nodeCount < 1 || nodeCount > 254 || window < 1 || duration < 1) {
+		usage();
+	}
+	if (gateway != NULL) {
+		snprintf(privateTty, sizeof(privateTty), "/tmp/LoadGen.%d.tty", (int)getpid());
+		snprintf(privateSocket, sizeof(privateSocket), "/tmp/LoadGen.%d.sock", (int)getpid());
+		tty = privateTty;
+		socketPath = privateSocket;
+	} else if (socketPath == NULL) {
+		usage();
+	} else if (tty == NULL) {
+		tty = _TTY_NAME;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	listenFd = listenRadio(socketPath);
+	if (listenFd < 0) {
+		perror(socketPath);
+		return EXIT_FAILURE;
+	}
+	if (gateway != NULL) {
+		child = startGateway(gateway, socketPath, tty, verbose);
+	} else {
+		fprintf(stderr, "Waiting for PiGatewaySerial -r socket:%s\n", socketPath);
+	}
+
+	// The gateway connects to the radio first and creates its tty afterwards
+	pfd.fd = listenFd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, gateway != NULL ? STARTUP_TIMEOUT : -1) <= 0 || (radioFd = accept(listenFd, NULL, NULL)) < 0) {
+		fprintf(stderr, "The gateway did not connect to %s\n", socketPath);
+		goto cleanup;
+	}
+	deadline = now() + STARTUP_TIMEOUT * 1000000ULL;
+	while (!openTty(tty) && now() < deadline) {
+		usleep(10000);
+	}
+	if (ttyFd < 0) {
+		perror(tty);
+		goto cleanup;
+	}
+
+	peerRunning = true;
+	pthread_create(&peerThread, NULL, radioPeer, NULL);
+
+	// Present all nodes, so the gateway has a route to each of them
+	for (unsigned int node = 1; node <= nodeCount; node++) {
+		MyMessage msg(COMMAND_SENSOR, S_CUSTOM);
+		msg.last = msg.sender = node;
+		msg.destination = GATEWAY_ADDRESS;
+		mSetCommand(msg, C_PRESENTATION);
+		mSetRequestAck(msg, false);
+		mSetAck(msg, false);
+		mSetVersion(msg, PROTOCOL_VERSION);
+		msg.set(LIBRARY_VERSION);
+		sendToGateway(msg, 0);
+	}
+	while (presentedCount < nodeCount && now() < deadline) {
+		readTty(10000000ULL);
+	}
+	// One version request, so the command path is known to be up as well
+	if (presentedCount == nodeCount) {
+		char request[32];
+		int len = snprintf(request, sizeof(request), "0;0;%d;0;%d;\n", C_INTERNAL, I_VERSION);
+		writeTty(request, len);
+		while (!versionSeen && now() < deadline) {
+			readTty(10000000ULL);
+		}
+	}
+	if (presentedCount < nodeCount) {
+		fprintf(stderr, "The gateway forwarded %u of %u node presentations\n", presentedCount, nodeCount);
+	} else if (!versionSeen) {
+		fprintf(stderr, "The gateway did not answer a version request\n");
+	} else {
+		unsigned long seq = 0;
+		uint64_t interval = rate > 0 ? 1000000000ULL / rate : 0;
+		uint64_t next, end;
+
+		start = next = now();
+		end = start + duration * 1000000000ULL;
+		for (;;) {
+			uint64_t t = now();
+			if (t < end) {
+				if (rate > 0) {
+					for (; next <= t; next += interval) {
+						sendCommand(seq++, next);
+					}
+				} else {
+					while (seq - acked - lost < window) {
+						sendCommand(seq++, now());
+					}
+				}
+			} else if (seq == acked + lost) {
+				break;
+			}
+			t = now();
+			while (!pending.empty() && (sendTime[pending.front()] == 0 || t > sendTime[pending.front()] + ACK_TIMEOUT)) {
+				if (sendTime[pending.front()] != 0) {
+					sendTime[pending.front()] = 0;
+					lost++;
+				}
+				pending.pop_front();
+			}
+			uint64_t wait = 10000000ULL;
+			if (rate > 0 && t < end) {
+				t = now();
+				wait = next > t ? next - t : 0;
+			}
+			if (!readTty(wait)) {
+				fprintf(stderr, "The gateway closed its tty\n");
+				break;
+			}
+		}
+
+		double elapsed = ((lastAck > end ? lastAck : end) - start) / 1e9;
+		printf("gateway     %s, %u nodes, reply delay %u us\n", gateway != NULL ? gateway : tty, nodeCount, replyDelay);
+		if (rate > 0) {
+			printf("load        open loop, %u commands/s for %u s\n", rate, duration);
+		} else {
+			printf("load        closed loop, %u outstanding for %u s\n", window, duration);
+		}
+		printf("commands    %lu sent, %lu acked, %lu lost (%lu frames to nodes, %lu acks)\n",
+				seq, acked, lost, framesIn, acksOut);
+		printf("throughput  %.0f commands/s\n", acked / elapsed);
+		if (!latencies.empty()) {
+			size_t n = latencies.size();
+			std::sort(latencies.begin(), latencies.end());
+			printf("latency     p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f us\n",
+					latencies[n / 2] / 1000.0, latencies[n * 90 / 100] / 1000.0, latencies[n * 99 / 100] / 1000.0,
+					latencies[n * 999 / 1000] / 1000.0, latencies[n - 1] / 1000.0);
+		}
+		status = lost == 0 && acked > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+		if (hangup > 0 && !hangUp(tty, hangup)) {
+			status = EXIT_FAILURE;
+		}
+	}
+	peerRunning = false;
+	pthread_join(peerThread, NULL);
+
+cleanup:
+	if (child > 0) {
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+	}
+	if (ttyFd >= 0) {
+		close(ttyFd);
+	}
+	if (radioFd >= 0) {
+		close(radioFd);
+	}
+	close(listenFd);
+	unlink(socketPath);
+	return status;
+}
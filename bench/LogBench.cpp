@@ -0,0 +1,127 @@
+/*
+ * LogBench.cpp - Radio loop latency with synchronous and asynchronous logging
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Runs a simulated radio loop that logs one debug line per frame while
+ * three other threads log in the background. The log sink is a small pipe
+ * whose reader regularly stalls, the way a busy rsyslog does. The latency
+ * of each loop iteration is reported for synchronous log() and for the
+ * asynchronous writer thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+
+#include "PiLog.h"
+
+#define ITERATIONS 20000
+#define NOISE_THREADS 3
+
+static volatile bool noiseRunning;
+static volatile bool readerRunning;
+static int pipeRead;
+
+static uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin(uint64_t ns)
+{
+	uint64_t end = now() + ns;
+	while (now() < end);
+}
+
+// Slow log consumer: drains the pipe, but stalls 20 ms out of every 100 ms
+static void *reader(void *arg)
+{
+	char buf[4096];
+	uint64_t start = now();
+	while (readerRunning) {
+		if ((now() - start) % 100000000ULL < 20000000ULL) {
+			usleep(1000);
+			continue;
+		}
+		if (read(pipeRead, buf, sizeof(buf)) <= 0) {
+			usleep(100);
+		}
+	}
+	return NULL;
+}
+
+static void *noise(void *arg)
+{
+	while (noiseRunning) {
+		log(LOG_INFO, "background %d: some other component logging\n", (int)(long)arg);
+		usleep(1000);
+	}
+	return NULL;
+}
+
+static void run(const char *name)
+{
+	static uint64_t samples[ITERATIONS];
+	pthread_t threads[NOISE_THREADS];
+
+	noiseRunning = true;
+	for (long i = 0; i < NOISE_THREADS; i++) {
+		pthread_create(&threads[i], NULL, noise, (void *)i);
+	}
+	for (int i = 0; i < ITERATIONS; i++) {
+		uint64_t start = now();
+		spin(20000); // radio and protocol work of one frame
+		log(LOG_DEBUG, "read: %d-%d-%d s=%d,c=%d,t=%d,pt=%d,l=%d:%s\n", i & 0xff, 0, 0, 1, 1, 0, 0, 5, "21.50");
+		samples[i] = now() - start;
+	}
+	noiseRunning = false;
+	for (int i = 0; i < NOISE_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	logFlush();
+
+	std::sort(samples, samples + ITERATIONS);
+	fprintf(stderr, "%-6s p50=%8.1f p99=%8.1f p99.9=%8.1f max=%9.1f us  dropped=%lu\n", name,
+			samples[ITERATIONS / 2] / 1000.0, samples[ITERATIONS * 99 / 100] / 1000.0,
+			samples[ITERATIONS * 999 / 1000] / 1000.0, samples[ITERATIONS - 1] / 1000.0, logDropped());
+}
+
+int main(int argc, char **argv)
+{
+	int fds[2];
+	pthread_t readerThread;
+
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		return EXIT_FAILURE;
+	}
+	fcntl(fds[1], F_SETPIPE_SZ, 4096);
+	pipeRead = fds[0];
+	dup2(fds[1], STDOUT_FILENO);
+	// one write per message, like syslog()
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	readerRunning = true;
+	pthread_create(&readerThread, NULL, reader, NULL);
+
+	run("sync");
+	logStartAsync();
+	run("async");
+	closeSyslog();
+
+	readerRunning = false;
+	close(fds[1]);
+	close(STDOUT_FILENO);
+	pthread_join(readerThread, NULL);
+	return EXIT_SUCCESS;
+}
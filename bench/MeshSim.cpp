@@ -0,0 +1,693 @@
+/*
+ * MeshSim.cpp - Routing scale test with many MySensor nodes on a simulated medium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Usage: MeshSim [-n nodes] [-R repeaters] [-d 250k|1m|2m] [-l loss] [-a area]
+ *                [-r range] [-t seconds] [-p period] [-S spread] [-c seconds]
+ *                [-T topology] [-s seed] [-z sleepers] [-N first-last:busy]
+ *                [-q seconds] [-g seconds] [-A] [-F] [-I] [-W] [-v]
+ *
+ * A gateway (node 0) sits in the middle of a square area of -a metres, -R
+ * repeaters on a ring around it and the other nodes at random positions.
+ * Nodes hear each other up to -r metres and every link loses -l of its
+ * frames, more towards the edge of the range. Nodes start within -S seconds
+ * and send a sequence number every -p seconds.
+ *
+ *   -T  read the links from a file instead, one "a b loss" line per link
+ *   -I  nodes ask the simulated controller for an id instead of their index
+ *   -c  the controller sends I_CHILDREN "C" to all repeaters at that time
+ *   -z  the last nodes sleep; their commands wait in the gateway's mailbox
+ *   -A  commands go to every node and ask for an ack, which is retried
+ *   -F  keep the auto retransmit setting of setupRadio() on every link
+ *   -N  foreign traffic on channels first..last, busy that share of the time
+ *   -q  the gateway surveys the channels then and moves to the quietest
+ *   -g  restart the gateway then, with wiped EEPROM, or from a snapshot
+ *       (PiSnapshot.h) with -W; the controller then sends every node a
+ *       command, one every RESTART_PACE ms
+ *
+ * Reported: delivery ratio, hop counts, convergence time, delivered commands
+ * and their delay, the I_DELIVERY results (-A), the channel migration (-q),
+ * the restart (-g), radio statistics per receiver, time spent waiting for
+ * acks and the CPU time of the gateway thread.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+// Before MyGateway.h, its min/max macros break the STL
+#include "SimRadio.h"
+#include "MyGateway.h"
+#include "PiEEPROM.h"
+#include "PiLog.h"
+#include "PiSnapshot.h"
+
+#define QUIESCE 10       // s without new messages at the end, so none are in flight
+#define MAX_REPLIES 512
+#define RESTART_PACE 100 // ms between the commands the controller sends after a restart
+
+struct SimNode {
+	bool repeater;
+	double x, y;
+	uint8_t eeprom[EEPROM_SIZE];
+	uint8_t nodeId;          // id the node got, AUTO until then
+	unsigned long sent;
+	unsigned int random;
+	bool sleeper;
+	std::vector<uint64_t> commands;  // virtual us each command was sent, by number
+	std::vector<bool> executed;
+	uint64_t restartCommand; // virtual us the command after the restart was sent, 0 once executed
+};
+
+// Controller view of a node id
+struct Heard {
+	uint64_t first;          // virtual us the first message arrived, 0 = never
+	uint64_t afterReset;     // first message after the I_CHILDREN reset
+	unsigned long received;  // unique sequence numbers
+	std::vector<bool> seqs;
+};
+
+static SimMedium *medium;
+static SimNode nodes[SIM_MAX_NODES];
+static unsigned int nodeCount = 150;   // without the gateway
+static unsigned int repeaters = 8;
+static rf24_datarate_e dataRate = RF24_250KBPS;
+static double baseLoss = 0.02;
+static double area = 70;
+static double range = 30;
+static unsigned int duration = 3600;
+static unsigned int period = 60;
+static unsigned int spread = 60;
+static unsigned int resetAt = 0;
+static bool staticIds = true;
+static unsigned int sleepers = 0;
+static bool acks = false;
+static bool retryTuning = true;
+static unsigned int surveyAt = 0;
+static uint8_t migratedTo = RF24_CHANNEL;
+static unsigned int restartAt = 0;
+static bool warmStart = false;
+static char snapshotFile[] = "/tmp/MeshSim.XXXXXX";
+static double restartMs;                // wall clock the gateway took to come up again
+static unsigned long restartLines;      // lines it wrote to the controller meanwhile
+static unsigned int restartCommands;
+static unsigned int restartNext = 1;    // node the next command is for
+static std::vector<uint64_t> restartDelays;
+static unsigned long deliveries[4];   // I_DELIVERY results, by delivery_result_e
+static std::vector<uint64_t> commandDelays;
+
+static Heard heard[256];
+static uint8_t nextId = 1;
+static char replies[MAX_REPLIES][MAX_SEND_LENGTH];
+static unsigned int replyCount;
+static unsigned long upstream;
+static uint64_t gatewayCpu;
+
+static uint64_t threadCpu()
+{
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void reply(const char *format, ...)
+{
+	va_list args;
+
+	if (replyCount == MAX_REPLIES) {
+		return;
+	}
+	va_start(args, format);
+	vsnprintf(replies[replyCount++], MAX_SEND_LENGTH, format, args);
+	va_end(args);
+}
+
+/*
+ * The controller: receives the serial protocol lines of the gateway.
+ */
+static void controllerReceive(char *line)
+{
+	int node, sensor, command, ack, type;
+	char payload[MAX_SEND_LENGTH];
+
+	payload[0] = '\0';
+	if (sscanf(line, "%d;%d;%d;%d;%d;%[^\n]", &node, &sensor, &command, &ack, &type, payload) < 5 ||
+			node < 0 || node > 255) {
+		return;
+	}
+	upstream++;
+	if (command == C_INTERNAL && type == I_ID_REQUEST) {
+		if (nextId < AUTO) {
+			reply("%d;%d;%d;0;%d;%d\n", BROADCAST_ADDRESS, NODE_SENSOR_ID, C_INTERNAL, I_ID_RESPONSE, nextId++);
+		}
+	} else if (command == C_INTERNAL && type == I_CONFIG) {
+		reply("%d;%d;%d;0;%d;M\n", node, NODE_SENSOR_ID, C_INTERNAL, I_CONFIG);
+	} else if (command == C_INTERNAL && type == I_DELIVERY) {
+		static const char *results[] = { "ok", "timeout", "replaced", "busy" };
+		char *result = strchr(payload, ',');
+		for (int i = 0; result != NULL && i < 4; i++) {
+			if (strncmp(result + 1, results[i], strlen(results[i])) == 0) {
+				deliveries[i]++;
+			}
+		}
+	} else if (command == C_SET && type == V_VAR1) {
+		Heard *h = &heard[node];
+		unsigned long seq = strtoul(payload, NULL, 10);
+		if (h->first == 0) {
+			h->first = medium->now();
+		}
+		if (resetAt > 0 && h->afterReset == 0 && medium->now() >= resetAt * 1000000ULL) {
+			h->afterReset = medium->now();
+		}
+		if (seq >= h->seqs.size()) {
+			h->seqs.resize(seq + 1);
+		}
+		if (!h->seqs[seq]) {
+			h->seqs[seq] = true;
+			h->received++;
+		}
+	}
+}
+
+/*
+ * The controller: commands for every sleeping node that has an id, or
+ * every node with -A
+ */
+static void sendCommands()
+{
+	for (unsigned int i = 1; i <= nodeCount; i++) {
+		SimNode *node = &nodes[i];
+		if ((node->sleeper || acks) && node->nodeId != AUTO) {
+			reply("%d;1;%d;%d;%d;%zu\n", node->nodeId, C_SET, acks, V_VAR2, node->commands.size());
+			node->commands.push_back(medium->now());
+			node->executed.push_back(false);
+		}
+	}
+}
+
+/*
+ * The controller: the command after the restart for the next node that has an id
+ */
+static void sendRestartCommand()
+{
+	for (; restartNext <= nodeCount; restartNext++) {
+		SimNode *node = &nodes[restartNext];
+		if (node->nodeId != AUTO) {
+			reply("%d;1;%d;%d;%d;%u\n", node->nodeId, C_SET, acks, V_VAR3, restartAt);
+			node->restartCommand = medium->now();
+			restartCommands++;
+			restartNext++;
+			return;
+		}
+	}
+}
+
+static void nodeReceive(const MyMessage &message)
+{
+	if (mGetCommand(message) == C_SET && message.type == V_VAR3) {
+		for (unsigned int i = 1; i <= nodeCount; i++) {
+			if (nodes[i].nodeId == message.destination && nodes[i].restartCommand != 0) {
+				restartDelays.push_back(medium->now() - nodes[i].restartCommand);
+				nodes[i].restartCommand = 0;
+				break;
+			}
+		}
+		return;
+	}
+	if (mGetCommand(message) != C_SET || message.type != V_VAR2) {
+		return;
+	}
+	for (unsigned int i = 1; i <= nodeCount; i++) {
+		SimNode *node = &nodes[i];
+		unsigned long command = message.getULong();
+		if (node->nodeId == message.destination && command < node->commands.size() && !node->executed[command]) {
+			node->executed[command] = true;
+			commandDelays.push_back(medium->now() - node->commands[command]);
+			break;
+		}
+	}
+}
+
+/*
+ * Survey the channels and move to the quietest, like PiRadioGroup does
+ * at startup
+ */
+static void surveyChannels(MyGateway &gw)
+{
+	PiChannelSurvey survey;
+
+	if (!gw.surveyChannels(survey, SURVEY_DWELL)) {
+		return;
+	}
+	uint8_t best = survey.quietest(SURVEY_FIRST, SURVEY_LAST, NULL, 0);
+	if (survey.score(best) + SURVEY_MARGIN <= survey.score(gw.getChannel())) {
+		migratedTo = best;
+		gw.migrateChannel(best);
+	}
+}
+
+static MyGateway *startGateway(SimRadio *radio)
+{
+	MyGateway *gw = new MyGateway(radio, 1);
+	gw->setRetryTuning(retryTuning);
+	gw->keepState(warmStart ? KEEP_SNAPSHOT : 0);
+	gw->begin(RF24_PA_LEVEL_GW, RF24_CHANNEL, dataRate, controllerReceive);
+	return gw;
+}
+
+/*
+ * Stop the gateway and start it again as a new process would: counters
+ * and gauges from zero, the EEPROM wiped or taken back from the snapshot
+ */
+static MyGateway *restartGateway(MyGateway *gw, SimRadio *radio, uint8_t *eeprom)
+{
+	timespec begin, end;
+
+	if (warmStart && !snapshotClose()) {
+		perror(snapshotFile);
+	}
+	delete gw;
+	for (unsigned int i = 0; i < METRICS_COUNT; i++) {
+		if (warmStart || !metricIsCounter((metric_id)i)) {
+			metricClear((metric_id)i);
+		}
+	}
+	memset(eeprom, 0xff, EEPROM_SIZE);
+	unsigned long lines = upstream;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	if (warmStart && !snapshotOpen(snapshotFile)) {
+		perror(snapshotFile);
+	}
+	gw = startGateway(radio);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	restartMs = (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+	restartLines = upstream - lines;
+	return gw;
+}
+
+static void gatewayNode(unsigned int index, void *arg)
+{
+	SimRadio *radio = medium->radio(index);
+	bool resetDone = resetAt == 0;
+	bool surveyDone = surveyAt == 0;
+	bool restartDone = restartAt == 0;
+	uint64_t nextRestartCommand = restartAt * 1000000ULL;
+	char line[MAX_SEND_LENGTH];
+	uint64_t nextCommands = (1 + repeaters + spread + period) * 1000000ULL;
+
+	eeprom_select(nodes[index].eeprom);
+	MyGateway *gw = startGateway(radio);
+	uint64_t cpuStart = threadCpu();
+	try {
+		for (;;) {
+			gw->processRadioMessage();
+			for (unsigned int i = 0; i < replyCount; i++) {
+				// parseAndSend() tokenizes in place
+				strcpy(line, replies[i]);
+				gw->parseAndSend(line);
+			}
+			replyCount = 0;
+			if ((sleepers > 0 || acks) && medium->now() >= nextCommands && medium->now() < (duration - QUIESCE) * 1000000ULL) {
+				nextCommands += period * 1000000ULL;
+				sendCommands();
+				continue;
+			}
+			if (!resetDone && medium->now() >= resetAt * 1000000ULL) {
+				resetDone = true;
+				for (unsigned int i = 1; i <= nodeCount; i++) {
+					if (nodes[i].repeater && nodes[i].nodeId != AUTO) {
+						reply("%d;%d;%d;0;%d;C\n", nodes[i].nodeId, NODE_SENSOR_ID, C_INTERNAL, I_CHILDREN);
+					}
+				}
+				continue;
+			}
+			if (!surveyDone && medium->now() >= surveyAt * 1000000ULL) {
+				surveyDone = true;
+				surveyChannels(*gw);
+				continue;
+			}
+			if (!restartDone && medium->now() >= restartAt * 1000000ULL) {
+				restartDone = true;
+				gw = restartGateway(gw, radio, nodes[index].eeprom);
+				continue;
+			}
+			if (restartDone && restartNext <= nodeCount && medium->now() >= nextRestartCommand) {
+				nextRestartCommand += RESTART_PACE * 1000ULL;
+				sendRestartCommand();
+				continue;
+			}
+			if (!radio->available()) {
+				// Keeps announcing a channel migration until the switch
+				uint64_t wait = gw->getChannel() != migratedTo ? CHANNEL_ANNOUNCE_INTERVAL : 1000;
+				if (!resetDone) {
+					wait = std::min<uint64_t>(wait, (resetAt * 1000000ULL - medium->now()) / 1000 + 1);
+				}
+				if (restartAt > 0 && restartNext <= nodeCount) {
+					wait = std::min<uint64_t>(wait, (nextRestartCommand - medium->now()) / 1000 + 1);
+				}
+				radio->waitForEvent(wait);
+			}
+		}
+	} catch (SimStopped &) {
+		gatewayCpu = threadCpu() - cpuStart;
+		delete gw;
+		throw;
+	}
+}
+
+static void sensorNode(unsigned int index, void *arg)
+{
+	SimNode *node = &nodes[index];
+	SimRadio *radio = medium->radio(index);
+
+	eeprom_select(node->eeprom);
+	MySensor sensor(radio);
+	sensor.setRetryTuning(retryTuning);
+	sensor.begin(nodeReceive, staticIds ? index : AUTO, node->repeater, AUTO, RF24_PA_LEVEL, RF24_CHANNEL, dataRate);
+	sensor.present(1, S_CUSTOM);
+	MyMessage msg(1, V_VAR1);
+	unsigned long seq = 0;
+	for (;;) {
+		node->nodeId = sensor.getNodeId();
+		if (medium->now() < (duration - QUIESCE) * 1000000ULL) {
+			if (node->nodeId != AUTO) {
+				node->sent++;
+				sensor.send(msg.set(seq++));
+			} else {
+				// Triggers a new id request
+				sensor.send(msg.set(seq));
+			}
+		}
+		// +-10% so the nodes don't stay in lock step
+		unsigned long wait = period * 1000UL;
+		wait += rand_r(&node->random) % (wait / 5 + 1) - wait / 10;
+		if (node->sleeper) {
+			sensor.sleep(wait);
+		} else {
+			sensor.wait(wait);
+		}
+	}
+}
+
+static void placeNodes(unsigned int seed)
+{
+	unsigned int random = seed;
+
+	nodes[0].x = area / 2;
+	nodes[0].y = area / 2;
+	for (unsigned int i = 1; i <= nodeCount; i++) {
+		if (i <= repeaters) {
+			double angle = 2 * M_PI * i / repeaters;
+			nodes[i].repeater = true;
+			nodes[i].x = area / 2 + range * 0.8 * cos(angle);
+			nodes[i].y = area / 2 + range * 0.8 * sin(angle);
+		} else {
+			nodes[i].x = area * rand_r(&random) / RAND_MAX;
+			nodes[i].y = area * rand_r(&random) / RAND_MAX;
+		}
+	}
+	for (unsigned int a = 0; a <= nodeCount; a++) {
+		for (unsigned int b = a + 1; b <= nodeCount; b++) {
+			double d = hypot(nodes[a].x - nodes[b].x, nodes[a].y - nodes[b].y);
+			if (d > range) {
+				continue;
+			}
+			// Links get worse over the last 20% of the range
+			double edge = (d - 0.8 * range) / (0.2 * range);
+			medium->setLink(a, b, baseLoss + (1 - baseLoss) * (edge > 0 ? edge * 0.5 : 0));
+		}
+	}
+}
+
+static bool readTopology(const char *file)
+{
+	FILE *f = fopen(file, "r");
+	unsigned int a, b;
+	double loss;
+	char line[128];
+
+	if (f == NULL) {
+		perror(file);
+		return false;
+	}
+	for (unsigned int i = 1; i <= nodeCount; i++) {
+		nodes[i].repeater = i <= repeaters;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%u %u %lf", &a, &b, &loss) != 3) {
+			continue;
+		}
+		if (a <= nodeCount && b <= nodeCount && a != b) {
+			medium->setLink(a, b, loss);
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+/*
+ * Time by which a fraction p of total nodes had been heard, as text.
+ */
+static const char *percentile(std::vector<uint64_t> &times, unsigned int total, double p, char *buf)
+{
+	size_t n = (size_t)ceil(total * p);
+	if (n == 0 || n > times.size()) {
+		return "never";
+	}
+	sprintf(buf, "%.1f s", times[n - 1] / 1e6);
+	return buf;
+}
+
+static void report(double wall)
+{
+	unsigned long sent = 0, received = 0;
+	unsigned int hops[256] = {};
+	unsigned int noParent = 0;
+	std::vector<uint64_t> joined, rejoined;
+	unsigned int heardBeforeReset = 0;
+	const char *rates[] = { "1 Mbps", "2 Mbps", "250 kbps" };
+	char p50[32], p90[32], p100[32];
+
+	for (unsigned int i = 1; i <= nodeCount; i++) {
+		sent += nodes[i].sent;
+		uint8_t distance = nodes[i].eeprom[EEPROM_DISTANCE_ADDRESS];
+		if (nodes[i].eeprom[EEPROM_PARENT_NODE_ID_ADDRESS] == 0xff || distance == 0xff) {
+			noParent++;
+		} else {
+			hops[distance]++;
+		}
+	}
+	for (unsigned int id = 1; id < 255; id++) {
+		received += heard[id].received;
+		if (heard[id].first) {
+			joined.push_back(heard[id].first);
+			if (resetAt > 0 && heard[id].first < resetAt * 1000000ULL) {
+				heardBeforeReset++;
+				if (heard[id].afterReset) {
+					rejoined.push_back(heard[id].afterReset - resetAt * 1000000ULL);
+				}
+			}
+		}
+	}
+	std::sort(joined.begin(), joined.end());
+	std::sort(rejoined.begin(), rejoined.end());
+
+	printf("nodes       %u (%u repeaters) + gateway, %s, loss %.3f\n", nodeCount, repeaters, rates[dataRate], baseLoss);
+	printf("simulated   %u s in %.2f s (%.0fx real time)\n", duration, wall, duration / wall);
+	printf("delivery    %lu/%lu (%.2f%%)\n", received, sent, sent ? 100.0 * received / sent : 0.0);
+	printf("hops       ");
+	double sum = 0;
+	unsigned int routed = 0;
+	for (unsigned int d = 1; d < 255; d++) {
+		if (hops[d]) {
+			printf(" %u:%u", d, hops[d]);
+			sum += d * hops[d];
+			routed += hops[d];
+		}
+	}
+	printf(" none:%u (avg %.2f)\n", noParent, routed ? sum / routed : 0.0);
+	printf("convergence %zu/%u nodes heard, 50%% %s, 90%% %s, 100%% %s\n", joined.size(), nodeCount,
+			percentile(joined, nodeCount, 0.5, p50), percentile(joined, nodeCount, 0.9, p90),
+			percentile(joined, nodeCount, 1.0, p100));
+	if (resetAt > 0) {
+		// times relative to the reset
+		printf("reset       %zu/%u nodes heard again after I_CHILDREN, 90%% %s, 100%% %s\n",
+				rejoined.size(), heardBeforeReset, percentile(rejoined, heardBeforeReset, 0.9, p90),
+				percentile(rejoined, heardBeforeReset, 1.0, p100));
+	}
+	if (sleepers > 0 || acks) {
+		unsigned long commands = 0;
+		unsigned int receivers = 0;
+		for (unsigned int i = 1; i <= nodeCount; i++) {
+			commands += nodes[i].commands.size();
+			receivers += !nodes[i].commands.empty();
+		}
+		std::sort(commandDelays.begin(), commandDelays.end());
+		printf("commands    %zu/%lu reached %u nodes (%u sleeping), delay 50%% %s, 90%% %s, 100%% %s\n",
+				commandDelays.size(), commands, receivers, sleepers, percentile(commandDelays, commandDelays.size(), 0.5, p50),
+				percentile(commandDelays, commandDelays.size(), 0.9, p90), percentile(commandDelays, commandDelays.size(), 1.0, p100));
+	}
+	if (surveyAt > 0) {
+		unsigned int followed = 0;
+		for (unsigned int i = 1; i <= nodeCount; i++) {
+			uint8_t channel = nodes[i].eeprom[EEPROM_CHANNEL_ADDRESS];
+			followed += channel == migratedTo && nodes[i].eeprom[EEPROM_CHANNEL_ADDRESS + 1] == (uint8_t)~channel;
+		}
+		if (migratedTo == RF24_CHANNEL) {
+			printf("channel     %d kept after the survey at %u s\n", RF24_CHANNEL, surveyAt);
+		} else {
+			printf("channel     %d -> %d at %u s, %u/%u nodes followed\n", RF24_CHANNEL, migratedTo, surveyAt,
+					followed, nodeCount);
+		}
+	}
+	if (restartAt > 0) {
+		std::sort(restartDelays.begin(), restartDelays.end());
+		printf("restart     %s at %u s, up in %.2f ms, %lu lines to the controller, commands reached %zu/%u nodes, delay 50%% %s, 90%% %s, 100%% %s\n",
+				warmStart ? "warm" : "cold", restartAt, restartMs, restartLines, restartDelays.size(), restartCommands,
+				percentile(restartDelays, restartCommands, 0.5, p50), percentile(restartDelays, restartCommands, 0.9, p90),
+				percentile(restartDelays, restartCommands, 1.0, p100));
+	}
+	if (acks) {
+		printf("deliveries  %lu ok, %lu timeout, %lu replaced, %lu busy\n", deliveries[DELIVERY_OK],
+				deliveries[DELIVERY_TIMEOUT], deliveries[DELIVERY_REPLACED], deliveries[DELIVERY_BUSY]);
+	}
+	printf("radio       %lu frames, %lu retransmissions, %lu failed, %lu collisions, %lu lost, %lu noise, %lu fifo full, %lu duplicates, %lu ack payloads\n",
+			medium->stats.transmissions, medium->stats.retransmissions, medium->stats.txFailed,
+			medium->stats.collisions, medium->stats.lost, medium->stats.noise, medium->stats.fifoFull,
+			medium->stats.duplicates, medium->stats.ackPayloads);
+	printf("retries     %.1f s waited for acks, %lu setting changes\n", metricGet(M_RETRY_WAIT) / 1e6,
+			metricGet(M_RETRY_CHANGES));
+	printf("gateway cpu %.3f s, %.1f us per upstream message (%lu)\n", gatewayCpu / 1e6,
+			upstream ? (double)gatewayCpu / upstream : 0.0, upstream);
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: MeshSim [-n nodes] [-R repeaters] [-d 250k|1m|2m] [-l loss] [-a area]\n"
+			"               [-r range] [-t seconds] [-p period] [-S spread] [-c seconds]\n"
+			"               [-T topology] [-s seed] [-z sleepers] [-N first-last:busy]\n"
+			"               [-q seconds] [-g seconds] [-A] [-F] [-I] [-W] [-v]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = 1;
+	const char *topology = NULL;
+	bool verbose = false;
+	std::vector<unsigned int> noiseFirst, noiseLast;
+	std::vector<double> noiseBusy;
+	unsigned int first, last;
+	double busy;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:R:d:l:a:r:t:p:S:c:T:s:z:N:q:g:AFIWv")) != -1) {
+		switch (c) {
+			case 'n': nodeCount = atoi(optarg); break;
+			case 'R': repeaters = atoi(optarg); break;
+			case 'd':
+				if (strcmp(optarg, "250k") == 0) dataRate = RF24_250KBPS;
+				else if (strcmp(optarg, "1m") == 0) dataRate = RF24_1MBPS;
+				else if (strcmp(optarg, "2m") == 0) dataRate = RF24_2MBPS;
+				else usage();
+				break;
+			case 'l': baseLoss = atof(optarg); break;
+			case 'a': area = atof(optarg); break;
+			case 'r': range = atof(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'p': period = atoi(optarg); break;
+			case 'S': spread = atoi(optarg); break;
+			case 'c': resetAt = atoi(optarg); break;
+			case 'T': topology = optarg; break;
+			case 's': seed = atoi(optarg); break;
+			case 'z': sleepers = atoi(optarg); break;
+			case 'N':
+				if (sscanf(optarg, "%u-%u:%lf", &first, &last, &busy) != 3 || first > last || last >= SIM_CHANNELS) {
+					usage();
+				}
+				noiseFirst.push_back(first);
+				noiseLast.push_back(last);
+				noiseBusy.push_back(busy);
+				break;
+			case 'q': surveyAt = atoi(optarg); break;
+			case 'g': restartAt = atoi(optarg); break;
+			case 'A': acks = true; break;
+			case 'F': retryTuning = false; break;
+			case 'I': staticIds = false; break;
+			case 'W': warmStart = true; break;
+			case 'v': verbose = true; break;
+			default: usage();
+		}
+	}
+	if (nodeCount < 1 || nodeCount > 254 || repeaters + sleepers > nodeCount || duration <= QUIESCE || period < 1 || restartAt >= duration) {
+		usage();
+	}
+	if (!verbose) {
+		// Keep the nodes' debug output out of the report
+		daemonizeFlag = 1;
+		logSetMask(LOG_UPTO(LOG_WARNING));
+	}
+
+	medium = new SimMedium(nodeCount + 1, seed);
+	for (size_t i = 0; i < noiseBusy.size(); i++) {
+		for (unsigned int channel = noiseFirst[i]; channel <= noiseLast[i]; channel++) {
+			medium->setNoise(channel, noiseBusy[i]);
+		}
+	}
+	if (topology != NULL) {
+		if (!readTopology(topology)) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		placeNodes(seed);
+	}
+
+	unsigned int random = seed;
+	for (unsigned int i = 0; i <= nodeCount; i++) {
+		// Factory fresh EEPROM
+		memset(nodes[i].eeprom, 0xff, EEPROM_SIZE);
+		nodes[i].nodeId = AUTO;
+		nodes[i].random = seed + i;
+		nodes[i].sleeper = i > nodeCount - sleepers;
+		if (i == 0) {
+			medium->startNode(i, 0, gatewayNode, NULL);
+		} else {
+			// Repeaters first, the network needs them to grow
+			uint64_t start = nodes[i].repeater ? 1000000ULL * i : 1000000ULL * (1 + repeaters) + 1000000ULL * spread * rand_r(&random) / RAND_MAX;
+			medium->startNode(i, start, sensorNode, NULL);
+		}
+	}
+
+	if (warmStart) {
+		// Kept from the first start on, there is none yet
+		int fd = mkstemp(snapshotFile);
+		if (fd < 0) {
+			perror(snapshotFile);
+			return EXIT_FAILURE;
+		}
+		close(fd);
+		unlink(snapshotFile);
+		snapshotOpen(snapshotFile);
+	}
+
+	timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	medium->run(duration * 1000000ULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	report((end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9);
+	if (warmStart) {
+		snapshotClose();
+		unlink(snapshotFile);
+	}
+	delete medium;
+	return EXIT_SUCCESS;
+}
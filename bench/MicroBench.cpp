@@ -0,0 +1,675 @@
+/*
+ * MicroBench.cpp - Microbenchmarks of the message codec, parser and routing
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Usage: MicroBench [-f filter] [-t ms] [-j file]
+ *
+ * Covers MyMessage::getString() for every payload type, the set() variants,
+ * MyGateway::parseAndSend() and serial(MyMessage&), the routing table,
+ * firmware blocks served from PiFirmware, PiFilter, PiRules and the
+ * PiEEPROM accessors, also with their writes journaled by PiJournal into a
+ * file in /tmp. Each benchmark is calibrated to run at least -t
+ * milliseconds (default 100) and then repeated; the best repetition is
+ * reported as ns, heap allocations and CPU cycles per operation. Cycles come
+ * from the cycle counter of perf_event_open() and are left out where the
+ * kernel doesn't allow it (see /proc/sys/kernel/perf_event_paranoid).
+ *
+ * -f runs only the benchmarks whose name contains the filter, -j also
+ * writes the results as JSON to a file ("-" for stdout).
+ *
+ * The gateway is built on a transport that discards written frames, so
+ * parseAndSend() measures parsing and routing, not a radio.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+
+#include "MyGateway.h"
+#include "PiEEPROM.h"
+#include "PiFirmware.h"
+#include "PiFilter.h"
+#include "PiRules.h"
+#include "PiJournal.h"
+#include "PiLog.h"
+#include "Version.h"
+
+#define REPEAT 5
+#define MAX_RESULTS 64
+
+struct Result {
+	const char *name;
+	unsigned long iterations;
+	double ns;
+	double allocs;
+	double cycles;      // < 0 if not available
+};
+
+static Result results[MAX_RESULTS];
+static unsigned int resultCount;
+static const char *filter;
+static uint64_t minTime = 100000000ULL;
+static int cycleFd = -1;
+
+/* Heap allocations of the process, counted by the malloc wrappers below */
+static volatile unsigned long allocations;
+
+extern "C" {
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t n, size_t size);
+	void *__libc_realloc(void *p, size_t size);
+
+	void *malloc(size_t size)
+	{
+		allocations++;
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t n, size_t size)
+	{
+		allocations++;
+		return __libc_calloc(n, size);
+	}
+
+	void *realloc(void *p, size_t size)
+	{
+		allocations++;
+		return __libc_realloc(p, size);
+	}
+}
+
+/* Keeps the compiler from optimizing a benchmarked result away */
+#define keep(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+
+static uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void openCycleCounter()
+{
+	perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	cycleFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t readCycles()
+{
+	uint64_t cycles = 0;
+	if (cycleFd >= 0 && read(cycleFd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+		cycles = 0;
+	}
+	return cycles;
+}
+
+/*
+ * Run fn(n) until one run takes minTime, then REPEAT times more, and record
+ * the fastest run per operation.
+ */
+static void bench(const char *name, void (*fn)(unsigned long n))
+{
+	unsigned long n = 1;
+	uint64_t start, elapsed;
+
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+	for (;;) {
+		start = now();
+		fn(n);
+		elapsed = now() - start;
+		if (elapsed >= minTime || n >= (1UL << 30)) {
+			break;
+		}
+		n = elapsed < minTime / 100 ? n * 100 : n * 2;
+	}
+
+	Result &r = results[resultCount++];
+	r.name = name;
+	r.iterations = n;
+	r.ns = r.allocs = r.cycles = -1;
+	for (int i = 0; i < REPEAT; i++) {
+		unsigned long allocsBefore = allocations;
+		if (cycleFd >= 0) {
+			ioctl(cycleFd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(cycleFd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		start = now();
+		fn(n);
+		elapsed = now() - start;
+		if (cycleFd >= 0) {
+			ioctl(cycleFd, PERF_EVENT_IOC_DISABLE, 0);
+		}
+		double ns = (double)elapsed / n;
+		if (r.ns < 0 || ns < r.ns) {
+			r.ns = ns;
+			r.allocs = (double)(allocations - allocsBefore) / n;
+			if (cycleFd >= 0) {
+				r.cycles = (double)readCycles() / n;
+			}
+		}
+	}
+	if (r.cycles >= 0) {
+		printf("%-28s %10.1f ns/op %8.2f allocs/op %10.1f cycles/op\n", r.name, r.ns, r.allocs, r.cycles);
+	} else {
+		printf("%-28s %10.1f ns/op %8.2f allocs/op\n", r.name, r.ns, r.allocs);
+	}
+	fflush(stdout);
+}
+
+static void writeJson(const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	utsname host;
+
+	if (f == NULL) {
+		perror(path);
+		return;
+	}
+	uname(&host);
+	fprintf(f, "{\n  \"host\": \"%s\",\n  \"version\": \"%s\",\n  \"benchmarks\": [\n", host.machine, LIBRARY_VERSION);
+	for (unsigned int i = 0; i < resultCount; i++) {
+		Result &r = results[i];
+		fprintf(f, "    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, ",
+				r.name, r.iterations, r.ns, r.allocs);
+		if (r.cycles >= 0) {
+			fprintf(f, "\"cycles_per_op\": %.1f}", r.cycles);
+		} else {
+			fprintf(f, "\"cycles_per_op\": null}");
+		}
+		fprintf(f, "%s\n", i + 1 < resultCount ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	if (f != stdout) {
+		fclose(f);
+	}
+}
+
+/*
+ * Radio that accepts and discards every frame
+ */
+class NullTransport : public MyTransport
+{
+  public:
+	bool begin() { return true; }
+	void setAutoAck(bool enable) {}
+	void setAutoAck(uint8_t pipe, bool enable) {}
+	void enableAckPayload() {}
+	void enableDynamicPayloads() {}
+	void setChannel(uint8_t channel) {}
+	void setPALevel(rf24_pa_dbm_e level) {}
+	bool setDataRate(rf24_datarate_e speed) { return true; }
+	void setRetries(uint8_t delay, uint8_t count) {}
+	void setCRCLength(rf24_crclength_e length) {}
+	void openWritingPipe(uint64_t address) {}
+	void openReadingPipe(uint8_t pipe, uint64_t address) {}
+	void startListening() {}
+	void stopListening() {}
+	void powerUp() {}
+	void powerDown() {}
+	bool available(uint8_t *pipe) { return false; }
+	uint8_t getDynamicPayloadSize() { return 0; }
+	void read(void *buf, uint8_t len) {}
+	bool write(const void *buf, uint8_t len, bool multicast) { return true; }
+};
+
+/*
+ * Gives the benchmarks access to the protected routing and serial code
+ */
+class BenchGateway : public MyGateway
+{
+  public:
+	BenchGateway(MyTransport *transport) : MyGateway(transport, 1) {}
+	using MyGateway::serial;
+	using MyGateway::serveFirmware;
+	using MySensor::getChildRoute;
+	using MySensor::addChildRoute;
+	using MySensor::removeChildRoute;
+};
+
+static BenchGateway *gw;
+static unsigned long outputLines;
+
+static void countOutput(char *line)
+{
+	outputLines++;
+}
+
+/* One message per payload type, for getString() */
+static MyMessage payloads[P_FLOAT32 + 1];
+static const char *payloadNames[P_FLOAT32 + 1] = {
+	"getString/P_STRING", "getString/P_BYTE", "getString/P_INT16", "getString/P_UINT16",
+	"getString/P_LONG32", "getString/P_ULONG32", "getString/P_CUSTOM", "getString/P_FLOAT32"
+};
+static uint8_t currentPayload;
+
+static void setupPayloads()
+{
+	static const uint8_t custom[] = { 0xde, 0xad, 0xbe, 0xef, 0x01, 0x02, 0x03, 0x04 };
+
+	payloads[P_STRING].set("Hello world");
+	payloads[P_BYTE].set((uint8_t)200);
+	payloads[P_INT16].set((int)-12345);
+	payloads[P_UINT16].set((unsigned int)54321);
+	payloads[P_LONG32].set((long)-1234567890L);
+	payloads[P_ULONG32].set((unsigned long)3456789012UL);
+	payloads[P_CUSTOM].set((void *)custom, sizeof(custom));
+	payloads[P_FLOAT32].set((float)21.37f, 2);
+}
+
+static void benchGetString(unsigned long n)
+{
+	char buf[MAX_PAYLOAD * 2 + 1];
+	MyMessage &msg = payloads[currentPayload];
+
+	for (unsigned long i = 0; i < n; i++) {
+		keep(msg.getString(buf));
+	}
+}
+
+static MyMessage setMsg;
+
+static void benchSetString(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set("23.5");
+		keep(setMsg);
+	}
+}
+
+static void benchSetByte(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set((uint8_t)i);
+		keep(setMsg);
+	}
+}
+
+static void benchSetInt(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set((int)i);
+		keep(setMsg);
+	}
+}
+
+static void benchSetUInt(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set((unsigned int)i);
+		keep(setMsg);
+	}
+}
+
+static void benchSetLong(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set((long)i);
+		keep(setMsg);
+	}
+}
+
+static void benchSetULong(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set((unsigned long)i);
+		keep(setMsg);
+	}
+}
+
+static void benchSetFloat(unsigned long n)
+{
+	float value = 21.37f;
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set(value, 2);
+		keep(setMsg);
+	}
+}
+
+static void benchSetCustom(unsigned long n)
+{
+	uint8_t data[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+	for (unsigned long i = 0; i < n; i++) {
+		setMsg.set(data, sizeof(data));
+		keep(setMsg);
+	}
+}
+
+/* parseAndSend() tokenizes in place, every call gets a fresh copy */
+static const char *command;
+
+static void benchParseAndSend(unsigned long n)
+{
+	char buf[MAX_RECEIVE_LENGTH];
+	size_t len = strlen(command) + 1;
+
+	for (unsigned long i = 0; i < n; i++) {
+		memcpy(buf, command, len);
+		gw->parseAndSend(buf);
+	}
+}
+
+static void benchSerial(unsigned long n)
+{
+	MyMessage msg(3, V_TEMP);
+	msg.sender = 42;
+	msg.set((float)21.37f, 2);
+	for (unsigned long i = 0; i < n; i++) {
+		gw->serial(msg);
+	}
+}
+
+static void benchGetChildRoute(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		keep(gw->getChildRoute((uint8_t)i));
+	}
+}
+
+static void benchAddChildRoute(unsigned long n)
+{
+	// Alternates between two routes, so every call changes the table
+	for (unsigned long i = 0; i < n; i++) {
+		gw->addChildRoute(1 + (i & 0x7f), 1 + (i & 0x80 ? 1 : 0));
+	}
+}
+
+#define FIRMWARE_BENCH_SIZE 32768
+
+static uint8_t firmwareImage[FIRMWARE_BENCH_SIZE];
+
+static bool setupFirmware()
+{
+	char path[] = "/tmp/MicroBench.XXXXXX";
+	int fd = mkstemp(path);
+	bool ok;
+
+	for (unsigned int i = 0; i < sizeof(firmwareImage); i++) {
+		firmwareImage[i] = (uint8_t)(i * 7);
+	}
+	if (fd < 0) {
+		return false;
+	}
+	ok = write(fd, firmwareImage, sizeof(firmwareImage)) == sizeof(firmwareImage);
+	close(fd);
+	ok = ok && firmwareLoad(1, 1, path);
+	unlink(path);
+	return ok;
+}
+
+static void benchFirmwareBlock(unsigned long n)
+{
+	MyMessage request(NODE_SENSOR_ID, ST_FIRMWARE_REQUEST);
+	FirmwareRequest block = { 1, 1, 0 };
+
+	request.sender = 1;
+	request.destination = GATEWAY_ADDRESS;
+	mSetCommand(request, C_STREAM);
+	for (unsigned long i = 0; i < n; i++) {
+		// Count down like the bootloader does
+		block.block = FIRMWARE_BENCH_SIZE / FIRMWARE_BLOCK_SIZE - 1 - i % (FIRMWARE_BENCH_SIZE / FIRMWARE_BLOCK_SIZE);
+		request.set(&block, sizeof(block));
+		keep(gw->serveFirmware(request));
+	}
+}
+
+static void benchFirmwareCrc(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		keep(firmwareCrc16(firmwareImage, sizeof(firmwareImage)));
+	}
+}
+
+static void benchEepromReadByte(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		keep(eeprom_read_byte((uint8_t *)(i & (EEPROM_SIZE - 1))));
+	}
+}
+
+static void benchEepromWriteByte(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		// Every pass over the EEPROM writes other values
+		eeprom_write_byte((uint8_t *)(i & (EEPROM_SIZE - 1)), (uint8_t)(i + i / EEPROM_SIZE));
+	}
+}
+
+static void benchEepromReadDword(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		keep(eeprom_read_dword((uint32_t *)((i * 4) & (EEPROM_SIZE - 4))));
+	}
+}
+
+static void benchEepromReadBlock(unsigned long n)
+{
+	uint8_t buf[32];
+	for (unsigned long i = 0; i < n; i++) {
+		eeprom_read_block(buf, (void *)((i * 32) & (EEPROM_SIZE - 32)), sizeof(buf));
+		keep(buf);
+	}
+}
+
+static void benchEepromWriteBlock(unsigned long n)
+{
+	uint8_t buf[32] = { 0 };
+	for (unsigned long i = 0; i < n; i++) {
+		buf[0] = (uint8_t)i;
+		eeprom_write_block(buf, (void *)((i * 32) & (EEPROM_SIZE - 32)), sizeof(buf));
+	}
+}
+
+/*
+ * Power readings of 200 nodes against a deadband rule, mostly unchanged
+ * or mostly changing
+ */
+static unsigned long filterStep;
+
+static void benchFilter(unsigned long n)
+{
+	PiFilter filter;
+	MyMessage msg(1, V_WATT);
+
+	mSetCommand(msg, C_SET);
+
+	for (unsigned long i = 0; i < n; i++) {
+		msg.sender = 1 + i % 200;
+		msg.set((long)(1000 + i / 200 * filterStep % 50));
+		keep(filter.pass(msg, i / 200));
+		keep(filter.due(i / 200));
+	}
+}
+
+/*
+ * Two rules per motion sensor of 100 nodes, one switching its light on,
+ * one off
+ */
+static bool setupRules()
+{
+	char path[] = "/tmp/MicroBench.XXXXXX";
+	int fd = mkstemp(path);
+	FILE *file;
+	bool ok;
+	int line;
+
+	if (fd < 0 || (file = fdopen(fd, "w")) == NULL) {
+		return false;
+	}
+	for (int node = 1; node <= 100; node++) {
+		fprintf(file, "%d;1;%d == 1 -> %d;1;%d;0;%d;1\n", node, V_TRIPPED, 100 + node, C_SET, V_LIGHT);
+		fprintf(file, "%d;1;%d == 0 -> %d;1;%d;0;%d;0\n", node, V_TRIPPED, 100 + node, C_SET, V_LIGHT);
+	}
+	ok = fclose(file) == 0 && rulesLoad(path, &line);
+	unlink(path);
+	return ok;
+}
+
+static uint8_t rulesSender;
+
+static void benchRules(unsigned long n)
+{
+	MyMessage msg(1, V_TRIPPED);
+	MyMessage actions[RULES_MAX_ACTIONS];
+
+	mSetCommand(msg, C_SET);
+	msg.sender = rulesSender;
+	for (unsigned long i = 0; i < n; i++) {
+		if (rulesSender == 0) {
+			msg.sender = 1 + i % 100;
+		}
+		msg.set((uint8_t)(i & 1));
+		keep(rulesMatch(msg, actions, RULES_MAX_ACTIONS));
+	}
+}
+
+/*
+ * The gateway's EEPROM journaled to a temporary file, false if it can't be
+ */
+static char journalFile[] = "/tmp/MicroBench.XXXXXX";
+
+static bool setupJournal()
+{
+	JournalRecovery recovery;
+	int fd = mkstemp(journalFile);
+
+	if (fd < 0) {
+		return false;
+	}
+	close(fd);
+	unlink(journalFile);
+	if (!journalOpen(journalFile, &recovery)) {
+		return false;
+	}
+	journalAttach(0, eeprom_image());
+	return true;
+}
+
+static void closeJournal()
+{
+	char path[sizeof(journalFile) + 8];
+
+	journalClose();
+	unlink(journalFile);
+	snprintf(path, sizeof(path), "%s.journal", journalFile);
+	unlink(path);
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: MicroBench [-f filter] [-t ms] [-j file]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *json = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:t:j:")) != -1) {
+		switch (c) {
+			case 'f': filter = optarg; break;
+			case 't': minTime = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+			case 'j': json = optarg; break;
+			default: usage();
+		}
+	}
+	// Keep the gateway's debug output out of the measurements
+	daemonizeFlag = 1;
+	logSetMask(LOG_UPTO(LOG_WARNING));
+	openCycleCounter();
+	if (cycleFd < 0) {
+		printf("cycle counter not available, reporting ns and allocations only\n");
+	}
+
+	setupPayloads();
+	for (currentPayload = P_STRING; currentPayload <= P_FLOAT32; currentPayload++) {
+		bench(payloadNames[currentPayload], benchGetString);
+	}
+	bench("set/string", benchSetString);
+	bench("set/uint8", benchSetByte);
+	bench("set/int", benchSetInt);
+	bench("set/unsigned_int", benchSetUInt);
+	bench("set/long", benchSetLong);
+	bench("set/unsigned_long", benchSetULong);
+	bench("set/float", benchSetFloat);
+	bench("set/custom", benchSetCustom);
+
+	gw = new BenchGateway(new NullTransport());
+	gw->begin(RF24_PA_LEVEL_GW, RF24_CHANNEL, RF24_DATARATE, countOutput);
+	gw->addChildRoute(1, 1);
+	command = "1;1;1;0;0;21.5\n";
+	bench("parseAndSend/set", benchParseAndSend);
+	command = "1;1;4;0;0;000102030405060708090a0b0c0d0e0f\n";
+	bench("parseAndSend/stream", benchParseAndSend);
+	command = "0;0;3;0;2;\n";
+	bench("parseAndSend/internal", benchParseAndSend);
+	command = "1;1;1\n";
+	bench("parseAndSend/invalid", benchParseAndSend);
+	bench("serial/message", benchSerial);
+	bench("route/get", benchGetChildRoute);
+	bench("route/add", benchAddChildRoute);
+	if (setupFirmware()) {
+		bench("firmware/block", benchFirmwareBlock);
+		if (resultCount > 0 && strcmp(results[resultCount - 1].name, "firmware/block") == 0) {
+			printf("%-28s %10.0f blocks/s\n", "firmware/block", 1e9 / results[resultCount - 1].ns);
+		}
+		bench("firmware/crc16_32k", benchFirmwareCrc);
+	} else {
+		printf("firmware image could not be loaded, skipping firmware benchmarks\n");
+	}
+
+	filterAddRule("*:*:17:5:1000:200:300");
+	filterStep = 1;
+	bench("filter/unchanged", benchFilter);
+	filterStep = 7;
+	bench("filter/changing", benchFilter);
+	filterClearRules();
+
+	if (setupRules()) {
+		rulesSender = 0;
+		bench("rules/hit", benchRules);
+		rulesSender = 200;
+		bench("rules/miss", benchRules);
+		rulesUnload();
+	} else {
+		printf("rules could not be loaded, skipping rule benchmarks\n");
+	}
+
+	bench("eeprom/read_byte", benchEepromReadByte);
+	bench("eeprom/write_byte", benchEepromWriteByte);
+	bench("eeprom/read_dword", benchEepromReadDword);
+	bench("eeprom/read_block32", benchEepromReadBlock);
+	bench("eeprom/write_block32", benchEepromWriteBlock);
+	if (setupJournal()) {
+		bench("journal/write_byte", benchEepromWriteByte);
+		bench("journal/write_block32", benchEepromWriteBlock);
+		bench("journal/route_add", benchAddChildRoute);
+		closeJournal();
+	} else {
+		printf("journal could not be opened, skipping journal benchmarks\n");
+	}
+
+	if (json != NULL) {
+		writeJson(json);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+/*
+ * RadioBench.cpp - SPI transactions and time per frame of the send paths
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Usage: RadioBench [-r 250|1000|2000] [-n frames]
+ *
+ * Sends full frames from a gateway to one next hop through
+ * MySensor::sendWrite() one at a time and through sendWriteBurst(), in
+ * bursts of 1 and of -n frames (default 50). The radio is MyTransportRF24
+ * on the RF24 model in bench/rf24model, which counts SPI transactions and
+ * keeps model time. "plain" runs the same paths on a transport that passes
+ * every call to the library, as MyTransportRF24 did before it cached the
+ * register state.
+ *
+ * Reported per frame: SPI transactions besides busy waits, status polls of
+ * busy waits, and microseconds of model time (SPI, the library's delays and
+ * air time at -r kbps, default the RF24_DATARATE of MyConfig.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "MyGateway.h"
+#include "MyTransportRF24.h"
+#include "PiLog.h"
+
+#define MAX_BURST 255
+#define BURSTS    20       // bursts per measurement
+
+/*
+ * The transport without the register cache, every call goes to the library
+ */
+class PlainTransport : public MyTransport, protected RF24
+{
+  public:
+	PlainTransport() : RF24(RPI_V2_GPIO_P1_22, BCM2835_SPI_CS0, BCM2835_SPI_SPEED_8MHZ) {}
+
+	bool begin() { return RF24::begin(); }
+	void setAutoAck(bool enable) { RF24::setAutoAck(enable); }
+	void setAutoAck(uint8_t pipe, bool enable) { RF24::setAutoAck(pipe, enable); }
+	void enableAckPayload() { RF24::enableAckPayload(); }
+	void enableDynamicPayloads() { RF24::enableDynamicPayloads(); }
+	void setChannel(uint8_t channel) { RF24::setChannel(channel); }
+	void setPALevel(rf24_pa_dbm_e level) { RF24::setPALevel(level); }
+	bool setDataRate(rf24_datarate_e speed) { return RF24::setDataRate(speed); }
+	void setRetries(uint8_t delay, uint8_t count) { RF24::setRetries(delay, count); }
+	void setCRCLength(rf24_crclength_e length) { RF24::setCRCLength(length); }
+	void openWritingPipe(uint64_t address) { RF24::openWritingPipe(address); }
+	void openReadingPipe(uint8_t pipe, uint64_t address) { RF24::openReadingPipe(pipe, address); }
+	void startListening() { RF24::startListening(); }
+	void stopListening() { RF24::stopListening(); }
+	void powerUp() { RF24::powerUp(); }
+	void powerDown() { RF24::powerDown(); }
+	bool available(uint8_t *pipe) { return RF24::available(pipe); }
+	uint8_t getDynamicPayloadSize() { return RF24::getDynamicPayloadSize(); }
+	void read(void *buf, uint8_t len) { RF24::read(buf, len); }
+	bool write(const void *buf, uint8_t len, bool multicast) { return RF24::write(buf, len, multicast); }
+	bool writeFast(const void *buf, uint8_t len) { return RF24::writeFast(buf, len); }
+	bool txStandBy() { return RF24::txStandBy(); }
+	uint8_t getRetransmits() { return RF24::read_register(OBSERVE_TX) & 0x0F; }
+};
+
+/*
+ * Gives the benchmark access to the protected send paths
+ */
+class BenchGateway : public MyGateway
+{
+  public:
+	BenchGateway(MyTransport *transport) : MyGateway(transport, 1) {}
+	using MySensor::sendWrite;
+	using MySensor::sendWriteBurst;
+};
+
+static rf24_datarate_e dataRate = RF24_DATARATE;
+static MyMessage frames[MAX_BURST];
+
+static void discardOutput(char *line)
+{
+}
+
+static void measure(const char *transportName, MyTransport *transport, bool burst, unsigned int burstSize)
+{
+	BenchGateway *gw = new BenchGateway(transport);
+	char name[64];
+
+	gw->begin(RF24_PA_LEVEL_GW, RF24_CHANNEL, dataRate, discardOutput);
+	// One burst first, so the results are for a radio that has sent before
+	if (burst) {
+		gw->sendWriteBurst(1, frames, burstSize);
+	} else {
+		gw->sendWrite(1, frames[0]);
+	}
+
+	RF24ModelStats before = rf24Model;
+	bool ok = true;
+	for (int i = 0; i < BURSTS; i++) {
+		if (burst) {
+			ok = gw->sendWriteBurst(1, frames, burstSize) && ok;
+		} else {
+			for (unsigned int j = 0; j < burstSize; j++) {
+				ok = gw->sendWrite(1, frames[j]) && ok;
+			}
+		}
+	}
+	double count = (double)BURSTS * burstSize;
+	double polls = rf24Model.polls - before.polls;
+	double transactions = rf24Model.transactions - before.transactions - polls;
+
+	snprintf(name, sizeof(name), "%s/%s_x%u", transportName, burst ? "burst" : "write", burstSize);
+	printf("%-24s %9.1f %9.1f %11.1f %8lu%s\n", name, transactions / count, polls / count,
+			(rf24Model.us - before.us) / count, rf24Model.failed - before.failed, ok ? "" : "  (send failed)");
+	delete gw;
+	delete transport;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: RadioBench [-r 250|1000|2000] [-n frames]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int burstSize = 50;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:n:")) != -1) {
+		switch (c) {
+			case 'r':
+				switch (atoi(optarg)) {
+					case 250:  dataRate = RF24_250KBPS; break;
+					case 1000: dataRate = RF24_1MBPS; break;
+					case 2000: dataRate = RF24_2MBPS; break;
+					default: usage();
+				}
+				break;
+			case 'n':
+				burstSize = atoi(optarg);
+				if (burstSize < 1 || burstSize > MAX_BURST) {
+					usage();
+				}
+				break;
+			default: usage();
+		}
+	}
+	// Keep the gateway's debug output out of the measurements
+	daemonizeFlag = 1;
+	logSetMask(LOG_UPTO(LOG_WARNING));
+
+	uint8_t payload[MAX_PAYLOAD];
+	memset(payload, 0x55, sizeof(payload));
+	for (unsigned int i = 0; i < MAX_BURST; i++) {
+		frames[i].sender = GATEWAY_ADDRESS;
+		frames[i].destination = 1;
+		frames[i].sensor = 1;
+		frames[i].type = ST_SEGMENT;
+		mSetCommand(frames[i], C_STREAM);
+		mSetRequestAck(frames[i], false);
+		mSetAck(frames[i], false);
+		frames[i].set(payload, sizeof(payload));
+	}
+
+	printf("%-24s %9s %9s %11s %8s\n", "per frame", "spi", "polls", "us", "failed");
+	const unsigned int sizes[2] = { 1, burstSize };
+	for (int i = 0; i < 2; i++) {
+		measure("plain", new PlainTransport(), false, sizes[i]);
+		measure("cached", new MyTransportRF24(RPI_V2_GPIO_P1_22, BCM2835_SPI_CS0, BCM2835_SPI_SPEED_8MHZ), false, sizes[i]);
+		measure("plain", new PlainTransport(), true, sizes[i]);
+		measure("cached", new MyTransportRF24(RPI_V2_GPIO_P1_22, BCM2835_SPI_CS0, BCM2835_SPI_SPEED_8MHZ), true, sizes[i]);
+	}
+	return EXIT_SUCCESS;
+}
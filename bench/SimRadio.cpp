@@ -0,0 +1,609 @@
+/*
+ * SimRadio.cpp - Simulated nRF24L01+ radios sharing a broadcast medium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include "SimRadio.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Frames older than this can't overlap anything still on the air
+#define SIM_AIR_HISTORY 5000
+
+SimRadio::SimRadio()
+{
+	medium = NULL;
+	index = 0;
+	channel = 0;
+	dataRate = RF24_1MBPS;
+	retryDelay = 1500;
+	retryCount = 15;
+	pipesOpen = 0;
+	pipesNoAck = 0;
+	writingAddress = 0;
+	fifoHead = 0;
+	fifoCount = 0;
+	memset(lastTx, 0xff, sizeof(lastTx));
+	ackPayloadState = ACK_PAYLOAD_NONE;
+	ackPayloadPipe = 0;
+	ackPayloadLength = 0;
+	poweredDown = false;
+	listenStart = 0;
+	pthread_cond_init(&cond, NULL);
+	blocked = false;
+	wakeOnFrame = false;
+	timerGen = 0;
+	writing = false;
+	txOk = false;
+	retransmits = 0;
+	started = false;
+	startTime = 0;
+	nodeFn = NULL;
+	nodeArg = NULL;
+}
+
+bool SimRadio::begin()
+{
+	return true;
+}
+
+void SimRadio::setAutoAck(bool enable)
+{
+	pipesNoAck = enable ? 0 : 0xff;
+}
+
+void SimRadio::setAutoAck(uint8_t pipe, bool enable)
+{
+	if (enable) {
+		pipesNoAck &= ~(1 << pipe);
+	} else {
+		pipesNoAck |= 1 << pipe;
+	}
+}
+
+void SimRadio::setRetries(uint8_t delay, uint8_t count)
+{
+	retryDelay = (delay + 1) * 250;
+	retryCount = count;
+}
+
+void SimRadio::openWritingPipe(uint64_t address)
+{
+	writingAddress = address;
+}
+
+void SimRadio::openReadingPipe(uint8_t pipe, uint64_t address)
+{
+	if (pipe < SIM_PIPES) {
+		readingPipes[pipe] = address;
+		pipesOpen |= 1 << pipe;
+	}
+}
+
+/*
+ * Pipes sharing an address report the highest one: MySensors opens pipe 0
+ * and 1 with the node address and relays only what arrives on pipe 1.
+ */
+int8_t SimRadio::matchPipe(uint64_t address)
+{
+	for (int8_t pipe = SIM_PIPES - 1; pipe >= 0; pipe--) {
+		if ((pipesOpen & (1 << pipe)) && readingPipes[pipe] == address) {
+			return pipe;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Air time in us of an Enhanced ShockBurst frame with length payload bytes:
+ * preamble, 5 byte address, 9 bit packet control field, payload, CRC16.
+ */
+uint32_t SimRadio::airTime(uint8_t length)
+{
+	uint32_t bits = 8 + 40 + 9 + 8 * length + 16;
+	switch (dataRate) {
+		case RF24_250KBPS: return bits * 4;
+		case RF24_2MBPS:   return (bits + 1) / 2;
+		default:           return bits;
+	}
+}
+
+bool SimRadio::available(uint8_t *pipe)
+{
+	pthread_mutex_lock(&medium->lock);
+	bool ok = fifoCount > 0;
+	if (ok && pipe != NULL) {
+		*pipe = fifo[fifoHead].pipe;
+	}
+	pthread_mutex_unlock(&medium->lock);
+	return ok;
+}
+
+uint8_t SimRadio::getDynamicPayloadSize()
+{
+	pthread_mutex_lock(&medium->lock);
+	uint8_t length = fifoCount > 0 ? fifo[fifoHead].length : 0;
+	pthread_mutex_unlock(&medium->lock);
+	return length;
+}
+
+void SimRadio::read(void *buf, uint8_t len)
+{
+	pthread_mutex_lock(&medium->lock);
+	if (fifoCount > 0) {
+		memcpy(buf, fifo[fifoHead].data, len < fifo[fifoHead].length ? len : fifo[fifoHead].length);
+		fifoHead = (fifoHead + 1) % SIM_RX_FIFO;
+		fifoCount--;
+	}
+	pthread_mutex_unlock(&medium->lock);
+}
+
+bool SimRadio::write(const void *buf, uint8_t len, bool multicast)
+{
+	SimMedium::Transmission tx;
+
+	if (len > SIM_FRAME_SIZE) {
+		len = SIM_FRAME_SIZE;
+	}
+	pthread_mutex_lock(&medium->lock);
+	tx.id = medium->nextTx++;
+	tx.sender = index;
+	tx.channel = channel;
+	tx.dataRate = dataRate;
+	tx.address = writingAddress;
+	tx.multicast = multicast;
+	tx.delivered = false;
+	tx.done = false;
+	tx.receiver = 0;
+	tx.length = len;
+	memcpy(tx.data, buf, len);
+	tx.ackLength = 0;
+	tx.start = SIM_NEVER;
+	tx.end = 0;
+	medium->air.push_back(tx);
+
+	if (ackPayloadState == ACK_PAYLOAD_QUEUED) {
+		ackPayloadState = ACK_PAYLOAD_FLUSHED;
+	}
+	poweredDown = false;
+	writing = true;
+	txOk = false;
+	retransmits = 0;
+	medium->schedule(medium->clock + SIM_TX_SETTLE, SimMedium::EV_TX_START, index, tx.id);
+	medium->block(this, SIM_NEVER, false);
+	writing = false;
+	bool ok = txOk;
+	pthread_mutex_unlock(&medium->lock);
+	return ok;
+}
+
+bool SimRadio::writeAckPayload(uint8_t pipe, const void *buf, uint8_t len)
+{
+	if (len > SIM_FRAME_SIZE) {
+		len = SIM_FRAME_SIZE;
+	}
+	pthread_mutex_lock(&medium->lock);
+	ackPayloadPipe = pipe;
+	ackPayloadLength = len;
+	memcpy(ackPayload, buf, len);
+	ackPayloadState = ACK_PAYLOAD_QUEUED;
+	pthread_mutex_unlock(&medium->lock);
+	return true;
+}
+
+ack_payload_state_e SimRadio::getAckPayloadState()
+{
+	pthread_mutex_lock(&medium->lock);
+	ack_payload_state_e state = ackPayloadState;
+	pthread_mutex_unlock(&medium->lock);
+	return state;
+}
+
+uint8_t SimRadio::getRetransmits()
+{
+	return retransmits;
+}
+
+void SimRadio::startListening()
+{
+	poweredDown = false;
+	listenStart = medium->clock;
+}
+
+/*
+ * Set if foreign traffic or a frame in range overlapped the time since
+ * startListening()
+ */
+bool SimRadio::testRPD(bool *power)
+{
+	pthread_mutex_lock(&medium->lock);
+	float noise = channel < SIM_CHANNELS ? medium->noise[channel] : 0;
+	*power = noise > 0 && medium->chance(noise);
+	for (size_t i = 0; i < medium->air.size() && !*power; i++) {
+		const SimMedium::Transmission *tx = &medium->air[i];
+		*power = tx->channel == channel && tx->sender != index && tx->start != SIM_NEVER &&
+			tx->start < medium->clock && tx->end > listenStart && medium->inRange(tx->sender, index);
+	}
+	pthread_mutex_unlock(&medium->lock);
+	return true;
+}
+
+/*
+ * Like on real nodes, millis() counts from the node's own power up.
+ */
+unsigned long SimRadio::millis()
+{
+	return (medium->now() - startTime) / 1000;
+}
+
+void SimRadio::delayMs(unsigned long ms)
+{
+	pthread_mutex_lock(&medium->lock);
+	medium->block(this, medium->clock + ms * 1000ULL, false);
+	pthread_mutex_unlock(&medium->lock);
+}
+
+bool SimRadio::waitForEvent(unsigned long ms)
+{
+	pthread_mutex_lock(&medium->lock);
+	if (fifoCount == 0) {
+		medium->block(this, medium->clock + ms * 1000ULL, true);
+	}
+	pthread_mutex_unlock(&medium->lock);
+	return true;
+}
+
+SimMedium::SimMedium(unsigned int _nodes, unsigned int seed)
+{
+	nodes = _nodes;
+	radios = new SimRadio[nodes];
+	loss = new float[nodes * nodes];
+	for (unsigned int i = 0; i < nodes; i++) {
+		radios[i].medium = this;
+		radios[i].index = i;
+	}
+	for (unsigned int i = 0; i < nodes * nodes; i++) {
+		loss[i] = 1.0;
+	}
+	for (unsigned int i = 0; i < SIM_CHANNELS; i++) {
+		noise[i] = 0;
+	}
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&schedCond, NULL);
+	running = 0;
+	stopping = false;
+	clock = 0;
+	seq = 0;
+	nextTx = 0;
+	randomState = seed;
+	memset(&stats, 0, sizeof(stats));
+}
+
+SimMedium::~SimMedium()
+{
+	delete [] radios;
+	delete [] loss;
+}
+
+SimRadio *SimMedium::radio(unsigned int index)
+{
+	return &radios[index];
+}
+
+void SimMedium::setLink(unsigned int a, unsigned int b, double _loss)
+{
+	loss[a * nodes + b] = _loss;
+	loss[b * nodes + a] = _loss;
+}
+
+bool SimMedium::inRange(unsigned int a, unsigned int b)
+{
+	return loss[a * nodes + b] < 1.0;
+}
+
+void SimMedium::setNoise(uint8_t channel, double busy)
+{
+	if (channel < SIM_CHANNELS) {
+		noise[channel] = busy;
+	}
+}
+
+uint64_t SimMedium::now()
+{
+	return clock;
+}
+
+bool SimMedium::chance(double probability)
+{
+	return rand_r(&randomState) < probability * ((double)RAND_MAX + 1.0);
+}
+
+void SimMedium::schedule(uint64_t time, EventType type, uint8_t node, uint32_t arg)
+{
+	Event e;
+	e.time = time;
+	e.seq = seq++;
+	e.type = type;
+	e.node = node;
+	e.arg = arg;
+	events.push(e);
+}
+
+/*
+ * Park the calling node (lock held) until the scheduler wakes it: at until,
+ * on a received frame if onFrame, or explicitly by a radio event.
+ */
+void SimMedium::block(SimRadio *radio, uint64_t until, bool onFrame)
+{
+	if (stopping) {
+		pthread_mutex_unlock(&lock);
+		throw SimStopped();
+	}
+	radio->timerGen++;
+	if (until != SIM_NEVER) {
+		schedule(until, EV_TIMER, radio->index, radio->timerGen);
+	}
+	radio->wakeOnFrame = onFrame;
+	radio->blocked = true;
+	running--;
+	pthread_cond_signal(&schedCond);
+	while (radio->blocked) {
+		pthread_cond_wait(&radio->cond, &lock);
+	}
+	if (stopping) {
+		pthread_mutex_unlock(&lock);
+		throw SimStopped();
+	}
+}
+
+void *SimMedium::nodeThread(void *arg)
+{
+	SimRadio *radio = (SimRadio *)arg;
+	SimMedium *medium = radio->medium;
+
+	try {
+		pthread_mutex_lock(&medium->lock);
+		medium->block(radio, radio->startTime, false);
+		pthread_mutex_unlock(&medium->lock);
+		radio->nodeFn(radio->index, radio->nodeArg);
+	} catch (SimStopped &) {
+		return NULL;
+	}
+	// The node gave up before the end
+	pthread_mutex_lock(&medium->lock);
+	medium->running--;
+	pthread_cond_signal(&medium->schedCond);
+	pthread_mutex_unlock(&medium->lock);
+	return NULL;
+}
+
+void SimMedium::startNode(unsigned int index, uint64_t start, void (*fn)(unsigned int index, void *arg), void *arg)
+{
+	SimRadio *radio = &radios[index];
+	pthread_attr_t attr;
+
+	radio->startTime = start;
+	radio->nodeFn = fn;
+	radio->nodeArg = arg;
+	radio->started = true;
+	pthread_mutex_lock(&lock);
+	running++;
+	pthread_mutex_unlock(&lock);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+	pthread_create(&radio->thread, &attr, nodeThread, radio);
+	pthread_attr_destroy(&attr);
+}
+
+void SimMedium::run(uint64_t end)
+{
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (running > 0) {
+			pthread_cond_wait(&schedCond, &lock);
+		}
+		if (events.empty() || events.top().time > end) {
+			break;
+		}
+		Event e = events.top();
+		events.pop();
+		clock = e.time;
+		handle(e);
+	}
+	clock = end;
+	stopping = true;
+	for (unsigned int i = 0; i < nodes; i++) {
+		if (radios[i].blocked) {
+			radios[i].blocked = false;
+			pthread_cond_signal(&radios[i].cond);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	for (unsigned int i = 0; i < nodes; i++) {
+		if (radios[i].started) {
+			pthread_join(radios[i].thread, NULL);
+		}
+	}
+}
+
+SimMedium::Transmission *SimMedium::findTx(uint32_t id)
+{
+	for (size_t i = air.size(); i-- > 0; ) {
+		if (air[i].id == id && !air[i].done) {
+			return &air[i];
+		}
+	}
+	return NULL;
+}
+
+void SimMedium::handle(const Event &e)
+{
+	SimRadio *radio = &radios[e.node];
+	Transmission *tx;
+
+	switch (e.type) {
+		case EV_TIMER:
+			if (radio->timerGen != e.arg) {
+				break;
+			}
+			// fall through
+		case EV_WAKE:
+			if (radio->blocked) {
+				radio->blocked = false;
+				running++;
+				pthread_cond_signal(&radio->cond);
+			}
+			break;
+		case EV_TX_START:
+			tx = findTx(e.arg);
+			tx->start = clock;
+			tx->end = clock + radio->airTime(tx->length);
+			stats.transmissions++;
+			schedule(tx->end, EV_TX_END, e.node, e.arg);
+			break;
+		case EV_TX_END:
+			txEnd(findTx(e.arg));
+			break;
+		case EV_ACK:
+			tx = findTx(e.arg);
+			if (tx->delivered && !chance(loss[tx->receiver * nodes + tx->sender])) {
+				radio->txOk = true;
+				if (tx->ackLength > 0 && radio->fifoCount < SIM_RX_FIFO) {
+					uint8_t slot = (radio->fifoHead + radio->fifoCount) % SIM_RX_FIFO;
+					radio->fifo[slot].pipe = 0;
+					radio->fifo[slot].length = tx->ackLength;
+					memcpy(radio->fifo[slot].data, tx->ackData, tx->ackLength);
+					radio->fifoCount++;
+					stats.ackPayloads++;
+				}
+			} else if (radio->retransmits < radio->retryCount) {
+				// Retry with a copy, the finished attempt stays on the air log
+				Transmission retry = *tx;
+				uint64_t at = tx->end + radio->retryDelay;
+				tx->done = true;
+				retry.delivered = false;
+				retry.start = SIM_NEVER;
+				retry.end = 0;
+				air.push_back(retry);
+				radio->retransmits++;
+				stats.retransmissions++;
+				schedule(at > clock ? at : clock, EV_TX_START, e.node, e.arg);
+				break;
+			} else {
+				stats.txFailed++;
+			}
+			tx->done = true;
+			schedule(clock, EV_WAKE, e.node, 0);
+			break;
+	}
+
+	// Forget frames nothing on the air can overlap with anymore
+	while (!air.empty() && air.front().done && air.front().end + SIM_AIR_HISTORY < clock) {
+		air.erase(air.begin());
+	}
+}
+
+/*
+ * A frame left the air: hand it to every radio that could receive it.
+ */
+void SimMedium::txEnd(Transmission *tx)
+{
+	SimRadio *sender = &radios[tx->sender];
+
+	for (unsigned int i = 0; i < nodes; i++) {
+		SimRadio *to = &radios[i];
+		float linkLoss = loss[tx->sender * nodes + i];
+		if (i == tx->sender || linkLoss >= 1.0 || !to->started || to->poweredDown) {
+			continue;
+		}
+		if (to->channel != tx->channel || to->dataRate != tx->dataRate) {
+			continue;
+		}
+		int8_t pipe = to->matchPipe(tx->address);
+		if (pipe < 0 || to->writing) {
+			continue;
+		}
+		if (collided(tx, i)) {
+			stats.collisions++;
+			continue;
+		}
+		if (chance(linkLoss)) {
+			stats.lost++;
+			continue;
+		}
+		if (tx->channel < SIM_CHANNELS && noise[tx->channel] > 0 && chance(noise[tx->channel])) {
+			stats.noise++;
+			continue;
+		}
+		deliver(tx, to, pipe);
+	}
+
+	if (tx->multicast) {
+		sender->txOk = true;
+		tx->done = true;
+		schedule(clock, EV_WAKE, tx->sender, 0);
+	} else {
+		schedule(clock + SIM_TX_SETTLE + sender->airTime(tx->ackLength), EV_ACK, tx->sender, tx->id);
+	}
+}
+
+void SimMedium::deliver(Transmission *tx, SimRadio *to, int8_t pipe)
+{
+	// Pipes without auto ack take the frame but never answer
+	bool ack = !tx->multicast && !(to->pipesNoAck & (1 << pipe));
+
+	if (ack && to->lastTx[tx->sender] == tx->id) {
+		// Retransmission after a lost ack, acked again but not received twice
+		stats.duplicates++;
+		tx->delivered = true;
+		tx->receiver = to->index;
+		return;
+	}
+	if (to->fifoCount == SIM_RX_FIFO) {
+		stats.fifoFull++;
+		return;
+	}
+	uint8_t slot = (to->fifoHead + to->fifoCount) % SIM_RX_FIFO;
+	to->fifo[slot].pipe = pipe;
+	to->fifo[slot].length = tx->length;
+	memcpy(to->fifo[slot].data, tx->data, tx->length);
+	to->fifoCount++;
+	if (ack) {
+		to->lastTx[tx->sender] = tx->id;
+		tx->delivered = true;
+		tx->receiver = to->index;
+		if (to->ackPayloadState == ACK_PAYLOAD_QUEUED && to->ackPayloadPipe == pipe) {
+			to->ackPayloadState = ACK_PAYLOAD_SENT;
+			tx->ackLength = to->ackPayloadLength;
+			memcpy(tx->ackData, to->ackPayload, to->ackPayloadLength);
+		}
+	}
+	if (to->blocked && to->wakeOnFrame) {
+		schedule(clock, EV_WAKE, to->index, 0);
+	}
+}
+
+/*
+ * True if another frame on the same channel overlapped tx at the receiver,
+ * or the receiver was transmitting itself.
+ */
+bool SimMedium::collided(const Transmission *tx, unsigned int receiver)
+{
+	for (size_t i = 0; i < air.size(); i++) {
+		const Transmission *other = &air[i];
+		if (other == tx || other->start == SIM_NEVER || other->channel != tx->channel) {
+			continue;
+		}
+		if (other->start >= tx->end || other->end <= tx->start) {
+			continue;
+		}
+		if (other->sender == receiver || loss[other->sender * nodes + receiver] < 1.0) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,252 @@
+/*
+ * SimRadio.h - Simulated nRF24L01+ radios sharing a broadcast medium
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Discrete-event simulation on virtual time (microseconds). Every node runs
+ * the unmodified MySensor code in its own thread, but only one thread runs
+ * at any moment: a node runs until it blocks in the radio (write, wait,
+ * delay) and the scheduler then handles the next event. The simulation is
+ * therefore deterministic for a given seed, and node code takes no virtual
+ * time at all.
+ *
+ * The medium models per link loss, collisions at the receiver, half duplex
+ * radios, the 3 frame RX FIFO and the Enhanced ShockBurst timing: air time
+ * of frame and auto ack at the configured data rate, TX settling, auto
+ * retransmit delay/count and duplicate suppression of retransmissions.
+ * Auto acks are only subject to loss, not to collisions. An ack payload
+ * goes with the next ack of its pipe and lands in the sender's RX FIFO on
+ * pipe 0; transmitting drops it, as the library's flush does. A powered
+ * down radio receives nothing.
+ *
+ * Foreign traffic (WiFi, other networks) is modelled per channel as the
+ * share of the time it is busy: a frame is lost with that chance, and it
+ * sets the RPD of a listening radio, as do the frames of other nodes.
+ */
+
+#ifndef SimRadio_h
+#define SimRadio_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+#include <queue>
+
+#include "MyTransport.h"
+
+#define SIM_MAX_NODES   256
+#define SIM_CHANNELS    126
+#define SIM_RX_FIFO     3
+#define SIM_PIPES       6
+#define SIM_FRAME_SIZE  32
+#define SIM_TX_SETTLE   130  // us from CE high to the first bit, and ack turnaround
+#define SIM_NEVER       UINT64_MAX
+
+/* Thrown out of the radio calls of a node when the simulation ends */
+struct SimStopped {};
+
+class SimMedium;
+
+class SimRadio : public MyTransport
+{
+  public:
+	bool begin();
+	void setAutoAck(bool enable);
+	void setAutoAck(uint8_t pipe, bool enable);
+	void enableAckPayload() {}
+	void enableDynamicPayloads() {}
+	void setChannel(uint8_t _channel) { channel = _channel; }
+	void setPALevel(rf24_pa_dbm_e level) {}
+	bool setDataRate(rf24_datarate_e speed) { dataRate = speed; return true; }
+	void setRetries(uint8_t delay, uint8_t count);
+	void setCRCLength(rf24_crclength_e length) {}
+
+	void openWritingPipe(uint64_t address);
+	void openReadingPipe(uint8_t pipe, uint64_t address);
+	void startListening();
+	void stopListening() {}
+	void powerUp() { poweredDown = false; }
+	void powerDown() { poweredDown = true; }
+
+	using MyTransport::available;
+	bool available(uint8_t *pipe);
+	uint8_t getDynamicPayloadSize();
+	void read(void *buf, uint8_t len);
+	bool write(const void *buf, uint8_t len, bool multicast);
+	bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len);
+	ack_payload_state_e getAckPayloadState();
+	uint8_t getRetransmits();
+	bool testRPD(bool *power);
+
+	unsigned long millis();
+	void delayMs(unsigned long ms);
+	bool waitForEvent(unsigned long ms);
+
+	/* Auto retransmit setting as last set, for tests */
+	uint16_t getRetryDelay() { return retryDelay; }
+	uint8_t getRetryCount() { return retryCount; }
+
+  private:
+	friend class SimMedium;
+
+	SimMedium *medium;
+	uint8_t index;
+	uint8_t channel;
+	rf24_datarate_e dataRate;
+	uint16_t retryDelay;      // us
+	uint8_t retryCount;
+	uint64_t readingPipes[SIM_PIPES];
+	uint8_t pipesOpen;
+	uint8_t pipesNoAck;       // pipes with auto ack disabled
+	uint64_t writingAddress;
+
+	struct {
+		uint8_t pipe;
+		uint8_t length;
+		uint8_t data[SIM_FRAME_SIZE];
+	} fifo[SIM_RX_FIFO];
+	uint8_t fifoHead;
+	uint8_t fifoCount;
+	uint32_t lastTx[SIM_MAX_NODES]; // last frame accepted from each sender, for duplicates
+	ack_payload_state_e ackPayloadState;
+	uint8_t ackPayloadPipe;
+	uint8_t ackPayloadLength;
+	uint8_t ackPayload[SIM_FRAME_SIZE];
+	bool poweredDown;
+	uint64_t listenStart;     // for the RPD
+
+	pthread_t thread;
+	pthread_cond_t cond;
+	bool blocked;             // waiting for the scheduler
+	bool wakeOnFrame;
+	uint32_t timerGen;        // invalidates timers of earlier blocks
+	bool writing;             // inside write(), the radio doesn't receive
+	bool txOk;
+	uint8_t retransmits;
+	bool started;
+	uint64_t startTime;
+	void (*nodeFn)(unsigned int index, void *arg);
+	void *nodeArg;
+
+	SimRadio();
+	int8_t matchPipe(uint64_t address);
+	uint32_t airTime(uint8_t length);
+};
+
+struct SimStats {
+	unsigned long transmissions;  // frames on the air, retransmissions included
+	unsigned long retransmissions;
+	unsigned long collisions;     // frames corrupted at a receiver by an overlapping one
+	unsigned long lost;           // frames lost to link loss
+	unsigned long noise;          // frames lost to foreign traffic on their channel
+	unsigned long fifoFull;       // frames dropped (and not acked) by a full RX FIFO
+	unsigned long duplicates;     // retransmissions the receiver had already accepted
+	unsigned long txFailed;       // unicast writes that ran out of retries
+	unsigned long ackPayloads;    // ack payloads received by the sender of a frame
+};
+
+class SimMedium
+{
+  public:
+	SimMedium(unsigned int nodes, unsigned int seed);
+	~SimMedium();
+
+	/**
+	 * Radio of node index (0 .. nodes-1).
+	 */
+	SimRadio *radio(unsigned int index);
+
+	/**
+	 * Set the link between two nodes (both directions). loss is the
+	 * probability a frame is not received, 1.0 means out of range.
+	 * All links start out of range.
+	 */
+	void setLink(unsigned int a, unsigned int b, double loss);
+	bool inRange(unsigned int a, unsigned int b);
+
+	/**
+	 * Foreign traffic on channel, busy is the share of the time (0 .. 1).
+	 */
+	void setNoise(uint8_t channel, double busy);
+
+	/**
+	 * Start the thread of a node at virtual time start (us). fn runs inside
+	 * the simulation and is left with SimStopped when it ends.
+	 */
+	void startNode(unsigned int index, uint64_t start, void (*fn)(unsigned int index, void *arg), void *arg);
+
+	/**
+	 * Run the simulation until virtual time end (us), then stop all nodes.
+	 */
+	void run(uint64_t end);
+
+	/**
+	 * Current virtual time in us, for node code.
+	 */
+	uint64_t now();
+
+	SimStats stats;
+
+  private:
+	friend class SimRadio;
+
+	enum EventType { EV_WAKE, EV_TIMER, EV_TX_START, EV_TX_END, EV_ACK };
+
+	struct Event {
+		uint64_t time;
+		uint64_t seq;        // orders events at the same time
+		EventType type;
+		uint8_t node;
+		uint32_t arg;        // timer generation or transmission id
+		bool operator<(const Event &o) const {
+			return time > o.time || (time == o.time && seq > o.seq);
+		}
+	};
+
+	struct Transmission {
+		uint32_t id;
+		uint8_t sender;
+		uint8_t channel;
+		rf24_datarate_e dataRate;
+		uint64_t address;
+		bool multicast;
+		bool delivered;      // accepted by the addressee (ack pending)
+		bool done;           // attempt over, kept for collision checks
+		uint8_t receiver;    // addressee that accepted it
+		uint8_t length;
+		uint8_t data[SIM_FRAME_SIZE];
+		uint8_t ackLength;   // ack payload the addressee answered with
+		uint8_t ackData[SIM_FRAME_SIZE];
+		uint64_t start;
+		uint64_t end;
+	};
+
+	unsigned int nodes;
+	SimRadio *radios;
+	float *loss;             // nodes x nodes, 1.0 = out of range
+	float noise[SIM_CHANNELS];
+	pthread_mutex_t lock;
+	pthread_cond_t schedCond;
+	int running;             // node threads not blocked (0 or 1)
+	bool stopping;
+	uint64_t clock;
+	uint64_t seq;
+	uint32_t nextTx;
+	unsigned int randomState;
+	std::priority_queue<Event> events;
+	std::vector<Transmission> air;  // recent and ongoing transmissions
+
+	void schedule(uint64_t time, EventType type, uint8_t node, uint32_t arg);
+	void block(SimRadio *radio, uint64_t until, bool onFrame);
+	void handle(const Event &e);
+	Transmission *findTx(uint32_t id);
+	void txEnd(Transmission *tx);
+	void deliver(Transmission *tx, SimRadio *to, int8_t pipe);
+	bool collided(const Transmission *tx, unsigned int receiver);
+	bool chance(double probability);
+	static void *nodeThread(void *arg);
+};
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * RF24.cpp - Model of the RF24 library and the nRF24L01+ it drives
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#include <string.h>
+
+#include "RF24.h"
+
+#define TX_SETTLE   130.0   // us, PLL settling before a frame and the ack turnaround
+
+RF24ModelStats rf24Model;
+
+RF24::RF24(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed)
+{
+	memset(registers, 0, sizeof(registers));
+	memset(txAddress, 0, sizeof(txAddress));
+	memset(pipe0Address, 0, sizeof(pipe0Address));
+	memset(pipe0_reading_address, 0, sizeof(pipe0_reading_address));
+	txFifo = 0;
+	ackPayloads = 0;
+	txDone = 0;
+	ceHigh = false;
+	txDelay = 250;
+	bitUs = 1.0;
+}
+
+/*
+ * One SPI transaction of bytes bytes, command byte included. Returns the
+ * STATUS register, which the chip shifts out with the command.
+ */
+uint8_t RF24::transfer(uint8_t bytes, bool poll)
+{
+	rf24Model.us += RF24_MODEL_TRANSACTION_US + bytes * RF24_MODEL_BYTE_US;
+	rf24Model.transactions++;
+	if (poll) {
+		rf24Model.polls++;
+	}
+	update();
+	return registers[NRF_STATUS] | (txFifo == 3 ? _BV(TX_FULL) : 0);
+}
+
+double RF24::frameTime(uint8_t len, bool ack)
+{
+	// preamble, address, packet control field, payload, CRC
+	double frame = TX_SETTLE + ((1 + 5 + len + 2) * 8 + 9) * bitUs;
+	return ack ? frame + TX_SETTLE + ((1 + 5 + 2) * 8 + 9) * bitUs : frame;
+}
+
+/*
+ * Run the transmitter up to the current model time
+ */
+void RF24::update()
+{
+	bool transmitting = (registers[NRF_CONFIG] & _BV(PWR_UP)) && !(registers[NRF_CONFIG] & _BV(PRIM_RX));
+
+	while (txDone != 0 && rf24Model.us >= txDone) {
+		double end = txDone;
+		bool ackReceived = memcmp(pipe0Address, txAddress, 5) == 0 && (registers[EN_RXADDR] & 1);
+
+		txDone = 0;
+		if (!txNoAck[0] && !ackReceived) {
+			// The frame stays in the FIFO, the chip waits for MAX_RT to be cleared
+			registers[NRF_STATUS] |= _BV(MAX_RT);
+			rf24Model.failed++;
+			break;
+		}
+		registers[NRF_STATUS] |= _BV(TX_DS);
+		rf24Model.frames++;
+		txFifo--;
+		memmove(txLength, txLength + 1, txFifo);
+		memmove(txNoAck, txNoAck + 1, txFifo);
+		if (ceHigh && transmitting && txFifo > 0) {
+			txDone = end + frameTime(txLength[0], !txNoAck[0]);
+		}
+	}
+	if (txDone == 0 && ceHigh && transmitting && txFifo > 0 && !(registers[NRF_STATUS] & _BV(MAX_RT))) {
+		bool ackReceived = memcmp(pipe0Address, txAddress, 5) == 0 && (registers[EN_RXADDR] & 1);
+		if (txNoAck[0] || ackReceived) {
+			txDone = rf24Model.us + frameTime(txLength[0], !txNoAck[0]);
+		} else {
+			// Every retransmission waits ARD for an ack that never comes
+			unsigned int ard = ((registers[SETUP_RETR] >> 4) + 1) * 250;
+			unsigned int arc = registers[SETUP_RETR] & 0x0f;
+			txDone = rf24Model.us + (arc + 1) * (frameTime(txLength[0], false) + ard);
+		}
+	}
+}
+
+uint8_t RF24::get_status()
+{
+	return transfer(1, true);
+}
+
+void RF24::ce(bool level)
+{
+	ceHigh = level;
+	update();
+}
+
+void RF24::flush_tx()
+{
+	transfer(1, false);
+	txFifo = 0;
+	ackPayloads = 0;
+	txDone = 0;
+}
+
+void RF24::delayMicroseconds(unsigned int us)
+{
+	rf24Model.us += us;
+	update();
+}
+
+uint8_t RF24::read_register(uint8_t reg, uint8_t *buf, uint8_t len)
+{
+	uint8_t status = transfer(1 + len, false);
+	if (reg == RX_ADDR_P0 && len <= 5) {
+		memcpy(buf, pipe0Address, len);
+	} else if (reg == TX_ADDR && len <= 5) {
+		memcpy(buf, txAddress, len);
+	} else {
+		memset(buf, 0, len);
+	}
+	return status;
+}
+
+uint8_t RF24::read_register(uint8_t reg)
+{
+	transfer(2, reg == FIFO_STATUS);
+	if (reg == FIFO_STATUS) {
+		return (txFifo + ackPayloads == 0 ? _BV(TX_EMPTY) : 0) | (txFifo + ackPayloads == 3 ? _BV(5) : 0);
+	}
+	return registers[reg & 0x1f];
+}
+
+uint8_t RF24::write_register(uint8_t reg, const uint8_t *buf, uint8_t len)
+{
+	uint8_t status = transfer(1 + len, false);
+	if (reg == RX_ADDR_P0 && len <= 5) {
+		memcpy(pipe0Address, buf, len);
+	} else if (reg == TX_ADDR && len <= 5) {
+		memcpy(txAddress, buf, len);
+	}
+	update();
+	return status;
+}
+
+uint8_t RF24::write_register(uint8_t reg, uint8_t value)
+{
+	uint8_t status = transfer(2, false);
+	if (reg == NRF_STATUS) {
+		// Interrupt flags are cleared by writing 1
+		registers[NRF_STATUS] &= ~value;
+	} else {
+		registers[reg & 0x1f] = value;
+	}
+	update();
+	return status;
+}
+
+bool RF24::begin()
+{
+	registers[NRF_CONFIG] = 0x0c;
+	setRetries(5, 15);
+	setDataRate(RF24_1MBPS);
+	write_register(FEATURE, 0);
+	write_register(DYNPD, 0);
+	write_register(NRF_STATUS, _BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT));
+	setChannel(76);
+	flush_tx();
+	powerUp();
+	write_register(NRF_CONFIG, read_register(NRF_CONFIG) & ~_BV(PRIM_RX));
+	write_register(EN_RXADDR, 0x03);
+	return true;
+}
+
+bool RF24::isPVariant()
+{
+	return true;
+}
+
+void RF24::setAutoAck(bool enable)
+{
+	write_register(EN_AA, enable ? 0x3f : 0);
+}
+
+void RF24::setAutoAck(uint8_t pipe, bool enable)
+{
+	uint8_t en_aa = read_register(EN_AA);
+	write_register(EN_AA, enable ? en_aa | _BV(pipe) : en_aa & ~_BV(pipe));
+}
+
+void RF24::enableAckPayload()
+{
+	write_register(FEATURE, read_register(FEATURE) | _BV(EN_ACK_PAY) | _BV(EN_DPL));
+	write_register(DYNPD, read_register(DYNPD) | 0x03);
+}
+
+void RF24::enableDynamicPayloads()
+{
+	write_register(FEATURE, read_register(FEATURE) | _BV(EN_DPL));
+	write_register(DYNPD, 0x3f);
+}
+
+void RF24::setChannel(uint8_t channel)
+{
+	write_register(RF_CH, channel);
+}
+
+void RF24::setPALevel(uint8_t level)
+{
+	write_register(RF_SETUP, (read_register(RF_SETUP) & 0xf8) | (level << 1));
+}
+
+bool RF24::setDataRate(rf24_datarate_e speed)
+{
+	// The library's delays for hosts faster than 20 MHz
+	switch (speed) {
+		case RF24_250KBPS: txDelay = 450; bitUs = 4.0; break;
+		case RF24_2MBPS:   txDelay = 190; bitUs = 0.5; break;
+		default:           txDelay = 250; bitUs = 1.0; break;
+	}
+	write_register(RF_SETUP, read_register(RF_SETUP));
+	return true;
+}
+
+void RF24::setRetries(uint8_t delay, uint8_t count)
+{
+	write_register(SETUP_RETR, (delay & 0xf) << 4 | (count & 0xf));
+}
+
+void RF24::setCRCLength(rf24_crclength_e length)
+{
+	write_register(NRF_CONFIG, read_register(NRF_CONFIG));
+}
+
+void RF24::openWritingPipe(uint64_t address)
+{
+	write_register(RX_ADDR_P0, (const uint8_t *)&address, 5);
+	write_register(TX_ADDR, (const uint8_t *)&address, 5);
+	write_register(RX_PW_P0, 32);
+}
+
+void RF24::openReadingPipe(uint8_t child, uint64_t address)
+{
+	if (child == 0) {
+		memcpy(pipe0_reading_address, &address, 5);
+	}
+	if (child > 5) {
+		return;
+	}
+	if (child < 2) {
+		write_register(RX_ADDR_P0 + child, (const uint8_t *)&address, 5);
+	} else {
+		write_register(RX_ADDR_P0 + child, (const uint8_t *)&address, 1);
+	}
+	write_register(RX_PW_P0 + child, 32);
+	write_register(EN_RXADDR, read_register(EN_RXADDR) | _BV(child));
+}
+
+void RF24::startListening()
+{
+	powerUp();
+	write_register(NRF_CONFIG, read_register(NRF_CONFIG) | _BV(PRIM_RX));
+	write_register(NRF_STATUS, _BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT));
+	ce(true);
+	if (pipe0_reading_address[0] > 0) {
+		write_register(RX_ADDR_P0, pipe0_reading_address, 5);
+	} else {
+		write_register(EN_RXADDR, read_register(EN_RXADDR) & ~1);
+	}
+	if (read_register(FEATURE) & _BV(EN_ACK_PAY)) {
+		flush_tx();
+	}
+}
+
+void RF24::stopListening()
+{
+	ce(false);
+	delayMicroseconds(txDelay);
+	if (read_register(FEATURE) & _BV(EN_ACK_PAY)) {
+		delayMicroseconds(txDelay);
+		flush_tx();
+	}
+	write_register(NRF_CONFIG, read_register(NRF_CONFIG) & ~_BV(PRIM_RX));
+	write_register(EN_RXADDR, read_register(EN_RXADDR) | 1);
+}
+
+void RF24::powerUp()
+{
+	uint8_t config = read_register(NRF_CONFIG);
+	if (!(config & _BV(PWR_UP))) {
+		write_register(NRF_CONFIG, config | _BV(PWR_UP));
+		delayMicroseconds(5000);
+	}
+}
+
+void RF24::powerDown()
+{
+	ce(false);
+	write_register(NRF_CONFIG, read_register(NRF_CONFIG) & ~_BV(PWR_UP));
+}
+
+bool RF24::available()
+{
+	return available(NULL);
+}
+
+bool RF24::available(uint8_t *pipe)
+{
+	// Nothing is ever received
+	get_status();
+	return false;
+}
+
+uint8_t RF24::getDynamicPayloadSize()
+{
+	transfer(2, false);
+	return 0;
+}
+
+void RF24::read(void *buf, uint8_t len)
+{
+	transfer(1 + len, false);
+	write_register(NRF_STATUS, _BV(RX_DR) | _BV(MAX_RT) | _BV(TX_DS));
+	memset(buf, 0, len);
+}
+
+void RF24::startFastWrite(const void *buf, uint8_t len, const bool multicast)
+{
+	// W_TX_PAYLOAD or W_TX_PAYLOAD_NO_ACK
+	transfer(1 + len, false);
+	if (txFifo < 3) {
+		txLength[txFifo] = len;
+		txNoAck[txFifo] = multicast;
+		txFifo++;
+	}
+	ce(true);
+}
+
+bool RF24::write(const void *buf, uint8_t len, const bool multicast)
+{
+	startFastWrite(buf, len, multicast);
+	while (!(get_status() & (_BV(TX_DS) | _BV(MAX_RT)))) {
+	}
+	ce(false);
+	uint8_t status = write_register(NRF_STATUS, _BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT));
+	if (status & _BV(MAX_RT)) {
+		flush_tx();
+		return false;
+	}
+	return true;
+}
+
+bool RF24::writeFast(const void *buf, uint8_t len, const bool multicast)
+{
+	while (get_status() & _BV(TX_FULL)) {
+		if (get_status() & _BV(MAX_RT)) {
+			write_register(NRF_STATUS, _BV(MAX_RT));
+			return false;
+		}
+	}
+	startFastWrite(buf, len, multicast);
+	return true;
+}
+
+bool RF24::txStandBy()
+{
+	while (!(read_register(FIFO_STATUS) & _BV(TX_EMPTY))) {
+		if (get_status() & _BV(MAX_RT)) {
+			write_register(NRF_STATUS, _BV(MAX_RT));
+			ce(false);
+			flush_tx();
+			return false;
+		}
+	}
+	ce(false);
+	return true;
+}
+
+/*
+ * No frames arrive in the model, so an ack payload waits until a flush
+ */
+void RF24::writeAckPayload(uint8_t pipe, const void *buf, uint8_t len)
+{
+	transfer(1 + (len < 32 ? len : 32), false);
+	if (txFifo + ackPayloads < 3) {
+		ackPayloads++;
+	}
+}
+
+bool RF24::testRPD()
+{
+	return read_register(RPD) & 1;
+}
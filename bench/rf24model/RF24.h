@@ -0,0 +1,114 @@
+/*
+ * RF24.h - Model of the RF24 library and the nRF24L01+ it drives
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Stands in for the RF24 library (TMRh20, 1.1.x) when bench/RadioBench is
+ * built, so the unmodified MyTransportRF24 and MySensor code can be measured
+ * without a radio. Every method makes the same SPI transactions, CE changes
+ * and delays as the library does. The chip behind it has a 3 frame TX FIFO
+ * and Enhanced ShockBurst timing, and receives the auto ack of a frame only
+ * if RX_ADDR_P0 matches TX_ADDR and pipe 0 is enabled, as a real one does.
+ * A transport that gets the pipe setup wrong sees failed writes.
+ *
+ * Time is virtual (rf24Model.us) and only advances for SPI transfers, the
+ * library's delays and busy waits on the air time of frames, at
+ * RF24_MODEL_TRANSACTION_US per transaction plus RF24_MODEL_BYTE_US per
+ * byte (8 MHz SPI).
+ */
+
+#ifndef __RF24_H__
+#define __RF24_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "RF24_config.h"
+#include "nRF24L01.h"
+
+#define RF24_MODEL_TRANSACTION_US 2.0
+#define RF24_MODEL_BYTE_US        1.0
+
+typedef enum { RF24_PA_MIN = 0, RF24_PA_LOW, RF24_PA_HIGH, RF24_PA_MAX, RF24_PA_ERROR } rf24_pa_dbm_e;
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+typedef enum { RF24_CRC_DISABLED = 0, RF24_CRC_8, RF24_CRC_16 } rf24_crclength_e;
+
+/* Counters of all modelled radios */
+struct RF24ModelStats {
+	unsigned long transactions;  // SPI transactions, polls included
+	unsigned long polls;         // STATUS and FIFO_STATUS reads of busy waits
+	unsigned long frames;        // frames acknowledged, or sent if multicast
+	unsigned long failed;        // frames without auto ack after all retransmissions
+	double us;                   // model time
+};
+
+extern RF24ModelStats rf24Model;
+
+class RF24
+{
+  public:
+	RF24(uint8_t _cepin, uint8_t _cspin, uint32_t spispeed);
+
+	bool begin();
+	bool isPVariant();
+	void setAutoAck(bool enable);
+	void setAutoAck(uint8_t pipe, bool enable);
+	void enableAckPayload();
+	void enableDynamicPayloads();
+	void setChannel(uint8_t channel);
+	void setPALevel(uint8_t level);
+	bool setDataRate(rf24_datarate_e speed);
+	void setRetries(uint8_t delay, uint8_t count);
+	void setCRCLength(rf24_crclength_e length);
+	void printDetails() {}
+
+	void openWritingPipe(uint64_t address);
+	void openReadingPipe(uint8_t child, uint64_t address);
+	void startListening();
+	void stopListening();
+	void powerUp();
+	void powerDown();
+
+	bool available();
+	bool available(uint8_t *pipe);
+	uint8_t getDynamicPayloadSize();
+	void read(void *buf, uint8_t len);
+	bool write(const void *buf, uint8_t len, const bool multicast = false);
+	bool writeFast(const void *buf, uint8_t len, const bool multicast = false);
+	bool txStandBy();
+	void writeAckPayload(uint8_t pipe, const void *buf, uint8_t len);
+	bool testRPD();
+
+  protected:
+	uint8_t read_register(uint8_t reg, uint8_t *buf, uint8_t len);
+	uint8_t read_register(uint8_t reg);
+	uint8_t write_register(uint8_t reg, const uint8_t *buf, uint8_t len);
+	uint8_t write_register(uint8_t reg, uint8_t value);
+
+  private:
+	uint8_t registers[0x20];
+	uint8_t txAddress[5];
+	uint8_t pipe0Address[5];
+	uint8_t pipe0_reading_address[5];
+	uint8_t txFifo;              // frames waiting or on air
+	uint8_t ackPayloads;         // ack payloads waiting in the TX FIFO, never sent
+	uint8_t txLength[3];
+	bool txNoAck[3];
+	double txDone;               // end of the frame on air, 0 if none
+	bool ceHigh;
+	unsigned int txDelay;
+	double bitUs;
+
+	uint8_t transfer(uint8_t bytes, bool poll);
+	uint8_t get_status();
+	void ce(bool level);
+	void flush_tx();
+	void delayMicroseconds(unsigned int us);
+	void startFastWrite(const void *buf, uint8_t len, const bool multicast);
+	double frameTime(uint8_t len, bool ack);
+	void update();
+};
+
+#endif /* __RF24_H__ */
@@ -0,0 +1,29 @@
+/*
+ * RF24_config.h - Platform definitions of the RF24 model
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __RF24_CONFIG_H__
+#define __RF24_CONFIG_H__ 1
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define _BV(x) (1 << (x))
+
+/* Pins and SPI speed of the bcm2835 driver, accepted and ignored */
+#define RPI_V2_GPIO_P1_22     25
+#define RPI_V2_GPIO_P1_24     8
+#define RPI_BPLUS_GPIO_J8_22  25
+#define RPI_BPLUS_GPIO_J8_24  8
+#define BCM2835_SPI_CS0       0
+#define BCM2835_SPI_CS1       1
+#define BCM2835_SPI_SPEED_8MHZ 32
+
+/* Sleeps of the node code take real time, only the radio runs on model time */
+inline void delay(unsigned long ms) { usleep(ms * 1000); }
+
+#endif /* __RF24_CONFIG_H__ */
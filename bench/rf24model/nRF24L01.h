@@ -0,0 +1,43 @@
+/*
+ * nRF24L01.h - Register map of the nRF24L01+, for the RF24 model
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * The subset of the names of the RF24 library's nRF24L01.h that the model
+ * and the transport use.
+ */
+
+#ifndef __nRF24L01_H__
+#define __nRF24L01_H__ 1
+
+/* Registers */
+#define NRF_CONFIG  0x00
+#define EN_AA       0x01
+#define EN_RXADDR   0x02
+#define SETUP_RETR  0x04
+#define RF_CH       0x05
+#define RF_SETUP    0x06
+#define NRF_STATUS  0x07
+#define OBSERVE_TX  0x08
+#define RPD         0x09
+#define RX_ADDR_P0  0x0A
+#define TX_ADDR     0x10
+#define RX_PW_P0    0x11
+#define FIFO_STATUS 0x17
+#define DYNPD       0x1C
+#define FEATURE     0x1D
+
+/* Bits */
+#define PRIM_RX     0
+#define PWR_UP      1
+#define TX_FULL     0
+#define MAX_RT      4
+#define TX_DS       5
+#define RX_DR       6
+#define TX_EMPTY    4
+#define EN_DPL      2
+#define EN_ACK_PAY  1
+
+#endif /* __nRF24L01_H__ */
@@ -0,0 +1,134 @@
+/*
+ * RetryTest.cpp - Auto retransmit tuning on links of fixed loss
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * A node sends RETRY_TEST_MESSAGES values to the gateway over one simulated
+ * link (bench/SimRadio.h) that loses frames and acks with a fixed chance.
+ * Once the first half is sent, every write of the second half must use the
+ * shortest ARD and an ARC within RETRY_TEST_SLACK of the one the loss
+ * calls for, and RETRY_TEST_DELIVERY of all values must reach the
+ * controller. Exits with 1 if a check fails.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "TestRadio.h"
+#include "SimRadio.h"
+#include "MyGateway.h"
+#include "PiEEPROM.h"
+
+#define RETRY_TEST_MESSAGES 400
+#define RETRY_TEST_PERIOD   50     // ms between values
+#define RETRY_TEST_SLACK    3      // ARC off the expected one
+#define RETRY_TEST_DELIVERY 0.98
+#define RETRY_TEST_CHANNEL  76
+#define NODE_ID             1
+
+static SimMedium *medium;
+static uint8_t eeproms[2][EEPROM_SIZE];
+static unsigned int delivered;
+static unsigned int sent;
+static uint8_t countMin, countMax;
+static uint16_t delayMin, delayMax;
+
+static void controllerReceive(char *line)
+{
+	int node, sensor, command;
+
+	if (sscanf(line, "%d;%d;%d;", &node, &sensor, &command) == 3 &&
+			node == NODE_ID && sensor == 1 && command == C_SET) {
+		delivered++;
+	}
+}
+
+static void gatewayNode(unsigned int index, void *arg)
+{
+	SimRadio *radio = medium->radio(index);
+
+	eeprom_select(eeproms[index]);
+	MyGateway gw(radio, 1);
+	gw.begin(RF24_PA_LEVEL_GW, RETRY_TEST_CHANNEL, RF24_2MBPS, controllerReceive);
+	for (;;) {
+		gw.processRadioMessage();
+		if (!radio->available()) {
+			radio->waitForEvent(1000);
+		}
+	}
+}
+
+static void sensorNode(unsigned int index, void *arg)
+{
+	SimRadio *radio = medium->radio(index);
+
+	eeprom_select(eeproms[index]);
+	MySensor sensor(radio);
+	sensor.begin(NULL, NODE_ID, false, GATEWAY_ADDRESS, RF24_PA_LEVEL, RETRY_TEST_CHANNEL, RF24_2MBPS);
+	MyMessage msg(1, V_VAR1);
+	for (unsigned long seq = 0; seq < RETRY_TEST_MESSAGES; seq++) {
+		sensor.send(msg.set(seq));
+		sent++;
+		if (seq >= RETRY_TEST_MESSAGES / 2) {
+			uint8_t count = radio->getRetryCount();
+			uint16_t delay = radio->getRetryDelay();
+			countMin = count < countMin ? count : countMin;
+			countMax = count > countMax ? count : countMax;
+			delayMin = delay < delayMin ? delay : delayMin;
+			delayMax = delay > delayMax ? delay : delayMax;
+		}
+		sensor.wait(RETRY_TEST_PERIOD);
+	}
+	for (;;) {
+		sensor.wait(1000);
+	}
+}
+
+/*
+ * ARC that gets a write through with RETRY_TARGET when an attempt succeeds
+ * with chance (1 - loss)^2, frame and ack
+ */
+static uint8_t expectedCount(double loss)
+{
+	double miss = 1.0 - (1.0 - loss) * (1.0 - loss);
+	uint8_t retries = 0;
+
+	while (pow(miss, retries + 1) > 1.0 - RETRY_TARGET && retries < 15) {
+		retries++;
+	}
+	return retries < RETRY_COUNT_MIN ? RETRY_COUNT_MIN : retries;
+}
+
+static void runLink(double loss, unsigned int seed)
+{
+	uint8_t expected = expectedCount(loss);
+
+	delivered = sent = 0;
+	countMin = UINT8_MAX;
+	delayMin = UINT16_MAX;
+	countMax = delayMax = 0;
+	memset(eeproms, 0xff, sizeof(eeproms));
+	medium = new SimMedium(2, seed);
+	medium->setLink(0, 1, loss);
+	medium->startNode(0, 0, gatewayNode, NULL);
+	medium->startNode(1, 100000, sensorNode, NULL);
+	medium->run((3 + RETRY_TEST_MESSAGES * RETRY_TEST_PERIOD / 1000 + 5) * 1000000ULL);
+	delete medium;
+
+	check(sent == RETRY_TEST_MESSAGES, "loss %.2f: %u values sent", loss, sent);
+	check(countMin + RETRY_TEST_SLACK >= expected && countMax <= expected + RETRY_TEST_SLACK,
+			"loss %.2f: ARC %u..%u, expected %u", loss, countMin, countMax, expected);
+	check(delayMin == 500 && delayMax == 500, "loss %.2f: ARD %u..%u us, expected 500", loss, delayMin, delayMax);
+	check(delivered >= RETRY_TEST_DELIVERY * sent, "loss %.2f: %u of %u values delivered", loss, delivered, sent);
+}
+
+int main()
+{
+	runLink(0.0, 1);
+	runLink(0.1, 2);
+	runLink(0.3, 3);
+	return failed > 0 ? 1 : 0;
+}
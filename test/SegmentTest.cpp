@@ -0,0 +1,165 @@
+/*
+ * SegmentTest.cpp - Malformed fragments and acknowledgements of segmented messages
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * A node on a TestRadio gets fragments and ST_SEGMENT_ACK frames as they
+ * could come off the air: with a length field larger than a frame carries,
+ * short, or with more missing fragments listed than sent. None may be
+ * delivered, acknowledged or copied past its buffer; well formed ones still
+ * work. Exits with 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "TestRadio.h"
+#include "MySensor.h"
+#include "PiEEPROM.h"
+#include "MyMetrics.h"
+
+#define NODE_ID   1
+#define SENSOR_ID 2
+
+static unsigned int delivered = 0;
+static uint16_t deliveredLength = 0;
+static uint8_t deliveredData[SEGMENT_MAX_LENGTH];
+
+static void segmentReceived(uint8_t sender, uint8_t sensor, uint8_t command, uint8_t type, const uint8_t *data, uint16_t length)
+{
+	delivered++;
+	deliveredLength = length;
+	memcpy(deliveredData, data, length);
+}
+
+/*
+ * Frame from the gateway to the node, payload of length bytes; the length
+ * field may claim more than the frame has
+ */
+static MyMessage frame(uint8_t type, const void *payload, uint8_t length)
+{
+	MyMessage message;
+
+	memset((void *)&message, 0, sizeof(message));
+	message.sender = GATEWAY_ADDRESS;
+	message.last = GATEWAY_ADDRESS;
+	message.destination = NODE_ID;
+	message.sensor = SENSOR_ID;
+	message.type = type;
+	mSetVersion(message, PROTOCOL_VERSION);
+	mSetCommand(message, C_STREAM);
+	mSetPayloadType(message, P_CUSTOM);
+	mSetLength(message, length);
+	memcpy(message.data, payload, length < MAX_PAYLOAD ? length : MAX_PAYLOAD);
+	return message;
+}
+
+static MyMessage fragment(uint8_t seq, uint8_t index, uint8_t count, const uint8_t *data, uint8_t length)
+{
+	uint8_t payload[MAX_PAYLOAD];
+	SegmentHeader header = { seq, index, count, C_SET, V_VAR1 };
+
+	memcpy(payload, &header, sizeof(header));
+	memcpy(payload + sizeof(header), data, length <= SEGMENT_FRAGMENT_SIZE ? length : SEGMENT_FRAGMENT_SIZE);
+	return frame(ST_SEGMENT, payload, sizeof(header) + length);
+}
+
+static void run(MySensor &node, TestRadio &radio)
+{
+	while (!radio.received.empty()) {
+		node.process();
+	}
+}
+
+int main()
+{
+	static uint8_t eeprom[EEPROM_SIZE];
+	uint8_t data[SEGMENT_MAX_LENGTH];
+	TestRadio radio;
+	MySensor node(&radio);
+
+	memset(eeprom, 0xff, EEPROM_SIZE);
+	eeprom_select(eeprom);
+	for (unsigned int i = 0; i < sizeof(data); i++) {
+		data[i] = i * 7;
+	}
+	node.begin(NULL, NODE_ID, false, GATEWAY_ADDRESS);
+	node.setSegmentCallback(segmentReceived);
+
+	// Well formed: two fragments, delivered and acknowledged once
+	radio.clear();
+	radio.receive(fragment(1, 0, 2, data, SEGMENT_FRAGMENT_SIZE));
+	radio.receive(fragment(1, 1, 2, data + SEGMENT_FRAGMENT_SIZE, 7));
+	run(node, radio);
+	check(delivered == 1 && deliveredLength == SEGMENT_FRAGMENT_SIZE + 7 &&
+			memcmp(deliveredData, data, deliveredLength) == 0,
+			"two fragments delivered as one message of %d bytes", (int)SEGMENT_FRAGMENT_SIZE + 7);
+	check(radio.count(C_STREAM, ST_SEGMENT_ACK) == 1, "complete message acknowledged");
+
+	// Length field of 31 in a full frame: more than data holds
+	unsigned long dropped = metricGet(M_SEGMENTS_DROPPED);
+	radio.clear();
+	radio.receive(fragment(2, 0, 1, data, 31 - sizeof(SegmentHeader)), MAX_MESSAGE_LENGTH);
+	run(node, radio);
+	check(delivered == 1 && radio.count(C_STREAM, ST_SEGMENT_ACK) == 0, "oversized fragment ignored");
+
+	// Short fragment before the last one
+	radio.clear();
+	radio.receive(fragment(3, 0, 2, data, SEGMENT_FRAGMENT_SIZE - 1));
+	radio.receive(fragment(3, 1, 2, data, 3));
+	run(node, radio);
+	check(delivered == 1 && metricGet(M_SEGMENTS_DROPPED) == dropped + 1,
+			"short fragment before the last dropped");
+	check(radio.count(C_STREAM, ST_SEGMENT_ACK) == 1, "missing fragment reported");
+
+	// Header without data
+	radio.clear();
+	radio.receive(frame(ST_SEGMENT, data, sizeof(SegmentHeader)));
+	run(node, radio);
+	check(delivered == 1 && radio.count(C_STREAM, ST_SEGMENT_ACK) == 0, "fragment without data ignored");
+
+	// The node sends one message of three fragments, acks refer to its seq
+	unsigned long sent = metricGet(M_SEGMENTS_SENT);
+	unsigned long retransmits = metricGet(M_SEGMENT_RETRANSMITS);
+	radio.clear();
+	check(node.sendSegmented(GATEWAY_ADDRESS, SENSOR_ID, C_SET, V_VAR1, data, 2 * SEGMENT_FRAGMENT_SIZE + 1),
+			"segmented message sent");
+	check(radio.count(C_STREAM, ST_SEGMENT) == 3, "three fragments on the air");
+	uint8_t seq = ((const SegmentHeader *)((const MyMessage *)radio.sent[0].data)->data)->seq;
+
+	// Ack of one byte
+	radio.clear();
+	radio.receive(frame(ST_SEGMENT_ACK, &seq, 1));
+	run(node, radio);
+	check(radio.sent.empty() && metricGet(M_SEGMENTS_SENT) == sent, "ack of 1 byte ignored");
+
+	// Ack claiming 31 bytes in a full frame
+	uint8_t ack[MAX_PAYLOAD];
+	memset(ack, 0, sizeof(ack));
+	ack[0] = seq;
+	ack[1] = 29;
+	radio.clear();
+	radio.receive(frame(ST_SEGMENT_ACK, ack, 31), MAX_MESSAGE_LENGTH);
+	run(node, radio);
+	check(radio.sent.empty() && metricGet(M_SEGMENT_RETRANSMITS) == retransmits, "oversized ack ignored");
+
+	// More missing fragments listed than the ack has bytes for
+	ack[1] = SEGMENT_ACK_MISSING;
+	ack[2] = 1;
+	radio.clear();
+	radio.receive(frame(ST_SEGMENT_ACK, ack, 3));
+	run(node, radio);
+	check(metricGet(M_SEGMENT_RETRANSMITS) == retransmits + 1 && radio.count(C_STREAM, ST_SEGMENT) == 1,
+			"ack listing more than it carries resends only what it lists");
+
+	// Complete
+	ack[1] = 0;
+	radio.clear();
+	radio.receive(frame(ST_SEGMENT_ACK, ack, 2));
+	run(node, radio);
+	check(metricGet(M_SEGMENTS_SENT) == sent + 1, "ack without missing fragments completes the message");
+
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * TestRadio.h - Scripted radio for the tests
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Frames queued with receive() come out of available()/read() in order,
+ * frames written by the node are kept in sent. Time is virtual: it only
+ * moves when the node waits or sleeps, so a test runs in no time and the
+ * same way every time.
+ */
+
+#ifndef TestRadio_h
+#define TestRadio_h
+
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+
+#include "MyTransport.h"
+#include "MyMessage.h"
+
+struct TestFrame {
+	uint8_t length;
+	uint8_t data[MAX_MESSAGE_LENGTH];
+};
+
+class TestRadio : public MyTransport
+{
+  public:
+	std::deque<TestFrame> received;
+	std::vector<TestFrame> sent;
+	unsigned long now;
+
+	TestRadio() : now(1) {}
+
+	bool begin() { return true; }
+	void setAutoAck(bool enable) {}
+	void setAutoAck(uint8_t pipe, bool enable) {}
+	void enableAckPayload() {}
+	void enableDynamicPayloads() {}
+	void setChannel(uint8_t channel) {}
+	void setPALevel(rf24_pa_dbm_e level) {}
+	bool setDataRate(rf24_datarate_e speed) { return true; }
+	void setRetries(uint8_t delay, uint8_t count) {}
+	void setCRCLength(rf24_crclength_e length) {}
+	void openWritingPipe(uint64_t address) {}
+	void openReadingPipe(uint8_t pipe, uint64_t address) {}
+	void startListening() {}
+	void stopListening() {}
+	void powerUp() {}
+	void powerDown() {}
+
+	bool available(uint8_t *pipe) {
+		if (pipe != NULL) {
+			*pipe = 1;
+		}
+		return !received.empty();
+	}
+	uint8_t getDynamicPayloadSize() { return received.front().length; }
+	void read(void *buf, uint8_t len) {
+		memcpy(buf, received.front().data, len);
+		received.pop_front();
+	}
+	bool write(const void *buf, uint8_t len, bool multicast) {
+		TestFrame frame;
+		frame.length = len;
+		memcpy(frame.data, buf, len);
+		sent.push_back(frame);
+		return true;
+	}
+
+	unsigned long millis() { return now; }
+	void delayMs(unsigned long ms) { now += ms; }
+	bool waitForEvent(unsigned long ms) {
+		if (received.empty()) {
+			now += ms;
+		}
+		return true;
+	}
+
+	/* Queue message for the node, with frameLength bytes on the air (0: header and payload) */
+	void receive(const MyMessage &message, uint8_t frameLength = 0) {
+		TestFrame frame;
+		frame.length = frameLength ? frameLength : HEADER_SIZE + mGetLength(message);
+		if (frame.length > MAX_MESSAGE_LENGTH) {
+			frame.length = MAX_MESSAGE_LENGTH;
+		}
+		memcpy(frame.data, &message, frame.length);
+		received.push_back(frame);
+	}
+
+	/* Frames sent of command and type since the last clear() */
+	unsigned int count(uint8_t command, uint8_t type) {
+		unsigned int n = 0;
+		for (size_t i = 0; i < sent.size(); i++) {
+			const MyMessage &message = *(const MyMessage *)sent[i].data;
+			if (mGetCommand(message) == command && message.type == type) {
+				n++;
+			}
+		}
+		return n;
+	}
+	void clear() { sent.clear(); }
+};
+
+/*
+ * Check cond, report the result as one line; failed counts the failures
+ */
+static unsigned int failed = 0;
+
+#define check(cond, ...) do { \
+	bool passed = (cond); \
+	printf("%s ", passed ? "ok  " : "FAIL"); \
+	printf(__VA_ARGS__); \
+	printf("\n"); \
+	if (!passed) failed++; \
+} while (0)
+
+#endif